@@ -47,6 +47,7 @@
 #include "third_party/fatfs/src/ff.h"
 #include "third_party/fatfs/src/diskio.h"
 #include "sd_util.h"
+#include "sd_erase.h"
 
 #define RED_LED   GPIO_PIN_1
 #define BLUE_LED  GPIO_PIN_2
@@ -129,6 +130,9 @@ void ConfigureLED()
 
 static SemaphoreHandle_t isrSemaphore;
 
+/* Serializes file system access between the writer and the pre-erase task */
+static SemaphoreHandle_t fsMutex;
+
 static void set_udma_txfer_done(int status)
 {
   if (status == 0)
@@ -181,6 +185,18 @@ int main_rtos(void)
     return 1;
   }
 
+  fsMutex = xSemaphoreCreateMutex();
+  if (fsMutex == NULL || SDEraseTaskCreate("0:", fsMutex) != 0)
+  {
+    return 1;
+  }
+
+  /* Card accesses go through the I/O scheduler once the kernel runs */
+  if (disk_sched_start() != RES_OK)
+  {
+    return 1;
+  }
+
   static uint32_t task_result = NULL;
 
 
@@ -230,12 +246,19 @@ void prvWriteTask(void *pvParameters)
   {
     file_write_buffer[i] = (unsigned char) (i & 0xFF);
   }
+  xSemaphoreTake(fsMutex, portMAX_DELAY);
   if ((fresult = ConfigureSD(&sd_params)) != FR_OK)
   {
     while (1)
     {}
   }
+  xSemaphoreGive(fsMutex);
+
+  /* Pre-erase free space while this task is idle */
+  SDEraseKick();
+  vTaskDelay(500 / portTICK_RATE_MS);
 
+  xSemaphoreTake(fsMutex, portMAX_DELAY);
   fresult = f_write(&sd_params.g_sFileObject, file_write_buffer, MEM_BUFFER_SIZE, &bytesWritten);
   if (fresult != FR_OK)
   {
@@ -247,6 +270,7 @@ void prvWriteTask(void *pvParameters)
 
   f_close(&sd_params.g_sFileObject);
   f_mount(0, NULL);
+  xSemaphoreGive(fsMutex);
 
   while (1)
   {
@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include "task.h"
+#include "sd_erase.h"
+
+static const char *erase_drv;
+static SemaphoreHandle_t erase_fs_mutex;
+static SemaphoreHandle_t erase_kick;
+
+static void prvEraseTask(void *pvParameters);
+
+/*
+ * Walks the FAT and pre-erases free cluster runs while the system is idle,
+ * so the next burst of f_write lands on erased blocks.  The task only ever
+ * try-takes the file system mutex, and each f_erasefree call scans and
+ * erases a bounded chunk, no more than one allocation unit, so a
+ * foreground request waits for one chunk at most.  f_erasefree only
+ * revisits clusters freed since its last pass, and the cursor is kept
+ * across kicks, so a kick does not erase again what is still erased.  A
+ * chunk that fails is retried from the same cursor, and after
+ * SD_ERASE_RETRIES failures in a row the task waits for the next kick,
+ * which resumes the pass where it stopped.
+ */
+static void
+prvEraseTask(void *pvParameters)
+{
+  DWORD cursor = 0;
+  FRESULT fresult;
+  unsigned int failed;
+
+  for (;;)
+  {
+    /* Sleep until the free space has changed */
+    xSemaphoreTake(erase_kick, portMAX_DELAY);
+
+    failed = 0;
+    for (;;)
+    {
+      if (xSemaphoreTake(erase_fs_mutex, 0) != pdTRUE)
+      {
+        /* Foreground task owns the card, back off */
+        vTaskDelay(SD_ERASE_BACKOFF_TICKS);
+        continue;
+      }
+      fresult = f_erasefree(erase_drv, &cursor, SD_ERASE_CHUNK_CLUSTERS);
+      xSemaphoreGive(erase_fs_mutex);
+
+      if (fresult != FR_OK)
+      {
+        /* Keep the cursor, so the range is not dropped from the pass */
+        if (++failed >= SD_ERASE_RETRIES)
+        {
+          /* Volume not mounted or card cannot erase, resume next time */
+          break;
+        }
+        vTaskDelay(SD_ERASE_BACKOFF_TICKS);
+        continue;
+      }
+      failed = 0;
+      if (cursor == 0)
+      {
+        /* Pass complete */
+        break;
+      }
+
+      /* Let equal-priority work run between chunks */
+      taskYIELD();
+    }
+  }
+}
+
+unsigned int
+SDEraseTaskCreate(const char *drv, SemaphoreHandle_t fs_mutex)
+{
+  erase_drv = drv;
+  erase_fs_mutex = fs_mutex;
+
+  erase_kick = xSemaphoreCreateBinary();
+  if (erase_kick == NULL)
+  {
+    return 1;
+  }
+
+  if (xTaskCreate(prvEraseTask,
+                  (portCHAR *) "prvEraseTask",
+                  SD_ERASE_TASK_STACK,
+                  NULL,
+                  SD_ERASE_TASK_PRIORITY,
+                  NULL) != pdTRUE)
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Request a new pre-erase pass, e.g. after mount or after deleting files */
+void
+SDEraseKick(void)
+{
+  if (erase_kick != NULL)
+  {
+    xSemaphoreGive(erase_kick);
+  }
+}
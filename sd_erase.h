@@ -0,0 +1,26 @@
+#ifndef SD_ERASE_H_
+#define SD_ERASE_H_
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#include "third_party/fatfs/src/ff.h"
+
+/* Number of free clusters erased per pass of the background task.  Keeps the
+ * card busy period short so a foreground request never waits long. */
+#define SD_ERASE_CHUNK_CLUSTERS 64
+
+/* Ticks to back off when a foreground task holds the file system, or after
+ * a chunk failed */
+#define SD_ERASE_BACKOFF_TICKS  (10 / portTICK_RATE_MS)
+
+/* Failed chunks in a row before the task waits for the next kick */
+#define SD_ERASE_RETRIES        3
+
+#define SD_ERASE_TASK_STACK     configMINIMAL_STACK_SIZE
+#define SD_ERASE_TASK_PRIORITY  tskIDLE_PRIORITY
+
+unsigned int SDEraseTaskCreate(const char *drv, SemaphoreHandle_t fs_mutex);
+void SDEraseKick(void);
+
+#endif /* SD_ERASE_H_ */
@@ -0,0 +1,343 @@
+#include <string.h>
+#include "sd_log.h"
+
+#define LOG_MAGIC_HDR   0x48474F4CUL  /* "LOGH" */
+#define LOG_MAGIC_DATA  0x44474F4CUL  /* "LOGD" */
+
+/* CRC-32 (IEEE 802.3), nibble table to keep the flash footprint small */
+static const DWORD crc_tbl[16] =
+{
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+  0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+  0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static DWORD
+log_crc32(const BYTE *p, UINT n)
+{
+  DWORD crc = 0xFFFFFFFF;
+
+  while (n--)
+  {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ crc_tbl[crc & 15];
+    crc = (crc >> 4) ^ crc_tbl[crc & 15];
+  }
+  return ~crc;
+}
+
+/* Fill in the block header and trailing CRC */
+static void
+log_seal(const SD_Log *log, BYTE *blk, DWORD magic, DWORD idx, WORD len)
+{
+  DWORD crc;
+
+  ST_DWORD(&blk[0], magic);
+  ST_DWORD(&blk[4], log->salt);
+  ST_DWORD(&blk[8], idx);
+  ST_WORD(&blk[12], len);
+  ST_WORD(&blk[14], 0);
+  crc = log_crc32(blk, SD_LOG_BLOCK_SIZE - 4);
+  ST_DWORD(&blk[SD_LOG_BLOCK_SIZE - 4], crc);
+}
+
+static BOOL
+log_valid(const SD_Log *log, const BYTE *blk, DWORD magic, DWORD idx)
+{
+  return LD_DWORD(&blk[0]) == magic
+    && LD_DWORD(&blk[4]) == log->salt
+    && LD_DWORD(&blk[8]) == idx
+    && LD_WORD(&blk[12]) <= SD_LOG_PAYLOAD_SIZE
+    && LD_DWORD(&blk[SD_LOG_BLOCK_SIZE - 4]) == log_crc32(blk, SD_LOG_BLOCK_SIZE - 4);
+}
+
+/*
+ * Write the header block.  The log only ever does whole-sector I/O, so the
+ * sector buffer of the file object is free to be used as scratch here.
+ */
+static FRESULT
+log_put_header(SD_Log *log, DWORD base)
+{
+  BYTE *blk = log->file.buffer;
+  WORD bw;
+  FRESULT fresult;
+
+  memset(blk, 0, SD_LOG_BLOCK_SIZE);
+  ST_DWORD(&blk[SD_LOG_HEADER_SIZE], base);
+  log_seal(log, blk, LOG_MAGIC_HDR, 0, 4);
+
+  if (log->hdr_sect)
+  {
+    return (disk_write(log->file.fs->drive, blk, log->hdr_sect, 1) == RES_OK) ? FR_OK : FR_RW_ERROR;
+  }
+
+  /* First header of a new log, file pointer is at block 0 */
+  fresult = f_write(&log->file, blk, SD_LOG_BLOCK_SIZE, &bw);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  if (bw != SD_LOG_BLOCK_SIZE)
+  {
+    return FR_DENIED;
+  }
+  log->hdr_sect = log->file.curr_sect;
+  return FR_OK;
+}
+
+/*
+ * Pre-allocate the next chunk and commit the directory entry and FAT.  This
+ * is the only place the log pays for f_sync.  The header is pointed at the
+ * new chunk afterwards so a re-open only scans from there.
+ */
+static FRESULT
+log_grow(SD_Log *log)
+{
+  FSIZE_t pos = log->file.fptr;
+  FRESULT fresult;
+
+  fresult = f_lseek(&log->file, log->file.fsize + (FSIZE_t)SD_LOG_PREALLOC_BLOCKS * SD_LOG_BLOCK_SIZE);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  if (log->file.fsize <= pos)
+  {
+    /* Disk full */
+    return FR_DENIED;
+  }
+  fresult = f_sync(&log->file);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  fresult = f_lseek(&log->file, pos);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  return log_put_header(log, pos ? (DWORD)(pos / SD_LOG_BLOCK_SIZE) : 1);
+}
+
+/* Write the tail block image to the card */
+static FRESULT
+log_place(SD_Log *log)
+{
+  WORD bw;
+  FRESULT fresult;
+
+  log_seal(log, log->block, LOG_MAGIC_DATA, log->seq, log->used);
+
+  if (log->tail_sect)
+  {
+    /* Placed by an earlier checkpoint, rewrite that one sector in place */
+    return (disk_write(log->file.fs->drive, log->block, log->tail_sect, 1) == RES_OK) ? FR_OK : FR_RW_ERROR;
+  }
+
+  if (log->file.fptr >= log->file.fsize)
+  {
+    fresult = log_grow(log);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+
+  /* Sector aligned and sector sized, so f_write goes straight to the card */
+  fresult = f_write(&log->file, log->block, SD_LOG_BLOCK_SIZE, &bw);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  if (bw != SD_LOG_BLOCK_SIZE)
+  {
+    return FR_DENIED;
+  }
+  log->tail_sect = log->file.curr_sect;
+  return FR_OK;
+}
+
+static void
+log_new_block(SD_Log *log, DWORD seq)
+{
+  log->seq = seq;
+  log->used = 0;
+  log->tail_sect = 0;
+  memset(log->block, 0, SD_LOG_BLOCK_SIZE);
+}
+
+FRESULT
+SDLogCreate(SD_Log *log, const char *path)
+{
+  FRESULT fresult;
+  DWORD salt;
+
+  /*
+   * The pre-allocated region is not cleared, so a new log must not share
+   * the salt of a log that used the same clusters before.  Derive it from
+   * the previous log at this path (if any) and the allocation cursor.
+   */
+  salt = get_fattime();
+  if (SDLogOpen(log, path) == FR_OK)
+  {
+    salt ^= log->salt + 0x9E3779B9UL;
+    f_close(&log->file);
+  }
+
+  fresult = f_open(&log->file, path, FA_CREATE_ALWAYS | FA_WRITE | FA_READ);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  log->salt = salt ^ (log->file.fs->last_clust << 12);
+  log->hdr_sect = 0;
+  log_new_block(log, 1);
+
+  return log_grow(log);
+}
+
+/*
+ * Re-open an existing log and rebuild its end from the blocks on the card.
+ * The scan starts at the chunk recorded in the header and stops at the
+ * first block that is not a valid continuation.
+ */
+FRESULT
+SDLogOpen(SD_Log *log, const char *path)
+{
+  FRESULT fresult;
+  WORD br, len;
+  DWORD idx;
+
+  fresult = f_open(&log->file, path, FA_OPEN_EXISTING | FA_WRITE | FA_READ);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+
+  fresult = f_read(&log->file, log->block, SD_LOG_BLOCK_SIZE, &br);
+  if (fresult != FR_OK)
+  {
+    f_close(&log->file);
+    return fresult;
+  }
+  log->salt = LD_DWORD(&log->block[4]);
+  if (br != SD_LOG_BLOCK_SIZE || !log_valid(log, log->block, LOG_MAGIC_HDR, 0))
+  {
+    f_close(&log->file);
+    return FR_NO_FILESYSTEM;
+  }
+  log->hdr_sect = log->file.curr_sect;
+  idx = LD_DWORD(&log->block[SD_LOG_HEADER_SIZE]);
+
+  fresult = f_lseek(&log->file, (FSIZE_t)idx * SD_LOG_BLOCK_SIZE);
+  if (fresult != FR_OK)
+  {
+    f_close(&log->file);
+    return fresult;
+  }
+  for (;; idx++)
+  {
+    if (log->file.fptr >= log->file.fsize)
+    {
+      break;
+    }
+    fresult = f_read(&log->file, log->block, SD_LOG_BLOCK_SIZE, &br);
+    if (fresult != FR_OK)
+    {
+      f_close(&log->file);
+      return fresult;
+    }
+    if (br != SD_LOG_BLOCK_SIZE || !log_valid(log, log->block, LOG_MAGIC_DATA, idx))
+    {
+      break;
+    }
+    len = LD_WORD(&log->block[12]);
+    if (len < SD_LOG_PAYLOAD_SIZE)
+    {
+      /* Partially filled tail block, keep appending into it */
+      log->seq = idx;
+      log->used = len;
+      log->tail_sect = log->file.curr_sect;
+      return FR_OK;
+    }
+  }
+
+  /* All blocks before idx are full, the next append starts block idx */
+  log_new_block(log, idx);
+  fresult = f_lseek(&log->file, (FSIZE_t)idx * SD_LOG_BLOCK_SIZE);
+  if (fresult != FR_OK)
+  {
+    f_close(&log->file);
+  }
+  return fresult;
+}
+
+FRESULT
+SDLogAppend(SD_Log *log, const void *data, UINT len)
+{
+  const BYTE *p = data;
+  UINT n;
+  FRESULT fresult;
+
+  while (len)
+  {
+    n = SD_LOG_PAYLOAD_SIZE - log->used;
+    if (n > len)
+    {
+      n = len;
+    }
+    memcpy(&log->block[SD_LOG_HEADER_SIZE + log->used], p, n);
+    log->used += n;
+    p += n;
+    len -= n;
+
+    if (log->used == SD_LOG_PAYLOAD_SIZE)
+    {
+      fresult = log_place(log);
+      if (fresult != FR_OK)
+      {
+        return fresult;
+      }
+      log_new_block(log, log->seq + 1);
+    }
+  }
+  return FR_OK;
+}
+
+/* Make everything appended so far durable: one sector write plus CTRL_SYNC */
+FRESULT
+SDLogCheckpoint(SD_Log *log)
+{
+  FRESULT fresult;
+
+  if (log->used)
+  {
+    fresult = log_place(log);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+  return (disk_ioctl(log->file.fs->drive, CTRL_SYNC, 0) == RES_OK) ? FR_OK : FR_RW_ERROR;
+}
+
+FRESULT
+SDLogClose(SD_Log *log)
+{
+  FRESULT fresult;
+
+  fresult = SDLogCheckpoint(log);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  return f_close(&log->file);
+}
+
+/* Number of payload bytes in the log */
+FSIZE_t
+SDLogSize(const SD_Log *log)
+{
+  return (FSIZE_t)(log->seq - 1) * SD_LOG_PAYLOAD_SIZE + log->used;
+}
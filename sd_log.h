@@ -0,0 +1,47 @@
+#ifndef SD_LOG_H_
+#define SD_LOG_H_
+
+#include "third_party/fatfs/src/ff.h"
+#include "third_party/fatfs/src/diskio.h"
+
+/*
+ * Append-only journaled log file.
+ *
+ * The file is pre-allocated in chunks and written in 512-byte blocks.  Every
+ * block carries a per-log salt, its own sequence number (= block index) and a
+ * CRC-32, so the end of the log is found on open by scanning forward instead
+ * of trusting the directory entry.  A checkpoint rewrites only the partially
+ * filled tail block in place: one data-sector write, no directory or FAT
+ * update.  The directory entry and FAT are only committed when a new chunk
+ * is pre-allocated.
+ *
+ * Block 0 (header): "LOGH", salt, first block of the newest chunk, CRC
+ * Block n (data):   "LOGD", salt, n, payload length, payload, CRC
+ */
+
+/* Blocks added to the file each time the pre-allocated region runs out */
+#define SD_LOG_PREALLOC_BLOCKS  2048
+
+#define SD_LOG_BLOCK_SIZE       512
+#define SD_LOG_HEADER_SIZE      16
+#define SD_LOG_PAYLOAD_SIZE     (SD_LOG_BLOCK_SIZE - SD_LOG_HEADER_SIZE - 4)
+
+typedef struct SD_Log
+{
+  FIL file;             /* Log file, kept open for read/write */
+  DWORD salt;           /* Tags all blocks of this log instance */
+  DWORD seq;            /* Block index of the tail block */
+  DWORD hdr_sect;       /* LBA of the header block */
+  DWORD tail_sect;      /* LBA of the tail block once placed, 0 if not yet */
+  WORD used;            /* Payload bytes in the tail block */
+  BYTE block[SD_LOG_BLOCK_SIZE];  /* Tail block image */
+} SD_Log;
+
+FRESULT SDLogCreate(SD_Log *log, const char *path);
+FRESULT SDLogOpen(SD_Log *log, const char *path);
+FRESULT SDLogAppend(SD_Log *log, const void *data, UINT len);
+FRESULT SDLogCheckpoint(SD_Log *log);
+FRESULT SDLogClose(SD_Log *log);
+FSIZE_t SDLogSize(const SD_Log *log);
+
+#endif /* SD_LOG_H_ */
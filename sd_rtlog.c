@@ -0,0 +1,233 @@
+#include <string.h>
+
+#include "sd_rtlog.h"
+
+/* CPU cycle counter, the Cortex-M4 DWT unless the build supplies another */
+#ifndef SD_RTLOG_CYCLES
+#include "third_party/fatfs/port/dwt-cm4f.h"
+
+#define SD_RTLOG_CYCLES()       DWT_CYCLES()
+#define SD_RTLOG_CYCLES_START() DWT_START()
+#endif
+
+#ifndef SD_RTLOG_CYCLES_START
+#define SD_RTLOG_CYCLES_START()
+#endif
+
+/*
+ * Keep the ring copy ahead of the index store that publishes it.  Single
+ * core, so stopping the compiler from reordering is enough.
+ */
+#if defined(__GNUC__)
+#define RING_BARRIER()      __asm volatile ("" ::: "memory")
+#else
+#define RING_BARRIER()
+#endif
+
+#define RING_MASK           (SD_RTLOG_RING_SIZE - 1)
+
+#if SD_RTLOG_RING_SIZE & RING_MASK
+#error SD_RTLOG_RING_SECTORS must be a power of 2
+#endif
+
+/* Make sure the file is allocated up to end, pre-allocating ahead of it */
+static FRESULT
+rtlog_grow(SD_RtLog *log, FSIZE_t end)
+{
+  FSIZE_t pos = log->file.fptr;
+  FRESULT fresult;
+
+  if (end <= log->file.fsize)
+  {
+    return FR_OK;
+  }
+
+  fresult = f_lseek(&log->file, log->file.fsize + SD_RTLOG_PREALLOC);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  if (log->file.fsize < end)
+  {
+    /* Disk full */
+    f_lseek(&log->file, pos);
+    return FR_DENIED;
+  }
+  fresult = f_sync(&log->file);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  return f_lseek(&log->file, pos);
+}
+
+/* Write len bytes from the ring tail to the file */
+static FRESULT
+rtlog_put(SD_RtLog *log, UINT len)
+{
+  DWORD tail = log->tail;
+  UINT ofs, n;
+  WORD bw;
+  FRESULT fresult;
+
+  fresult = rtlog_grow(log, log->file.fptr + len);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+
+  while (len)
+  {
+    /* Up to the end of the ring at most, then wrap around */
+    ofs = (UINT)(tail & RING_MASK);
+    n = SD_RTLOG_RING_SIZE - ofs;
+    if (n > len)
+    {
+      n = len;
+    }
+    fresult = f_write(&log->file, &log->ring[ofs], (WORD)n, &bw);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+    if (bw != n)
+    {
+      return FR_DENIED;
+    }
+    tail += n;
+    len -= n;
+    log->stats.written += n;
+
+    /* Hand the space back to the writer as soon as it is on the card */
+    RING_BARRIER();
+    log->tail = tail;
+  }
+  return FR_OK;
+}
+
+FRESULT
+SDRtLogCreate(SD_RtLog *log, const char *path)
+{
+  FRESULT fresult;
+
+  memset(&log->stats, 0, sizeof log->stats);
+  log->head = 0;
+  log->tail = 0;
+  SD_RTLOG_CYCLES_START();
+
+  fresult = f_open(&log->file, path, FA_WRITE | FA_CREATE_ALWAYS);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  return rtlog_grow(log, 1);
+}
+
+/*
+ * Called from the real-time task.  Copies the record into the ring or drops
+ * it whole; never waits and never touches the file system.
+ */
+FRESULT
+SDRtLogWrite(SD_RtLog *log, const void *data, UINT len)
+{
+  DWORD start = SD_RTLOG_CYCLES();
+  DWORD head = log->head;
+  DWORD used = head - log->tail;
+  UINT ofs, n;
+  FRESULT fresult = FR_OK;
+
+  if (len > SD_RTLOG_RING_SIZE - used)
+  {
+    log->stats.dropped++;
+    fresult = FR_DENIED;
+  }
+  else
+  {
+    ofs = (UINT)(head & RING_MASK);
+    n = SD_RTLOG_RING_SIZE - ofs;
+    if (n > len)
+    {
+      n = len;
+    }
+    memcpy(&log->ring[ofs], data, n);
+    memcpy(log->ring, (const BYTE*)data + n, len - n);
+
+    RING_BARRIER();
+    log->head = head + len;
+
+    used += len;
+    if (used > log->stats.ring_peak)
+    {
+      log->stats.ring_peak = used;
+    }
+  }
+
+  start = SD_RTLOG_CYCLES() - start;
+  if (start > log->stats.write_max)
+  {
+    log->stats.write_max = start;
+  }
+  return fresult;
+}
+
+/*
+ * Called from the maintenance task, with whatever lock guards the volume
+ * held.  Writes every complete sector in the ring.  Card busy time and all
+ * FAT and directory updates land here, not in SDRtLogWrite().
+ */
+FRESULT
+SDRtLogService(SD_RtLog *log)
+{
+  DWORD start = SD_RTLOG_CYCLES();
+  DWORD full = (log->head - log->tail) & ~(DWORD)(SD_RTLOG_SECTOR_SIZE - 1);
+  FRESULT fresult = FR_OK;
+
+  if (full)
+  {
+    fresult = rtlog_put(log, (UINT)full);
+  }
+
+  start = SD_RTLOG_CYCLES() - start;
+  if (start > log->stats.service_max)
+  {
+    log->stats.service_max = start;
+  }
+  return fresult;
+}
+
+/* Write out what is left in the ring, cut off the pre-allocation and close */
+FRESULT
+SDRtLogClose(SD_RtLog *log)
+{
+  FRESULT fresult;
+
+  fresult = rtlog_put(log, (UINT)(log->head - log->tail));
+  if (fresult != FR_OK)
+  {
+    f_close(&log->file);
+    return fresult;
+  }
+  fresult = f_truncate(&log->file);
+  if (fresult != FR_OK)
+  {
+    f_close(&log->file);
+    return fresult;
+  }
+  return f_close(&log->file);
+}
+
+/*
+ * Worst cases since SDRtLogCreate() or the last reset.  A reset racing a
+ * write or service call may lose that one sample.
+ */
+void
+SDRtLogGetStats(SD_RtLog *log, SD_RtLogStats *stats, BOOL reset)
+{
+  *stats = log->stats;
+  if (reset)
+  {
+    log->stats.write_max = 0;
+    log->stats.service_max = 0;
+    log->stats.ring_peak = 0;
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef SD_RTLOG_H_
+#define SD_RTLOG_H_
+
+#include "third_party/fatfs/src/ff.h"
+
+/*
+ * Bounded-latency log for real-time tasks.
+ *
+ * SDRtLogWrite() never calls into FatFs.  It copies the data into a ring of
+ * sectors in RAM and returns, so its run time depends only on the length:
+ * the same whether the card is idle, busy programming, or the file needs a
+ * new cluster.  SDRtLogService(), called from a background task, does all
+ * the file system work: it writes completed sectors with whole-sector
+ * f_write (straight to the card), pre-allocates the file ahead of the data
+ * with f_lseek, and commits the FAT and directory entry with f_sync only
+ * when it pre-allocates.
+ *
+ * The ring has a single producer and a single consumer: one task or ISR
+ * writes, one task services, with no lock between them.  When the ring is
+ * full, SDRtLogWrite() drops the record and counts it instead of waiting.
+ *
+ * The file is pre-allocated ahead of the data.  SDRtLogClose() truncates it
+ * at the end of the data.  After a power loss it keeps the pre-allocated
+ * length, and the part past the data holds whatever the clusters held.
+ *
+ * Every SDRtLogWrite() and SDRtLogService() call is timed with the CPU cycle
+ * counter, and SDRtLogGetStats() reports the worst cases.
+ */
+
+/* Ring size in sectors, a power of 2 */
+#define SD_RTLOG_RING_SECTORS   16
+
+/* Bytes pre-allocated ahead of the data, in one step */
+#define SD_RTLOG_PREALLOC       (1024UL * 1024)
+
+#define SD_RTLOG_SECTOR_SIZE    512
+#define SD_RTLOG_RING_SIZE      (SD_RTLOG_RING_SECTORS * SD_RTLOG_SECTOR_SIZE)
+
+typedef struct SD_RtLogStats
+{
+  DWORD write_max;      /* Longest SDRtLogWrite(), CPU cycles */
+  DWORD service_max;    /* Longest SDRtLogService(), CPU cycles */
+  DWORD ring_peak;      /* Most bytes waiting in the ring */
+  DWORD dropped;        /* Records dropped because the ring was full */
+  DWORD written;        /* Bytes written to the card */
+} SD_RtLogStats;
+
+typedef struct SD_RtLog
+{
+  FIL file;             /* Log file, owned by the service task */
+  volatile DWORD head;  /* Bytes put into the ring (free running) */
+  volatile DWORD tail;  /* Bytes taken out of the ring (free running) */
+  SD_RtLogStats stats;
+  BYTE ring[SD_RTLOG_RING_SIZE];
+} SD_RtLog;
+
+FRESULT SDRtLogCreate(SD_RtLog *log, const char *path);
+FRESULT SDRtLogWrite(SD_RtLog *log, const void *data, UINT len);
+FRESULT SDRtLogService(SD_RtLog *log);
+FRESULT SDRtLogClose(SD_RtLog *log);
+void SDRtLogGetStats(SD_RtLog *log, SD_RtLogStats *stats, BOOL reset);
+
+#endif /* SD_RTLOG_H_ */
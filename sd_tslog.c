@@ -0,0 +1,404 @@
+#include <string.h>
+#include "sd_tslog.h"
+
+#define TSLOG_MAGIC_DATA    0x444C5354UL  /* "TSLD" */
+#define TSLOG_MAGIC_INDEX   0x494C5354UL  /* "TSLI" */
+
+#define TSLOG_N             SD_TSLOG_INDEX_INTERVAL
+
+/* Header fields shared by data and index blocks */
+#define TSLOG_MAGIC         0
+#define TSLOG_FIRST_TS      4
+#define TSLOG_LAST_TS       8
+#define TSLOG_COUNT         12
+#define TSLOG_USED          14
+
+#if TSLOG_N < 2 || TSLOG_N > (SD_TSLOG_BLOCK_SIZE - SD_TSLOG_HEADER_SIZE) / 4 + 1
+#error SD_TSLOG_INDEX_INTERVAL is out of range
+#endif
+
+/*****************************************************************************
+ *
+ *                           WRITER
+ *
+ *****************************************************************************/
+
+static FRESULT
+tslog_put(SD_TsLog *log, const BYTE *blk)
+{
+  WORD bw;
+  FRESULT fresult;
+
+  /* Whole sector at a sector boundary, f_write hands it straight to the card */
+  fresult = f_write(&log->file, blk, SD_TSLOG_BLOCK_SIZE, &bw);
+  if (fresult == FR_OK && bw != SD_TSLOG_BLOCK_SIZE)
+  {
+    /* Disk full */
+    fresult = FR_DENIED;
+  }
+  return fresult;
+}
+
+/* Write the current data block and record it in the group index */
+static FRESULT
+tslog_close_block(SD_TsLog *log)
+{
+  BYTE *idx = log->index;
+  WORD k = (WORD)(log->sect % TSLOG_N);
+  FRESULT fresult;
+
+  ST_WORD(&log->block[TSLOG_USED], log->pos);
+  memset(&log->block[log->pos], 0, SD_TSLOG_BLOCK_SIZE - log->pos);
+  fresult = tslog_put(log, log->block);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+
+  if (k == 0)
+  {
+    memset(idx, 0, SD_TSLOG_BLOCK_SIZE);
+    ST_DWORD(&idx[TSLOG_MAGIC], TSLOG_MAGIC_INDEX);
+    memcpy(&idx[TSLOG_FIRST_TS], &log->block[TSLOG_FIRST_TS], 4);
+  }
+  memcpy(&idx[TSLOG_LAST_TS], &log->block[TSLOG_LAST_TS], 4);
+  memcpy(&idx[SD_TSLOG_HEADER_SIZE + k * 4], &log->block[TSLOG_FIRST_TS], 4);
+  ST_WORD(&idx[TSLOG_COUNT], k + 1);
+  log->sect++;
+
+  if (k == TSLOG_N - 2)
+  {
+    /* Group complete, the index takes the last sector */
+    fresult = tslog_put(log, idx);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+    log->sect++;
+  }
+
+  log->pos = 0;
+  return FR_OK;
+}
+
+FRESULT
+SDTsLogCreate(SD_TsLog *log, const char *path)
+{
+  log->sect = 0;
+  log->pos = 0;
+  return f_open(&log->file, path, FA_CREATE_ALWAYS | FA_WRITE);
+}
+
+FRESULT
+SDTsLogWrite(SD_TsLog *log, DWORD ts, const void *data, UINT len)
+{
+  BYTE *p;
+  FRESULT fresult;
+
+  if (len > SD_TSLOG_MAX_RECORD)
+  {
+    return FR_DENIED;
+  }
+  if (log->pos && ts < LD_DWORD(&log->block[TSLOG_LAST_TS]))
+  {
+    /* Timestamps must not go backwards */
+    return FR_DENIED;
+  }
+
+  if (log->pos + SD_TSLOG_REC_HDR_SIZE + len > SD_TSLOG_BLOCK_SIZE)
+  {
+    /* Does not fit, the record goes to a fresh block instead of straddling */
+    fresult = tslog_close_block(log);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+
+  if (!log->pos)
+  {
+    ST_DWORD(&log->block[TSLOG_MAGIC], TSLOG_MAGIC_DATA);
+    ST_DWORD(&log->block[TSLOG_FIRST_TS], ts);
+    ST_WORD(&log->block[TSLOG_COUNT], 0);
+    log->pos = SD_TSLOG_HEADER_SIZE;
+  }
+
+  p = &log->block[log->pos];
+  ST_WORD(&p[0], len);
+  ST_DWORD(&p[2], ts);
+  memcpy(&p[SD_TSLOG_REC_HDR_SIZE], data, len);
+  log->pos += SD_TSLOG_REC_HDR_SIZE + len;
+  ST_DWORD(&log->block[TSLOG_LAST_TS], ts);
+  ST_WORD(&log->block[TSLOG_COUNT], LD_WORD(&log->block[TSLOG_COUNT]) + 1);
+
+  return FR_OK;
+}
+
+/*
+ * Write out the partially filled block and commit the file.  The next
+ * record starts a new block, so no record is ever split by a flush.
+ */
+FRESULT
+SDTsLogFlush(SD_TsLog *log)
+{
+  FRESULT fresult;
+
+  if (log->pos)
+  {
+    fresult = tslog_close_block(log);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+  return f_sync(&log->file);
+}
+
+/*****************************************************************************
+ *
+ *                           READER
+ *
+ *****************************************************************************/
+
+static FRESULT
+tslog_load(SD_TsLog *log, DWORD sect, BYTE *blk)
+{
+  WORD br;
+  FRESULT fresult;
+
+  if (log->file.fptr != (FSIZE_t)sect * SD_TSLOG_BLOCK_SIZE)
+  {
+    fresult = f_lseek(&log->file, (FSIZE_t)sect * SD_TSLOG_BLOCK_SIZE);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+  fresult = f_read(&log->file, blk, SD_TSLOG_BLOCK_SIZE, &br);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  if (br != SD_TSLOG_BLOCK_SIZE
+      || LD_DWORD(&blk[TSLOG_MAGIC]) != ((sect % TSLOG_N == TSLOG_N - 1) ? TSLOG_MAGIC_INDEX : TSLOG_MAGIC_DATA))
+  {
+    return FR_NO_FILESYSTEM;
+  }
+  return FR_OK;
+}
+
+static FRESULT
+tslog_load_index(SD_TsLog *log, DWORD grp)
+{
+  DWORD sect = grp * TSLOG_N + TSLOG_N - 1;
+  FRESULT fresult;
+
+  if (log->isect == sect)
+  {
+    return FR_OK;
+  }
+  log->isect = 0xFFFFFFFF;
+  fresult = tslog_load(log, sect, log->index);
+  if (fresult == FR_OK)
+  {
+    log->isect = sect;
+  }
+  return fresult;
+}
+
+/* Make sure a record is available at log->pos, moving on to later blocks */
+static FRESULT
+tslog_peek(SD_TsLog *log)
+{
+  FRESULT fresult;
+
+  while (log->sect >= log->nsect || log->pos >= LD_WORD(&log->block[TSLOG_USED]))
+  {
+    if (log->sect + 1 >= log->nsect)
+    {
+      /* End of the log */
+      log->sect = log->nsect;
+      return FR_NO_FILE;
+    }
+    log->sect++;
+    if (log->sect % TSLOG_N == TSLOG_N - 1)
+    {
+      /* Skip the index block */
+      continue;
+    }
+    fresult = tslog_load(log, log->sect, log->block);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+    log->pos = SD_TSLOG_HEADER_SIZE;
+  }
+  return FR_OK;
+}
+
+FRESULT
+SDTsLogOpen(SD_TsLog *log, const char *path)
+{
+  FRESULT fresult;
+
+  fresult = f_open(&log->file, path, FA_READ);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+#if _USE_FASTSEEK
+  /* Seeks go back and forth, map the clusters so f_lseek skips the FAT walk */
+  log->cltbl[0] = SD_TSLOG_LINKMAP_SIZE;
+  log->file.cltbl = log->cltbl;
+  if (f_lseek(&log->file, CREATE_LINKMAP) != FR_OK)
+  {
+    /* Too fragmented for the table, fall back to plain seeks */
+    log->file.cltbl = NULL;
+  }
+#endif
+  log->nsect = (DWORD)(log->file.fsize / SD_TSLOG_BLOCK_SIZE);
+  log->isect = 0xFFFFFFFF;
+  log->sect = 0;
+  log->pos = 0;
+  ST_WORD(&log->block[TSLOG_USED], 0);
+
+  /* Load the first block so that reading starts at the top */
+  if (log->nsect)
+  {
+    fresult = tslog_load(log, 0, log->block);
+    log->pos = SD_TSLOG_HEADER_SIZE;
+  }
+  return fresult;
+}
+
+/*
+ * Position the reader at the first record with a timestamp >= ts.  Binary
+ * search over the index blocks of complete groups, then over the data block
+ * headers of the trailing group, then a short scan inside one block.
+ */
+FRESULT
+SDTsLogSeek(SD_TsLog *log, DWORD ts)
+{
+  DWORD lo, hi, mid, ngrp, sect;
+  WORD k, n;
+  FRESULT fresult;
+
+  ngrp = log->nsect / TSLOG_N;
+
+  lo = 0;
+  hi = ngrp;
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    fresult = tslog_load_index(log, mid);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+    if (LD_DWORD(&log->index[TSLOG_LAST_TS]) < ts)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  if (lo < ngrp)
+  {
+    /* In a complete group, the index tells which block to start at */
+    fresult = tslog_load_index(log, lo);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+    n = LD_WORD(&log->index[TSLOG_COUNT]);
+    for (k = 0; k < n && LD_DWORD(&log->index[SD_TSLOG_HEADER_SIZE + k * 4]) < ts; k++);
+    sect = lo * TSLOG_N + (k ? k - 1 : 0);
+  }
+  else
+  {
+    /* In the trailing group that has no index yet, search the block headers */
+    lo = ngrp * TSLOG_N;
+    hi = log->nsect;
+    while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      fresult = tslog_load(log, mid, log->block);
+      if (fresult != FR_OK)
+      {
+        return fresult;
+      }
+      if (LD_DWORD(&log->block[TSLOG_FIRST_TS]) < ts)
+      {
+        lo = mid + 1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+    sect = (lo > ngrp * TSLOG_N) ? lo - 1 : lo;
+  }
+
+  if (sect >= log->nsect)
+  {
+    log->sect = log->nsect;
+    return FR_OK;
+  }
+  fresult = tslog_load(log, sect, log->block);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  log->sect = sect;
+  log->pos = SD_TSLOG_HEADER_SIZE;
+
+  /* Skip the earlier records in this block */
+  while ((fresult = tslog_peek(log)) == FR_OK && LD_DWORD(&log->block[log->pos + 2]) < ts)
+  {
+    log->pos += SD_TSLOG_REC_HDR_SIZE + LD_WORD(&log->block[log->pos]);
+  }
+  return (fresult == FR_NO_FILE) ? FR_OK : fresult;
+}
+
+/* Read the next record, returns FR_NO_FILE at the end of the log */
+FRESULT
+SDTsLogRead(SD_TsLog *log, DWORD *ts, void *buf, UINT size, UINT *len)
+{
+  BYTE *p;
+  UINT n;
+  FRESULT fresult;
+
+  fresult = tslog_peek(log);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+
+  p = &log->block[log->pos];
+  n = LD_WORD(&p[0]);
+  *ts = LD_DWORD(&p[2]);
+  *len = (n < size) ? n : size;
+  memcpy(buf, &p[SD_TSLOG_REC_HDR_SIZE], *len);
+  log->pos += SD_TSLOG_REC_HDR_SIZE + n;
+
+  return FR_OK;
+}
+
+FRESULT
+SDTsLogClose(SD_TsLog *log)
+{
+  FRESULT fresult;
+
+  if (log->file.flag & FA_WRITE)
+  {
+    fresult = SDTsLogFlush(log);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+  return f_close(&log->file);
+}
@@ -0,0 +1,56 @@
+#ifndef SD_TSLOG_H_
+#define SD_TSLOG_H_
+
+#include "third_party/fatfs/src/ff.h"
+
+/*
+ * Record-oriented time-series log.
+ *
+ * Records (timestamp + payload) are packed into 512-byte blocks and a record
+ * never straddles a block, so every block written to the card can be decoded
+ * on its own.  Timestamps are caller-defined units and must not decrease.
+ * The last sector of every group of SD_TSLOG_INDEX_INTERVAL sectors is an
+ * index block holding the first timestamp of each data block in the group,
+ * which lets SDTsLogSeek() find a timestamp in O(log n) sector reads.
+ *
+ * Data block:  "TSLD", first ts, last ts, record count, used bytes, records
+ * Record:      length (WORD), ts (DWORD), payload
+ * Index block: "TSLI", first ts, last ts, entry count, first ts[]
+ */
+
+/* Sectors per index group, the last one is the index (2..125) */
+#define SD_TSLOG_INDEX_INTERVAL 64
+
+/* Cluster link map entries for the reader, 2 per file fragment + 2 */
+#define SD_TSLOG_LINKMAP_SIZE   16
+
+#define SD_TSLOG_BLOCK_SIZE     512
+#define SD_TSLOG_HEADER_SIZE    16
+#define SD_TSLOG_REC_HDR_SIZE   6
+#define SD_TSLOG_MAX_RECORD     (SD_TSLOG_BLOCK_SIZE - SD_TSLOG_HEADER_SIZE - SD_TSLOG_REC_HDR_SIZE)
+
+typedef struct SD_TsLog
+{
+  FIL file;
+  DWORD sect;           /* Writer: next sector to write, reader: loaded sector */
+  DWORD nsect;          /* Reader: number of complete sectors in the file */
+  DWORD isect;          /* Reader: sector loaded in index[] (0xFFFFFFFF: none) */
+  WORD pos;             /* Writer: used bytes in block[], reader: next record */
+  BYTE block[SD_TSLOG_BLOCK_SIZE];  /* Current data block */
+  BYTE index[SD_TSLOG_BLOCK_SIZE];  /* Index block of the current group */
+#if _USE_FASTSEEK
+  DWORD cltbl[SD_TSLOG_LINKMAP_SIZE];  /* Reader: cluster link map for f_lseek */
+#endif
+} SD_TsLog;
+
+FRESULT SDTsLogCreate(SD_TsLog *log, const char *path);
+FRESULT SDTsLogWrite(SD_TsLog *log, DWORD ts, const void *data, UINT len);
+FRESULT SDTsLogFlush(SD_TsLog *log);
+
+FRESULT SDTsLogOpen(SD_TsLog *log, const char *path);
+FRESULT SDTsLogSeek(SD_TsLog *log, DWORD ts);
+FRESULT SDTsLogRead(SD_TsLog *log, DWORD *ts, void *buf, UINT size, UINT *len);
+
+FRESULT SDTsLogClose(SD_TsLog *log);
+
+#endif /* SD_TSLOG_H_ */
@@ -0,0 +1,560 @@
+#include <string.h>
+#include "sd_zlog.h"
+
+#define ZLOG_MAGIC          0x46474C5AUL  /* "ZLGF" */
+
+/* Frame header fields */
+#define ZLOG_HDR_MAGIC      0
+#define ZLOG_HDR_OFS        4
+#define ZLOG_HDR_RAW        8
+#define ZLOG_HDR_COMP       10
+#define ZLOG_HDR_STRIDE     12
+
+#define ZLOG_MIN_MATCH      4
+#define ZLOG_MAX_MATCH      (0x7F + ZLOG_MIN_MATCH)
+#define ZLOG_MAX_LITERALS   128
+
+#if SD_ZLOG_WINDOW < 2 * ZLOG_MAX_MATCH || SD_ZLOG_WINDOW > 32768
+#error SD_ZLOG_WINDOW is out of range
+#endif
+
+/* Reverse the delta filter in place: buf[i] += buf[i - stride] for i < n */
+static void
+zlog_integrate(BYTE *buf, UINT n, UINT stride)
+{
+  UINT i;
+
+  if (stride)
+  {
+    for (i = stride; i < n; i++)
+    {
+      buf[i] += buf[i - stride];
+    }
+  }
+}
+
+/*****************************************************************************
+ *
+ *                           WRITER
+ *
+ *****************************************************************************/
+
+static UINT
+zlog_hash(const BYTE *p)
+{
+  return (UINT)(((LD_DWORD(p) * 2654435761UL) & 0xFFFFFFFFUL) >> (32 - SD_ZLOG_HASH_BITS));
+}
+
+/* Start a new frame with an empty LZ state */
+static void
+zlog_new_frame(SD_ZLog *log)
+{
+  log->ip = 0;
+  log->anchor = 0;
+  log->opos = SD_ZLOG_HEADER_SIZE;
+  memset(log->hash, 0, sizeof log->hash);
+}
+
+static FRESULT
+zlog_put(SD_ZLog *log)
+{
+  WORD bw, n;
+  FRESULT fresult;
+
+  n = log->nframe * SD_ZLOG_FRAME_SIZE;
+  if (!n)
+  {
+    return FR_OK;
+  }
+  /* Whole sectors at a sector boundary, f_write hands them straight to the card */
+  fresult = f_write(&log->file, log->out, n, &bw);
+  if (fresult == FR_OK && bw != n)
+  {
+    /* Disk full */
+    fresult = FR_DENIED;
+  }
+  log->nframe = 0;
+  return fresult;
+}
+
+/*
+ * Seal the current frame with the raw bytes emitted so far (up to anchor)
+ * and carry the rest of buf[] over into the next frame.
+ */
+static FRESULT
+zlog_close_frame(SD_ZLog *log)
+{
+  BYTE *o = &log->out[log->nframe * SD_ZLOG_FRAME_SIZE];
+  WORD n = log->anchor;
+  UINT lim;
+
+  ST_DWORD(&o[ZLOG_HDR_MAGIC], ZLOG_MAGIC);
+  ST_DWORD(&o[ZLOG_HDR_OFS], log->ofs);
+  ST_WORD(&o[ZLOG_HDR_RAW], n);
+  ST_WORD(&o[ZLOG_HDR_COMP], log->opos - SD_ZLOG_HEADER_SIZE);
+  o[ZLOG_HDR_STRIDE] = log->stride;
+  memset(&o[ZLOG_HDR_STRIDE + 1], 0, SD_ZLOG_HEADER_SIZE - ZLOG_HDR_STRIDE - 1);
+  memset(&o[log->opos], 0, SD_ZLOG_FRAME_SIZE - log->opos);
+  log->nframe++;
+  log->sect++;
+
+  /*
+   * The carried bytes were filtered against bytes of this frame.  Turn the
+   * first `stride' of them back into plain values so the next frame does
+   * not depend on this one.
+   */
+  lim = n + log->stride;
+  zlog_integrate(log->buf, (lim < log->len) ? lim : log->len, log->stride);
+  memmove(log->buf, &log->buf[n], log->len - n);
+  log->len -= n;
+  log->ofs += n;
+  zlog_new_frame(log);
+
+  return (log->nframe == SD_ZLOG_BATCH_FRAMES) ? zlog_put(log) : FR_OK;
+}
+
+/* Emit the pending literals up to end as far as they fit, TRUE if all did */
+static BOOL
+zlog_literals(SD_ZLog *log, WORD end)
+{
+  BYTE *o = &log->out[log->nframe * SD_ZLOG_FRAME_SIZE];
+  WORD n, room;
+
+  while (log->anchor < end)
+  {
+    room = SD_ZLOG_FRAME_SIZE - log->opos;
+    if (room < 2)
+    {
+      return FALSE;
+    }
+    n = end - log->anchor;
+    if (n > ZLOG_MAX_LITERALS)
+    {
+      n = ZLOG_MAX_LITERALS;
+    }
+    if (n > room - 1)
+    {
+      n = room - 1;
+    }
+    o[log->opos++] = (BYTE)(n - 1);
+    memcpy(&o[log->opos], &log->buf[log->anchor], n);
+    log->opos += n;
+    log->anchor += n;
+  }
+  return TRUE;
+}
+
+/*
+ * Greedy LZ over buf[].  Unless final is set, positions without a full
+ * match length of data behind them are left for the next call.
+ */
+static FRESULT
+zlog_encode(SD_ZLog *log, BOOL final)
+{
+  BYTE *o;
+  WORD cand, m, max;
+  UINT h;
+  FRESULT fresult;
+
+  while (log->ip < log->len && (final || log->len - log->ip >= ZLOG_MAX_MATCH))
+  {
+    m = 0;
+    cand = 0;
+    if (log->len - log->ip >= ZLOG_MIN_MATCH)
+    {
+      h = zlog_hash(&log->buf[log->ip]);
+      cand = log->hash[h];
+      log->hash[h] = log->ip + 1;
+      if (cand--)
+      {
+        max = log->len - log->ip;
+        if (max > ZLOG_MAX_MATCH)
+        {
+          max = ZLOG_MAX_MATCH;
+        }
+        while (m < max && log->buf[cand + m] == log->buf[log->ip + m])
+        {
+          m++;
+        }
+      }
+    }
+
+    if (m >= ZLOG_MIN_MATCH)
+    {
+      if (!zlog_literals(log, log->ip) || log->opos + 3 > SD_ZLOG_FRAME_SIZE)
+      {
+        /* Frame is full, the match is looked up again in the next one */
+        fresult = zlog_close_frame(log);
+        if (fresult != FR_OK)
+        {
+          return fresult;
+        }
+        continue;
+      }
+      o = &log->out[log->nframe * SD_ZLOG_FRAME_SIZE + log->opos];
+      o[0] = (BYTE)(0x80 | (m - ZLOG_MIN_MATCH));
+      ST_WORD(&o[1], log->ip - cand);
+      log->opos += 3;
+      log->ip += m;
+      log->anchor = log->ip;
+    }
+    else
+    {
+      log->ip++;
+      if (log->ip - log->anchor == ZLOG_MAX_LITERALS && !zlog_literals(log, log->ip))
+      {
+        fresult = zlog_close_frame(log);
+        if (fresult != FR_OK)
+        {
+          return fresult;
+        }
+      }
+    }
+  }
+  return FR_OK;
+}
+
+/* Encode the rest of buf[] and close the frame */
+static FRESULT
+zlog_finish_frame(SD_ZLog *log)
+{
+  FRESULT fresult;
+
+  fresult = zlog_encode(log, TRUE);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  zlog_literals(log, log->len);
+  return zlog_close_frame(log);
+}
+
+FRESULT
+SDZLogCreate(SD_ZLog *log, const char *path, BYTE stride)
+{
+  if (stride > SD_ZLOG_MAX_STRIDE)
+  {
+    return FR_DENIED;
+  }
+  log->stride = stride;
+  log->dpos = 0;
+  memset(log->last, 0, sizeof log->last);
+  log->ofs = 0;
+  log->sect = 0;
+  log->len = 0;
+  log->nframe = 0;
+  zlog_new_frame(log);
+  return f_open(&log->file, path, FA_CREATE_ALWAYS | FA_WRITE);
+}
+
+FRESULT
+SDZLogWrite(SD_ZLog *log, const void *data, UINT len)
+{
+  const BYTE *p = data;
+  BYTE x;
+  FRESULT fresult;
+
+  while (len)
+  {
+    /* Append through the delta filter, the head of a frame stays unfiltered */
+    while (len && log->len < SD_ZLOG_WINDOW)
+    {
+      x = *p++;
+      len--;
+      if (log->stride)
+      {
+        log->buf[log->len] = (log->len < log->stride) ? x : (BYTE)(x - log->last[log->dpos]);
+        log->last[log->dpos] = x;
+        if (++log->dpos == log->stride)
+        {
+          log->dpos = 0;
+        }
+      }
+      else
+      {
+        log->buf[log->len] = x;
+      }
+      log->len++;
+    }
+
+    fresult = zlog_encode(log, FALSE);
+    if (fresult == FR_OK && log->len == SD_ZLOG_WINDOW)
+    {
+      /* Frame has taken all the raw data it can */
+      fresult = zlog_finish_frame(log);
+    }
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+  return FR_OK;
+}
+
+/*
+ * Close the current frame and commit the file.  Data written after this
+ * goes to a new frame, so frequent flushes cost compression ratio.
+ */
+FRESULT
+SDZLogFlush(SD_ZLog *log)
+{
+  FRESULT fresult;
+
+  while (log->len)
+  {
+    fresult = zlog_finish_frame(log);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+  fresult = zlog_put(log);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  return f_sync(&log->file);
+}
+
+/*****************************************************************************
+ *
+ *                           READER
+ *
+ *****************************************************************************/
+
+/* Read the frame at sect into out[] */
+static FRESULT
+zlog_load(SD_ZLog *log, DWORD sect)
+{
+  WORD br;
+  FRESULT fresult;
+
+  if (log->file.fptr != (FSIZE_t)sect * SD_ZLOG_FRAME_SIZE)
+  {
+    fresult = f_lseek(&log->file, (FSIZE_t)sect * SD_ZLOG_FRAME_SIZE);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+  fresult = f_read(&log->file, log->out, SD_ZLOG_FRAME_SIZE, &br);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  if (br != SD_ZLOG_FRAME_SIZE || LD_DWORD(&log->out[ZLOG_HDR_MAGIC]) != ZLOG_MAGIC)
+  {
+    return FR_NO_FILESYSTEM;
+  }
+  return FR_OK;
+}
+
+/* Decode the frame in out[] into buf[] */
+static FRESULT
+zlog_decode(SD_ZLog *log)
+{
+  const BYTE *in = log->out;
+  BYTE *buf = log->buf;
+  UINT p, end, o, n, d, raw;
+
+  raw = LD_WORD(&in[ZLOG_HDR_RAW]);
+  end = SD_ZLOG_HEADER_SIZE + LD_WORD(&in[ZLOG_HDR_COMP]);
+  if (raw > SD_ZLOG_WINDOW || end > SD_ZLOG_FRAME_SIZE || in[ZLOG_HDR_STRIDE] > SD_ZLOG_MAX_STRIDE)
+  {
+    return FR_NO_FILESYSTEM;
+  }
+
+  p = SD_ZLOG_HEADER_SIZE;
+  o = 0;
+  while (p < end)
+  {
+    n = in[p++];
+    if (n < 0x80)
+    {
+      n++;
+      if (p + n > end || o + n > raw)
+      {
+        return FR_NO_FILESYSTEM;
+      }
+      memcpy(&buf[o], &in[p], n);
+      p += n;
+    }
+    else
+    {
+      n = n - 0x80 + ZLOG_MIN_MATCH;
+      if (p + 2 > end)
+      {
+        return FR_NO_FILESYSTEM;
+      }
+      d = LD_WORD(&in[p]);
+      p += 2;
+      if (!d || d > o || o + n > raw)
+      {
+        return FR_NO_FILESYSTEM;
+      }
+      /* Byte by byte, the match may overlap itself (runs) */
+      for (; n; n--, o++)
+      {
+        buf[o] = buf[o - d];
+      }
+      continue;
+    }
+    o += n;
+  }
+  if (o != raw)
+  {
+    return FR_NO_FILESYSTEM;
+  }
+
+  zlog_integrate(buf, raw, in[ZLOG_HDR_STRIDE]);
+  log->ofs = LD_DWORD(&in[ZLOG_HDR_OFS]);
+  log->len = (WORD)raw;
+  log->ip = 0;
+  return FR_OK;
+}
+
+FRESULT
+SDZLogOpen(SD_ZLog *log, const char *path)
+{
+  FRESULT fresult;
+
+  fresult = f_open(&log->file, path, FA_READ);
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+#if _USE_FASTSEEK
+  /* Seeks go back and forth, map the clusters so f_lseek skips the FAT walk */
+  log->cltbl[0] = SD_ZLOG_LINKMAP_SIZE;
+  log->file.cltbl = log->cltbl;
+  if (f_lseek(&log->file, CREATE_LINKMAP) != FR_OK)
+  {
+    /* Too fragmented for the table, fall back to plain seeks */
+    log->file.cltbl = NULL;
+  }
+#endif
+  log->nsect = (DWORD)(log->file.fsize / SD_ZLOG_FRAME_SIZE);
+  log->sect = 0;
+  log->ofs = 0;
+  log->len = 0;
+  log->ip = 0;
+  return FR_OK;
+}
+
+/*
+ * Position the reader at stream offset ofs.  Binary search over the frame
+ * headers, then one frame is decoded.
+ */
+FRESULT
+SDZLogSeek(SD_ZLog *log, DWORD ofs)
+{
+  DWORD lo, hi, mid;
+  FRESULT fresult;
+
+  if (log->len && ofs >= log->ofs && ofs - log->ofs <= log->len)
+  {
+    /* Inside the frame already decoded */
+    log->ip = (WORD)(ofs - log->ofs);
+    return FR_OK;
+  }
+
+  /* Find the last frame that starts at or before ofs */
+  lo = 0;
+  hi = log->nsect;
+  while (hi - lo > 1)
+  {
+    mid = (lo + hi) / 2;
+    fresult = zlog_load(log, mid);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+    if (LD_DWORD(&log->out[ZLOG_HDR_OFS]) <= ofs)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  log->len = 0;
+  log->ip = 0;
+  log->sect = lo;
+  if (lo >= log->nsect)
+  {
+    return FR_OK;
+  }
+  fresult = zlog_load(log, lo);
+  if (fresult == FR_OK)
+  {
+    fresult = zlog_decode(log);
+  }
+  if (fresult != FR_OK)
+  {
+    return fresult;
+  }
+  log->sect = lo + 1;
+  log->ip = (ofs - log->ofs < log->len) ? (WORD)(ofs - log->ofs) : log->len;
+  return FR_OK;
+}
+
+FRESULT
+SDZLogRead(SD_ZLog *log, void *buf, UINT len, UINT *br)
+{
+  BYTE *p = buf;
+  UINT n;
+  FRESULT fresult;
+
+  *br = 0;
+  while (len)
+  {
+    if (log->ip >= log->len)
+    {
+      if (log->sect >= log->nsect)
+      {
+        /* End of the log */
+        break;
+      }
+      fresult = zlog_load(log, log->sect);
+      if (fresult == FR_OK)
+      {
+        fresult = zlog_decode(log);
+      }
+      if (fresult != FR_OK)
+      {
+        return fresult;
+      }
+      log->sect++;
+      continue;
+    }
+    n = log->len - log->ip;
+    if (n > len)
+    {
+      n = len;
+    }
+    memcpy(p, &log->buf[log->ip], n);
+    log->ip += n;
+    p += n;
+    len -= n;
+    *br += n;
+  }
+  return FR_OK;
+}
+
+FRESULT
+SDZLogClose(SD_ZLog *log)
+{
+  FRESULT fresult;
+
+  if (log->file.flag & FA_WRITE)
+  {
+    fresult = SDZLogFlush(log);
+    if (fresult != FR_OK)
+    {
+      return fresult;
+    }
+  }
+  return f_close(&log->file);
+}
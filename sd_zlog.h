@@ -0,0 +1,71 @@
+#ifndef SD_ZLOG_H_
+#define SD_ZLOG_H_
+
+#include "third_party/fatfs/src/ff.h"
+
+/*
+ * Compressed stream log.
+ *
+ * Data written to the log is delta filtered (optional, byte-wise against the
+ * byte `stride' positions back) and then LZ compressed into 512-byte frames.
+ * Each frame is one sector and starts with a fresh delta and LZ state, so any
+ * sector of the file can be decoded on its own and the reader can seek by
+ * binary search over the frame headers.  The LZ history is the raw data of
+ * the current frame only, which bounds the working set to SD_ZLOG_WINDOW.
+ *
+ * Frame:  "ZLGF", stream offset, raw length, compressed length, stride, codes
+ * Codes:  0x00-0x7F  literal run of 1-128 bytes follows
+ *         0x80-0xFF  match of 4-131 bytes, followed by the distance (WORD)
+ */
+
+/* Raw bytes per frame at most, also the LZ history (<= 32768) */
+#define SD_ZLOG_WINDOW          2048
+
+/* Match finder hash table entries, 2^n */
+#define SD_ZLOG_HASH_BITS       8
+
+/* Frames collected before they are written as one multi-sector write */
+#define SD_ZLOG_BATCH_FRAMES    2
+
+/* Largest delta distance, i.e. the largest sample size to filter against */
+#define SD_ZLOG_MAX_STRIDE      16
+
+/* Cluster link map entries for the reader, 2 per file fragment + 2 */
+#define SD_ZLOG_LINKMAP_SIZE    16
+
+#define SD_ZLOG_FRAME_SIZE      512
+#define SD_ZLOG_HEADER_SIZE     16
+
+typedef struct SD_ZLog
+{
+  FIL file;
+  DWORD ofs;            /* Stream offset of buf[0] */
+  DWORD sect;           /* Writer: frames written, reader: frame loaded in buf[] */
+  DWORD nsect;          /* Reader: number of frames in the file */
+  WORD len;             /* Bytes in buf[] */
+  WORD ip;              /* Writer: next byte to encode, reader: next byte to return */
+  WORD anchor;          /* Writer: first byte not yet emitted */
+  WORD opos;            /* Writer: bytes used in the current frame */
+  BYTE stride;          /* Delta distance, 0: no delta filter */
+  BYTE dpos;            /* Writer: next slot in last[] */
+  BYTE nframe;          /* Writer: complete frames in out[] */
+  BYTE last[SD_ZLOG_MAX_STRIDE];  /* Writer: last `stride' bytes of the stream */
+  WORD hash[1 << SD_ZLOG_HASH_BITS];  /* Writer: buf[] position + 1 by hash */
+  BYTE buf[SD_ZLOG_WINDOW];  /* Raw data of the current frame (delta filtered while writing) */
+  BYTE out[SD_ZLOG_BATCH_FRAMES * SD_ZLOG_FRAME_SIZE];  /* Frame images */
+#if _USE_FASTSEEK
+  DWORD cltbl[SD_ZLOG_LINKMAP_SIZE];  /* Reader: cluster link map for f_lseek */
+#endif
+} SD_ZLog;
+
+FRESULT SDZLogCreate(SD_ZLog *log, const char *path, BYTE stride);
+FRESULT SDZLogWrite(SD_ZLog *log, const void *data, UINT len);
+FRESULT SDZLogFlush(SD_ZLog *log);
+
+FRESULT SDZLogOpen(SD_ZLog *log, const char *path);
+FRESULT SDZLogSeek(SD_ZLog *log, DWORD ofs);
+FRESULT SDZLogRead(SD_ZLog *log, void *buf, UINT len, UINT *br);
+
+FRESULT SDZLogClose(SD_ZLog *log);
+
+#endif /* SD_ZLOG_H_ */
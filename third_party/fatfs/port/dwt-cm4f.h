@@ -0,0 +1,29 @@
+/*-----------------------------------------------------------------------*/
+/* Cortex-M4 DWT cycle counter  (Platform dependent)                     */
+/*-----------------------------------------------------------------------*/
+/* Shared by the trace recorder and the real-time log, which both stamp  */
+/* events with the free running CPU cycle counter.                       */
+/*-----------------------------------------------------------------------*/
+
+#ifndef _DWT_CM4F
+#define _DWT_CM4F
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "inc/hw_types.h"
+
+#define DEMCR               0xE000EDFC    /* Debug Exception and Monitor Control */
+#define DEMCR_TRCENA        0x01000000
+#define DWT_CTRL            0xE0001000
+#define DWT_CTRL_CYCCNTENA  0x00000001
+#define DWT_CYCCNT          0xE0001004
+
+/* Current cycle count, wraps around every 2^32 cycles */
+#define DWT_CYCLES()        HWREG(DWT_CYCCNT)
+
+/* Enable the trace block and start the counter, keeping its count */
+#define DWT_START() \
+    do { HWREG(DEMCR) |= DEMCR_TRCENA; HWREG(DWT_CTRL) |= DWT_CTRL_CYCCNTENA; } while (0)
+
+#endif /* _DWT_CM4F */
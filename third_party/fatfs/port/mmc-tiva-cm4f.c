@@ -34,16 +34,22 @@
 
 /* FatFs includes */
 #include "diskio.h"
+#include "fftrace.h"
 
 #define USE_FREERTOS
+#define USE_IO_SCHED
 
 #if defined (USE_FREERTOS)
 /* FreeRTOS Includes */
 #include "FreeRTOS.h"
 #include "semphr.h"
+#include "task.h"
+#include "queue.h"
 
 /* Semaphore for interrupt completion */
 static xSemaphoreHandle sd_int_semphr;
+#elif defined (USE_IO_SCHED)
+#error USE_IO_SCHED requires USE_FREERTOS
 #endif
 
 /* Definitions for MMC/SDC command */
@@ -53,13 +59,18 @@ static xSemaphoreHandle sd_int_semphr;
 #define CMD9    (0x40+9)    /* SEND_CSD */
 #define CMD10    (0x40+10)    /* SEND_CID */
 #define CMD12    (0x40+12)    /* STOP_TRANSMISSION */
+#define CMD13    (0x40+13)    /* SD_STATUS (ACMD) */
 #define CMD16    (0x40+16)    /* SET_BLOCKLEN */
 #define CMD17    (0x40+17)    /* READ_SINGLE_BLOCK */
 #define CMD18    (0x40+18)    /* READ_MULTIPLE_BLOCK */
 #define CMD23    (0x40+23)    /* SET_BLOCK_COUNT */
 #define CMD24    (0x40+24)    /* WRITE_BLOCK */
 #define CMD25    (0x40+25)    /* WRITE_MULTIPLE_BLOCK */
+#define CMD32    (0x40+32)    /* ERASE_WR_BLK_START */
+#define CMD33    (0x40+33)    /* ERASE_WR_BLK_END */
+#define CMD38    (0x40+38)    /* ERASE */
 #define CMD41    (0x40+41)    /* SEND_OP_COND (ACMD) */
+#define CMD51    (0x40+51)    /* SEND_SCR (ACMD) */
 #define CMD55    (0x40+55)    /* APP_CMD */
 #define CMD58    (0x40+58)    /* READ_OCR */
 
@@ -84,10 +95,16 @@ static xSemaphoreHandle sd_int_semphr;
 #define USE_SCATTERGATHER
 #define USE_DMA_TX
 #define USE_DMA_RX
+// #define USE_SPI_BATCH    /* Off until measured on a target, see USE_SPI_STATS */
+// #define USE_SPI_STATS    /* DWT cycles of send_cmd() and wait_ready(), read by MMC_GET_SPI_STATS */
+
+#define SSI_FIFO_DEPTH  8       /* Entries in each of the SSI TX and RX FIFOs */
+#define SPI_POLL_DMA    128     /* Bytes clocked per DMA busy poll */
 
 void init_dma(uint8_t send);
 uint32_t sector_send_dma(uint8_t *buff, uint32_t len);
 uint32_t sector_receive_dma(uint8_t *buff, uint32_t len);
+uint8_t busy_poll_dma(uint32_t len);
 
 static uint8_t ui8ControlTable[1024] __attribute__ ((aligned(1024)));
 
@@ -172,6 +189,13 @@ void set_sg_list_rxbuff(uint8_t* buff)
 }
 #endif
 
+#if defined(USE_SPI_BATCH)
+/* Bytes a batch received beyond the command response, returned by rcvr_spi() first */
+static BYTE spi_cmdbuf[SSI_FIFO_DEPTH];
+static const BYTE *spi_ahead;
+static BYTE spi_nahead;
+#endif
+
 // asserts the CS pin to the card
 static
 void SELECT (void)
@@ -184,6 +208,9 @@ static
 void DESELECT (void)
 {
     ROM_GPIOPinWrite(SDC_GPIO_PORT_BASE, SDC_SSI_FSS, SDC_SSI_FSS);
+#if defined(USE_SPI_BATCH)
+    spi_nahead = 0;
+#endif
 }
 
 /*--------------------------------------------------------------------------
@@ -204,6 +231,12 @@ BYTE CardType;            /* b0:MMC, b1:SDC, b2:Block addressing */
 static
 BYTE PowerFlag = 0;     /* indicates if "power" is on */
 
+static
+portTickType StartTick;    /* disk_initialize() called */
+
+static
+DWORD StartTime[2];        /* ms after StartTick: card ready, first write done (0xFFFFFFFF: none yet) */
+
 /*-----------------------------------------------------------------------*/
 /* Transmit a byte to MMC via SPI  (Platform dependent)                  */
 /*-----------------------------------------------------------------------*/
@@ -239,6 +272,12 @@ BYTE rcvr_spi (void)
 {
     uint32_t ui32RcvDat;
 
+#if defined(USE_SPI_BATCH)
+    if (spi_nahead) {
+        spi_nahead--;
+        return *spi_ahead++;
+    }
+#endif
     ROM_SSIDataPut(SDC_SSI_BASE, 0xFF); /* write dummy data */
 
     ROM_SSIDataGet(SDC_SSI_BASE, &ui32RcvDat); /* read data frm rx fifo */
@@ -269,6 +308,72 @@ void rcvr_spi_m16 (WORD *dst)
     *dst = rcvr_spi16();
 }
 
+#if defined(USE_SPI_BATCH)
+/*-----------------------------------------------------------------------*/
+/* Exchange a run of bytes with the FIFOs kept full  (Platform dependent)*/
+/*-----------------------------------------------------------------------*/
+/* The TX FIFO is refilled while earlier bytes are still shifting, so    */
+/* the bus runs without gaps.  No more than SSI_FIFO_DEPTH bytes are in  */
+/* flight, which keeps the RX FIFO from overrunning.  8-bit frames only. */
+
+static
+void spi_xfer (
+    const BYTE *tx,    /* Bytes to send, NULL: send 0xFF */
+    BYTE *rx,          /* Received bytes (may be tx), NULL: discard */
+    UINT n             /* Number of bytes */
+)
+{
+    UINT nt = 0, nr = 0;
+    uint32_t d;
+
+
+    while (nr < n) {
+        while (nt < n && nt - nr < SSI_FIFO_DEPTH
+               && (HWREG(SDC_SSI_BASE + SSI_O_SR) & SSI_SR_TNF)) {
+            HWREG(SDC_SSI_BASE + SSI_O_DR) = tx ? tx[nt] : 0xFF;
+            nt++;
+        }
+        if (HWREG(SDC_SSI_BASE + SSI_O_SR) & SSI_SR_RNE) {
+            d = HWREG(SDC_SSI_BASE + SSI_O_DR);
+            if (rx) rx[nr] = (BYTE)d;
+            nr++;
+        }
+    }
+}
+#endif
+
+#if defined(USE_SPI_STATS)
+/*-----------------------------------------------------------------------*/
+/* Command latency statistics                                            */
+/*-----------------------------------------------------------------------*/
+/* DWT cycles from the first command byte to the response in send_cmd()  */
+/* and through wait_ready(), to compare builds with and without          */
+/* USE_SPI_BATCH on a target.  Each entry holds the calls, the total and */
+/* the longest; MMC_GET_SPI_STATS copies them out and clears them.  The  */
+/* total wraps after 2^32 cycles, so read them before that.              */
+
+#include "dwt-cm4f.h"
+
+#define SPI_STAT_CMD    0
+#define SPI_STAT_READY  1
+
+static DWORD SpiStats[2][3];
+
+static
+void spi_stat (
+    int i,            /* SPI_STAT_CMD or SPI_STAT_READY */
+    DWORD t0        /* DWT_CYCLES() at the start */
+)
+{
+    DWORD t = DWT_CYCLES() - t0;
+
+
+    SpiStats[i][0]++;
+    SpiStats[i][1] += t;
+    if (t > SpiStats[i][2]) SpiStats[i][2] = t;
+}
+#endif
+
 /*-----------------------------------------------------------------------*/
 /* Wait for card ready                                                   */
 /*-----------------------------------------------------------------------*/
@@ -277,13 +382,68 @@ static
 BYTE wait_ready (void)
 {
     BYTE res;
+#if defined(USE_SPI_STATS)
+    DWORD t0 = DWT_CYCLES();
+#endif
 
 
+    TRACE_B(TR_WAIT_READY, 0);
     Timer2 = 50;    /* Wait for ready in timeout of 500ms */
+#if defined(USE_SPI_BATCH)
+    /* Once the card releases DO it stays high, so only the last byte of a batch matters */
+    spi_nahead = 0;
+    spi_xfer(0, spi_cmdbuf, SSI_FIFO_DEPTH);
+    res = spi_cmdbuf[SSI_FIFO_DEPTH - 1];
+    while ((res != 0xFF) && Timer2) {
+#if defined(USE_DMA_RX)
+        res = busy_poll_dma(SPI_POLL_DMA);    /* Sleep through a long busy (write, CMD38) */
+#else
+        spi_xfer(0, spi_cmdbuf, SSI_FIFO_DEPTH);
+        res = spi_cmdbuf[SSI_FIFO_DEPTH - 1];
+#endif
+    }
+#else
     rcvr_spi();
     do
         res = rcvr_spi();
     while ((res != 0xFF) && Timer2);
+#endif
+#if defined(USE_SPI_STATS)
+    spi_stat(SPI_STAT_READY, t0);
+#endif
+    TRACE_E(TR_WAIT_READY, res);
+
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Wait for an erase to complete                                         */
+/*-----------------------------------------------------------------------*/
+/* An erase can keep the card busy far longer than wait_ready() allows.  */
+/* With FreeRTOS the poll sleeps a tick between bytes, so the CPU is     */
+/* free for other tasks while the card works.  The card is deselected    */
+/* while the task sleeps and selected again to poll it.                  */
+
+static
+BYTE wait_erase (void)
+{
+    BYTE res, n;
+
+
+    rcvr_spi();
+    for (n = 12; n; n--) {    /* Wait for ready in timeout of 30s */
+        Timer2 = 250;
+        do {
+            res = rcvr_spi();
+            if (res == 0xFF) return res;
+#if defined(USE_FREERTOS)
+            DESELECT();
+            rcvr_spi();
+            vTaskDelay(1);
+            SELECT();
+#endif
+        } while (Timer2);
+    }
 
     return res;
 }
@@ -399,6 +559,7 @@ void set_max_speed(void)
 static
 void power_off (void)
 {
+    Stat |= STA_NOINIT;        /* The card loses its state with the socket power */
     PowerFlag = 0;
 }
 
@@ -429,16 +590,21 @@ BOOL rcvr_datablock (
     } while ((token == 0xFF) && Timer1);
     if(token != 0xFE) return FALSE;    /* If not valid data token, retutn with error */
 
-#if defined(USE_SCATTERGATHER) && defined(USE_DMA_RX)
+#if defined(USE_DMA_RX)
+    if (btr == 512) {    /* Sectors by DMA, the DMA lists are fixed to 512 bytes */
+#if defined(USE_SCATTERGATHER)
         /* Handles data + CRC for now (not token) */
         sector_receive_dma((uint8_t*)buff, btr);
-#elif defined(USE_DMA_RX)
+#else
         sector_receive_dma((uint8_t*)buff, btr);
         rcvr_spi();
         rcvr_spi();
-#else
+#endif
+        return TRUE;
+    }
+#endif
 
-    /* Set data width to 16 bits */
+    /* Set data width to 16 bits (short blocks: CSD, CID, SD status) */
     set_ssi_data_width(SDC_SSI_BASE, 16);
 
     do {                            /* Receive the data block into buffer */
@@ -452,7 +618,6 @@ BOOL rcvr_datablock (
 
     rcvr_spi();                        /* Discard CRC */
     rcvr_spi();
-#endif
 
     return TRUE;                    /* Return with success */
 }
@@ -533,10 +698,51 @@ BYTE send_cmd (
 )
 {
     BYTE n, res;
+#if defined(USE_SPI_BATCH)
+    BYTE i;
+#endif
+#if defined(USE_SPI_STATS)
+    DWORD t0;
+#endif
 
 
-    if (wait_ready() != 0xFF) return 0xFF;
+    TRACE_B(TR_SEND_CMD, cmd & 0x3F);
+    if (wait_ready() != 0xFF) {
+        TRACE_E(TR_SEND_CMD, 0xFF);
+        return 0xFF;
+    }
+#if defined(USE_SPI_STATS)
+    t0 = DWT_CYCLES();                    /* The busy wait is counted apart */
+#endif
 
+#if defined(USE_SPI_BATCH)
+    /* Send the command packet and the first response polls as one FIFO load */
+    spi_cmdbuf[0] = cmd;                /* Command */
+    spi_cmdbuf[1] = (BYTE)(arg >> 24);    /* Argument[31..24] */
+    spi_cmdbuf[2] = (BYTE)(arg >> 16);    /* Argument[23..16] */
+    spi_cmdbuf[3] = (BYTE)(arg >> 8);    /* Argument[15..8] */
+    spi_cmdbuf[4] = (BYTE)arg;            /* Argument[7..0] */
+    n = 0xff;
+    if (cmd == CMD0) n = 0x95;            /* CRC for CMD0(0) */
+    if (cmd == CMD8) n = 0x87;            /* CRC for CMD8(0x1AA) */
+    spi_cmdbuf[5] = n;
+    spi_cmdbuf[6] = spi_cmdbuf[7] = 0xFF;
+    spi_xfer(spi_cmdbuf, spi_cmdbuf, SSI_FIFO_DEPTH);
+
+    /* Receive command response */
+    i = (cmd == CMD12) ? 7 : 6;            /* Skip a stuff byte when stop reading */
+    n = 10;                                /* Wait for a valid response in timeout of 10 attempts */
+    do {                                /* Every byte read counts as one attempt */
+        res = spi_cmdbuf[i++]; n--;
+    } while ((res & 0x80) && i < SSI_FIFO_DEPTH);
+    if (!(res & 0x80)) {
+        spi_ahead = &spi_cmdbuf[i];        /* R3/R7 payload or Nac bytes go to rcvr_spi() */
+        spi_nahead = SSI_FIFO_DEPTH - i;
+    }
+    while ((res & 0x80) && n) {            /* Slow card, poll the rest one by one */
+        res = rcvr_spi(); n--;
+    }
+#else
     /* Send command packet */
     xmit_spi(cmd);                        /* Command */
     xmit_spi((BYTE)(arg >> 24));        /* Argument[31..24] */
@@ -554,6 +760,11 @@ BYTE send_cmd (
     do
         res = rcvr_spi();
     while ((res & 0x80) && --n);
+#endif
+#if defined(USE_SPI_STATS)
+    spi_stat(SPI_STAT_CMD, t0);
+#endif
+    TRACE_E(TR_SEND_CMD, res);
 
     return res;            /* Return with the response value */
 }
@@ -577,11 +788,26 @@ static
 BYTE send_cmd12 (void)
 {
     BYTE n, res, val;
+#if defined(USE_SPI_BATCH)
+    BYTE buf[16] = {CMD12, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+#endif
 
     /* For CMD12, we don't wait for the card to be idle before we send
      * the new command.
      */
 
+#if defined(USE_SPI_BATCH)
+    /* Command packet and the 10 response bytes in one pass through the FIFO */
+    spi_xfer(buf, buf, 16);
+    for(n = 6; n < 16; n++)
+    {
+        val = buf[n];
+        if(val != 0xFF)
+        {
+            res = val;
+        }
+    }
+#else
     /* Send command packet - the argument for CMD12 is ignored. */
     xmit_spi(CMD12);
     xmit_spi(0);
@@ -600,10 +826,448 @@ BYTE send_cmd12 (void)
             res = val;
         }
     }
+#endif
 
     return res;            /* Return with the response value */
 }
 
+/*-----------------------------------------------------------------------*/
+/* Card access requests                                                  */
+/*-----------------------------------------------------------------------*/
+/* Every card access is described by an IO_REQ.  Without the scheduler   */
+/* the request is run right away in the caller's context, with it the    */
+/* request is queued to the I/O task, which may chain requests for       */
+/* adjacent sectors into a single multiple block command.                */
+
+#define IO_INIT     0    /* disk_initialize */
+#define IO_READ     1    /* disk_read */
+#define IO_WRITE    2    /* disk_write */
+#define IO_IOCTL    3    /* disk_ioctl */
+
+/* Priority classes, lower is served first */
+#define IO_CLASS_READ   0    /* Interactive read */
+#define IO_CLASS_WRITE  1    /* Foreground write */
+#define IO_CLASS_BG     2    /* Background flush or erase */
+
+typedef struct _IO_REQ {
+    struct _IO_REQ *link;    /* Next request of the same transfer (ascending sectors) */
+#if defined(USE_IO_SCHED)
+    struct _IO_REQ *next;    /* Next request in the queue (arrival order) */
+    xSemaphoreHandle done;   /* Given by the I/O task on completion */
+    portTickType deadline;   /* Served ahead of any class once passed */
+#endif
+    BYTE op;                 /* IO_xxx */
+    BYTE cls;                /* IO_CLASS_xxx */
+    BYTE count;              /* Sector count, or control code for IO_IOCTL */
+    BYTE res;                /* DRESULT (DSTATUS for IO_INIT) */
+    BYTE *buff;              /* Data buffer */
+    DWORD sector;            /* Start sector number (LBA), next one to erase for CTRL_ERASE_SECTOR */
+} IO_REQ;
+
+/* An erase request with a part of its range left to erase */
+#define io_erase_left(r)    ((r)->op == IO_IOCTL && (r)->count == CTRL_ERASE_SECTOR \
+                             && (r)->res == RES_OK && (r)->sector != ((DWORD*)(r)->buff)[1] + 1)
+
+static DSTATUS mmc_initialize (void);
+static DRESULT mmc_ioctl (BYTE ctrl, void *buff);
+
+/*-----------------------------------------------------------------------*/
+/* Transfer a chain of requests for consecutive sectors                  */
+/*-----------------------------------------------------------------------*/
+
+static
+void mmc_xfer (
+    IO_REQ *req        /* First request of the chain (all IO_READ or all IO_WRITE) */
+)
+{
+    IO_REQ *r;
+    BYTE *buff, n;
+    UINT count = 0;
+    DWORD sector = req->sector;
+
+
+    for (r = req; r; r = r->link) {
+        r->res = RES_ERROR;
+        count += r->count;
+    }
+
+    if (!(CardType & 4)) sector *= 512;    /* Convert to byte address if needed */
+
+    SELECT();            /* CS = L */
+
+    if (req->op == IO_READ) {
+        /* READ_SINGLE_BLOCK or READ_MULTIPLE_BLOCK */
+        if (send_cmd(count == 1 ? CMD17 : CMD18, sector) == 0) {
+            for (r = req; r; r = r->link) {
+                buff = r->buff;
+                for (n = r->count; n; n--) {
+                    if (!rcvr_datablock(buff, 512)) break;
+                    buff += 512;
+                }
+                if (n) break;
+                r->res = RES_OK;
+            }
+            if (count > 1) send_cmd12();    /* STOP_TRANSMISSION */
+        }
+    }
+#if _READONLY == 0
+    else {
+        if (count > 1 && (CardType & 2)) {
+            send_cmd(CMD55, 0); send_cmd(CMD23, count);    /* ACMD23 */
+        }
+        /* WRITE_BLOCK or WRITE_MULTIPLE_BLOCK */
+        if (send_cmd(count == 1 ? CMD24 : CMD25, sector) == 0) {
+            for (r = req; r; r = r->link) {
+                buff = r->buff;
+                for (n = r->count; n; n--) {
+                    if (!xmit_datablock(buff, count == 1 ? 0xFE : 0xFC)) break;
+                    buff += 512;
+                }
+                if (n) break;
+                r->res = RES_OK;
+            }
+            if (count > 1 && !xmit_datablock(0, 0xFD)) {    /* STOP_TRAN token */
+                for (r = req; r; r = r->link) r->res = RES_ERROR;
+            }
+        }
+    }
+#endif
+
+    DESELECT();            /* CS = H */
+    rcvr_spi();            /* Idle (Release DO) */
+}
+
+/*-----------------------------------------------------------------------*/
+/* Erase the next piece of a sector range                                */
+/*-----------------------------------------------------------------------*/
+/* A range is erased in pieces aligned to SD_ERASE_SPAN, one CMD32/33/38  */
+/* each, so that the card is never busy for long.  With the scheduler,  */
+/* other requests are served between the pieces.                         */
+
+#define SD_ERASE_SPAN   8192    /* Sectors per erase command, the 4MB AU of most cards (power of 2) */
+
+static
+void mmc_erase (
+    IO_REQ *req        /* CTRL_ERASE_SECTOR request (buff: DWORD[2] start, end), sector is advanced */
+)
+{
+    DWORD st = req->sector, ed = ((DWORD*)req->buff)[1];
+
+
+    if (Stat & STA_NOINIT) {
+        req->res = RES_NOTRDY;
+        return;
+    }
+    req->res = RES_ERROR;
+    if (!(CardType & 2)) return;        /* SDC only */
+
+    if (ed - st > (SD_ERASE_SPAN - 1) - (st & (SD_ERASE_SPAN - 1)))    /* Up to the end of the piece */
+        ed = st | (SD_ERASE_SPAN - 1);
+
+    SELECT();            /* CS = L */
+
+    if (send_cmd(CMD32, (CardType & 4) ? st : st * 512) == 0        /* ERASE_WR_BLK_START */
+        && send_cmd(CMD33, (CardType & 4) ? ed : ed * 512) == 0    /* ERASE_WR_BLK_END */
+        && send_cmd(CMD38, 0) == 0                                /* ERASE */
+        && wait_erase() == 0xFF) {
+        req->sector = ed + 1;
+        req->res = RES_OK;
+    }
+
+    DESELECT();            /* CS = H */
+    rcvr_spi();            /* Idle (Release DO) */
+}
+
+
+static
+void mmc_run (
+    IO_REQ *req
+)
+{
+    switch (req->op) {
+    case IO_INIT :
+        req->res = mmc_initialize();
+        break;
+    case IO_IOCTL :
+        if (req->count == CTRL_ERASE_SECTOR)
+            mmc_erase(req);
+        else
+            req->res = mmc_ioctl(req->count, req->buff);
+        break;
+    default :
+        mmc_xfer(req);
+    }
+}
+
+
+
+#if defined(USE_IO_SCHED)
+/*-----------------------------------------------------------------------*/
+/* I/O scheduler task                                                    */
+/*-----------------------------------------------------------------------*/
+/* Requests are served by class (read > write > background), first come  */
+/* first served within a class.  A request whose deadline has passed is  */
+/* served before all others, so a stream of reads cannot starve writes.  */
+/* Queued requests for adjacent sectors in the same direction are       */
+/* chained behind the one picked and go out as one CMD18/CMD25.  A       */
+/* request never passes an earlier one that overlaps it when either of   */
+/* them writes.  An erase is run one piece at a time (mmc_erase), and    */
+/* the rest of it is queued again behind the requests that came in the  */
+/* meantime.                                                             */
+
+#define SD_IO_QUEUE_DEPTH       8        /* Requests in flight at most */
+#define SD_IO_MERGE_MAX         128      /* Sectors per chained transfer (<= 255) */
+#define SD_IO_TASK_STACK        configMINIMAL_STACK_SIZE
+#define SD_IO_TASK_PRIORITY     (configMAX_PRIORITIES - 1)
+#define SD_IO_BG_PRIORITY       tskIDLE_PRIORITY    /* Callers at this priority or below are background */
+
+/* Deadline of each class in ticks */
+static const portTickType io_deadline[] = {
+    20 / portTICK_RATE_MS,      /* IO_CLASS_READ */
+    100 / portTICK_RATE_MS,     /* IO_CLASS_WRITE */
+    1000 / portTICK_RATE_MS     /* IO_CLASS_BG */
+};
+
+static IO_REQ io_slot[SD_IO_QUEUE_DEPTH];
+static IO_REQ *io_head, *io_tail;       /* Pending requests */
+static xQueueHandle io_free;            /* Unused slots */
+static xSemaphoreHandle io_kick;        /* New request queued */
+static volatile BYTE io_running;        /* I/O task is serving requests */
+
+
+/* Sectors a request touches, returns 0: none, 1: read, 2: written */
+static
+BYTE io_extent (
+    const IO_REQ *r,
+    DWORD *st,
+    DWORD *ed
+)
+{
+    switch (r->op) {
+    case IO_READ :
+    case IO_WRITE :
+        *st = r->sector;
+        *ed = r->sector + r->count - 1;
+        return r->op == IO_READ ? 1 : 2;
+    case IO_IOCTL :
+        if (r->count == CTRL_ERASE_SECTOR) {    /* The part not erased yet */
+            *st = r->sector;
+            *ed = ((DWORD*)r->buff)[1];
+            return 2;
+        }
+    }
+    return 0;
+}
+
+
+/* Must a be kept behind the earlier queued request b? */
+static
+BOOL io_conflict (
+    const IO_REQ *b,
+    const IO_REQ *a
+)
+{
+    DWORD st1, ed1, st2, ed2;
+    BYTE m1, m2;
+
+
+    if (b->op == IO_INIT || a->op == IO_INIT) return TRUE;
+    m1 = io_extent(b, &st1, &ed1);
+    m2 = io_extent(a, &st2, &ed2);
+    return (m1 && m2 && (m1 | m2) & 2 && st1 <= ed2 && st2 <= ed1) ? TRUE : FALSE;
+}
+
+
+/* May r be moved ahead of everything queued before it? */
+static
+BOOL io_can_pass (
+    const IO_REQ *r
+)
+{
+    const IO_REQ *h;
+
+
+    for (h = io_head; h != r; h = h->next) {
+        if (io_conflict(h, r)) return FALSE;
+    }
+    return TRUE;
+}
+
+
+static
+void io_unlink (
+    IO_REQ *r
+)
+{
+    IO_REQ **pp, *prev = 0;
+
+
+    for (pp = &io_head; *pp != r; pp = &(*pp)->next) prev = *pp;
+    *pp = r->next;
+    if (io_tail == r) io_tail = prev;
+}
+
+
+/* Take the next request off the queue with the ones chained to it */
+static
+IO_REQ* io_pick (void)
+{
+    IO_REQ *r, *best, *first, *last;
+    portTickType now = xTaskGetTickCount();
+    BOOL late = FALSE;
+    UINT count;
+
+
+    best = 0;
+    for (r = io_head; r; r = r->next) {
+        if ((int32_t)(now - r->deadline) >= 0) {    /* Overdue, earliest deadline first */
+            if (!late || (int32_t)(r->deadline - best->deadline) < 0) best = r;
+            late = TRUE;
+        } else if (!late && (!best || r->cls < best->cls)) {
+            best = r;
+        }
+    }
+    if (!best) return 0;
+
+    /* Serve an earlier overlapping request first to keep the data coherent */
+    for (r = io_head; r != best; ) {
+        if (io_conflict(r, best)) {
+            best = r;
+            r = io_head;
+        } else {
+            r = r->next;
+        }
+    }
+    io_unlink(best);
+    best->link = 0;
+    if (best->op != IO_READ && best->op != IO_WRITE) return best;
+
+    /* Chain the requests that continue the transfer on either end */
+    first = last = best;
+    count = best->count;
+    r = io_head;
+    while (r) {
+        if (r->op == best->op && count + r->count <= SD_IO_MERGE_MAX
+            && (r->sector == last->sector + last->count || r->sector + r->count == first->sector)
+            && io_can_pass(r)) {
+            io_unlink(r);
+            if (r->sector == first->sector - r->count) {
+                r->link = first;
+                first = r;
+            } else {
+                r->link = 0;
+                last->link = r;
+                last = r;
+            }
+            count += r->count;
+            r = io_head;    /* Rescan, the chain has grown */
+        } else {
+            r = r->next;
+        }
+    }
+    return first;
+}
+
+
+static
+void prvSDIOTask (void *pvParameters)
+{
+    IO_REQ *r, *n;
+
+
+    io_running = 1;
+    for (;;) {
+        xSemaphoreTake(io_kick, portMAX_DELAY);
+        for (;;) {
+            taskENTER_CRITICAL();
+            r = io_pick();
+            taskEXIT_CRITICAL();
+            if (!r) break;
+            mmc_run(r);
+            if (io_erase_left(r)) {    /* Queue the rest of an erase behind the requests that came meanwhile */
+                r->deadline = xTaskGetTickCount() + io_deadline[r->cls];
+                r->next = 0;
+                taskENTER_CRITICAL();
+                if (io_tail) io_tail->next = r; else io_head = r;
+                io_tail = r;
+                taskEXIT_CRITICAL();
+                continue;
+            }
+            do {                /* Wake up the callers */
+                n = r->link;
+                xSemaphoreGive(r->done);
+                r = n;
+            } while (r);
+        }
+    }
+}
+
+
+/* Class of a request from the calling task */
+static
+BYTE io_class (
+    BYTE cls            /* Class for a foreground caller */
+)
+{
+    if (io_running && uxTaskPriorityGet(NULL) <= SD_IO_BG_PRIORITY) return IO_CLASS_BG;
+    return cls;
+}
+
+
+/* Queue the request to the I/O task and wait for it */
+static
+BYTE io_submit (
+    const IO_REQ *req
+)
+{
+    IO_REQ *r;
+    BYTE res;
+
+
+    TRACE_B(TR_IO_WAIT, req->sector);
+    xQueueReceive(io_free, &r, portMAX_DELAY);
+    r->op = req->op;
+    r->cls = req->cls;
+    r->count = req->count;
+    r->buff = req->buff;
+    r->sector = req->sector;
+    r->deadline = xTaskGetTickCount() + io_deadline[req->cls];
+    r->next = 0;
+
+    taskENTER_CRITICAL();
+    if (io_tail) io_tail->next = r; else io_head = r;
+    io_tail = r;
+    taskEXIT_CRITICAL();
+    xSemaphoreGive(io_kick);
+
+    xSemaphoreTake(r->done, portMAX_DELAY);
+    res = r->res;
+    xQueueSend(io_free, &r, 0);
+    TRACE_E(TR_IO_WAIT, res);
+
+    return res;
+}
+
+#else
+#define io_class(cls)   (cls)
+#endif /* USE_IO_SCHED */
+
+
+static
+BYTE io_run (
+    IO_REQ *req
+)
+{
+#if defined(USE_IO_SCHED)
+    if (io_running) return io_submit(req);
+#endif
+    req->link = 0;
+    do
+        mmc_run(req);
+    while (io_erase_left(req));
+    return req->res;
+}
+
 /*--------------------------------------------------------------------------
 
    Public Functions
@@ -615,17 +1279,18 @@ BYTE send_cmd12 (void)
 /* Initialize Disk Drive                                                 */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_initialize (
-    BYTE drv        /* Physical drive nmuber (0) */
-)
+static
+DSTATUS mmc_initialize (void)
 {
     BYTE n, ty, ocr[4];
 
 
-    if (drv) return STA_NOINIT;            /* Supports only single drive */
     if (Stat & STA_NODISK) return Stat;    /* No card in the socket */
 
     power_on();                            /* Force socket power on */
+#if defined(USE_SPI_STATS)
+    DWT_START();
+#endif
     send_initial_clock_train();            /* Ensure the card is in SPI mode */
 
     SELECT();                /* CS = L */
@@ -638,6 +1303,7 @@ DSTATUS disk_initialize (
                 do {
                     if (send_cmd(CMD55, 0) <= 1 && send_cmd(CMD41, 1UL << 30) == 0)    break;    /* ACMD41 with HCS bit */
                 } while (Timer1);
+                if (Timer1) set_max_speed();        /* Out of the identification mode, no need to stay at 400kHz */
                 if (Timer1 && send_cmd(CMD58, 0) == 0) {    /* Check CCS bit */
                     for (n = 0; n < 4; n++) ocr[n] = rcvr_spi();
                     ty = (ocr[0] & 0x40) ? 6 : 2;
@@ -652,6 +1318,7 @@ DSTATUS disk_initialize (
                     if (send_cmd(CMD1, 0) == 0) break;                                /* CMD1 */
                 }
             } while (Timer1);
+            if (Timer1) set_max_speed();
             if (!Timer1 || send_cmd(CMD16, 512) != 0)    /* Select R/W block length */
                 ty = 0;
         }
@@ -662,7 +1329,6 @@ DSTATUS disk_initialize (
 
     if (ty) {            /* Initialization succeded */
         Stat &= ~STA_NOINIT;        /* Clear STA_NOINIT */
-        set_max_speed();
     } else {            /* Initialization failed */
         power_off();
     }
@@ -671,6 +1337,26 @@ DSTATUS disk_initialize (
 }
 
 
+DSTATUS disk_initialize (
+    BYTE drv        /* Physical drive nmuber (0) */
+)
+{
+    IO_REQ req;
+    DSTATUS stat;
+
+
+    if (drv) return STA_NOINIT;            /* Supports only single drive */
+
+    StartTick = xTaskGetTickCount();
+    StartTime[1] = 0xFFFFFFFF;
+    req.op = IO_INIT;
+    req.cls = IO_CLASS_READ;
+    stat = io_run(&req);
+    StartTime[0] = (xTaskGetTickCount() - StartTick) * portTICK_RATE_MS;
+    return stat;
+}
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Get Disk Status                                                       */
@@ -697,32 +1383,18 @@ DRESULT disk_read (
     BYTE count            /* Sector count (1..255) */
 )
 {
-    if (drv || !count) return RES_PARERR;
-    if (Stat & STA_NOINIT) return RES_NOTRDY;
+    IO_REQ req;
 
-    if (!(CardType & 4)) sector *= 512;    /* Convert to byte address if needed */
 
-    SELECT();            /* CS = L */
-
-    if (count == 1) {    /* Single block read */
-        if ((send_cmd(CMD17, sector) == 0)    /* READ_SINGLE_BLOCK */
-            && rcvr_datablock(buff, 512))
-            count = 0;
-    }
-    else {                /* Multiple block read */
-        if (send_cmd(CMD18, sector) == 0) {    /* READ_MULTIPLE_BLOCK */
-            do {
-                if (!rcvr_datablock(buff, 512)) break;
-                buff += 512;
-            } while (--count);
-            send_cmd12();                /* STOP_TRANSMISSION */
-        }
-    }
-
-    DESELECT();            /* CS = H */
-    rcvr_spi();            /* Idle (Release DO) */
+    if (drv || !count) return RES_PARERR;
+    if (Stat & STA_NOINIT) return RES_NOTRDY;
 
-    return count ? RES_ERROR : RES_OK;
+    req.op = IO_READ;
+    req.cls = io_class(IO_CLASS_READ);
+    req.buff = buff;
+    req.sector = sector;
+    req.count = count;
+    return io_run(&req);
 }
 
 
@@ -739,37 +1411,23 @@ DRESULT disk_write (
     BYTE count            /* Sector count (1..255) */
 )
 {
+    IO_REQ req;
+    DRESULT res;
+
+
     if (drv || !count) return RES_PARERR;
     if (Stat & STA_NOINIT) return RES_NOTRDY;
     if (Stat & STA_PROTECT) return RES_WRPRT;
 
-    if (!(CardType & 4)) sector *= 512;    /* Convert to byte address if needed */
-
-    SELECT();            /* CS = L */
-
-    if (count == 1) {    /* Single block write */
-        if ((send_cmd(CMD24, sector) == 0)    /* WRITE_BLOCK */
-            && xmit_datablock(buff, 0xFE))
-            count = 0;
-    }
-    else {                /* Multiple block write */
-        if (CardType & 2) {
-            send_cmd(CMD55, 0); send_cmd(CMD23, count);    /* ACMD23 */
-        }
-        if (send_cmd(CMD25, sector) == 0) {    /* WRITE_MULTIPLE_BLOCK */
-            do {
-                if (!xmit_datablock(buff, 0xFC)) break;
-                buff += 512;
-            } while (--count);
-            if (!xmit_datablock(0, 0xFD))    /* STOP_TRAN token */
-                count = 1;
-        }
-    }
-
-    DESELECT();            /* CS = H */
-    rcvr_spi();            /* Idle (Release DO) */
-
-    return count ? RES_ERROR : RES_OK;
+    req.op = IO_WRITE;
+    req.cls = io_class(IO_CLASS_WRITE);
+    req.buff = (BYTE*)buff;
+    req.sector = sector;
+    req.count = count;
+    res = io_run(&req);
+    if (res == RES_OK && StartTime[1] == 0xFFFFFFFF)    /* Time to first write since disk_initialize() */
+        StartTime[1] = (xTaskGetTickCount() - StartTick) * portTICK_RATE_MS;
+    return res;
 }
 #endif /* _READONLY */
 
@@ -779,19 +1437,20 @@ DRESULT disk_write (
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (
-    BYTE drv,        /* Physical drive nmuber (0) */
+static
+DRESULT mmc_ioctl (
     BYTE ctrl,        /* Control code */
     void *buff        /* Buffer to send/receive control data */
 )
 {
     DRESULT res;
-    BYTE n, csd[16], *ptr = buff;
+    BYTE n, csd[16], sdstat[64], scr[8], *ptr = buff;
     WORD csize;
+    static const WORD au_tbl[6] = {    /* AU sizes 8M..64M in units of 8 sectors */
+        2048, 3072, 4096, 6144, 8192, 16384
+    };
 
 
-    if (drv) return RES_PARERR;
-
     res = RES_ERROR;
 
     if (ctrl == CTRL_POWER) {
@@ -838,6 +1497,47 @@ DRESULT disk_ioctl (
             res = RES_OK;
             break;
 
+        case GET_BLOCK_SIZE :    /* Get erase block size from the CSD (DWORD, sectors) */
+            if ((send_cmd(CMD9, 0) == 0) && rcvr_datablock(csd, 16)) {
+                if (CardType & 2) {            /* SDC: SECTOR_SIZE in units of WRITE_BL_LEN */
+                    *(DWORD*)buff = ((((DWORD)(csd[10] & 63) << 1) + (csd[11] >> 7) + 1)
+                                    << (((csd[12] & 3) << 2) + (csd[13] >> 6))) >> 9;
+                } else {                    /* MMC: (ERASE_GRP_SIZE + 1) * (ERASE_GRP_MULT + 1) */
+                    *(DWORD*)buff = ((WORD)((csd[10] & 124) >> 2) + 1) * (((csd[11] & 3) << 3) + ((csd[11] & 224) >> 5) + 1);
+                }
+                res = RES_OK;
+            }
+            break;
+
+        case GET_AU_SIZE :    /* Get allocation unit size from the SD status (DWORD, sectors) */
+            if ((CardType & 2)
+                && send_cmd(CMD55, 0) <= 1 && send_cmd(CMD13, 0) == 0) {    /* ACMD13 */
+                rcvr_spi();                    /* Second byte of the R2 response */
+                if (rcvr_datablock(sdstat, 64) && (n = sdstat[10] >> 4) != 0) {
+                    *(DWORD*)buff = (n <= 9) ? 16UL << n : (DWORD)au_tbl[n - 10] << 3;
+                    res = RES_OK;
+                }
+            }
+            break;
+
+        case GET_ERASE_VALUE :    /* Get the data erased blocks read as from the SCR (BYTE) */
+            if ((CardType & 2)
+                && send_cmd(CMD55, 0) <= 1 && send_cmd(CMD51, 0) == 0    /* ACMD51 */
+                && rcvr_datablock(scr, 8)) {
+                *ptr = (scr[1] & 0x80) ? 0xFF : 0x00;    /* DATA_STAT_AFTER_ERASE */
+                res = RES_OK;
+            }
+            break;
+
+        case MMC_GET_SDSTAT :    /* Receive SD status as a data block (64 bytes) */
+            if ((CardType & 2)
+                && send_cmd(CMD55, 0) <= 1 && send_cmd(CMD13, 0) == 0) {    /* ACMD13 */
+                rcvr_spi();
+                if (rcvr_datablock(ptr, 64))
+                    res = RES_OK;
+            }
+            break;
+
         case CTRL_SYNC :    /* Make sure that data has been written */
             if (wait_ready() == 0xFF)
                 res = RES_OK;
@@ -879,6 +1579,81 @@ DRESULT disk_ioctl (
 }
 
 
+DRESULT disk_ioctl (
+    BYTE drv,        /* Physical drive nmuber (0) */
+    BYTE ctrl,        /* Control code */
+    void *buff        /* Buffer to send/receive control data */
+)
+{
+    IO_REQ req;
+#if defined(USE_SPI_STATS)
+    BYTE n;
+#endif
+
+
+    if (drv) return RES_PARERR;
+
+    if (ctrl == MMC_GET_STARTUP) {        /* Kept in RAM, no card access */
+        ((DWORD*)buff)[0] = StartTime[0];
+        ((DWORD*)buff)[1] = StartTime[1];
+        return RES_OK;
+    }
+#if defined(USE_SPI_STATS)
+    if (ctrl == MMC_GET_SPI_STATS) {    /* Kept in RAM, no card access */
+        for (n = 0; n < 6; n++) {
+            ((DWORD*)buff)[n] = SpiStats[n / 3][n % 3];
+            SpiStats[n / 3][n % 3] = 0;
+        }
+        return RES_OK;
+    }
+#endif
+
+    req.op = IO_IOCTL;
+    req.cls = io_class(ctrl == CTRL_ERASE_SECTOR ? IO_CLASS_BG : IO_CLASS_WRITE);
+    req.count = ctrl;
+    req.buff = buff;
+    req.sector = (ctrl == CTRL_ERASE_SECTOR) ? ((DWORD*)buff)[0] : 0;    /* Erase (mmc_erase) starts here */
+    return io_run(&req);
+}
+
+
+
+#if defined(USE_IO_SCHED)
+/*-----------------------------------------------------------------------*/
+/* Start the I/O scheduler task                                          */
+/*-----------------------------------------------------------------------*/
+/* Until the task runs, disk functions access the card directly in the   */
+/* caller's context.                                                     */
+
+DRESULT disk_sched_start (void)
+{
+    IO_REQ *r;
+    UINT i;
+
+
+    io_free = xQueueCreate(SD_IO_QUEUE_DEPTH, sizeof(IO_REQ*));
+    io_kick = xSemaphoreCreateBinary();
+    if (io_free == NULL || io_kick == NULL) return RES_ERROR;
+
+    for (i = 0; i < SD_IO_QUEUE_DEPTH; i++) {
+        r = &io_slot[i];
+        r->done = xSemaphoreCreateBinary();
+        if (r->done == NULL) return RES_ERROR;
+        xQueueSend(io_free, &r, 0);
+    }
+
+    if (xTaskCreate(prvSDIOTask,
+                    (portCHAR *) "prvSDIOTask",
+                    SD_IO_TASK_STACK,
+                    NULL,
+                    SD_IO_TASK_PRIORITY,
+                    NULL) != pdTRUE) return RES_ERROR;
+
+    return RES_OK;
+}
+#endif
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Device Timer Interrupt Procedure  (Platform dependent)                */
@@ -935,6 +1710,7 @@ SDCSSIIntHandler(void)
 
     /* Get status */
     ui32Status = ROM_SSIIntStatus(SDC_SSI_BASE, TRUE);
+    TRACE_I(TR_SSI_ISR, ui32Status);
 
     /* Clear status */
     ROM_SSIIntClear(SDC_SSI_BASE, ui32Status);
@@ -974,6 +1750,7 @@ sector_send_dma(uint8_t *buff, uint32_t len)
 
     volatile uint32_t discard;
 
+    TRACE_B(TR_DMA_TX, len);
     dma_complete = 0;
 
     /* Re-initialize DMA every transmission */
@@ -1028,16 +1805,66 @@ sector_send_dma(uint8_t *buff, uint32_t len)
     ROM_uDMAChannelDisable(SDC_SSI_RX_UDMA_CHAN);
     ROM_uDMAChannelDisable(SDC_SSI_TX_UDMA_CHAN);
     ROM_SSIDMADisable(SDC_SSI_BASE, SSI_DMA_TX | SSI_DMA_RX);
+    TRACE_E(TR_DMA_TX, 0);
 
     return 0;
 }
 
+/*-----------------------------------------------------------------------*/
+/* Clock out dummy bytes by DMA while the card is busy                   */
+/*-----------------------------------------------------------------------*/
+/* Both channels stay on a single byte, so the result is the last byte   */
+/* received.  With FreeRTOS the task sleeps on the completion interrupt  */
+/* instead of spinning on the FIFO for the whole busy time.              */
+
+uint8_t
+busy_poll_dma(uint32_t len)
+{
+    TRACE_B(TR_DMA_RX, len);
+    dma_complete = 0;
+
+    init_dma(1);
+    ROM_uDMAChannelControlSet(SDC_SSI_TX_UDMA_CHAN | UDMA_PRI_SELECT,
+                              UDMA_SIZE_8 | UDMA_SRC_INC_NONE | UDMA_DST_INC_NONE | UDMA_ARB_4);
+
+    ROM_uDMAChannelTransferSet(SDC_SSI_RX_UDMA_CHAN | UDMA_PRI_SELECT,
+                               UDMA_MODE_BASIC,
+                               (void *)(SDC_SSI_BASE + SSI_O_DR),
+                               &dummy_rx,
+                               len);
+
+    ROM_uDMAChannelTransferSet(SDC_SSI_TX_UDMA_CHAN | UDMA_PRI_SELECT,
+                               UDMA_MODE_BASIC,
+                               &dummy_tx,
+                               (void *)(SDC_SSI_BASE + SSI_O_DR),
+                               len);
+
+    ROM_uDMAChannelEnable(SDC_SSI_RX_UDMA_CHAN);
+    ROM_uDMAChannelEnable(SDC_SSI_TX_UDMA_CHAN);
+
+#if defined(USE_FREERTOS)
+    xSemaphoreTake(sd_int_semphr, portMAX_DELAY);
+#else
+    while (!dma_complete);
+#endif
+
+    while (ROM_uDMAChannelModeGet(SDC_SSI_RX_UDMA_CHAN | UDMA_PRI_SELECT) != UDMA_MODE_STOP) ;
+
+    ROM_uDMAChannelDisable(SDC_SSI_RX_UDMA_CHAN);
+    ROM_uDMAChannelDisable(SDC_SSI_TX_UDMA_CHAN);
+    ROM_SSIDMADisable(SDC_SSI_BASE, SSI_DMA_TX | SSI_DMA_RX);
+    TRACE_E(TR_DMA_RX, dummy_rx);
+
+    return dummy_rx;
+}
+
 unsigned int
 sector_receive_dma(uint8_t *buff, uint32_t len)
 {
 
     volatile uint32_t discard;
 
+    TRACE_B(TR_DMA_RX, len);
     dma_complete = 0;
 
     /* Re-initialize DMA every transmission */
@@ -1093,6 +1920,7 @@ sector_receive_dma(uint8_t *buff, uint32_t len)
     ROM_uDMAChannelDisable(SDC_SSI_RX_UDMA_CHAN);
     ROM_uDMAChannelDisable(SDC_SSI_TX_UDMA_CHAN);
     ROM_SSIDMADisable(SDC_SSI_BASE, SSI_DMA_TX | SSI_DMA_RX);
+    TRACE_E(TR_DMA_RX, 0);
 
     return 0;
 }
@@ -0,0 +1,125 @@
+/*-----------------------------------------------------------------------*/
+/* Trace event recorder for the storage stack  (Platform dependent)      */
+/*-----------------------------------------------------------------------*/
+/* Events from ff.c and the MMC driver (see fftrace.h) are stamped with  */
+/* the Cortex-M4 cycle counter and the running task, and kept in a ring  */
+/* buffer that holds the last TRACE_DEPTH events.  ff_trace_dump()       */
+/* prints the buffer on the UART for tools/trace2json.py.                */
+/*-----------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "inc/hw_types.h"
+#include "driverlib/sysctl.h"
+#include "utils/uartstdio.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "fftrace.h"
+#include "dwt-cm4f.h"
+
+#if _USE_TRACE
+
+#ifndef TRACE_DEPTH
+#define TRACE_DEPTH     512     /* Events kept, power of 2 (16 bytes each) */
+#endif
+#if TRACE_DEPTH & (TRACE_DEPTH - 1)
+#error TRACE_DEPTH must be a power of 2
+#endif
+#define TRACE_MAX_TASKS 16      /* Task names listed by the dump */
+
+/* Cortex-M4 system control registers (the DWT is in dwt-cm4f.h) */
+#define NVIC_ICSR       0xE000ED04    /* Interrupt Control and State */
+#define ICSR_VECTACTIVE 0x000001FF
+
+typedef struct _TRACE_EVT {
+    DWORD ts;           /* Cycle counter */
+    DWORD task;         /* Task handle, or the exception number in handler mode */
+    DWORD arg;          /* Event argument */
+    BYTE ev;            /* Event ID and phase flags */
+} TRACE_EVT;
+
+static TRACE_EVT trace_buf[TRACE_DEPTH];
+static DWORD trace_head;            /* Events recorded since start */
+static volatile BYTE trace_on;
+
+
+static
+void trace_start (void)
+{
+    HWREG(DEMCR) |= DEMCR_TRCENA;
+    HWREG(DWT_CYCCNT) = 0;
+    HWREG(DWT_CTRL) |= DWT_CTRL_CYCCNTENA;
+    trace_head = 0;
+    trace_on = 1;
+}
+
+
+void ff_trace (
+    BYTE ev,            /* TR_xxx | TR_BEGIN / TR_END */
+    DWORD arg
+)
+{
+    TRACE_EVT *e;
+    DWORD vec;
+    uint32_t mask;
+
+
+    if (!trace_on) {
+        if (trace_head) return;    /* Stopped for a dump */
+        trace_start();             /* First event */
+    }
+
+    vec = HWREG(NVIC_ICSR) & ICSR_VECTACTIVE;
+
+    mask = portSET_INTERRUPT_MASK_FROM_ISR();
+    e = &trace_buf[trace_head++ & (TRACE_DEPTH - 1)];
+    e->ts = DWT_CYCLES();
+    e->task = vec ? vec : (DWORD)xTaskGetCurrentTaskHandle();
+    e->arg = arg;
+    e->ev = ev;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Print the recorded events and restart recording                       */
+/*-----------------------------------------------------------------------*/
+/* Format, one record per line (numbers in hex unless noted):            */
+/*   TRACE <cpu clock Hz, decimal> <event count, decimal>                */
+/*   T <task handle> <task name>                                         */
+/*   E <cycle count> <task handle or exception number> <event> <arg>     */
+/*   END                                                                 */
+
+void ff_trace_dump (void)
+{
+    static TaskStatus_t tasks[TRACE_MAX_TASKS];
+    UBaseType_t nt, i;
+    DWORD n, first;
+    TRACE_EVT *e;
+
+
+    trace_on = 0;
+
+    n = trace_head < TRACE_DEPTH ? trace_head : TRACE_DEPTH;
+    first = trace_head - n;
+    UARTprintf("TRACE %u %u\n", SysCtlClockGet(), n);
+
+    nt = uxTaskGetSystemState(tasks, TRACE_MAX_TASKS, NULL);
+    for (i = 0; i < nt; i++)
+        UARTprintf("T %x %s\n", (DWORD)tasks[i].xHandle, tasks[i].pcTaskName);
+
+    for (; n; n--, first++) {
+        e = &trace_buf[first & (TRACE_DEPTH - 1)];
+        UARTprintf("E %x %x %x %x\n", e->ts, e->task, e->ev, e->arg);
+    }
+    UARTprintf("END\n");
+
+    trace_head = 0;
+    trace_on = 1;
+}
+
+#endif /* _USE_TRACE */
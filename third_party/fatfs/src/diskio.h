@@ -33,6 +33,7 @@ DRESULT disk_write (BYTE, const BYTE*, DWORD, BYTE);
 #endif
 DRESULT disk_ioctl (BYTE, BYTE, void*);
 void	disk_timerproc (void);
+DRESULT disk_sched_start (void);	/* Start the I/O scheduler task (RTOS drivers) */
 
 
 
@@ -52,9 +53,16 @@ void	disk_timerproc (void);
 #define CTRL_POWER			4
 #define CTRL_LOCK			5
 #define CTRL_EJECT			6
+#define CTRL_ERASE_SECTOR	7	/* Erase a sector range (DWORD[2]: start, end) */
+#define GET_BLOCK_SIZE		8	/* Get erase block size (DWORD, sectors) */
+#define GET_AU_SIZE			9	/* Get SD allocation unit size (DWORD, sectors) */
 #define MMC_GET_CSD			10
 #define MMC_GET_CID			11
 #define MMC_GET_OCR			12
+#define MMC_GET_SDSTAT		13
+#define GET_ERASE_VALUE		14	/* Get the byte erased sectors read back as (BYTE, 0x00 or 0xFF) */
+#define MMC_GET_STARTUP		15	/* Get ms from disk_initialize to card ready and to first write (DWORD[2]) */
+#define MMC_GET_SPI_STATS	16	/* Get and clear DWT cycles of send_cmd and wait_ready: calls, total, max (DWORD[6]) */
 #define ATA_GET_REV			20
 #define ATA_GET_MODEL		21
 #define ATA_GET_SN			22
@@ -40,6 +40,32 @@
 #include <string.h>
 #include "ff.h"            /* FatFs declarations */
 #include "diskio.h"        /* Include file for user provided disk functions */
+#include "fftrace.h"        /* Trace event hooks */
+
+
+#if !(_FS_FATTYPES & 7) && !_FS_EXFAT
+#error No FAT sub type is enabled (_FS_FATTYPES)
+#endif
+
+/* FAT sub type of a mounted volume, a constant in single type builds */
+#if _FS_FATTYPES == 1 && !_FS_EXFAT
+#define FSTYPE(fs)    FS_FAT12
+#elif _FS_FATTYPES == 2 && !_FS_EXFAT
+#define FSTYPE(fs)    FS_FAT16
+#elif _FS_FATTYPES == 4 && !_FS_EXFAT
+#define FSTYPE(fs)    FS_FAT32
+#elif !(_FS_FATTYPES & 7)
+#define FSTYPE(fs)    FS_EXFAT
+#else
+#define FSTYPE(fs)    ((fs)->fs_type)
+#endif
+
+/* Current sector in the file I/O buffer */
+#if _FS_BLOCK > 1
+#define FBUF(fp)    (&(fp)->buffer[((fp)->curr_sect & (_FS_BLOCK - 1)) * S_SIZ])
+#else
+#define FBUF(fp)    ((fp)->buffer)
+#endif
 
 
 /*--------------------------------------------------------------------------
@@ -53,6 +79,108 @@ FATFS *FatFs[_DRIVES];    /* Pointer to the file system objects (logical drives)
 static
 WORD fsid;                /* File system mount ID */
 
+#if _USE_LFN
+static
+WORD LfnBuf[_MAX_LFN + 1];    /* LFN working buffer (not reentrant) */
+static
+WORD LfnLen;                /* Length of the name in LfnBuf[] */
+static
+const BYTE LfnOfs[] = {1,3,5,7,9,14,16,18,20,22,24,28,30};    /* Offset of LFN chars in the directory entry */
+#endif
+
+#if _USE_MNTCACHE
+typedef struct _MNTCACHE {
+    BYTE    id[32];            /* CID and CSD of the card */
+    DWORD    sects_fat;
+    DWORD    max_clust;
+    DWORD    fatbase;
+    DWORD    dirbase;
+    DWORD    database;
+#if _FS_EXFAT
+    DWORD    bitbase;
+#endif
+    DWORD    bootsect;        /* Boot sector of the volume */
+    DWORD    vsn;            /* Volume serial number in the boot sector */
+#if !_FS_READONLY
+#if _USE_AU_ALIGN
+    DWORD    au_clust;
+    DWORD    au_ofs;
+#endif
+#if _USE_FSINFO
+    DWORD    fsi_sector;
+    DWORD    last_clust;        /* As in the FSInfo sector */
+    DWORD    free_clust;
+#endif
+#endif
+    WORD    n_rootdir;
+    WORD    sects_clust;
+    BYTE    fs_type;        /* 0:No geometry for the card */
+    BYTE    n_fats;
+    BYTE    keyed;            /* id[] is valid */
+} MNTCACHE;
+
+static
+MNTCACHE MntCache[_DRIVES];    /* Volume geometry of the card last mounted on each logical drive */
+#endif
+
+/* Name status flags in fn[12] */
+#define NS_LFN        0x01    /* The name needs LFN entries */
+#define NS_TAIL        0x02    /* The SFN needs a numbered tail */
+
+
+
+#if _FS_BLOCK > 1
+/*-----------------------------------------------------------------------*/
+/* Block behind the window                                               */
+/*-----------------------------------------------------------------------*/
+/* The sectors around the window are held in fs->wblk[], read with one   */
+/* multiple sector read, so that moving the window within the block is a */
+/* copy instead of a disk access. Sectors the window leaves dirty are    */
+/* written back in runs when the block is replaced or on sync().         */
+
+#if !_FS_READONLY
+static
+BOOL flush_wblock (        /* TRUE: successful, FALSE: failed */
+    FATFS *fs            /* File system object */
+)
+{
+    DWORD sect, s, e;
+    BYTE i, n, nf;
+
+
+    for (i = 0; i < fs->wblk_n; i += n) {
+        for (n = 0; i + n < fs->wblk_n && (fs->wblk_dirty & (1 << (i + n))); n++) ;
+        if (!n) { n = 1; continue; }
+        sect = fs->wblk_sect + i;
+        if (disk_write(fs->drive, &fs->wblk[i * S_SIZ], sect, n) != RES_OK)
+            return FALSE;
+        s = (sect > fs->fatbase) ? sect : fs->fatbase;    /* Part of the run in the FAT area */
+        e = (sect + n < fs->fatbase + fs->sects_fat) ? sect + n : fs->fatbase + fs->sects_fat;
+        for (nf = 1; s < e && nf < fs->n_fats; nf++)    /* Reflect the change to FAT copies */
+            disk_write(fs->drive, &fs->wblk[(s - fs->wblk_sect) * S_SIZ], s + nf * fs->sects_fat, (BYTE)(e - s));
+    }
+    fs->wblk_dirty = 0;
+    return TRUE;
+}
+
+
+static
+BOOL drop_wblock (        /* TRUE: successful, FALSE: failed */
+    FATFS *fs,            /* File system object */
+    DWORD sect,            /* First sector to be written around the window */
+    DWORD n                /* Number of sectors */
+)                        /* Drops the block if it holds any of them */
+{
+    if (fs->wblk_n && sect < fs->wblk_sect + fs->wblk_n && sect + n > fs->wblk_sect) {
+        if (fs->wblk_dirty && !flush_wblock(fs)) return FALSE;
+        fs->wblk_n = 0;
+    }
+    return TRUE;
+}
+#endif
+#endif
+
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -66,6 +194,10 @@ BOOL move_window (        /* TRUE: successful, FALSE: failed */
 )                        /* Move to zero only writes back dirty window */
 {
     DWORD wsect;
+#if _FS_BLOCK > 1
+    DWORD bsect;
+    BYTE nb;
+#endif
 
 
     wsect = fs->winsect;
@@ -73,22 +205,51 @@ BOOL move_window (        /* TRUE: successful, FALSE: failed */
 #if !_FS_READONLY
         BYTE n;
         if (fs->winflag) {    /* Write back dirty window if needed */
-            if (disk_write(fs->drive, fs->win, wsect, 1) != RES_OK)
-                return FALSE;
-            fs->winflag = 0;
-            if (wsect < (fs->fatbase + fs->sects_fat)) {    /* In FAT area */
-                for (n = fs->n_fats; n >= 2; n--) {    /* Refrect the change to FAT copy */
-                    wsect += fs->sects_fat;
-                    disk_write(fs->drive, fs->win, wsect, 1);
+#if _FS_BLOCK > 1
+            if (wsect - fs->wblk_sect < fs->wblk_n) {    /* In the block, written back with it */
+                memcpy(&fs->wblk[(wsect - fs->wblk_sect) * S_SIZ], fs->win, S_SIZ);
+                fs->wblk_dirty |= 1 << (wsect - fs->wblk_sect);
+            } else
+#endif
+            {
+                if (disk_write(fs->drive, fs->win, wsect, 1) != RES_OK)
+                    return FALSE;
+                if (wsect < (fs->fatbase + fs->sects_fat)) {    /* In FAT area */
+                    for (n = fs->n_fats; n >= 2; n--) {    /* Refrect the change to FAT copy */
+                        wsect += fs->sects_fat;
+                        disk_write(fs->drive, fs->win, wsect, 1);
+                    }
                 }
             }
+            fs->winflag = 0;
         }
 #endif
         if (sector) {
+            TRACE_B(TR_WIN_MISS, sector);
+#if _FS_BLOCK > 1
+            if (sector - fs->wblk_sect >= fs->wblk_n && sector < fs->wblk_end) {    /* Load the block around it */
+#if !_FS_READONLY
+                if (fs->wblk_dirty && !flush_wblock(fs)) return FALSE;
+#endif
+                bsect = sector & ~(DWORD)(_FS_BLOCK - 1);
+                nb = (fs->wblk_end - bsect < _FS_BLOCK) ? (BYTE)(fs->wblk_end - bsect) : _FS_BLOCK;
+                fs->wblk_n = 0;
+                if (disk_read(fs->drive, fs->wblk, bsect, nb) != RES_OK)
+                    return FALSE;
+                fs->wblk_sect = bsect;
+                fs->wblk_n = nb;
+            }
+            if (sector - fs->wblk_sect < fs->wblk_n)
+                memcpy(fs->win, &fs->wblk[(sector - fs->wblk_sect) * S_SIZ], S_SIZ);
+            else
+#endif
             if (disk_read(fs->drive, fs->win, sector, 1) != RES_OK)
                 return FALSE;
             fs->winsect = sector;
+            TRACE_E(TR_WIN_MISS, 0);
         }
+    } else {
+        TRACE_I(TR_WIN_HIT, sector);
     }
     return TRUE;
 }
@@ -106,10 +267,21 @@ FRESULT sync (            /* FR_OK: successful, FR_RW_ERROR: failed */
     FATFS *fs            /* File system object */
 )
 {
+#if _USE_FSINFO && _USE_MNTCACHE
+    BYTE n;
+
+
+#endif
     fs->winflag = 1;
     if (!move_window(fs, 0)) return FR_RW_ERROR;
+#if _FS_BLOCK > 1
+    if (fs->wblk_dirty && !flush_wblock(fs)) return FR_RW_ERROR;
+#endif
 #if _USE_FSINFO
-    if (fs->fs_type == FS_FAT32 && fs->fsi_flag) {        /* Update FSInfo sector if needed */
+    if (FSTYPE(fs) == FS_FAT32 && fs->fsi_flag) {        /* Update FSInfo sector if needed */
+#if _FS_BLOCK > 1
+        if (!drop_wblock(fs, fs->fsi_sector, 1)) return FR_RW_ERROR;
+#endif
         fs->winsect = 0;
         memset(fs->win, 0, 512);
         ST_WORD(&fs->win[BS_55AA], 0xAA55);
@@ -117,8 +289,16 @@ FRESULT sync (            /* FR_OK: successful, FR_RW_ERROR: failed */
         ST_DWORD(&fs->win[FSI_StrucSig], 0x61417272);
         ST_DWORD(&fs->win[FSI_Free_Count], fs->free_clust);
         ST_DWORD(&fs->win[FSI_Nxt_Free], fs->last_clust);
-        disk_write(0, fs->win, fs->fsi_sector, 1);
+        if (disk_write(fs->drive, fs->win, fs->fsi_sector, 1) != RES_OK) return FR_RW_ERROR;
         fs->fsi_flag = 0;
+#if _USE_MNTCACHE
+        for (n = 0; n < _DRIVES; n++) {        /* The cached copy follows the FSInfo sector once written */
+            if (FatFs[n] == fs && MntCache[n].fs_type) {
+                MntCache[n].last_clust = fs->last_clust;
+                MntCache[n].free_clust = fs->free_clust;
+            }
+        }
+#endif
     }
 #endif
     if (disk_ioctl(fs->drive, CTRL_SYNC, NULL) != RES_OK) return FR_RW_ERROR;
@@ -139,13 +319,29 @@ DWORD get_cluster (        /* 0,>=2: successful, 1: failed */
     DWORD clust            /* Cluster# to get the link information */
 )
 {
+#if _FS_FATTYPES & 1
     WORD wc, bc;
+#endif
     DWORD fatsect;
+#if !(_FS_FATTYPES & 3)
+    DWORD val;
+#endif
 
 
     if (clust >= 2 && clust < fs->max_clust) {        /* Valid cluster# */
         fatsect = fs->fatbase;
-        switch (fs->fs_type) {
+#if !(_FS_FATTYPES & 3)                                /* FAT32 and/or exFAT: 4-byte entries, no type switch */
+        if (!move_window(fs, fatsect + (clust / (S_SIZ / 4)))) return 1;
+        val = LD_DWORD(&fs->win[((WORD)clust * 4) & (S_SIZ - 1)]);
+#if (_FS_FATTYPES & 4) && _FS_EXFAT
+        val &= (FSTYPE(fs) == FS_FAT32) ? 0x0FFFFFFF : 0xFFFFFFFF;    /* A select, not a branch */
+#elif _FS_FATTYPES & 4
+        val &= 0x0FFFFFFF;
+#endif
+        return val;
+#else
+        switch (FSTYPE(fs)) {
+#if _FS_FATTYPES & 1
         case FS_FAT12 :
             bc = (WORD)clust * 3 / 2;
             if (!move_window(fs, fatsect + (bc / S_SIZ))) break;
@@ -153,15 +349,24 @@ DWORD get_cluster (        /* 0,>=2: successful, 1: failed */
             if (!move_window(fs, fatsect + (bc / S_SIZ))) break;
             wc |= (WORD)fs->win[bc & (S_SIZ - 1)] << 8;
             return (clust & 1) ? (wc >> 4) : (wc & 0xFFF);
-
+#endif
+#if _FS_FATTYPES & 2
         case FS_FAT16 :
             if (!move_window(fs, fatsect + (clust / (S_SIZ / 2)))) break;
             return LD_WORD(&fs->win[((WORD)clust * 2) & (S_SIZ - 1)]);
-
+#endif
+#if _FS_FATTYPES & 4
         case FS_FAT32 :
             if (!move_window(fs, fatsect + (clust / (S_SIZ / 4)))) break;
             return LD_DWORD(&fs->win[((WORD)clust * 4) & (S_SIZ - 1)]) & 0x0FFFFFFF;
+#endif
+#if _FS_EXFAT
+        case FS_EXFAT :
+            if (!move_window(fs, fatsect + (clust / (S_SIZ / 4)))) break;
+            return LD_DWORD(&fs->win[((WORD)clust * 4) & (S_SIZ - 1)]);
+#endif
         }
+#endif
     }
 
     return 1;    /* There is no cluster information, or an error occured */
@@ -182,13 +387,20 @@ BOOL put_cluster (        /* TRUE: successful, FALSE: failed */
     DWORD val            /* New value to mark the cluster */
 )
 {
+#if _FS_FATTYPES & 1
     WORD bc;
     BYTE *p;
+#endif
     DWORD fatsect;
 
 
     fatsect = fs->fatbase;
-    switch (fs->fs_type) {
+#if !(_FS_FATTYPES & 3)                                /* FAT32 and/or exFAT: 4-byte entries, no type switch */
+    if (!move_window(fs, fatsect + (clust / (S_SIZ / 4)))) return FALSE;
+    ST_DWORD(&fs->win[((WORD)clust * 4) & (S_SIZ - 1)], val);
+#else
+    switch (FSTYPE(fs)) {
+#if _FS_FATTYPES & 1
     case FS_FAT12 :
         bc = (WORD)clust * 3 / 2;
         if (!move_window(fs, fatsect + (bc / S_SIZ))) return FALSE;
@@ -200,20 +412,27 @@ BOOL put_cluster (        /* TRUE: successful, FALSE: failed */
         p = &fs->win[bc & (S_SIZ - 1)];
         *p = (clust & 1) ? (BYTE)(val >> 4) : ((*p & 0xF0) | ((BYTE)(val >> 8) & 0x0F));
         break;
-
+#endif
+#if _FS_FATTYPES & 2
     case FS_FAT16 :
         if (!move_window(fs, fatsect + (clust / (S_SIZ / 2)))) return FALSE;
         ST_WORD(&fs->win[((WORD)clust * 2) & (S_SIZ - 1)], (WORD)val);
         break;
-
+#endif
+#if (_FS_FATTYPES & 4) || _FS_EXFAT
     case FS_FAT32 :
+#if _FS_EXFAT
+    case FS_EXFAT :
+#endif
         if (!move_window(fs, fatsect + (clust / (S_SIZ / 4)))) return FALSE;
         ST_DWORD(&fs->win[((WORD)clust * 4) & (S_SIZ - 1)], val);
         break;
+#endif
 
     default :
         return FALSE;
     }
+#endif
     fs->winflag = 1;
     return TRUE;
 }
@@ -222,10 +441,113 @@ BOOL put_cluster (        /* TRUE: successful, FALSE: failed */
 
 
 
+#if _FS_EXFAT
+/*-----------------------------------------------------------------------*/
+/* Get/Change cluster status in the allocation bitmap (exFAT)            */
+/*-----------------------------------------------------------------------*/
+
+#if !_FS_READONLY
+static
+DWORD get_bitmap (        /* 0: free, 1: failed, 2: in use */
+    FATFS *fs,            /* File system object */
+    DWORD clust            /* Cluster# to get the status */
+)
+{
+    clust -= 2;
+    if (clust >= fs->max_clust - 2) return 1;
+    if (!move_window(fs, fs->bitbase + clust / (S_SIZ * 8))) return 1;
+    return (fs->win[(clust / 8) & (S_SIZ - 1)] & (1 << (clust & 7))) ? 2 : 0;
+}
+
+
+static
+BOOL put_bitmap (        /* TRUE: successful, FALSE: failed */
+    FATFS *fs,            /* File system object */
+    DWORD clust,        /* First cluster# to change */
+    DWORD ncl,            /* Number of clusters to change */
+    BYTE bv                /* 1: mark in use, 0: mark free */
+)
+{
+    BYTE *p, bm;
+
+
+    clust -= 2;
+    if (clust >= fs->max_clust - 2 || ncl > fs->max_clust - 2 - clust) return FALSE;
+    while (ncl) {
+        if (!move_window(fs, fs->bitbase + clust / (S_SIZ * 8))) return FALSE;
+        p = &fs->win[(clust / 8) & (S_SIZ - 1)];
+        do {                                /* Change the bits in this sector */
+            bm = 1 << (clust & 7);
+            *p = bv ? (*p | bm) : (*p & ~bm);
+            if (!(++clust & 7)) p++;
+        } while (--ncl && (clust & (S_SIZ * 8 - 1)));
+        fs->winflag = 1;
+    }
+    return TRUE;
+}
+#endif /* !_FS_READONLY */
+#endif /* _FS_EXFAT */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get allocation status of a cluster                                    */
+/*-----------------------------------------------------------------------*/
+
+#if !_FS_READONLY
+static
+DWORD get_cstat (        /* 0: free, 1: failed, others: in use */
+    FATFS *fs,            /* File system object */
+    DWORD clust            /* Cluster# to get the status */
+)
+{
+#if _FS_EXFAT
+    if (FSTYPE(fs) == FS_EXFAT) return get_bitmap(fs, clust);    /* exFAT: FAT entry of a free cluster is undefined */
+#endif
+    return get_cluster(fs, clust);
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Remove a cluster chain                                                */
 /*-----------------------------------------------------------------------*/
 
+#if !_FS_READONLY && _USE_AU_ALIGN
+static
+void au_rescan (
+    FATFS *fs,            /* File system object */
+    DWORD clust            /* Cluster# about to be freed */
+)                        /* Lets seek_free_au() look over all the AUs again */
+{
+    DWORD n = fs->au_clust;
+
+
+    if (!n || fs->max_clust <= fs->au_ofs) return;
+    if (clust < fs->au_ofs) clust = fs->au_ofs;
+    if (!fs->au_next) fs->au_next = clust - (clust - fs->au_ofs) % n;    /* Resume at the AU of this cluster */
+    fs->au_left = (fs->max_clust - fs->au_ofs) / n;
+}
+#endif
+
+
+#if !_FS_READONLY && _USE_ERASE
+static
+void mark_freed (
+    FATFS *fs,            /* File system object */
+    DWORD clust,        /* First cluster# freed */
+    DWORD n                /* Number of clusters */
+)                        /* Widens the range the next erase pass visits */
+{
+    if (clust < fs->ers_lo) fs->ers_lo = clust;
+    if (clust + n - 1 > fs->ers_hi) fs->ers_hi = clust + n - 1;
+}
+#endif
+
+
 #if !_FS_READONLY
 static
 BOOL remove_chain (        /* TRUE: successful, FALSE: failed */
@@ -233,24 +555,248 @@ BOOL remove_chain (        /* TRUE: successful, FALSE: failed */
     DWORD clust            /* Cluster# to remove chain from */
 )
 {
+    DWORD sect, n = 0;
+    BYTE *p;
+    UINT w;
+#if _FS_EXFAT || (_FS_FATTYPES & 1)
     DWORD nxt;
+#endif
+#if _FS_EXFAT
+    DWORD scl;
+    BYTE map[S_MAX_SIZ / 4 / 8];    /* Chain clusters in the current FAT sector (exFAT) */
+#endif
 
 
+#if _USE_AU_ALIGN
+    if (clust >= 2 && clust < fs->max_clust) au_rescan(fs, clust);
+#endif
     while (clust >= 2 && clust < fs->max_clust) {
-        nxt = get_cluster(fs, clust);
-        if (nxt == 1) return FALSE;
-        if (!put_cluster(fs, clust, 0)) return FALSE;
-        if (fs->free_clust != 0xFFFFFFFF) {
-            fs->free_clust++;
-#if _USE_FSINFO
-            fs->fsi_flag = 1;
+#if _FS_EXFAT
+        if (FSTYPE(fs) == FS_EXFAT) {    /* Collect the chain in this FAT sector, then free it in the bitmap */
+            sect = fs->fatbase + clust / (S_SIZ / 4);
+            if (!move_window(fs, sect)) return FALSE;
+            scl = clust & ~(DWORD)(S_SIZ / 4 - 1);    /* First cluster mapped by this FAT sector */
+            memset(map, 0, sizeof(map));
+            do {
+                map[(clust - scl) / 8] |= 1 << (clust & 7);
+#if _USE_ERASE
+                mark_freed(fs, clust, 1);
+#endif
+                clust = LD_DWORD(&fs->win[((WORD)clust * 4) & (S_SIZ - 1)]);    /* The FAT is left as is */
+                n++;
+            } while (clust >= 2 && clust < fs->max_clust && clust - scl < S_SIZ / 4);
+            for (w = 0; w < S_SIZ / 4; w++) {
+                if (!(map[w / 8] & (1 << (w & 7)))) continue;
+                nxt = scl + w - 2;                /* Bit# in the bitmap */
+                if (!move_window(fs, fs->bitbase + nxt / (S_SIZ * 8))) return FALSE;
+                fs->win[(nxt / 8) & (S_SIZ - 1)] &= ~(1 << (nxt & 7));
+                fs->winflag = 1;
+            }
+            continue;
+        }
 #endif
+#if _FS_FATTYPES & 1
+        if (FSTYPE(fs) == FS_FAT12) {    /* FAT12 entries can straddle sectors, one at a time */
+            nxt = get_cluster(fs, clust);
+            if (nxt == 1 || !put_cluster(fs, clust, 0)) return FALSE;
+#if _USE_ERASE
+            mark_freed(fs, clust, 1);
+#endif
+            clust = nxt; n++;
+            continue;
         }
-        clust = nxt;
+#endif
+        w = (FSTYPE(fs) == FS_FAT16) ? 2 : 4;    /* Clear the entries of the chain in this FAT sector in place */
+        sect = fs->fatbase + clust / (S_SIZ / w);
+        if (!move_window(fs, sect)) return FALSE;
+        do {
+#if _USE_ERASE
+            mark_freed(fs, clust, 1);
+#endif
+            p = &fs->win[((WORD)clust * w) & (S_SIZ - 1)];
+            if (w == 2) {
+                clust = LD_WORD(p); ST_WORD(p, 0);
+            } else {
+                clust = LD_DWORD(p) & 0x0FFFFFFF; ST_DWORD(p, 0);
+            }
+            n++;
+        } while (clust >= 2 && clust < fs->max_clust && fs->fatbase + clust / (S_SIZ / w) == sect);
+        fs->winflag = 1;                /* Written back (and mirrored) once when the window moves */
+    }
+#if _FS_RESERVE
+    if (n) fs->rsv_full = 0;            /* Free clusters outside the windows again */
+#endif
+    if (n && fs->free_clust != 0xFFFFFFFF) {
+        fs->free_clust += n;
+#if _USE_FSINFO
+        fs->fsi_flag = 1;
+#endif
+    }
+    return TRUE;
+}
+
+
+#if _FS_EXFAT
+static
+BOOL remove_xchain (    /* TRUE: successful, FALSE: failed */
+    FATFS *fs,            /* File system object */
+    DWORD clust,        /* Cluster# to remove chain from */
+    DWORD ncont            /* Number of clusters of the contiguous chain (0:FAT chain) */
+)
+{
+    if (!ncont) return remove_chain(fs, clust);
+#if _USE_AU_ALIGN
+    au_rescan(fs, clust);
+#endif
+    if (!put_bitmap(fs, clust, ncont, 0)) return FALSE;    /* No FAT access for a contiguous chain */
+#if _USE_ERASE
+    mark_freed(fs, clust, ncont);
+#endif
+#if _FS_RESERVE
+    fs->rsv_full = 0;
+#endif
+    if (fs->free_clust != 0xFFFFFFFF) {
+        fs->free_clust += ncont;
     }
     return TRUE;
 }
 #endif
+#endif
+
+
+
+
+#if !_FS_READONLY && _FS_RESERVE
+/*-----------------------------------------------------------------------*/
+/* Cluster reservation of the files being written                        */
+/*-----------------------------------------------------------------------*/
+/* Each file that allocates a cluster reserves a window of the clusters  */
+/* after it, up to the end of the allocation unit (or RSV_SIZE bytes if  */
+/* the AU is not known), but not over 1/(2*_FS_RESERVE) of the volume.   */
+/* Other allocations pass over the windows while any other free cluster  */
+/* is left, and then take from the far end of a window. The windows are  */
+/* not recorded on the disk, so an unclosed file leaves nothing behind.  */
+/* Once a scan of the whole FAT finds free clusters only in the windows, */
+/* rsv_full keeps the next allocations to the windows until a chain is   */
+/* removed or a window is given back.                                    */
+
+#define RSV_SIZE    0x400000    /* Window size when the AU is not known */
+
+static
+BOOL is_reserved (    /* TRUE: reserved for another file */
+    FATFS *fs,        /* File system object */
+    DWORD clust        /* Free cluster# to check */
+)
+{
+    BYTE i;
+
+
+    for (i = 0; i < _FS_RESERVE; i++) {
+        if (i + 1 != fs->rsv_own && clust - fs->rsv_clust[i] < fs->rsv_end[i] - fs->rsv_clust[i])
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+static
+DWORD take_rsv (    /* 0: no free cluster, 1: error, >=2: free cluster# */
+    FATFS *fs        /* File system object with rsv_full set */
+)                    /* Looks in the own window from its start, then in the others from their far end */
+{
+    DWORD cl, cstat;
+    BYTE i;
+
+
+    if (fs->rsv_own) {
+        i = fs->rsv_own - 1;
+        for (cl = fs->rsv_clust[i]; cl < fs->rsv_end[i]; cl++) {
+            cstat = get_cstat(fs, cl);
+            if (cstat == 1) return 1;
+            if (cstat == 0) break;
+        }
+        fs->rsv_clust[i] = cl;            /* The clusters passed over are in use */
+        if (cl < fs->rsv_end[i]) return cl;
+    }
+    for (i = 0; i < _FS_RESERVE; i++) {
+        if (i + 1 == fs->rsv_own) continue;
+        for (cl = fs->rsv_end[i]; cl > fs->rsv_clust[i]; ) {
+            cstat = get_cstat(fs, --cl);
+            if (cstat == 1) return 1;
+            if (cstat == 0) {
+                fs->rsv_end[i] = cl;        /* The window loses its tail, which is in use */
+                return cl;
+            }
+        }
+    }
+    return 0;
+}
+
+
+static
+void set_rsv (
+    FIL *fp,        /* File object with a reservation slot */
+    DWORD clust        /* Cluster# just allocated to the file */
+)
+{
+    FATFS *fs = fp->fs;
+    DWORD n, ofs, end;
+    BYTE i = fp->rsv - 1, j;
+
+
+    if (clust - fs->rsv_clust[i] < fs->rsv_end[i] - fs->rsv_clust[i] && clust + 1 < fs->rsv_end[i]) {
+        fs->rsv_clust[i] = clust + 1;        /* Taken from the window */
+        return;
+    }
+    if (fs->rsv_full) {                        /* A new window would hold no free cluster */
+        fs->rsv_clust[i] = fs->rsv_end[i] = clust + 1;
+        return;
+    }
+
+    n = RSV_SIZE / S_SIZ / fs->sects_clust; ofs = 2;    /* Open a new window after it */
+    if (!n) n = 1;
+#if _USE_AU_ALIGN
+    if (fs->au_clust) {
+        n = fs->au_clust; ofs = fs->au_ofs;
+    }
+#endif
+    clust++;
+    end = (clust < ofs) ? ofs : clust + n - (clust - ofs) % n;    /* Up to the next AU boundary */
+    n = (fs->max_clust - 2) / (_FS_RESERVE * 2) + 1;    /* Not too large a share of the volume */
+    if (end - clust > n) end = clust + n;
+    if (end > fs->max_clust) end = fs->max_clust;
+    for (j = 0; j < _FS_RESERVE; j++) {        /* and to the window of another file */
+        if (j != i && fs->rsv_end[j] > fs->rsv_clust[j] && fs->rsv_clust[j] >= clust && fs->rsv_clust[j] < end)
+            end = fs->rsv_clust[j];
+    }
+    if (end < clust) end = clust;
+    fs->rsv_clust[i] = clust;
+    fs->rsv_end[i] = end;
+}
+
+
+static
+void free_rsv (
+    FIL *fp            /* File object to be reused */
+)                    /* Returns the slots the file object still holds on any drive */
+{
+    FATFS *fs;
+    BYTE n, i;
+
+
+    for (n = 0; n < _DRIVES; n++) {
+        fs = FatFs[n];
+        if (!fs) continue;
+        for (i = 0; i < _FS_RESERVE; i++) {
+            if (fs->rsv_fil[i] == fp) {
+                if (fs->rsv_end[i] > fs->rsv_clust[i]) fs->rsv_full = 0;    /* Its free clusters are open to all */
+                fs->rsv_clust[i] = fs->rsv_end[i] = 0;
+                fs->rsv_fil[i] = NULL;
+            }
+        }
+    }
+}
+#endif
 
 
 
@@ -267,6 +813,9 @@ DWORD create_chain (    /* 0: no free cluster, 1: error, >=2: new cluster number
 )
 {
     DWORD cstat, ncl, scl, mcl = fs->max_clust;
+#if _FS_RESERVE
+    DWORD rcl = 0;
+#endif
 
 
     if (clust == 0) {        /* Create new chain */
@@ -281,20 +830,48 @@ DWORD create_chain (    /* 0: no free cluster, 1: error, >=2: new cluster number
     }
 
     ncl = scl;                /* Start cluster */
+#if _FS_RESERVE
+    if (fs->rsv_full) {        /* Only the windows had free clusters at the last scan */
+        ncl = take_rsv(fs);
+        if (ncl == 1) return 1;
+    } else
+#endif
     for (;;) {
         ncl++;                            /* Next cluster */
         if (ncl >= mcl) {                /* Wrap around */
             ncl = 2;
-            if (ncl > scl) return 0;    /* No free custer */
+            if (ncl > scl) { ncl = 0; break; }    /* No free custer */
+        }
+        cstat = get_cstat(fs, ncl);        /* Get the cluster status */
+#if _FS_RESERVE
+        if (cstat == 0 && is_reserved(fs, ncl)) {    /* Reserved for another file, take the last */
+            rcl = ncl;                    /* one seen only if no other cluster is free */
+            cstat = 2;
         }
-        cstat = get_cluster(fs, ncl);    /* Get the cluster status */
+#endif
         if (cstat == 0) break;            /* Found a free cluster */
         if (cstat == 1) return 1;        /* Any error occured */
-        if (ncl == scl) return 0;        /* No free custer */
+        if (ncl == scl) { ncl = 0; break; }    /* No free custer */
+    }
+#if _FS_RESERVE
+    if (!ncl && !fs->rsv_full) {    /* The whole FAT was scanned */
+        ncl = rcl;
+        fs->rsv_full = 1;
+    }
+#endif
+    if (!ncl) return 0;
+
+#if _FS_EXFAT
+    if (FSTYPE(fs) == FS_EXFAT) {
+        if (!put_bitmap(fs, ncl, 1, 1)) return 1;            /* Mark the new cluster "in use" */
+        if (clust && (!put_cluster(fs, ncl, 0xFFFFFFFF)        /* Link it to previous one if needed, */
+            || !put_cluster(fs, clust, ncl))) return 1;        /* a new chain is left out of the FAT */
+    } else
+#endif
+    {
+        if (!put_cluster(fs, ncl, 0x0FFFFFFF)) return 1;        /* Mark the new cluster "in use" */
+        if (clust && !put_cluster(fs, clust, ncl)) return 1;    /* Link it to previous one if needed */
     }
-
-    if (!put_cluster(fs, ncl, 0x0FFFFFFF)) return 1;        /* Mark the new cluster "in use" */
-    if (clust && !put_cluster(fs, clust, ncl)) return 1;    /* Link it to previous one if needed */
 
     fs->last_clust = ncl;                /* Update fsinfo */
     if (fs->free_clust != 0xFFFFFFFF) {
@@ -306,14 +883,113 @@ DWORD create_chain (    /* 0: no free cluster, 1: error, >=2: new cluster number
 
     return ncl;        /* Return new cluster number */
 }
-#endif /* !_FS_READONLY */
+
+#if _USE_TRACE
+static
+DWORD trace_create_chain (
+    FATFS *fs,
+    DWORD clust
+)
+{
+    DWORD ncl;
+
+
+    TRACE_B(TR_CREATE_CHAIN, clust);
+    ncl = create_chain(fs, clust);
+    TRACE_E(TR_CREATE_CHAIN, ncl);
+    return ncl;
+}
+#define create_chain trace_create_chain    /* Trace all calls from here on */
+#endif
+
+
+#if _FS_EXFAT
+static
+DWORD create_xchain (    /* 0: no free cluster, 1: error, >=2: next cluster number */
+    FATFS *fs,            /* File system object */
+    DWORD org,            /* Start cluster of the chain */
+    DWORD clust,        /* Cluster# to stretch */
+    DWORD *ncont        /* Number of clusters of the contiguous chain (0:FAT chain), updated */
+)
+{
+    DWORD ncl, cstat;
+
+
+    if (!*ncont) return create_chain(fs, clust);    /* The chain is in the FAT */
+
+    ncl = clust + 1;
+    if (ncl < org + *ncont) return ncl;            /* It is already followed by next cluster */
+    cstat = (ncl < fs->max_clust) ? get_bitmap(fs, ncl) : 2;
+    if (cstat == 1) return 1;
+#if _FS_RESERVE
+    if (cstat == 0 && is_reserved(fs, ncl)) cstat = 2;    /* Do not grow into the window of another file */
+#endif
+    if (cstat == 0) {                            /* Next cluster is free, keep it contiguous */
+        if (!put_bitmap(fs, ncl, 1, 1)) return 1;
+        (*ncont)++;
+        fs->last_clust = ncl;
+        if (fs->free_clust != 0xFFFFFFFF) {
+            fs->free_clust--;
+        }
+        return ncl;
+    }
+
+    for (ncl = org; ncl < clust; ncl++) {        /* Fragmented, move the chain into the FAT */
+        if (!put_cluster(fs, ncl, ncl + 1)) return 1;
+    }
+    if (!put_cluster(fs, clust, 0xFFFFFFFF)) return 1;
+    *ncont = 0;
+    return create_chain(fs, clust);
+}
+#endif
+
+
+#if _USE_AU_ALIGN
+#define AU_SCAN        32        /* AUs looked at per seek_free_au() call at most */
+
+static
+BOOL seek_free_au (        /* TRUE: successful, FALSE: failed */
+    FATFS *fs            /* File system object */
+)                        /* Moves the allocation pointer to a free AU, if one is found soon */
+{
+    DWORD n = fs->au_clust, cl, i, cstat;
+    UINT scan;
+
+
+    if (!n || !fs->au_next) return TRUE;    /* No alignment, or no free AU is left */
+
+    cl = fs->au_next;                        /* Go on where the last search stopped */
+    for (scan = AU_SCAN; scan && fs->au_left; scan--) {
+        if (cl < fs->au_ofs || cl + n > fs->max_clust) cl = fs->au_ofs;    /* Wrap around */
+        fs->au_left--;
+        for (i = 0; i < n; i++) {            /* Is the whole AU free? */
+            cstat = get_cstat(fs, cl + i);
+            if (cstat == 1) return FALSE;
+#if _FS_RESERVE
+            if (cstat == 0 && is_reserved(fs, cl + i)) break;    /* and not reserved? */
+#endif
+            if (cstat) break;
+        }
+        if (i == n) {                        /* Found, let create_chain() start here */
+            fs->last_clust = cl - 1;
+            fs->au_next = cl + n;
+            return TRUE;
+        }
+        cl += n;
+    }
+
+    fs->au_next = fs->au_left ? cl : 0;    /* Not found yet, the file is not aligned */
+    return TRUE;
+}
+#endif
+#endif /* !_FS_READONLY */
 
 
 
 
 /*-----------------------------------------------------------------------*/
-/* Get sector# from cluster#                                             */
-/*-----------------------------------------------------------------------*/
+/* Get sector# from cluster#                                             */
+/*-----------------------------------------------------------------------*/
 
 static
 DWORD clust2sect (    /* !=0: sector number, 0: failed - invalid cluster# */
@@ -329,6 +1005,291 @@ DWORD clust2sect (    /* !=0: sector number, 0: failed - invalid cluster# */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Follow or stretch the cluster chain of a file                         */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD get_fcluster (    /* 0,>=2: successful, 1: failed */
+    FIL *fp,            /* File object */
+    DWORD clust            /* Cluster# to get the next cluster */
+)
+{
+#if _FS_EXFAT
+    if (fp->n_cont) return clust + 1;    /* Contiguous file, no FAT access */
+#endif
+    if (fp->ext_ncl && clust - fp->ext_clust < fp->ext_ncl - 1)
+        return clust + 1;                /* Inside the cached contiguous run, no FAT access */
+    return get_cluster(fp->fs, clust);
+}
+
+
+#if !_FS_READONLY
+static
+DWORD create_fchain (    /* 0: no free cluster, 1: error, >=2: new cluster number */
+    FIL *fp,            /* File object */
+    DWORD clust            /* Cluster# to stretch, 0 means create new */
+)
+{
+    DWORD ncl;
+#if _FS_RESERVE
+    FATFS *fs = fp->fs;
+    BYTE i;
+
+
+    if (!fp->rsv) {                        /* Take a reservation slot if any is free */
+        for (i = 0; i < _FS_RESERVE && fs->rsv_end[i]; i++) ;
+        if (i < _FS_RESERVE) {
+            fs->rsv_clust[i] = fs->rsv_end[i] = 1;    /* In use, no window yet */
+            fs->rsv_fil[i] = fp;
+            fp->rsv = i + 1;
+        }
+    }
+    fs->rsv_own = fp->rsv;                /* The file's own window is free to it */
+#endif
+#if _FS_EXFAT
+    if (FSTYPE(fp->fs) == FS_EXFAT) {
+        if (!clust) {                    /* A new chain starts contiguous */
+            ncl = create_chain(fp->fs, 0);
+            fp->n_cont = (ncl >= 2) ? 1 : 0;
+        } else {
+            ncl = create_xchain(fp->fs, fp->org_clust, clust, &fp->n_cont);
+        }
+    } else
+#endif
+    ncl = create_chain(fp->fs, clust);
+#if _FS_RESERVE
+    fs->rsv_own = 0;
+    if (fp->rsv && ncl >= 2 && ncl == fs->last_clust)    /* Newly allocated, reserve the clusters after it */
+        set_rsv(fp, ncl);
+#endif
+    return ncl;
+}
+#endif
+
+
+static
+DWORD get_frun (    /* Number of clusters that follow clust contiguously (<= ncl), 0xFFFFFFFF: error */
+    FIL *fp,        /* File object */
+    DWORD clust,    /* Cluster# in the chain of the file */
+    DWORD ncl,        /* Number of following clusters wanted */
+    BYTE stretch    /* TRUE: stretch the chain at its end (writing) */
+)
+{
+    DWORD n, nxt;
+
+
+    if (clust - fp->ext_clust < fp->ext_ncl) {    /* In the cached run, start after its end */
+        n = fp->ext_clust + fp->ext_ncl - 1 - clust;
+    } else {                                    /* Start a new run */
+        fp->ext_clust = clust; fp->ext_ncl = 1;
+        n = 0;
+    }
+    while (n < ncl) {                            /* Scan ahead in the FAT */
+#if !_FS_READONLY
+        nxt = stretch ? create_fchain(fp, clust + n) : get_fcluster(fp, clust + n);
+#else
+        (void)stretch;                            /* Nothing to stretch in a read only build */
+        nxt = get_fcluster(fp, clust + n);
+#endif
+        if (nxt == 1) return 0xFFFFFFFF;
+        if (nxt != clust + n + 1) break;        /* End of the run (fragment, end of chain or disk full) */
+        n++; fp->ext_ncl++;
+    }
+    return (n < ncl) ? n : ncl;
+}
+
+
+#if !_FS_READONLY
+#if _USE_WCACHE
+static
+BOOL flush_wcache (    /* TRUE: successful, FALSE: failed */
+    FIL *fp            /* File object with sectors in the write cache */
+)
+{
+    if (disk_write(fp->fs->drive, fp->wc_buf, fp->wc_sect, fp->wc_n) != RES_OK)
+        return FALSE;
+    fp->wc_n = 0;
+    return TRUE;
+}
+#endif
+
+
+static
+BOOL put_fsect (    /* TRUE: successful, FALSE: failed */
+    FIL *fp,            /* File object */
+    const BYTE *buff,    /* Data to be written */
+    DWORD sect,            /* Sector# */
+    BYTE n                /* Number of sectors */
+)
+{
+#if _USE_WCACHE
+    if (fp->wc_size) {                            /* Put the sectors into the write cache */
+        for ( ; n; n--, sect++, buff += S_SIZ) {
+            if (fp->wc_n && sect != fp->wc_sect + fp->wc_n && !flush_wcache(fp))
+                return FALSE;                    /* Not next to the cached sectors */
+            if (!fp->wc_n) fp->wc_sect = sect;
+            memcpy(&fp->wc_buf[fp->wc_n * S_SIZ], buff, S_SIZ);
+            if (++fp->wc_n == fp->wc_size && !flush_wcache(fp))    /* Write it out when full */
+                return FALSE;
+        }
+        return TRUE;
+    }
+#endif
+    return disk_write(fp->fs->drive, buff, sect, n) == RES_OK;
+}
+
+
+#if _FS_BLOCK > 1
+static
+BOOL flush_fblock (    /* TRUE: successful, FALSE: failed */
+    FIL *fp            /* File object with dirty sectors in the block */
+)
+{
+    BYTE i, n;
+
+
+    for (i = 0; i < _FS_BLOCK; i += n) {    /* Write back the runs of dirty sectors */
+        for (n = 0; i + n < _FS_BLOCK && (fp->blk_dirty & (1 << (i + n))); n++) ;
+        if (!n) { n = 1; continue; }
+        if (!put_fsect(fp, &fp->buffer[i * S_SIZ], fp->blk_sect + i, n))
+            return FALSE;
+    }
+    fp->blk_dirty = 0;
+    return TRUE;
+}
+#endif
+
+
+static
+BOOL put_fbuf (        /* TRUE: successful, FALSE: failed */
+    FIL *fp            /* File object with the dirty file I/O buffer */
+)
+{
+#if _FS_BLOCK > 1
+    fp->blk_dirty |= 1 << (fp->curr_sect - fp->blk_sect);    /* Written back with the block */
+#else
+    if (!put_fsect(fp, fp->buffer, fp->curr_sect, 1))
+        return FALSE;
+#endif
+    fp->flag &= ~FA__DIRTY;
+    return TRUE;
+}
+
+
+static
+BOOL sync_fbuf (    /* TRUE: successful, FALSE: failed */
+    FIL *fp            /* File object */
+)
+{
+    if ((fp->flag & FA__DIRTY) && !put_fbuf(fp))    /* Write back the file I/O buffer */
+        return FALSE;
+#if _FS_BLOCK > 1
+    if (fp->blk_dirty && !flush_fblock(fp))
+        return FALSE;
+#endif
+#if _USE_WCACHE
+    if (fp->wc_n && !flush_wcache(fp))                /* and the write cache */
+        return FALSE;
+#endif
+    return TRUE;
+}
+#endif /* !_FS_READONLY */
+
+
+/*-----------------------------------------------------------------------*/
+/* Load a sector into the file I/O buffer                                */
+/*-----------------------------------------------------------------------*/
+/* With _FS_BLOCK > 1 the buffer holds the aligned block of sectors      */
+/* around it, read at once up to the cluster boundary. fp->sect_clust    */
+/* must be set for sect.                                                 */
+
+static
+BOOL load_fsect (    /* TRUE: successful, FALSE: failed */
+    FIL *fp,        /* File object */
+    DWORD sect,        /* Sector to be made current */
+    BOOL fill        /* FALSE: The sector is to be overwritten, no need to read it */
+)
+{
+#if _FS_BLOCK > 1
+    DWORD bsect, s, e;
+
+
+    bsect = sect & ~(DWORD)(_FS_BLOCK - 1);
+    if (bsect != fp->blk_sect) {                /* Another block */
+#if !_FS_READONLY
+        if (fp->blk_dirty && !flush_fblock(fp)) return FALSE;
+#endif
+        fp->blk_sect = bsect;
+        fp->blk_valid = 0;
+    }
+    if (fp->blk_valid & (1 << (sect - bsect))) return TRUE;    /* Already in the buffer */
+    if (!fill) {
+        fp->blk_valid |= 1 << (sect - bsect);
+        return TRUE;
+    }
+#if !_FS_READONLY
+    if (!sync_fbuf(fp)) return FALSE;            /* The read must see sectors not written back yet */
+#endif
+    s = sect - (fp->fs->sects_clust - fp->sect_clust);    /* Sectors of the block in the cluster */
+    if (s < bsect) s = bsect;
+    e = sect + fp->sect_clust;
+    if (e > bsect + _FS_BLOCK) e = bsect + _FS_BLOCK;
+    fp->blk_valid = 0;
+    if (disk_read(fp->fs->drive, &fp->buffer[(s - bsect) * S_SIZ], s, (BYTE)(e - s)) != RES_OK)
+        return FALSE;
+    fp->blk_valid = (BYTE)(((1 << (e - s)) - 1) << (s - bsect));
+    return TRUE;
+#else
+    return !fill || disk_read(fp->fs->drive, fp->buffer, sect, 1) == RES_OK;
+#endif
+}
+
+
+#if _FS_BLOCK > 1
+static
+BOOL drop_fblock (    /* TRUE: successful, FALSE: failed */
+    FIL *fp,        /* File object */
+    DWORD sect,        /* First sector of a direct transfer */
+    BYTE n            /* Number of sectors */
+)                    /* Drops the block if it holds any of them */
+{
+    if (fp->blk_valid && sect < fp->blk_sect + _FS_BLOCK && sect + n > fp->blk_sect) {
+#if !_FS_READONLY
+        if (!sync_fbuf(fp)) return FALSE;
+#endif
+        fp->blk_valid = 0;
+    }
+    return TRUE;
+}
+#endif
+
+
+#if _USE_FASTSEEK && _FS_MINIMIZE <= 2
+static
+DWORD clmt_clust (        /* 0: out of the table, >=2: cluster# */
+    FIL *fp,            /* File object with the cluster link map table */
+    FSIZE_t ofs            /* File offset to be converted to cluster# */
+)
+{
+    DWORD cl, ncl, *tbl;
+
+
+    tbl = fp->cltbl + 1;                                /* Top of the fragment list */
+    cl = (DWORD)(ofs / S_SIZ / fp->fs->sects_clust);    /* Cluster order from top of the file */
+    for (;;) {
+        ncl = *tbl++;                                    /* Number of clusters in the fragment */
+        if (!ncl) return 0;                                /* End of table */
+        if (cl < ncl) break;                            /* In this fragment? */
+        cl -= ncl; tbl++;                                /* Next fragment */
+    }
+    return cl + *tbl;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Move directory pointer to next                                        */
 /*-----------------------------------------------------------------------*/
@@ -350,6 +1311,12 @@ BOOL next_dir_entry (    /* TRUE: successful, FALSE: could not move next */
             if (idx >= fs->n_rootdir) return FALSE;    /* Reached to end of table */
         } else {                    /* In dynamic table */
             if (((idx / (S_SIZ / 32)) & (fs->sects_clust - 1)) == 0) {    /* Cluster changed? */
+#if _FS_EXFAT
+                if (dirobj->n_cont) {                        /* Contiguous table */
+                    clust = dirobj->clust + 1;
+                    if (clust - dirobj->sclust >= dirobj->n_cont) return FALSE;
+                } else
+#endif
                 clust = get_cluster(fs, dirobj->clust);        /* Get next cluster */
                 if (clust < 2 || clust >= fs->max_clust)    /* Reached to end of table */
                     return FALSE;
@@ -365,6 +1332,49 @@ BOOL next_dir_entry (    /* TRUE: successful, FALSE: could not move next */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Move directory pointer to an index                                    */
+/*-----------------------------------------------------------------------*/
+
+#if !_FS_READONLY || (_FS_MINIMIZE == 0 && _USE_LFN)
+static
+BOOL dir_seek (            /* TRUE: successful, FALSE: out of the table */
+    DIR *dirobj,        /* Pointer to directory object */
+    WORD idx            /* Directory index to move to */
+)
+{
+    DWORD clust;
+    WORD ic, ofs;
+    FATFS *fs = dirobj->fs;
+
+
+    clust = dirobj->sclust;
+    if (!clust) {            /* In static table */
+        if (idx >= fs->n_rootdir) return FALSE;
+        dirobj->sect = fs->dirbase + idx / (S_SIZ / 32);
+    } else {                /* In dynamic table */
+        ic = (S_SIZ / 32) * fs->sects_clust;    /* Entries per cluster */
+        for (ofs = idx; ofs >= ic; ofs -= ic) {    /* Follow the cluster chain */
+#if _FS_EXFAT
+            if (dirobj->n_cont) {                /* Contiguous table */
+                if (++clust - dirobj->sclust >= dirobj->n_cont) return FALSE;
+                continue;
+            }
+#endif
+            clust = get_cluster(fs, clust);
+            if (clust < 2 || clust >= fs->max_clust) return FALSE;
+        }
+        dirobj->sect = clust2sect(fs, clust) + ofs / (S_SIZ / 32);
+    }
+    dirobj->clust = clust;
+    dirobj->index = idx;
+    return TRUE;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get file status from directory entry                                  */
 /*-----------------------------------------------------------------------*/
@@ -417,7 +1427,7 @@ void get_fileinfo (        /* No return code */
 static
 char make_dirfile (            /* 1: error - detected an invalid format, '\0'or'/': next character */
     const char **path,        /* Pointer to the file path pointer */
-    char *dirname            /* Pointer to directory name buffer {Name(8), Ext(3), NT flag(1)} */
+    char *dirname            /* Pointer to directory name buffer {Name(8), Ext(3), NT flag(1), NS flag(1)} */
 )
 {
     BYTE n, t, c, a, b;
@@ -431,6 +1441,7 @@ char make_dirfile (            /* 1: error - detected an invalid format, '\0'or'
         if (c == '\0' || c == '/') {        /* Reached to end of str or directory separator */
             if (n == 0) break;
             dirname[11] = _USE_NTFLAG ? (a & b) : 0;
+            dirname[12] = (a & ~b & 0x18) ? NS_LFN : 0;    /* Mixed case can only be kept in an LFN */
             return c;
         }
         if (c <= ' ' || c == 0x7F) break;        /* Reject invisible chars */
@@ -468,12 +1479,511 @@ char make_dirfile (            /* 1: error - detected an invalid format, '\0'or'
         if (n >= t) break;
         dirname[n++] = c;
     }
-    return 1;
+    return 1;
+}
+
+
+
+#if _USE_LFN
+/*-----------------------------------------------------------------------*/
+/* LFN helpers                                                           */
+/*-----------------------------------------------------------------------*/
+
+static
+WORD lfn_upper (        /* Upper case of the char (US-ASCII only) */
+    WORD wc
+)
+{
+    return (wc >= 'a' && wc <= 'z') ? wc - 0x20 : wc;
+}
+
+
+static
+BYTE sum_sfn (            /* Checksum of the SFN tied to LFN entries */
+    const BYTE *dir        /* Pointer to the SFN (11 bytes) */
+)
+{
+    BYTE sum = 0;
+    UINT n = 11;
+
+
+    do sum = (sum >> 1) + (sum << 7) + *dir++; while (--n);
+    return sum;
+}
+
+
+static
+BOOL cmp_lfn (            /* TRUE: matched, FALSE: not matched */
+    const BYTE *dir        /* Pointer to the LFN entry to compare with LfnBuf[] */
+)
+{
+    UINT i, s;
+    WORD wc, uc;
+
+
+    i = ((dir[LDIR_Ord] & 0x3F) - 1) * 13;    /* Offset of this part in the name */
+    s = 0; wc = 1;
+    do {                                    /* Compare the chars in place */
+        uc = LD_WORD(&dir[LfnOfs[s]]);
+        if (wc) {                            /* Skip the padding after the terminator */
+            wc = uc;
+            if (i >= LfnLen) {
+                if (uc) return FALSE;        /* The stored name is longer */
+            } else {
+                if (lfn_upper(uc) != lfn_upper(LfnBuf[i])) return FALSE;
+            }
+            i++;
+        }
+    } while (++s < 13);
+
+    return TRUE;
+}
+
+
+#if _FS_MINIMIZE <= 1
+static
+BOOL pick_lfn (            /* TRUE: successful, FALSE: name too long */
+    const BYTE *dir        /* Pointer to the LFN entry to be loaded into LfnBuf[] */
+)
+{
+    UINT i, s;
+    WORD wc;
+
+
+    i = ((dir[LDIR_Ord] & 0x3F) - 1) * 13;    /* Offset of this part in the name */
+    s = 0; wc = 1;
+    do {
+        if (wc) {
+            if (i > _MAX_LFN) return FALSE;
+            LfnBuf[i++] = wc = LD_WORD(&dir[LfnOfs[s]]);
+        }
+    } while (++s < 13);
+    if ((dir[LDIR_Ord] & 0x40) && wc) {        /* Terminate the name if it fills the last part */
+        if (i > _MAX_LFN) return FALSE;
+        LfnBuf[i] = 0;
+    }
+
+    return TRUE;
+}
+
+
+static
+void get_lfninfo (        /* No return code */
+    FILINFO *finfo,        /* Ptr to store the long file name */
+    BOOL valid            /* TRUE: LfnBuf[] holds the LFN of the object */
+)
+{
+    UINT i = 0;
+    WORD wc = 0;
+    char *p = finfo->lfname;
+
+
+    if (!p || !finfo->lfsize) return;
+    if (valid) {
+        while ((wc = LfnBuf[i]) != 0 && i < finfo->lfsize - 1)
+            p[i++] = (wc < 0x100) ? (char)wc : '?';
+        if (wc) i = 0;            /* Does not fit, return null string */
+    }
+    p[i] = '\0';
+}
+#endif /* _FS_MINIMIZE <= 1 */
+
+
+#if !_FS_READONLY
+static
+void fit_lfn (            /* No return code */
+    BYTE *dir,            /* Pointer to the directory entry to be made */
+    BYTE ord,            /* LFN order (1-20) */
+    BYTE sum            /* Checksum of the SFN */
+)
+{
+    UINT i, s;
+    WORD wc;
+
+
+    dir[LDIR_Chksum] = sum;
+    dir[LDIR_Attr] = AM_LFN;
+    dir[LDIR_Type] = 0;
+    ST_WORD(&dir[LDIR_FstClusLO], 0);
+
+    i = (ord - 1) * 13;
+    s = wc = 0;
+    do {
+        if (wc != 0xFFFF) wc = LfnBuf[i++];    /* Get a char, or pad after the terminator */
+        ST_WORD(&dir[LfnOfs[s]], wc);
+        if (!wc) wc = 0xFFFF;
+    } while (++s < 13);
+    if (wc == 0xFFFF || !LfnBuf[i]) ord |= 0x40;    /* Mark the last part of the name */
+    dir[LDIR_Ord] = ord;
+}
+
+
+static
+WORD hash_lfn (            /* CRC-16 of the name in LfnBuf[] */
+    WORD seed
+)
+{
+    DWORD sr = seed;
+    UINT n, i;
+    WORD wc;
+
+
+    for (n = 0; n < LfnLen; n++) {
+        wc = LfnBuf[n];
+        for (i = 0; i < 16; i++) {
+            sr = (sr << 1) + (wc & 1);
+            wc >>= 1;
+            if (sr & 0x10000) sr ^= 0x11021;
+        }
+    }
+    return (WORD)sr;
+}
+
+
+static
+BYTE gen_numname (        /* Returns the position of '~' */
+    char *dst,            /* Pointer to the SFN basis, body is overwritten */
+    WORD hash,            /* Hash of the long name */
+    BYTE seq            /* Tail number ('1'-'9') */
+)
+{
+    BYTE i, n, c, t;
+
+
+    i = (dst[1] == ' ') ? 1 : 2;    /* Keep up to 2 chars of the basis */
+    for (n = 0; n < 4; n++) {        /* 4 hex digits of the hash */
+        c = (BYTE)((hash >> ((3 - n) * 4)) & 15);
+        dst[i++] = c + ((c < 10) ? '0' : 'A' - 10);
+    }
+    t = i;
+    dst[i++] = '~';
+    dst[i++] = seq;
+    while (i < 8) dst[i++] = ' ';
+    return t;
+}
+#endif /* !_FS_READONLY */
+#endif /* _USE_LFN */
+
+
+
+
+#if _FS_EXFAT
+/*-----------------------------------------------------------------------*/
+/* exFAT entry set helpers                                               */
+/*-----------------------------------------------------------------------*/
+
+static
+WORD xname_upper (        /* Upper case of the char as the default up-case table (US-ASCII and Latin-1) */
+    WORD wc
+)
+{
+    if (wc >= 'a' && wc <= 'z') return wc - 0x20;
+    if (wc >= 0xE0 && wc <= 0xFE && wc != 0xF7) return wc - 0x20;
+    if (wc == 0xFF) return 0x178;
+    if (wc == 0xB5) return 0x39C;
+    return wc;
+}
+
+
+static
+WORD xname_hash (void)    /* Name hash of the name in LfnBuf[] */
+{
+    WORD wc, sum = 0;
+    UINT n;
+
+
+    for (n = 0; n < LfnLen; n++) {
+        wc = xname_upper(LfnBuf[n]);
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + (wc & 0xFF);
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + (wc >> 8);
+    }
+    return sum;
+}
+
+
+static
+DWORD get_xncont (        /* Number of clusters of the contiguous object in dirbuf[] (0:FAT chain) */
+    FATFS *fs            /* File system object */
+)
+{
+    DWORD csize, n;
+
+
+    if (!(fs->dirbuf[XDIR_GenFlags] & 2) || !LD_DWORD(&fs->dirbuf[XDIR_FstClus])) return 0;
+    csize = (DWORD)fs->sects_clust * S_SIZ;
+    n = (DWORD)((LD_QWORD(&fs->dirbuf[XDIR_FileSize]) + csize - 1) / csize);
+    return n ? n : 1;
+}
+
+
+#if !_FS_READONLY || _FS_MINIMIZE <= 1
+static
+BOOL load_xset (        /* TRUE: successful, FALSE: failed or broken entry set */
+    DIR *dirobj            /* Directory object pointing the file entry */
+)
+{
+    DIR dj = *dirobj;
+    FATFS *fs = dj.fs;
+    UINT n;
+
+
+    for (n = 0; n < 64; n += 32) {    /* Load the file and stream extension entries into dirbuf[] */
+        if (n && !next_dir_entry(&dj)) return FALSE;
+        if (!move_window(fs, dj.sect)) return FALSE;
+        memcpy(&fs->dirbuf[n], &fs->win[(dj.index & ((S_SIZ - 1) / 32)) * 32], 32);
+    }
+    return (fs->dirbuf[XDIR_Type] == 0x85 && fs->dirbuf[32] == 0xC0) ? TRUE : FALSE;
+}
+#endif
+
+
+#if !_FS_READONLY
+static
+FRESULT store_xset (    /* FR_OK: successful, FR_RW_ERROR: a disk error occured */
+    DIR *dirobj            /* Directory object pointing the file entry */
+)
+{
+    DIR dj = *dirobj;
+    FATFS *fs = dj.fs;
+    BYTE *dptr;
+    UINT n, i, nent;
+    WORD sum = 0;
+
+
+    nent = fs->dirbuf[XDIR_NumSec] + 1;
+    for (n = 0; ; ) {                /* Write back dirbuf[] and sum up the entry set */
+        if (!move_window(fs, dj.sect)) return FR_RW_ERROR;
+        dptr = &fs->win[(dj.index & ((S_SIZ - 1) / 32)) * 32];
+        if (n < 2) {
+            memcpy(dptr, &fs->dirbuf[n * 32], 32);
+            fs->winflag = 1;
+        }
+        for (i = 0; i < 32; i++) {
+            if (n || (i != XDIR_SetSum && i != XDIR_SetSum + 1))
+                sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + dptr[i];
+        }
+        if (++n >= nent) break;
+        if (!next_dir_entry(&dj)) return FR_RW_ERROR;
+    }
+
+    ST_WORD(&fs->dirbuf[XDIR_SetSum], sum);    /* Store the checksum into the file entry */
+    if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
+    dptr = &fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32];
+    ST_WORD(&dptr[XDIR_SetSum], sum);
+    fs->winflag = 1;
+    return FR_OK;
+}
+#endif
+
+
+static
+FRESULT find_xentry (    /* FR_OK: found, FR_NO_FILE: not found, FR_RW_ERROR: a disk error occured */
+    DIR *dirobj            /* Directory object to search the name in LfnBuf[], points the file entry if found */
+)
+{
+    DIR sdj;
+    BYTE *dptr, c, st;
+    UINT i, k;
+    WORD hash;
+    FATFS *fs = dirobj->fs;
+
+
+    hash = xname_hash();
+    st = 0; i = 0;
+    for (;;) {
+        if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
+        dptr = &fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32];    /* Pointer to the directory entry */
+        c = dptr[XDIR_Type];
+        if (c == 0) return FR_NO_FILE;                    /* Reached to end of the directory */
+        if (c == 0x85) {                                /* A file entry, top of an entry set */
+            memcpy(fs->dirbuf, dptr, 32);
+            sdj = *dirobj;
+            st = 1; i = 0;
+        } else if (st == 1 && c == 0xC0) {                /* Stream extension entry, quick reject by length and hash */
+            memcpy(&fs->dirbuf[32], dptr, 32);
+            st = (fs->dirbuf[XDIR_NumName] == LfnLen && LD_WORD(&fs->dirbuf[XDIR_NameHash]) == hash) ? 2 : 0;
+        } else if (st == 2 && c == 0xC1) {                /* File name entry, compare 15 chars in place */
+            for (k = 0; k < 15 && i < LfnLen; k++, i++) {
+                if (xname_upper(LD_WORD(&dptr[2 + k * 2])) != xname_upper(LfnBuf[i])) break;
+            }
+            if (i >= LfnLen) {                            /* Matched */
+                *dirobj = sdj;
+                return FR_OK;
+            }
+            if (k < 15) st = 0;
+        } else {
+            st = 0;
+        }
+        if (!next_dir_entry(dirobj)) return FR_NO_FILE;
+    }
+}
+
+
+static
+void enter_xdir (        /* No return code */
+    DIR *dirobj            /* Directory object pointing the entry set of a sub-directory in dirbuf[] */
+)
+{
+    FATFS *fs = dirobj->fs;
+
+
+    dirobj->c_sclust = dirobj->sclust;        /* Remember where the entry set is */
+    dirobj->c_ncont = dirobj->n_cont;
+    dirobj->c_index = dirobj->index;
+    dirobj->n_cont = get_xncont(fs);        /* Move into the sub-directory table */
+    dirobj->clust = dirobj->sclust = LD_DWORD(&fs->dirbuf[XDIR_FstClus]);
+    dirobj->sect = clust2sect(fs, dirobj->clust);
+    dirobj->index = 0;
+}
+
+
+#if _FS_MINIMIZE <= 1
+static
+void get_xfileinfo (    /* No return code */
+    DIR *dirobj,        /* Directory object pointing the entry set loaded in dirbuf[] */
+    FILINFO *finfo        /* Ptr to store the file information */
+)
+{
+    DIR dj = *dirobj;
+    FATFS *fs = dj.fs;
+    BYTE *dptr;
+    UINT i, k, n;
+    WORD wc;
+    char *p;
+
+
+    n = fs->dirbuf[XDIR_NumName];            /* Load the name into LfnBuf[] */
+    i = 0;
+    if (next_dir_entry(&dj)) {
+        while (i < n && next_dir_entry(&dj) && move_window(fs, dj.sect)) {
+            dptr = &fs->win[(dj.index & ((S_SIZ - 1) / 32)) * 32];
+            if (dptr[XDIR_Type] != 0xC1) break;
+            for (k = 0; k < 15 && i < n; k++) LfnBuf[i++] = LD_WORD(&dptr[2 + k * 2]);
+        }
+    }
+    LfnBuf[i] = 0;
+
+    p = &finfo->fname[0];                    /* There is no 8.3 name, give the name if it fits */
+    if (i == n && n <= 8+1+3) {
+        for (k = 0; k < n; k++) {
+            wc = LfnBuf[k];
+            *p++ = (wc < 0x100) ? (char)wc : '?';
+        }
+    } else {
+        *p++ = '?';
+    }
+    *p = '\0';
+
+    finfo->fattrib = fs->dirbuf[XDIR_Attr];                    /* Attribute */
+    finfo->fsize = LD_QWORD(&fs->dirbuf[XDIR_FileSize]);    /* Size */
+    finfo->fdate = LD_WORD(&fs->dirbuf[XDIR_ModTime + 2]);    /* Date */
+    finfo->ftime = LD_WORD(&fs->dirbuf[XDIR_ModTime]);        /* Time */
+    get_lfninfo(finfo, (BOOL)(i == n));
+}
+#endif
+
+
+#if !_FS_READONLY
+static
+FRESULT update_xdir (    /* FR_OK: successful, FR_RW_ERROR: a disk error occured */
+    DIR *dirobj            /* Sub-directory which has been stretched */
+)
+{
+    DIR dj;
+    DWORD n, clust;
+    QWORD sz;
+    FATFS *fs = dirobj->fs;
+
+
+    n = dirobj->n_cont;
+    if (!n) {                                /* Count the clusters in the FAT chain */
+        for (clust = dirobj->sclust; clust >= 2 && clust < fs->max_clust; clust = get_cluster(fs, clust)) n++;
+        if (clust == 1) return FR_RW_ERROR;
+    }
+    sz = (QWORD)n * fs->sects_clust * S_SIZ;
+
+    dj.fs = fs;                                /* Reflect the new size to the entry set */
+    dj.sclust = dirobj->c_sclust;
+    dj.n_cont = dirobj->c_ncont;
+    if (!dir_seek(&dj, dirobj->c_index) || !load_xset(&dj)) return FR_RW_ERROR;
+    fs->dirbuf[XDIR_GenFlags] = dirobj->n_cont ? 0x03 : 0x01;
+    ST_QWORD(&fs->dirbuf[XDIR_ValidFileSize], sz);
+    ST_QWORD(&fs->dirbuf[XDIR_FileSize], sz);
+    return store_xset(&dj);
+}
+#endif
+#endif /* _FS_EXFAT */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Pick a paragraph and create the name, with LFN if needed              */
+/*-----------------------------------------------------------------------*/
+
+static
+char create_name (            /* 1: error - detected an invalid format, '\0'or'/': next character */
+    const char **path,        /* Pointer to the file path pointer */
+    char *dirname            /* Pointer to directory name buffer {Name(8), Ext(3), NT flag(1), NS flag(1)} */
+)
+{
+#if _USE_LFN
+    const char *p = *path;
+    char ds;
+    BYTE c, t;
+    UINT si, di, ext, i;
+
+
+    ds = make_dirfile(path, dirname);    /* Try an 8.3 name first */
+
+    for (di = 0; ; di++) {                /* Store the paragraph into LfnBuf[] */
+        c = (BYTE)p[di];
+        if (c == '\0' || c == '/') break;
+        if (ds == 1 && (c < ' ' || c == 0x7F || strchr("\"*:<>?|\\", c)))
+            return 1;                    /* Reject chars illegal in LFN */
+        if (di >= _MAX_LFN) return 1;
+        LfnBuf[di] = c;
+    }
+    t = c;
+    *path = &p[di + 1];
+    while (di && (LfnBuf[di - 1] == ' ' || LfnBuf[di - 1] == '.')) di--;    /* Strip trailing spaces and dots */
+    if (!di) return 1;
+    LfnBuf[di] = 0;
+    LfnLen = (WORD)di;
+    if (ds != 1) return ds;                /* It is a valid 8.3 name */
+
+    /* Create the SFN basis from the long name */
+    memset(dirname, ' ', 8+3);
+    for (si = 0; LfnBuf[si] == ' ' || LfnBuf[si] == '.'; si++) ;    /* Skip leading spaces and dots */
+    for (ext = di; ext > si && LfnBuf[ext - 1] != '.'; ext--) ;        /* Find the last dot */
+    if (ext <= si) ext = di + 1;        /* No extension */
+    for (i = 0; si < ext - 1 && i < 8; si++) {
+        c = (BYTE)LfnBuf[si];
+        if (c == ' ' || c == '.') continue;
+        if (c >= 0x80 || strchr("+,;=[]", c)) c = '_';
+        if (c >= 'a' && c <= 'z') c -= 0x20;
+        dirname[i++] = c;
+    }
+    for (i = 8; ext < di && i < 11; ext++) {
+        c = (BYTE)LfnBuf[ext];
+        if (c == ' ' || c == '.') continue;
+        if (c >= 0x80 || strchr("+,;=[]", c)) c = '_';
+        if (c >= 'a' && c <= 'z') c -= 0x20;
+        dirname[i++] = c;
+    }
+    if (dirname[0] == ' ') dirname[0] = '_';
+    dirname[11] = 0;
+    dirname[12] = NS_LFN | NS_TAIL;
+    return t;
+#else
+    return make_dirfile(path, dirname);
+#endif
 }
 
 
 
 
+
 /*-----------------------------------------------------------------------*/
 /* Trace a file path                                                     */
 /*-----------------------------------------------------------------------*/
@@ -481,7 +1991,7 @@ char make_dirfile (            /* 1: error - detected an invalid format, '\0'or'
 static
 FRESULT trace_path (    /* FR_OK(0): successful, !=0: error code */
     DIR *dirobj,        /* Pointer to directory object to return last directory */
-    char *fn,            /* Pointer to last segment name to return {file(8),ext(3),attr(1)} */
+    char *fn,            /* Pointer to last segment name to return {file(8),ext(3),attr(1),NS flag(1)} */
     const char *path,    /* Full-path string to trace a file or directory */
     BYTE **dir            /* Directory pointer in Win[] to retutn */
 )
@@ -489,12 +1999,18 @@ FRESULT trace_path (    /* FR_OK(0): successful, !=0: error code */
     DWORD clust;
     char ds;
     BYTE *dptr = NULL;
+#if _USE_LFN
+    BYTE c, a, ord, sum, mt;
+#endif
+#if _FS_EXFAT
+    FRESULT res;
+#endif
     FATFS *fs = dirobj->fs;    /* Get logical drive from the given DIR structure */
 
 
     /* Initialize directory object */
     clust = fs->dirbase;
-    if (fs->fs_type == FS_FAT32) {
+    if (FSTYPE(fs) >= FS_FAT32) {        /* FAT32/exFAT: the root directory is a cluster chain */
         dirobj->clust = dirobj->sclust = clust;
         dirobj->sect = clust2sect(fs, clust);
     } else {
@@ -502,22 +2018,70 @@ FRESULT trace_path (    /* FR_OK(0): successful, !=0: error code */
         dirobj->sect = clust;
     }
     dirobj->index = 0;
+#if _FS_EXFAT
+    dirobj->n_cont = 0;
+#endif
 
     if (*path == '\0') {                    /* Null path means the root directory */
         *dir = NULL; return FR_OK;
     }
 
     for (;;) {
-        ds = make_dirfile(&path, fn);            /* Get a paragraph into fn[] */
+        ds = create_name(&path, fn);            /* Get a paragraph into fn[] */
         if (ds == 1) return FR_INVALID_NAME;
+#if _FS_EXFAT
+        if (FSTYPE(fs) == FS_EXFAT) {            /* exFAT: find the entry set by the name in LfnBuf[] */
+            res = find_xentry(dirobj);
+            if (res != FR_OK) return (res == FR_NO_FILE && ds) ? FR_NO_PATH : res;
+            dptr = fs->dirbuf;
+            if (!ds) { *dir = dptr; return FR_OK; }                /* Matched with end of path */
+            if (!(dptr[XDIR_Attr] & AM_DIR)) return FR_NO_PATH;    /* Cannot trace because it is a file */
+            enter_xdir(dirobj);                                    /* Restart scanning at the new directory */
+            continue;
+        }
+#endif
+#if _USE_LFN
+        ord = sum = 0xFF; mt = 0;
+        dirobj->lfn_idx = 0xFFFF;
+#endif
         for (;;) {
             if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
             dptr = &fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32];    /* Pointer to the directory entry */
             if (dptr[DIR_Name] == 0)                        /* Has it reached to end of dir? */
                 return !ds ? FR_NO_FILE : FR_NO_PATH;
+#if _USE_LFN
+            c = dptr[DIR_Name]; a = dptr[DIR_Attr];
+            if (c == 0xE5) {                                /* A deleted entry breaks the LFN sequence */
+                ord = 0xFF;
+            } else if (a == AM_LFN) {                        /* An LFN entry */
+                if (c & 0x40) {                                /* Top of an LFN sequence */
+                    sum = dptr[LDIR_Chksum];
+                    c &= 0x3F; ord = c;
+                    dirobj->lfn_idx = dirobj->index;
+                    mt = ((WORD)(c - 1) * 13 < LfnLen && LfnLen <= (WORD)c * 13);    /* Quick reject by the length */
+                }
+                if (c == ord && sum == dptr[LDIR_Chksum]) {    /* Check the sequence, then compare in place */
+                    if (mt) mt = cmp_lfn(dptr);
+                    ord--;
+                } else {
+                    ord = 0xFF;
+                }
+            } else {                                        /* An SFN entry */
+                if (ord || sum != sum_sfn(dptr)) {            /* Is it tied to the preceding LFN? */
+                    dirobj->lfn_idx = 0xFFFF; mt = 0;
+                }
+                if (!(a & AM_VOL)) {
+                    if (mt) break;                            /* Matched with the LFN */
+                    if (!(fn[12] & NS_TAIL) && !memcmp(&dptr[DIR_Name], fn, 8+3)) break;    /* Matched with the SFN */
+                }
+                ord = 0xFF; mt = 0;
+                dirobj->lfn_idx = 0xFFFF;
+            }
+#else
             if (dptr[DIR_Name] != 0xE5                        /* Matched? */
                 && !(dptr[DIR_Attr] & AM_VOL)
                 && !memcmp(&dptr[DIR_Name], fn, 8+3) ) break;
+#endif
             if (!next_dir_entry(dirobj))                    /* Next directory pointer */
                 return !ds ? FR_NO_FILE : FR_NO_PATH;
         }
@@ -541,14 +2105,43 @@ FRESULT trace_path (    /* FR_OK(0): successful, !=0: error code */
 static
 FRESULT reserve_direntry (    /* FR_OK: successful, FR_DENIED: no free entry, FR_RW_ERROR: a disk error occured */
     DIR *dirobj,            /* Target directory to create new entry */
+    char *fn,                /* SFN of the new entry, a numbered tail is filled in if needed */
     BYTE **dir                /* Pointer to pointer to created entry to retutn */
 )
 {
     DWORD clust, sector;
-    BYTE c, n, *dptr;
+    WORD need, run, idx, end, epc;
+    BYTE c, *dptr;
+    WORD n;
     FATFS *fs = dirobj->fs;
+#if _USE_LFN
+    WORD used, hash;
+    BYTE t, ord, sum;
+#endif
+#if _FS_EXFAT
+    BYTE grown = 0;
+    UINT i, k;
+#endif
 
 
+    need = 1;                    /* Number of entries to be allocated */
+#if _USE_LFN
+#if _FS_EXFAT
+    if (FSTYPE(fs) == FS_EXFAT) {    /* exFAT: file, stream extension and name entries, no SFN */
+        need = 2 + (LfnLen + 14) / 15;
+        fn[12] = 0;
+    }
+#endif
+    if (fn[12] & NS_LFN) need += (LfnLen + 12) / 13;
+    hash = (fn[12] & NS_TAIL) ? hash_lfn(0) : 0;
+    t = 0;
+  rd_retry:
+    if (fn[12] & NS_TAIL) t = gen_numname(fn, hash, '1');
+    used = 0;
+#else
+    (void)fn;                    /* The SFN is used as is */
+#endif
+
     /* Re-initialize directory object */
     clust = dirobj->sclust;
     if (clust) {    /* Dyanmic directory table */
@@ -559,31 +2152,184 @@ FRESULT reserve_direntry (    /* FR_OK: successful, FR_DENIED: no free entry, FR
     }
     dirobj->index = 0;
 
-    do {
+    /* Find a run of free entries and collect the used tails in a single pass */
+    run = 0; idx = 0;
+    epc = (S_SIZ / 32) * fs->sects_clust;
+    for (;;) {
         if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
         dptr = &fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32];    /* Pointer to the directory entry */
         c = dptr[DIR_Name];
-        if (c == 0 || c == 0xE5) {            /* Found an empty entry! */
-            *dir = dptr; return FR_OK;
+#if _FS_EXFAT
+        if (FSTYPE(fs) == FS_EXFAT && c && !(c & 0x80)) c = 0xE5;    /* exFAT: an entry not in use */
+#endif
+        if (c == 0) {                        /* End of the directory, following entries are all free */
+            if (run < need) {
+                if (!run) idx = dirobj->index;
+                end = clust ? (dirobj->index / epc + 1) * epc : fs->n_rootdir;
+                run = end - idx;
+            }
+            break;
+        }
+        if (c == 0xE5) {                    /* A free entry */
+            if (run < need) {
+                if (!run) idx = dirobj->index;
+                run++;
+#if _USE_LFN
+                if (run >= need && !(fn[12] & NS_TAIL)) break;    /* Found, no collision check needed */
+#else
+                if (run >= need) break;
+#endif
+            }
+        } else {
+            if (run < need) run = 0;
+#if _USE_LFN
+            if ((fn[12] & NS_TAIL) && dptr[DIR_Attr] != AM_LFN    /* Record the tail if the SFN is of the same hash */
+                && !memcmp(dptr, fn, t) && dptr[t] == '~'
+                && dptr[t + 1] >= '1' && dptr[t + 1] <= '9'
+                && !memcmp(&dptr[8], &fn[8], 3))
+                used |= 1 << (dptr[t + 1] - '0');
+#endif
+        }
+        if (!next_dir_entry(dirobj)) {        /* Reached to end of the directory table */
+            if (!run) idx = dirobj->index + 1;
+            break;
         }
-    } while (next_dir_entry(dirobj));                /* Next directory pointer */
-    /* Reached to end of the directory table */
+    }
+
+#if _USE_LFN
+    if (fn[12] & NS_TAIL) {                    /* Take the lowest free tail number */
+        for (n = 1; n <= 9 && (used & (1 << n)); n++) ;
+        if (n > 9) {                        /* All tails of this hash are in use, try another hash */
+            hash++;
+            goto rd_retry;
+        }
+        gen_numname(fn, hash, '0' + n);
+    }
+#endif
 
-    /* Abort when static table or could not stretch dynamic table */
-    if (!clust || !(clust = create_chain(fs, dirobj->clust))) return FR_DENIED;
-    if (clust == 1 || !move_window(fs, 0)) return FR_RW_ERROR;
+    /* Stretch the dynamic table if the free run reaches its end */
+    while (run < need) {
+        if (!clust) return FR_DENIED;                            /* Static table cannot be stretched */
+#if _FS_EXFAT
+        if (FSTYPE(fs) == FS_EXFAT) {
+            clust = create_xchain(fs, dirobj->sclust, dirobj->clust, &dirobj->n_cont);
+            grown = 1;
+        } else
+#endif
+        clust = create_chain(fs, dirobj->clust);
+        if (!clust) return FR_DENIED;
+        if (clust == 1 || !move_window(fs, 0)) return FR_RW_ERROR;
 
-    fs->winsect = sector = clust2sect(fs, clust);        /* Cleanup the expanded table */
-    memset(fs->win, 0, S_SIZ);
-    for (n = fs->sects_clust; n; n--) {
-        if (disk_write(fs->drive, fs->win, sector, 1) != RES_OK)
-            return FR_RW_ERROR;
-        sector++;
+        fs->winsect = sector = clust2sect(fs, clust);        /* Cleanup the expanded table */
+#if _FS_BLOCK > 1
+        if (!drop_wblock(fs, sector, fs->sects_clust)) return FR_RW_ERROR;
+#endif
+        memset(fs->win, 0, S_SIZ);
+        for (n = fs->sects_clust; n; n--) {
+            if (disk_write(fs->drive, fs->win, sector, 1) != RES_OK)
+                return FR_RW_ERROR;
+            sector++;
+        }
+        dirobj->clust = clust;
+        run += epc;
+    }
+
+#if _FS_EXFAT
+    if (grown && dirobj->sclust != fs->dirbase) {    /* Reflect the new size of the sub-directory */
+        if (update_xdir(dirobj) != FR_OK) return FR_RW_ERROR;
+    }
+#endif
+
+    /* Write the LFN entries and return the SFN entry */
+    if (!dir_seek(dirobj, idx)) return FR_RW_ERROR;
+#if _FS_EXFAT
+    if (FSTYPE(fs) == FS_EXFAT) {        /* Write the name entries and return the entry set in dirbuf[] */
+        memset(fs->dirbuf, 0, 64);
+        fs->dirbuf[XDIR_Type] = 0x85;
+        fs->dirbuf[XDIR_NumSec] = (BYTE)(need - 1);
+        fs->dirbuf[32] = 0xC0;
+        fs->dirbuf[XDIR_GenFlags] = 0x01;
+        fs->dirbuf[XDIR_NumName] = (BYTE)LfnLen;
+        ST_WORD(&fs->dirbuf[XDIR_NameHash], xname_hash());
+        for (i = 0, n = 0; n < need; n++) {
+            if (n >= 2) {
+                if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
+                dptr = &fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32];
+                memset(dptr, 0, 32);
+                dptr[XDIR_Type] = 0xC1;
+                for (k = 0; k < 15 && i < LfnLen; k++) ST_WORD(&dptr[2 + k * 2], LfnBuf[i++]);
+                fs->winflag = 1;
+            }
+            if (n + 1 < need && !next_dir_entry(dirobj)) return FR_RW_ERROR;
+        }
+        if (!dir_seek(dirobj, idx)) return FR_RW_ERROR;
+        *dir = fs->dirbuf;
+        return FR_OK;
+    }
+#endif
+#if _USE_LFN
+    sum = sum_sfn((BYTE*)fn);
+    for (ord = (BYTE)(need - 1); ord; ord--) {
+        if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
+        fit_lfn(&fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32], ord, sum);
+        fs->winflag = 1;
+        if (!next_dir_entry(dirobj)) return FR_RW_ERROR;
+    }
+#endif
+    if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
+    *dir = &fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32];
+    return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Remove a directory entry and its LFN entries                          */
+/*-----------------------------------------------------------------------*/
+
+#if _FS_MINIMIZE == 0
+static
+FRESULT remove_direntry (    /* FR_OK: successful, FR_RW_ERROR: a disk error occured */
+    DIR *dirobj                /* Directory object pointing the SFN entry found by trace_path() */
+)
+{
+    WORD idx = dirobj->index;
+    FATFS *fs = dirobj->fs;
+#if _FS_EXFAT
+    BYTE *dptr;
+    UINT n;
+
+
+    if (FSTYPE(fs) == FS_EXFAT) {        /* exFAT: clear the InUse bit of all entries in the set */
+        for (n = 0; ; ) {
+            if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
+            dptr = &fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32];
+            if (!n) n = dptr[XDIR_NumSec] + 1;
+            dptr[XDIR_Type] &= 0x7F;
+            fs->winflag = 1;
+            if (!--n) break;
+            if (!next_dir_entry(dirobj)) return FR_RW_ERROR;
+        }
+        return FR_OK;
+    }
+#endif
+
+
+#if _USE_LFN
+    if (dirobj->lfn_idx != 0xFFFF && !dir_seek(dirobj, dirobj->lfn_idx))
+        return FR_RW_ERROR;
+#endif
+    for (;;) {                /* Mark the entries 'deleted' up to the SFN entry */
+        if (!move_window(fs, dirobj->sect)) return FR_RW_ERROR;
+        fs->win[(dirobj->index & ((S_SIZ - 1) / 32)) * 32] = 0xE5;
+        fs->winflag = 1;
+        if (dirobj->index >= idx) break;
+        if (!next_dir_entry(dirobj)) return FR_RW_ERROR;
     }
-    fs->winflag = 1;
-    *dir = fs->win;
     return FR_OK;
 }
+#endif /* _FS_MINIMIZE == 0 */
 #endif /* !_FS_READONLY */
 
 
@@ -594,7 +2340,7 @@ FRESULT reserve_direntry (    /* FR_OK: successful, FR_DENIED: no free entry, FR
 /*-----------------------------------------------------------------------*/
 
 static
-BYTE check_fs (        /* 0:The FAT boot record, 1:Valid boot record but not an FAT, 2:Not a boot record or error */
+BYTE check_fs (        /* 0:The FAT boot record, 1:Valid boot record but not an FAT, 2:Not a boot record or error, 3:exFAT boot record */
     FATFS *fs,        /* File system object */
     DWORD sect        /* Sector# (lba) to check if it is a FAT boot record or not */
 )
@@ -608,6 +2354,10 @@ BYTE check_fs (        /* 0:The FAT boot record, 1:Valid boot record but not an
         return 0;
     if (!memcmp(&fs->win[BS_FilSysType32], "FAT32", 5) && !(fs->win[BPB_ExtFlags] & 0x80))
         return 0;
+#if _FS_EXFAT
+    if (!memcmp(&fs->win[BS_OEMName], "EXFAT   ", 8))            /* Check exFAT signature */
+        return 3;
+#endif
 
     return 1;
 }
@@ -615,6 +2365,164 @@ BYTE check_fs (        /* 0:The FAT boot record, 1:Valid boot record but not an
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Get allocation unit geometry of the volume                            */
+/*-----------------------------------------------------------------------*/
+
+#if !_FS_READONLY && _USE_AU_ALIGN
+static
+void set_au (
+    FATFS *fs        /* File system object (mounted) */
+)
+{
+    DWORD au, bs;
+
+
+    fs->au_clust = 0;
+    if (disk_ioctl(fs->drive, GET_AU_SIZE, &au) != RES_OK
+        && disk_ioctl(fs->drive, GET_BLOCK_SIZE, &au) != RES_OK) return;
+    if (!au || au % fs->sects_clust) return;    /* AU must be a multiple of the cluster */
+    bs = fs->database + (au - fs->database % au) % au;    /* First AU boundary in the data area */
+    if ((bs - fs->database) % fs->sects_clust) return;    /* Clusters are not aligned to the AU */
+    if (au / fs->sects_clust < 2) return;        /* Cluster size is the AU already */
+    fs->au_clust = au / fs->sects_clust;
+    fs->au_ofs = (bs - fs->database) / fs->sects_clust + 2;
+    fs->au_next = 0;
+    au_rescan(fs, fs->au_ofs);
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Volume geometry cache                                                 */
+/*-----------------------------------------------------------------------*/
+
+#if _USE_MNTCACHE
+static
+DWORD boot_vsn (        /* Volume serial number */
+    const FATFS *fs,    /* File system object with the boot sector in win[] */
+    BYTE fmt            /* Result of check_fs() */
+)
+{
+#if _FS_EXFAT
+    if (fmt == 3) return LD_DWORD(&fs->win[BS_VolIDEx]);
+#else
+    (void)fmt;
+#endif
+    return LD_DWORD(&fs->win[LD_WORD(&fs->win[BPB_FATSz16]) ? BS_VolID : BS_VolID32]);
+}
+
+
+static
+BOOL load_mount (        /* TRUE: geometry restored, FALSE: the volume must be mounted from scratch */
+    FATFS *fs,            /* File system object (drive initialized) */
+    BYTE drv            /* Logical drive number */
+)
+{
+    MNTCACHE *mc = &MntCache[drv];
+    BYTE id[32], fmt;
+
+
+    if (disk_ioctl(fs->drive, MMC_GET_CID, id) != RES_OK
+        || disk_ioctl(fs->drive, MMC_GET_CSD, id + 16) != RES_OK) {    /* No card identity, no cache */
+        mc->keyed = 0; mc->fs_type = 0;
+        return FALSE;
+    }
+    if (!mc->keyed || !mc->fs_type || memcmp(mc->id, id, 32)) {    /* Another card */
+        memcpy(mc->id, id, 32);
+        mc->keyed = 1; mc->fs_type = 0;
+        return FALSE;
+    }
+    fmt = check_fs(fs, mc->bootsect);    /* Same card, is it still the same volume? */
+    if ((fmt != 0 && fmt != 3)
+        || (fmt == 3) != (mc->fs_type == FS_EXFAT)
+        || (fmt == 0 && (LD_WORD(&fs->win[BPB_FATSz16]) == 0) != (mc->fs_type == FS_FAT32))
+        || (fmt == 0 && fs->win[BPB_SecPerClus] != mc->sects_clust)
+#if _FS_EXFAT
+        || (fmt == 3 && (1U << fs->win[BPB_SecPerClusEx]) != mc->sects_clust)
+#endif
+        || boot_vsn(fs, fmt) != mc->vsn) {
+        mc->fs_type = 0;
+        return FALSE;
+    }
+
+    fs->sects_fat = mc->sects_fat;
+    fs->max_clust = mc->max_clust;
+    fs->fatbase = mc->fatbase;
+    fs->dirbase = mc->dirbase;
+    fs->database = mc->database;
+#if _FS_EXFAT
+    fs->bitbase = mc->bitbase;
+#endif
+#if !_FS_READONLY
+    fs->free_clust = 0xFFFFFFFF;
+#if _USE_AU_ALIGN
+    fs->au_clust = mc->au_clust;
+    fs->au_ofs = mc->au_ofs;
+    fs->au_next = 0;
+    au_rescan(fs, fs->au_ofs);
+#endif
+#if _USE_FSINFO
+    fs->fsi_sector = mc->fsi_sector;
+    if (mc->fs_type == FS_FAT32) {
+        fs->last_clust = mc->last_clust;
+        fs->free_clust = mc->free_clust;
+    }
+#endif
+#endif
+    fs->n_rootdir = mc->n_rootdir;
+    fs->sects_clust = mc->sects_clust;
+    fs->n_fats = mc->n_fats;
+    fs->fs_type = mc->fs_type;
+    return TRUE;
+}
+
+
+static
+void save_mount (
+    const FATFS *fs,    /* File system object (mounted from the boot sector) */
+    BYTE drv,            /* Logical drive number */
+    DWORD bootsect,        /* Boot sector of the volume */
+    DWORD vsn            /* Volume serial number in it */
+)
+{
+    MNTCACHE *mc = &MntCache[drv];
+
+
+    if (!mc->keyed) return;
+    mc->bootsect = bootsect;
+    mc->vsn = vsn;
+    mc->sects_fat = fs->sects_fat;
+    mc->max_clust = fs->max_clust;
+    mc->fatbase = fs->fatbase;
+    mc->dirbase = fs->dirbase;
+    mc->database = fs->database;
+#if _FS_EXFAT
+    mc->bitbase = fs->bitbase;
+#endif
+#if !_FS_READONLY
+#if _USE_AU_ALIGN
+    mc->au_clust = fs->au_clust;
+    mc->au_ofs = fs->au_ofs;
+#endif
+#if _USE_FSINFO
+    mc->fsi_sector = fs->fsi_sector;
+    mc->last_clust = fs->last_clust;
+    mc->free_clust = fs->free_clust;
+#endif
+#endif
+    mc->n_rootdir = fs->n_rootdir;
+    mc->sects_clust = fs->sects_clust;
+    mc->n_fats = fs->n_fats;
+    mc->fs_type = fs->fs_type;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Make sure that the file system is valid                               */
 /*-----------------------------------------------------------------------*/
@@ -631,6 +2539,13 @@ FRESULT auto_mount (        /* FR_OK(0): successful, !=0: any error occured */
     DWORD bootsect, fatsize, totalsect, maxclust;
     const char *p = *path;
     FATFS *fs;
+#if _FS_EXFAT
+    DWORD sect;
+    UINT i;
+#endif
+#if _USE_MNTCACHE
+    DWORD vsn;
+#endif
 
 
     /* Get drive number from the path name */
@@ -663,6 +2578,9 @@ FRESULT auto_mount (        /* FR_OK(0): successful, !=0: any error occured */
     /* The logical drive has not been mounted, following code attempts to mount the logical drive */
 
     memset(fs, 0, sizeof(FATFS));        /* Clean-up the file system object */
+#if !_FS_READONLY && _USE_ERASE
+    fs->ers_lo = 2; fs->ers_hi = 0xFFFFFFFF;    /* Whether free clusters are erased is not known yet */
+#endif
     fs->drive = LD2PD(drv);                /* Bind the logical drive and a physical drive */
     stat = disk_initialize(fs->drive);    /* Initialize low level disk I/O layer */
     if (stat & STA_NOINIT)                /* Check if the drive is ready */
@@ -674,6 +2592,15 @@ FRESULT auto_mount (        /* FR_OK(0): successful, !=0: any error occured */
 #if !_FS_READONLY
     if (chk_wp && (stat & STA_PROTECT))    /* Check write protection if needed */
         return FR_WRITE_PROTECTED;
+#endif
+#if _USE_MNTCACHE
+    if (load_mount(fs, drv)) {            /* Same volume as last time, skip the rest */
+#if _FS_BLOCK > 1
+        fs->wblk_end = fs->database + (fs->max_clust - 2) * fs->sects_clust;
+#endif
+        fs->id = ++fsid;
+        return FR_OK;
+    }
 #endif
     /* Search FAT partition on the drive */
     fmt = check_fs(fs, bootsect = 0);    /* Check sector 0 as an SFD format */
@@ -685,6 +2612,49 @@ FRESULT auto_mount (        /* FR_OK(0): successful, !=0: any error occured */
             fmt = check_fs(fs, bootsect);            /* Check the partition */
         }
     }
+#if _USE_MNTCACHE
+    vsn = boot_vsn(fs, fmt);            /* Kept to recognize the volume at the next mount */
+#endif
+#if _FS_EXFAT
+    if (fmt == 3) {                        /* An exFAT volume is found */
+        if (fs->win[BPB_FSVerEx + 1] != 1                    /* Only exFAT version 1.x is supported */
+            || (1UL << fs->win[BPB_BytsPerSecEx]) != S_SIZ    /* Sector size must match the media */
+            || fs->win[BPB_BytsPerSecEx] + fs->win[BPB_SecPerClusEx] > 20)    /* Cluster size up to 1MB */
+            return FR_NO_FILESYSTEM;
+        fs->sects_fat = LD_DWORD(&fs->win[BPB_FatSzEx]);        /* Number of sectors per FAT */
+        fs->n_fats = 1;                                            /* Only the first FAT is used */
+        fs->fatbase = bootsect + LD_DWORD(&fs->win[BPB_FatOfsEx]);
+        fs->sects_clust = 1 << fs->win[BPB_SecPerClusEx];
+        fs->max_clust = LD_DWORD(&fs->win[BPB_NumClusEx]) + 2;
+        fs->dirbase = LD_DWORD(&fs->win[BPB_RootClusEx]);        /* Root directory start cluster */
+        fs->database = bootsect + LD_DWORD(&fs->win[BPB_DataOfsEx]);
+        fs->fs_type = FS_EXFAT;
+
+        /* Find the allocation bitmap entry in the root directory */
+        for (sect = 0; ; sect++) {
+            if (sect >= fs->sects_clust || !move_window(fs, clust2sect(fs, fs->dirbase) + sect)) {
+                fs->fs_type = 0; return FR_NO_FILESYSTEM;
+            }
+            for (i = 0; i < S_SIZ && fs->win[i] && fs->win[i] != 0x81; i += 32) ;
+            if (i < S_SIZ && fs->win[i] == 0x81) break;
+        }
+        fs->bitbase = clust2sect(fs, LD_DWORD(&fs->win[i + 20]));    /* Bitmap start sector (lba) */
+#if !_FS_READONLY
+        fs->free_clust = 0xFFFFFFFF;
+#if _USE_AU_ALIGN
+        set_au(fs);
+#endif
+#endif
+#if _FS_BLOCK > 1
+        fs->wblk_end = fs->database + (fs->max_clust - 2) * fs->sects_clust;
+#endif
+#if _USE_MNTCACHE
+        save_mount(fs, drv, bootsect, vsn);
+#endif
+        fs->id = ++fsid;                                    /* File system mount ID */
+        return FR_OK;
+    }
+#endif
     if (fmt || LD_WORD(&fs->win[BPB_BytsPerSec]) != S_SIZ)    /* No valid FAT patition is found */
         return FR_NO_FILESYSTEM;
 
@@ -706,6 +2676,8 @@ FRESULT auto_mount (        /* FR_OK(0): successful, !=0: any error occured */
     fmt = FS_FAT12;                                        /* Determine the FAT sub type */
     if (maxclust > 0xFF7) fmt = FS_FAT16;
     if (maxclust > 0xFFF7) fmt = FS_FAT32;
+    if (!(_FS_FATTYPES & (1 << (fmt - 1))))                /* Is the sub type supported? */
+        return FR_NO_FILESYSTEM;
     fs->fs_type = fmt;
 
     if (fmt == FS_FAT32)
@@ -716,11 +2688,14 @@ FRESULT auto_mount (        /* FR_OK(0): successful, !=0: any error occured */
 
 #if !_FS_READONLY
     fs->free_clust = 0xFFFFFFFF;
+#if _USE_AU_ALIGN
+    set_au(fs);
+#endif
 #if _USE_FSINFO
     /* Load fsinfo sector if needed */
     if (fmt == FS_FAT32) {
         fs->fsi_sector = bootsect + LD_WORD(&fs->win[BPB_FSInfo]);
-        if (disk_read(0, fs->win, fs->fsi_sector, 1) == RES_OK &&
+        if (disk_read(fs->drive, fs->win, fs->fsi_sector, 1) == RES_OK &&
             LD_WORD(&fs->win[BS_55AA]) == 0xAA55 &&
             LD_DWORD(&fs->win[FSI_LeadSig]) == 0x41615252 &&
             LD_DWORD(&fs->win[FSI_StrucSig]) == 0x61417272) {
@@ -729,6 +2704,12 @@ FRESULT auto_mount (        /* FR_OK(0): successful, !=0: any error occured */
         }
     }
 #endif
+#endif
+#if _FS_BLOCK > 1
+    fs->wblk_end = fs->database + (fs->max_clust - 2) * fs->sects_clust;    /* Read by blocks up to the end of data area */
+#endif
+#if _USE_MNTCACHE
+    save_mount(fs, drv, bootsect, vsn);
 #endif
     fs->id = ++fsid;                                    /* File system mount ID */
     return FR_OK;
@@ -758,6 +2739,106 @@ FRESULT validate (        /* FR_OK(0): The object is valid, !=0: Not valid */
 
 
 
+#if _FS_EXFAT
+/*-----------------------------------------------------------------------*/
+/* Open or Create a File on the exFAT volume                             */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT open_xfile (    /* FR_OK(0): successful, !=0: error code */
+    FIL *fp,            /* Pointer to the blank file object */
+    DIR *dirobj,        /* Directory object left by trace_path() */
+    char *fn,            /* Name buffer left by trace_path() */
+    BYTE *dir,            /* Entry set in dirbuf[] (NULL:root) */
+    FRESULT res,        /* Result of trace_path() */
+    BYTE mode            /* Access mode and file open mode flags */
+)
+{
+    FATFS *fs = dirobj->fs;
+#if !_FS_READONLY
+    DWORD tim, cl;
+#endif
+
+
+#if _FS_READONLY
+    (void)fn;                            /* Only used to create a file */
+#else
+    /* Create or Open a file */
+    if (mode & (FA_CREATE_ALWAYS|FA_OPEN_ALWAYS|FA_CREATE_NEW)) {
+        if (res != FR_OK) {        /* No file, create new */
+            if (res != FR_NO_FILE) return res;
+            res = reserve_direntry(dirobj, fn, &dir);    /* The new entry set is initialized in dirbuf[] */
+            if (res != FR_OK) return res;
+            mode |= FA_CREATE_ALWAYS;
+        }
+        else {                    /* Any object is already existing */
+            if (mode & FA_CREATE_NEW)            /* Cannot create new */
+                return FR_EXIST;
+            if (dir == NULL || (dir[XDIR_Attr] & (AM_RDO|AM_DIR)))    /* Cannot overwrite it (R/O or DIR) */
+                return FR_DENIED;
+            if (mode & FA_CREATE_ALWAYS) {        /* Resize it to zero if needed */
+                cl = LD_DWORD(&dir[XDIR_FstClus]);
+                if (cl && !remove_xchain(fs, cl, get_xncont(fs)))    /* Remove the cluster chain */
+                    return FR_RW_ERROR;
+                dir[XDIR_GenFlags] = 0x01;
+                ST_DWORD(&dir[XDIR_FstClus], 0);
+                ST_QWORD(&dir[XDIR_ValidFileSize], 0);
+                ST_QWORD(&dir[XDIR_FileSize], 0);
+                fs->last_clust = cl - 1;        /* Reuse the cluster hole */
+            }
+        }
+        if (mode & FA_CREATE_ALWAYS) {
+            ST_WORD(&dir[XDIR_Attr], AM_ARC);    /* New attribute */
+            tim = get_fattime();
+            ST_DWORD(&dir[XDIR_ModTime], tim);    /* Updated time */
+            ST_DWORD(&dir[XDIR_CrtTime], tim);    /* Created time */
+            res = store_xset(dirobj);
+            if (res != FR_OK) return res;
+        }
+    }
+    /* Open an existing file */
+    else {
+#endif /* !_FS_READONLY */
+        if (res != FR_OK) return res;        /* Trace failed */
+        if (dir == NULL || (dir[XDIR_Attr] & AM_DIR))    /* It is a directory */
+            return FR_NO_FILE;
+#if !_FS_READONLY
+        if ((mode & FA_WRITE) && (dir[XDIR_Attr] & AM_RDO)) /* R/O violation */
+            return FR_DENIED;
+    }
+
+    fp->c_sclust = dirobj->sclust;        /* Location of the entry set */
+    fp->c_ncont = dirobj->n_cont;
+    fp->c_index = dirobj->index;
+#endif
+    fp->flag = mode;                    /* File access mode */
+    fp->org_clust = LD_DWORD(&dir[XDIR_FstClus]);    /* File start cluster */
+    fp->n_cont = get_xncont(fs);        /* Contiguous or FAT chain */
+#if _USE_FASTSEEK
+    fp->cltbl = NULL;                    /* No cluster link map */
+#endif
+    fp->fsize = LD_QWORD(&dir[XDIR_FileSize]);    /* File size */
+    fp->ext_ncl = 0;                    /* No contiguous run cached */
+#if !_FS_READONLY && _USE_WCACHE
+    fp->wc_size = fp->wc_n = 0;            /* No write cache */
+#endif
+#if _FS_BLOCK > 1
+    fp->blk_valid = fp->blk_dirty = 0;    /* Empty block */
+#endif
+#if !_FS_READONLY && _FS_RESERVE
+    fp->rsv = 0;                        /* No cluster reservation */
+#endif
+    fp->fptr = 0;                        /* File ptr */
+    fp->sect_clust = 1;                    /* Sector counter */
+    fp->fs = fs; fp->id = fs->id;        /* Owner file system object of the file */
+
+    return FR_OK;
+}
+#endif /* _FS_EXFAT */
+
+
+
+
 /*--------------------------------------------------------------------------
 
    Public Functions
@@ -783,6 +2864,9 @@ FRESULT f_mount (
     FatFs[drv] = fs;
     if (fsobj) memset(fsobj, 0, sizeof(FATFS));
     if (fs) memset(fs, 0, sizeof(FATFS));
+#if _USE_MNTCACHE
+    if (!fs) MntCache[drv].fs_type = 0;    /* Unmounted, read the boot sector next time */
+#endif
 
     return FR_OK;
 }
@@ -803,10 +2887,13 @@ FRESULT f_open (
     FRESULT res;
     BYTE *dir;
     DIR dirobj;
-    char fn[8+3+1];
+    char fn[8+3+2];
     FATFS *fs;
 
 
+#if !_FS_READONLY && _FS_RESERVE
+    free_rsv(fp);                        /* The object may still hold a slot from an open not closed */
+#endif
     fp->fs = NULL;
 #if !_FS_READONLY
     mode &= (FA_READ|FA_WRITE|FA_CREATE_ALWAYS|FA_OPEN_ALWAYS|FA_CREATE_NEW);
@@ -820,13 +2907,17 @@ FRESULT f_open (
 
     /* Trace the file path */
     res = trace_path(&dirobj, fn, path, &dir);
+#if _FS_EXFAT
+    if (FSTYPE(fs) == FS_EXFAT)
+        return open_xfile(fp, &dirobj, fn, dir, res, mode);
+#endif
 #if !_FS_READONLY
     /* Create or Open a file */
     if (mode & (FA_CREATE_ALWAYS|FA_OPEN_ALWAYS|FA_CREATE_NEW)) {
         DWORD ps, rs;
         if (res != FR_OK) {        /* No file, create new */
             if (res != FR_NO_FILE) return res;
-            res = reserve_direntry(&dirobj, &dir);
+            res = reserve_direntry(&dirobj, fn, &dir);
             if (res != FR_OK) return res;
             memset(dir, 0, 32);                        /* Initialize the new entry with open name */
             memcpy(&dir[DIR_Name], fn, 8+3);
@@ -876,6 +2967,22 @@ FRESULT f_open (
     fp->org_clust =                        /* File start cluster */
         ((DWORD)LD_WORD(&dir[DIR_FstClusHI]) << 16) | LD_WORD(&dir[DIR_FstClusLO]);
     fp->fsize = LD_DWORD(&dir[DIR_FileSize]);    /* File size */
+#if _FS_EXFAT
+    fp->n_cont = 0;                        /* Always in the FAT */
+#endif
+#if _USE_FASTSEEK
+    fp->cltbl = NULL;                    /* No cluster link map */
+#endif
+    fp->ext_ncl = 0;                    /* No contiguous run cached */
+#if !_FS_READONLY && _USE_WCACHE
+    fp->wc_size = fp->wc_n = 0;            /* No write cache */
+#endif
+#if _FS_BLOCK > 1
+    fp->blk_valid = fp->blk_dirty = 0;    /* Empty block */
+#endif
+#if !_FS_READONLY && _FS_RESERVE
+    fp->rsv = 0;                        /* No cluster reservation */
+#endif
     fp->fptr = 0;                        /* File ptr */
     fp->sect_clust = 1;                    /* Sector counter */
     fp->fs = fs; fp->id = fs->id;        /* Owner file system object of the file */
@@ -897,7 +3004,8 @@ FRESULT f_read (
     WORD *br        /* Pointer to number of bytes read */
 )
 {
-    DWORD clust, sect, remain;
+    DWORD clust, sect, ncl;
+    FSIZE_t remain;
     WORD rcnt;
     BYTE cc, *rbuff = buff;
     FRESULT res;
@@ -919,7 +3027,7 @@ FRESULT f_read (
                 sect = fp->curr_sect + 1;            /* Get current sector */
             } else {                                /* On the cluster boundary, get next cluster */
                 clust = (fp->fptr == 0) ?
-                    fp->org_clust : get_cluster(fs, fp->curr_clust);
+                    fp->org_clust : get_fcluster(fp, fp->curr_clust);
                 if (clust < 2 || clust >= fs->max_clust)
                     goto fr_error;
                 fp->curr_clust = clust;                /* Current cluster */
@@ -927,28 +3035,35 @@ FRESULT f_read (
                 fp->sect_clust = fs->sects_clust;    /* Re-initialize the left sector counter */
             }
 #if !_FS_READONLY
-            if (fp->flag & FA__DIRTY) {                /* Flush file I/O buffer if needed */
-                if (disk_write(fs->drive, fp->buffer, fp->curr_sect, 1) != RES_OK)
-                    goto fr_error;
-                fp->flag &= ~FA__DIRTY;
-            }
+            if (!sync_fbuf(fp))                        /* Flush file I/O buffer if needed */
+                goto fr_error;
 #endif
             fp->curr_sect = sect;                    /* Update current sector */
             cc = btr / S_SIZ;                        /* When left bytes >= S_SIZ, */
             if (cc) {                                /* Read maximum contiguous sectors directly */
-                if (cc > fp->sect_clust) cc = fp->sect_clust;
+                if (cc > fp->sect_clust) {            /* Span the clusters that follow contiguously */
+                    ncl = get_frun(fp, fp->curr_clust, (cc - fp->sect_clust + fs->sects_clust - 1) / fs->sects_clust, 0);
+                    if (ncl == 0xFFFFFFFF) goto fr_error;
+                    if (cc > fp->sect_clust + ncl * fs->sects_clust) cc = (BYTE)(fp->sect_clust + ncl * fs->sects_clust);
+                }
+#if _FS_BLOCK > 1
+                if (!drop_fblock(fp, sect, cc))
+                    goto fr_error;
+#endif
                 if (disk_read(fs->drive, rbuff, sect, cc) != RES_OK)
                     goto fr_error;
-                fp->sect_clust -= cc - 1;
+                ncl = (cc > fp->sect_clust) ? (cc - fp->sect_clust + fs->sects_clust - 1) / fs->sects_clust : 0;
+                fp->curr_clust += ncl;                /* Clusters passed */
+                fp->sect_clust += ncl * fs->sects_clust - (cc - 1);
                 fp->curr_sect += cc - 1;
                 rcnt = cc * S_SIZ; continue;
             }
-            if (disk_read(fs->drive, fp->buffer, sect, 1) != RES_OK)    /* Load the sector into file I/O buffer */
+            if (!load_fsect(fp, sect, TRUE))        /* Load the sector into file I/O buffer */
                 goto fr_error;
         }
         rcnt = S_SIZ - ((WORD)fp->fptr & (S_SIZ - 1));                /* Copy fractional bytes from file I/O buffer */
         if (rcnt > btr) rcnt = btr;
-        memcpy(rbuff, &fp->buffer[fp->fptr & (S_SIZ - 1)], rcnt);
+        memcpy(rbuff, &FBUF(fp)[fp->fptr & (S_SIZ - 1)], rcnt);
     }
 
     return FR_OK;
@@ -961,6 +3076,100 @@ fr_error:    /* Abort this file due to an unrecoverable error */
 
 
 
+#if _USE_FORWARD
+/*-----------------------------------------------------------------------*/
+/* Forward data to the stream directly                                   */
+/*-----------------------------------------------------------------------*/
+/* Each sector is read into the file I/O buffer (by DMA in the driver)   */
+/* and func() gets a pointer into it, so the data is never copied.       */
+/* With _FS_BLOCK > 1 func() gets the run of valid sectors of the block  */
+/* up to the cluster boundary at once, not one sector at a time.         */
+/* func(0, 0) returns non-zero while the stream can take more data.      */
+
+FRESULT f_forward (
+    FIL *fp,                        /* Pointer to the file object */
+    UINT (*func)(const BYTE*, UINT),    /* Pointer to the streaming function */
+    UINT btf,                        /* Number of bytes to forward */
+    UINT *bf                        /* Pointer to number of bytes forwarded */
+)
+{
+    DWORD clust, sect, o_clust, o_sect;
+    WORD o_left;
+    FSIZE_t remain;
+    UINT rcnt;
+#if _FS_BLOCK > 1
+    BYTE i, n;
+#endif
+    FRESULT res;
+    FATFS *fs = fp->fs;
+
+
+    *bf = 0;
+    res = validate(fs, fp->id);                        /* Check validity of the object */
+    if (res) return res;
+    if (fp->flag & FA__ERROR) return FR_RW_ERROR;    /* Check error flag */
+    if (!(fp->flag & FA_READ)) return FR_DENIED;    /* Check access mode */
+    remain = fp->fsize - fp->fptr;
+    if (btf > remain) btf = (UINT)remain;            /* Truncate forward count by number of bytes left */
+
+    for ( ;  btf && (*func)(0, 0);                    /* Repeat until all data forwarded or stream goes busy */
+        fp->fptr += rcnt, *bf += rcnt, btf -= rcnt) {
+        o_clust = fp->curr_clust;                    /* Position to return to if the stream takes nothing */
+        o_sect = fp->curr_sect;
+        o_left = fp->sect_clust;
+        if ((fp->fptr & (S_SIZ - 1)) == 0) {        /* On the sector boundary */
+            if (--fp->sect_clust) {                    /* Decrement left sector counter */
+                sect = fp->curr_sect + 1;            /* Get current sector */
+            } else {                                /* On the cluster boundary, get next cluster */
+                clust = (fp->fptr == 0) ?
+                    fp->org_clust : get_fcluster(fp, fp->curr_clust);
+                if (clust < 2 || clust >= fs->max_clust)
+                    goto ff_error;
+                fp->curr_clust = clust;                /* Current cluster */
+                sect = clust2sect(fs, clust);        /* Get current sector */
+                fp->sect_clust = fs->sects_clust;    /* Re-initialize the left sector counter */
+            }
+#if !_FS_READONLY
+            if (!sync_fbuf(fp))                        /* Flush file I/O buffer if needed */
+                goto ff_error;
+#endif
+            fp->curr_sect = sect;                    /* Update current sector */
+            if (!load_fsect(fp, sect, TRUE))        /* Load the sector into file I/O buffer */
+                goto ff_error;
+        }
+#if _FS_BLOCK > 1
+        i = (BYTE)(fp->curr_sect - fp->blk_sect);    /* Count the valid sectors from here in the block and cluster */
+        for (n = 1; i + n < _FS_BLOCK && n < fp->sect_clust && (fp->blk_valid & (1 << (i + n))); n++) ;
+        rcnt = n * S_SIZ - ((UINT)fp->fptr & (S_SIZ - 1));            /* Forward data from file I/O buffer */
+#else
+        rcnt = S_SIZ - ((UINT)fp->fptr & (S_SIZ - 1));                /* Forward data from file I/O buffer */
+#endif
+        if (rcnt > btf) rcnt = btf;
+        rcnt = (*func)(&FBUF(fp)[fp->fptr & (S_SIZ - 1)], rcnt);
+        if (!rcnt) {                                /* Stream took nothing, fptr has not moved */
+            fp->curr_clust = o_clust;                /* Undo the move to the next sector */
+            fp->curr_sect = o_sect;
+            fp->sect_clust = o_left;
+            break;
+        }
+#if _FS_BLOCK > 1
+        n = (BYTE)((((UINT)fp->fptr & (S_SIZ - 1)) + rcnt - 1) / S_SIZ);    /* Sector boundaries passed */
+        fp->curr_sect += n;                            /* Make the last sector taken from current */
+        fp->sect_clust -= n;
+#endif
+    }
+
+    return FR_OK;
+
+ff_error:    /* Abort this file due to an unrecoverable error */
+    fp->flag |= FA__ERROR;
+    return FR_RW_ERROR;
+}
+#endif /* _USE_FORWARD */
+
+
+
+
 #if !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Write File                                                            */
@@ -973,7 +3182,7 @@ FRESULT f_write (
     WORD *bw            /* Pointer to number of bytes written */
 )
 {
-    DWORD clust, sect;
+    DWORD clust, sect, ncl;
     WORD wcnt;
     BYTE cc;
     FRESULT res;
@@ -986,7 +3195,11 @@ FRESULT f_write (
     if (res) return res;
     if (fp->flag & FA__ERROR) return FR_RW_ERROR;    /* Check error flag */
     if (!(fp->flag & FA_WRITE)) return FR_DENIED;    /* Check access mode */
-    if (fp->fsize + btw < fp->fsize) return FR_OK;    /* File size cannot reach 4GB */
+#if _FS_EXFAT
+    if (FSTYPE(fs) != FS_EXFAT)
+#endif
+    if ((DWORD)fp->fsize + btw < (DWORD)fp->fsize) return FR_OK;    /* File size cannot reach 4GB */
+    TRACE_B(TR_F_WRITE, btw);
 
     for ( ;  btw;                                    /* Repeat until all data transferred */
         wbuff += wcnt, fp->fptr += wcnt, *bw += wcnt, btw -= wcnt) {
@@ -996,10 +3209,15 @@ FRESULT f_write (
             } else {                                /* On the cluster boundary, get next cluster */
                 if (fp->fptr == 0) {                /* Is top of the file */
                     clust = fp->org_clust;
-                    if (clust == 0)                    /* No cluster is created yet */
-                        fp->org_clust = clust = create_chain(fs, 0);    /* Create a new cluster chain */
+                    if (clust == 0) {                /* No cluster is created yet */
+#if _USE_AU_ALIGN
+                        if (btw >= (UINT)S_SIZ * fs->sects_clust    /* Start a large file on a free AU */
+                            && !seek_free_au(fs)) goto fw_error;
+#endif
+                        fp->org_clust = clust = create_fchain(fp, 0);    /* Create a new cluster chain */
+                    }
                 } else {                            /* Middle or end of file */
-                    clust = create_chain(fs, fp->curr_clust);            /* Trace or streach cluster chain */
+                    clust = create_fchain(fp, fp->curr_clust);            /* Trace or streach cluster chain */
                 }
                 if (clust == 0) break;                /* Disk full */
                 if (clust == 1 || clust >= fs->max_clust) goto fw_error;
@@ -1007,37 +3225,45 @@ FRESULT f_write (
                 sect = clust2sect(fs, clust);        /* Get current sector */
                 fp->sect_clust = fs->sects_clust;    /* Re-initialize the left sector counter */
             }
-            if (fp->flag & FA__DIRTY) {                /* Flush file I/O buffer if needed */
-                if (disk_write(fs->drive, fp->buffer, fp->curr_sect, 1) != RES_OK)
-                    goto fw_error;
-                fp->flag &= ~FA__DIRTY;
-            }
+            if ((fp->flag & FA__DIRTY) && !put_fbuf(fp))    /* Flush file I/O buffer if needed */
+                goto fw_error;
             fp->curr_sect = sect;                    /* Update current sector */
             cc = btw / S_SIZ;                        /* When left bytes >= S_SIZ, */
             if (cc) {                                /* Write maximum contiguous sectors directly */
-                if (cc > fp->sect_clust) cc = fp->sect_clust;
+                if (cc > fp->sect_clust) {            /* Span the clusters that follow (or are added) contiguously */
+                    ncl = get_frun(fp, fp->curr_clust, (cc - fp->sect_clust + fs->sects_clust - 1) / fs->sects_clust, 1);
+                    if (ncl == 0xFFFFFFFF) goto fw_error;
+                    if (cc > fp->sect_clust + ncl * fs->sects_clust) cc = (BYTE)(fp->sect_clust + ncl * fs->sects_clust);
+                }
+#if _FS_BLOCK > 1
+                if (!drop_fblock(fp, sect, cc))
+                    goto fw_error;
+#endif
                 if (disk_write(fs->drive, wbuff, sect, cc) != RES_OK)
                     goto fw_error;
-                fp->sect_clust -= cc - 1;
+                ncl = (cc > fp->sect_clust) ? (cc - fp->sect_clust + fs->sects_clust - 1) / fs->sects_clust : 0;
+                fp->curr_clust += ncl;                /* Clusters passed */
+                fp->sect_clust += ncl * fs->sects_clust - (cc - 1);
                 fp->curr_sect += cc - 1;
                 wcnt = cc * S_SIZ; continue;
             }
-            if (fp->fptr < fp->fsize &&              /* Fill sector buffer with file data if needed */
-                disk_read(fs->drive, fp->buffer, sect, 1) != RES_OK)
-                    goto fw_error;
+            if (!load_fsect(fp, sect, fp->fptr < fp->fsize))    /* Fill sector buffer with file data if needed */
+                goto fw_error;
         }
         wcnt = S_SIZ - ((WORD)fp->fptr & (S_SIZ - 1));    /* Copy fractional bytes to file I/O buffer */
         if (wcnt > btw) wcnt = btw;
-        memcpy(&fp->buffer[fp->fptr & (S_SIZ - 1)], wbuff, wcnt);
+        memcpy(&FBUF(fp)[fp->fptr & (S_SIZ - 1)], wbuff, wcnt);
         fp->flag |= FA__DIRTY;
     }
 
     if (fp->fptr > fp->fsize) fp->fsize = fp->fptr;    /* Update file size if needed */
     fp->flag |= FA__WRITTEN;                        /* Set file changed flag */
+    TRACE_E(TR_F_WRITE, FR_OK);
     return FR_OK;
 
 fw_error:    /* Abort this file due to an unrecoverable error */
     fp->flag |= FA__ERROR;
+    TRACE_E(TR_F_WRITE, FR_RW_ERROR);
     return FR_RW_ERROR;
 }
 
@@ -1056,17 +3282,38 @@ FRESULT f_sync (
     BYTE *dir;
     FRESULT res;
     FATFS *fs = fp->fs;
+#if _FS_EXFAT
+    DIR dj;
+#endif
 
 
     res = validate(fs, fp->id);            /* Check validity of the object */
     if (res == FR_OK) {
         if (fp->flag & FA__WRITTEN) {    /* Has the file been written? */
-            /* Write back data buffer if needed */
-            if (fp->flag & FA__DIRTY) {
-                if (disk_write(fs->drive, fp->buffer, fp->curr_sect, 1) != RES_OK)
+            /* Write back data buffer and write cache if needed */
+            if (!sync_fbuf(fp))
+                return FR_RW_ERROR;
+#if _FS_EXFAT
+            if (FSTYPE(fs) == FS_EXFAT) {    /* Update the entry set */
+                dj.fs = fs;
+                dj.sclust = fp->c_sclust;
+                dj.n_cont = fp->c_ncont;
+                if (!dir_seek(&dj, fp->c_index) || !load_xset(&dj))
                     return FR_RW_ERROR;
-                fp->flag &= ~FA__DIRTY;
+                dir = fs->dirbuf;
+                dir[XDIR_Attr] |= AM_ARC;                        /* Set archive bit */
+                tim = get_fattime();                            /* Updated time */
+                ST_DWORD(&dir[XDIR_ModTime], tim);
+                dir[XDIR_GenFlags] = fp->n_cont ? 0x03 : 0x01;    /* Contiguous or FAT chain */
+                ST_DWORD(&dir[XDIR_FstClus], fp->org_clust);    /* Update start cluster */
+                ST_QWORD(&dir[XDIR_ValidFileSize], fp->fsize);    /* Update file size */
+                ST_QWORD(&dir[XDIR_FileSize], fp->fsize);
+                res = store_xset(&dj);
+                if (res != FR_OK) return res;
+                fp->flag &= ~FA__WRITTEN;
+                return sync(fs);
             }
+#endif
             /* Update the directory entry */
             if (!move_window(fs, fp->dir_sect))
                 return FR_RW_ERROR;
@@ -1084,6 +3331,41 @@ FRESULT f_sync (
     return res;
 }
 
+
+
+
+#if _USE_WCACHE
+/*-----------------------------------------------------------------------*/
+/* Give a File a Write Cache                                             */
+/*-----------------------------------------------------------------------*/
+/* Sectors completed by f_write collect in buf and go out as one         */
+/* multiple sector write when the cache is full, when the next sector    */
+/* is not adjacent, or on f_sync/f_close/f_lseek/f_read.  buf must stay  */
+/* valid until the file is closed or the cache is removed (buf = NULL).  */
+
+FRESULT f_setwcache (
+    FIL *fp,        /* Pointer to the file object */
+    BYTE *buf,        /* Cache buffer of nsect sectors (NULL:remove the cache) */
+    UINT nsect        /* Number of sectors in buf (2..255) */
+)
+{
+    FRESULT res;
+
+
+    res = validate(fp->fs, fp->id);        /* Check validity of the object */
+    if (res) return res;
+    if (fp->flag & FA__ERROR) return FR_RW_ERROR;
+    if (buf && (nsect < 2 || nsect > 255)) return FR_DENIED;
+    if (fp->wc_n && !flush_wcache(fp)) {    /* Write out the old cache */
+        fp->flag |= FA__ERROR;
+        return FR_RW_ERROR;
+    }
+    fp->wc_buf = buf;
+    fp->wc_size = buf ? (BYTE)nsect : 0;
+    return FR_OK;
+}
+#endif
+
 #endif /* !_FS_READONLY */
 
 
@@ -1105,8 +3387,13 @@ FRESULT f_close (
 #else
     res = validate(fp->fs, fp->id);
 #endif
-    if (res == FR_OK)
-        fp->fs = NULL;
+#if !_FS_READONLY && _FS_RESERVE
+    if (fp->rsv) {                        /* Return the reserved clusters, also when the sync failed */
+        free_rsv(fp);
+        fp->rsv = 0;
+    }
+#endif
+    if (res == FR_OK) fp->fs = NULL;
     return res;
 }
 
@@ -1120,52 +3407,108 @@ FRESULT f_close (
 
 FRESULT f_lseek (
     FIL *fp,        /* Pointer to the file object */
-    DWORD ofs        /* File pointer from top of file */
+    FSIZE_t ofs        /* File pointer from top of file */
 )
 {
     DWORD clust, csize;
-    BYTE csect;
+    WORD csect;
     FRESULT res;
     FATFS *fs = fp->fs;
+#if _USE_FASTSEEK
+    DWORD *tbl, tlen, ulen, tcl, ncl, pcl;
+#endif
 
 
     res = validate(fs, fp->id);            /* Check validity of the object */
     if (res) return res;
     if (fp->flag & FA__ERROR) return FR_RW_ERROR;
 #if !_FS_READONLY
-    if (fp->flag & FA__DIRTY) {            /* Write-back dirty buffer if needed */
-        if (disk_write(fs->drive, fp->buffer, fp->curr_sect, 1) != RES_OK)
+    if (!sync_fbuf(fp))                    /* Write-back dirty buffer if needed */
+        goto fk_error;
+#endif
+#if _USE_FASTSEEK
+    if (fp->cltbl && ofs == CREATE_LINKMAP) {    /* Create the cluster link map table */
+        tbl = fp->cltbl;
+        tlen = *tbl++; ulen = 2;        /* Given table size and required table size */
+        clust = fp->org_clust;
+        if (clust) {
+            do {
+                tcl = clust; ncl = 0; ulen += 2;    /* Top of a fragment and its length */
+#if _FS_EXFAT
+                if (fp->n_cont) {                /* Contiguous file is a single fragment */
+                    ncl = fp->n_cont; clust = fs->max_clust;
+                } else
+#endif
+                do {
+                    pcl = clust; ncl++;
+                    clust = get_cluster(fs, pcl);
+                    if (clust <= 1) goto fk_error;
+                } while (clust == pcl + 1);
+                if (ulen <= tlen) {                /* Store the fragment if the table has room */
+                    *tbl++ = ncl; *tbl++ = tcl;
+                }
+            } while (clust < fs->max_clust);    /* Until end of the chain */
+        }
+        *fp->cltbl = ulen;                /* Number of items used */
+        if (ulen > tlen) return FR_DENIED;    /* Given table is too small */
+        *tbl = 0;                        /* Terminate the table */
+        return FR_OK;
+    }
+    if (fp->cltbl && ofs && ofs <= fp->fsize && (clust = clmt_clust(fp, ofs - 1)) != 0) {
+        fp->curr_clust = clust;            /* Fast seek with the link map, no FAT access */
+        csect = (WORD)((ofs - 1) / S_SIZ & (fs->sects_clust - 1));    /* Sector offset in the cluster */
+        fp->curr_sect = clust2sect(fs, clust) + csect;
+        fp->sect_clust = fs->sects_clust - csect;
+        if ((ofs & (S_SIZ - 1)) &&        /* Load current sector if needed */
+            !load_fsect(fp, fp->curr_sect, TRUE))
             goto fk_error;
-        fp->flag &= ~FA__DIRTY;
+        fp->fptr = ofs;
+        return FR_OK;
     }
+#endif
+#if !_FS_READONLY
     if (ofs > fp->fsize && !(fp->flag & FA_WRITE))
 #else
     if (ofs > fp->fsize)
 #endif
         ofs = fp->fsize;
-    fp->fptr = 0; fp->sect_clust = 1;        /* Set file R/W pointer to top of the file */
+#if _FS_EXFAT
+    if (FSTYPE(fs) != FS_EXFAT && ofs > 0xFFFFFFFF)    /* Clip at the FAT file size limit */
+        ofs = 0xFFFFFFFF;
+#endif
+    csize = (DWORD)fs->sects_clust * S_SIZ;    /* Cluster size in unit of byte */
+    if (ofs && fp->fptr && (ofs - 1) / csize >= (fp->fptr - 1) / csize) {
+        clust = fp->curr_clust;                /* Moving forward, follow the chain from the current cluster */
+        fp->fptr = (fp->fptr - 1) / csize * csize;
+        ofs -= fp->fptr;
+    } else {
+        clust = fp->org_clust;                /* Set file R/W pointer to top of the file */
+        fp->fptr = 0;
+    }
+    fp->sect_clust = 1;
 
     /* Move file R/W pointer if needed */
     if (ofs) {
-        clust = fp->org_clust;    /* Get start cluster */
 #if !_FS_READONLY
         if (!clust) {            /* If the file does not have a cluster chain, create new cluster chain */
-            clust = create_chain(fs, 0);
+#if _USE_AU_ALIGN
+            if (ofs >= csize && !seek_free_au(fs)) goto fk_error;    /* Expanding by a cluster or more */
+#endif
+            clust = create_fchain(fp, 0);
             if (clust == 1) goto fk_error;
             fp->org_clust = clust;
         }
 #endif
         if (clust) {            /* If the file has a cluster chain, it can be followed */
-            csize = (DWORD)fs->sects_clust * S_SIZ;        /* Cluster size in unit of byte */
             for (;;) {                                    /* Loop to skip leading clusters */
                 fp->curr_clust = clust;                    /* Update current cluster */
                 if (ofs <= csize) break;
 #if !_FS_READONLY
                 if (fp->flag & FA_WRITE)                /* Check if in write mode or not */
-                    clust = create_chain(fs, clust);    /* Force streached if in write mode */
+                    clust = create_fchain(fp, clust);    /* Force streached if in write mode */
                 else
 #endif
-                    clust = get_cluster(fs, clust);        /* Only follow cluster chain if not in write mode */
+                    clust = get_fcluster(fp, clust);    /* Only follow cluster chain if not in write mode */
                 if (clust == 0) {                        /* Stop if could not follow the cluster chain */
                     ofs = csize; break;
                 }
@@ -1173,12 +3516,12 @@ FRESULT f_lseek (
                 fp->fptr += csize;                        /* Update R/W pointer */
                 ofs -= csize;
             }
-            csect = (BYTE)((ofs - 1) / S_SIZ);            /* Sector offset in the cluster */
+            csect = (WORD)((ofs - 1) / S_SIZ);            /* Sector offset in the cluster */
             fp->curr_sect = clust2sect(fs, clust) + csect;    /* Current sector */
+            fp->sect_clust = fs->sects_clust - csect;    /* Left sector counter in the cluster */
             if ((ofs & (S_SIZ - 1)) &&                    /* Load current sector if needed */
-                disk_read(fs->drive, fp->buffer, fp->curr_sect, 1) != RES_OK)
+                !load_fsect(fp, fp->curr_sect, TRUE))
                 goto fk_error;
-            fp->sect_clust = fs->sects_clust - csect;    /* Left sector counter in the cluster */
             fp->fptr += ofs;                            /* Update file R/W pointer */
         }
     }
@@ -1210,7 +3553,7 @@ FRESULT f_opendir (
 )
 {
     BYTE *dir;
-    char fn[8+3+1];
+    char fn[8+3+2];
     FRESULT res;
     FATFS *fs;
 
@@ -1222,8 +3565,16 @@ FRESULT f_opendir (
     res = trace_path(dirobj, fn, path, &dir);    /* Trace the directory path */
     if (res == FR_OK) {                        /* Trace completed */
         if (dir != NULL) {                    /* It is not the root dir */
+#if _FS_EXFAT
+            if (FSTYPE(fs) == FS_EXFAT) {
+                if (dir[XDIR_Attr] & AM_DIR)    /* Enter the directory table of the entry set */
+                    enter_xdir(dirobj);
+                else
+                    res = FR_NO_FILE;
+            } else
+#endif
             if (dir[DIR_Attr] & AM_DIR) {        /* The entry is a directory */
-                dirobj->clust = ((DWORD)LD_WORD(&dir[DIR_FstClusHI]) << 16) | LD_WORD(&dir[DIR_FstClusLO]);
+                dirobj->clust = dirobj->sclust = ((DWORD)LD_WORD(&dir[DIR_FstClusHI]) << 16) | LD_WORD(&dir[DIR_FstClusLO]);
                 dirobj->sect = clust2sect(fs, dirobj->clust);
                 dirobj->index = 2;
             } else {                        /* The entry is not a directory */
@@ -1248,6 +3599,12 @@ FRESULT f_readdir (
 )
 {
     BYTE *dir, c, res;
+#if _USE_LFN
+    BYTE ord = 0xFF, sum = 0xFF;
+#endif
+#if _FS_EXFAT
+    UINT n;
+#endif
     FATFS *fs = dirobj->fs;
 
 
@@ -1261,8 +3618,35 @@ FRESULT f_readdir (
         dir = &fs->win[(dirobj->index & ((S_SIZ - 1) >> 5)) * 32];    /* pointer to the directory entry */
         c = *dir;
         if (c == 0) break;                                /* Has it reached to end of dir? */
+#if _FS_EXFAT
+        if (FSTYPE(fs) == FS_EXFAT) {
+            if (c == 0x85 && load_xset(dirobj)) {        /* Top of an entry set, skip the rest of the set */
+                get_xfileinfo(dirobj, finfo);
+                for (n = fs->dirbuf[XDIR_NumSec]; n && next_dir_entry(dirobj); n--) ;
+            }
+            if (!next_dir_entry(dirobj)) dirobj->sect = 0;    /* Next entry */
+            if (finfo->fname[0]) break;                    /* Found valid entry */
+            continue;
+        }
+#endif
+#if _USE_LFN
+        if (c != 0xE5 && dir[DIR_Attr] == AM_LFN) {        /* An LFN entry, load its part of the name */
+            if (c & 0x40) {
+                sum = dir[LDIR_Chksum];
+                c &= 0x3F; ord = c;
+            }
+            ord = (c == ord && sum == dir[LDIR_Chksum] && pick_lfn(dir)) ? ord - 1 : 0xFF;
+        } else {
+            if (c != 0xE5 && !(dir[DIR_Attr] & AM_VOL)) {    /* Is it a valid entry? */
+                get_fileinfo(finfo, dir);
+                get_lfninfo(finfo, (BOOL)(ord == 0 && sum == sum_sfn(dir)));
+            }
+            ord = 0xFF;
+        }
+#else
         if (c != 0xE5 && !(dir[DIR_Attr] & AM_VOL))        /* Is it a valid entry? */
             get_fileinfo(finfo, dir);
+#endif
         if (!next_dir_entry(dirobj)) dirobj->sect = 0;    /* Next entry */
         if (finfo->fname[0]) break;                        /* Found valid entry */
     }
@@ -1284,7 +3668,7 @@ FRESULT f_stat (
 )
 {
     BYTE *dir;
-    char fn[8+3+1];
+    char fn[8+3+2];
     FRESULT res;
     DIR dirobj;
     FATFS *fs;
@@ -1296,10 +3680,31 @@ FRESULT f_stat (
 
     res = trace_path(&dirobj, fn, path, &dir);    /* Trace the file path */
     if (res == FR_OK) {                            /* Trace completed */
-        if (dir)    /* Found an object */
+#if _FS_EXFAT
+        if (dir && FSTYPE(fs) == FS_EXFAT) {    /* The entry set is in dirbuf[] */
+            get_xfileinfo(&dirobj, finfo);
+            return FR_OK;
+        }
+#endif
+        if (dir) {    /* Found an object */
             get_fileinfo(finfo, dir);
-        else        /* It is root dir */
+#if _USE_LFN
+            if (dirobj.lfn_idx != 0xFFFF) {            /* Load the LFN of the object */
+                WORD idx = dirobj.index;
+                if (!dir_seek(&dirobj, dirobj.lfn_idx)) return FR_RW_ERROR;
+                while (dirobj.index < idx) {
+                    if (!move_window(fs, dirobj.sect)) return FR_RW_ERROR;
+                    if (!pick_lfn(&fs->win[(dirobj.index & ((S_SIZ - 1) / 32)) * 32])) break;
+                    if (!next_dir_entry(&dirobj)) return FR_RW_ERROR;
+                }
+                get_lfninfo(finfo, (BOOL)(dirobj.index >= idx));
+            } else {
+                get_lfninfo(finfo, FALSE);
+            }
+#endif
+        } else {    /* It is root dir */
             res = FR_INVALID_NAME;
+        }
     }
 
     return res;
@@ -1336,14 +3741,26 @@ FRESULT f_getfree (
     }
 
     /* Count number of free clusters */
-    fat = fs->fs_type;
+    fat = FSTYPE(fs);
     n = 0;
+#if _FS_EXFAT
+    if (fat == FS_EXFAT) {                /* Count zero bits in the allocation bitmap */
+        sect = fs->bitbase;
+        for (clust = 0; clust < fs->max_clust - 2; clust++) {
+            if (!(clust & (S_SIZ * 8 - 1)) && !move_window(fs, sect++)) return FR_RW_ERROR;
+            if (!(fs->win[(clust / 8) & (S_SIZ - 1)] & (1 << (clust & 7)))) n++;
+        }
+    } else
+#endif
+#if _FS_FATTYPES & 1
     if (fat == FS_FAT12) {
         clust = 2;
         do {
             if ((WORD)get_cluster(fs, clust) == 0) n++;
         } while (++clust < fs->max_clust);
-    } else {
+    } else
+#endif
+    {
         clust = fs->max_clust;
         sect = fs->fatbase;
         f = 0; p = 0;
@@ -1373,6 +3790,154 @@ FRESULT f_getfree (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Truncate File                                                         */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_truncate (
+    FIL *fp        /* Pointer to the file object */
+)
+{
+    FRESULT res;
+    FATFS *fs = fp->fs;
+    DWORD ncl;
+
+
+    res = validate(fs, fp->id);            /* Check validity of the object */
+    if (res) return res;
+    if (fp->flag & FA__ERROR) return FR_RW_ERROR;
+    if (!(fp->flag & FA_WRITE)) return FR_DENIED;
+    if (fp->fptr >= fp->fsize) return FR_OK;    /* Nothing beyond the file pointer */
+
+#if _FS_BLOCK > 1
+    if (fp->blk_dirty && !flush_fblock(fp)) goto ft_error;    /* Sectors in the block may be freed */
+    fp->blk_valid = 0;
+#endif
+#if _USE_WCACHE
+    if (fp->wc_n && !flush_wcache(fp)) goto ft_error;    /* Cached sectors may be freed */
+#endif
+    fp->fsize = fp->fptr;                /* Set file size to the current R/W pointer */
+    fp->flag |= FA__WRITTEN;
+    fp->ext_ncl = 0;                    /* The cached run may be freed */
+#if _USE_FASTSEEK
+    fp->cltbl = NULL;                    /* The link map may point to freed clusters */
+#endif
+    if (fp->fptr == 0) {                /* Remove the whole chain */
+#if _FS_EXFAT
+        if (!remove_xchain(fs, fp->org_clust, fp->n_cont)) goto ft_error;
+        fp->n_cont = 0;
+#else
+        if (!remove_chain(fs, fp->org_clust)) goto ft_error;
+#endif
+        fp->org_clust = 0;
+    } else {                            /* Cut the chain after the current cluster */
+#if _FS_EXFAT
+        if (fp->n_cont) {                /* Contiguous file: free the tail in the bitmap */
+            ncl = fp->org_clust + fp->n_cont - fp->curr_clust - 1;
+            if (ncl && !remove_xchain(fs, fp->curr_clust + 1, ncl)) goto ft_error;
+            fp->n_cont -= ncl;
+        } else
+#endif
+        {
+            ncl = get_cluster(fs, fp->curr_clust);
+            if (ncl == 1) goto ft_error;
+            if (ncl < fs->max_clust) {
+                if (!put_cluster(fs, fp->curr_clust, (FSTYPE(fs) == FS_EXFAT) ? 0xFFFFFFFF : 0x0FFFFFFF)    /* New end of the chain */
+                    || !remove_chain(fs, ncl)) goto ft_error;
+            }
+        }
+    }
+    return FR_OK;
+
+ft_error:    /* Abort this file due to an unrecoverable error */
+    fp->flag |= FA__ERROR;
+    return FR_RW_ERROR;
+}
+
+
+
+
+#if _USE_ERASE && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Pre-erase a Run of Free Clusters                                      */
+/*-----------------------------------------------------------------------*/
+
+#define ERASE_SCAN    4096    /* Maximum FAT entries examined per call */
+
+FRESULT f_erasefree (
+    const char *drv,    /* Logical drive number */
+    DWORD *cursor,        /* Pointer to the scan cursor (cluster#, 0:start a new pass, returns 0 at end of pass) */
+    DWORD maxclust        /* Maximum number of clusters to be erased in this call */
+)
+{
+    DWORD scl, ncl, ecl, lim, cstat, rng[2];
+    FRESULT res;
+    FATFS *fs;
+
+
+    res = auto_mount(&drv, &fs, 1);
+    if (res != FR_OK) return res;
+    if (!maxclust) return FR_OK;
+
+    scl = *cursor;
+    if (scl < 2 || scl >= fs->ers_end) {    /* Start a pass over the clusters freed since the last one */
+        ecl = (fs->ers_hi < fs->max_clust) ? fs->ers_hi + 1 : fs->max_clust;
+        scl = fs->ers_lo;
+        fs->ers_lo = 0xFFFFFFFF; fs->ers_hi = 0;    /* Collect the clusters freed from now on */
+        if (scl >= ecl) {                    /* Nothing freed */
+            fs->ers_end = 0;
+            *cursor = 0;
+            return FR_OK;
+        }
+        fs->ers_end = ecl;
+    }
+    ecl = fs->ers_end;
+
+    lim = (ecl - scl > ERASE_SCAN) ? scl + ERASE_SCAN : ecl;
+    for ( ; scl < lim; scl++) {            /* Find the next free cluster */
+        cstat = get_cstat(fs, scl);
+        if (cstat == 1) return FR_RW_ERROR;
+        if (cstat == 0) break;
+    }
+    if (scl >= ecl) {                    /* No free cluster left in this pass */
+        fs->ers_end = 0;
+        *cursor = 0;
+        return FR_OK;
+    }
+    if (scl >= lim) {                    /* Scan limit, go on from here in the next call */
+        *cursor = scl;
+        return FR_OK;
+    }
+    lim = (ecl - scl > maxclust) ? scl + maxclust : ecl;
+#if _USE_AU_ALIGN
+    if (fs->au_clust && scl >= fs->au_ofs) {    /* Not over an AU boundary, one erase command per AU */
+        ncl = scl + fs->au_clust - (scl - fs->au_ofs) % fs->au_clust;
+        if (ncl < lim) lim = ncl;
+    }
+#endif
+    for (ncl = scl + 1; ncl < lim; ncl++) {    /* Measure the free run */
+        cstat = get_cstat(fs, ncl);
+        if (cstat == 1) return FR_RW_ERROR;
+        if (cstat != 0) break;
+    }
+
+    rng[0] = clust2sect(fs, scl);                                /* First sector of the run */
+    rng[1] = clust2sect(fs, ncl - 1) + fs->sects_clust - 1;    /* Last sector of the run */
+    if (disk_ioctl(fs->drive, CTRL_ERASE_SECTOR, rng) != RES_OK)
+        return FR_RW_ERROR;
+
+    if (ncl >= ecl) {                    /* End of the pass */
+        fs->ers_end = 0;
+        ncl = 0;
+    }
+    *cursor = ncl;
+    return FR_OK;
+}
+#endif /* _USE_ERASE && !_FS_READONLY */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Delete a File or a Directory                                          */
 /*-----------------------------------------------------------------------*/
@@ -1382,10 +3947,13 @@ FRESULT f_unlink (
 )
 {
     BYTE *dir, *sdir;
-    DWORD dclust, dsect;
-    char fn[8+3+1];
+    DWORD dclust;
+#if _FS_EXFAT
+    DWORD ncont;
+#endif
+    char fn[8+3+2];
     FRESULT res;
-    DIR dirobj;
+    DIR dirobj, sdirobj;
     FATFS *fs;
 
 
@@ -1396,26 +3964,50 @@ FRESULT f_unlink (
     res = trace_path(&dirobj, fn, path, &dir);    /* Trace the file path */
     if (res != FR_OK) return res;                /* Trace failed */
     if (dir == NULL) return FR_INVALID_NAME;    /* It is the root directory */
+#if _FS_EXFAT
+    if (FSTYPE(fs) == FS_EXFAT) {
+        if (dir[XDIR_Attr] & AM_RDO) return FR_DENIED;    /* It is a R/O object */
+        dclust = LD_DWORD(&dir[XDIR_FstClus]);
+        ncont = get_xncont(fs);
+        if ((dir[XDIR_Attr] & AM_DIR) && dclust) {    /* It is a sub-directory */
+            sdirobj = dirobj;                        /* Check if the sub-dir is empty or not */
+            enter_xdir(&sdirobj);
+            do {
+                if (!move_window(fs, sdirobj.sect)) return FR_RW_ERROR;
+                sdir = &fs->win[(sdirobj.index & ((S_SIZ - 1) >> 5)) * 32];
+                if (sdir[XDIR_Type] == 0) break;
+                if (sdir[XDIR_Type] & 0x80)
+                    return FR_DENIED;    /* The directory is not empty */
+            } while (next_dir_entry(&sdirobj));
+        }
+        res = remove_direntry(&dirobj);            /* Mark the entry set 'not in use' */
+        if (res != FR_OK) return res;
+        if (dclust && !remove_xchain(fs, dclust, ncont)) return FR_RW_ERROR;    /* Remove the cluster chain */
+        return sync(fs);
+    }
+#endif
     if (dir[DIR_Attr] & AM_RDO) return FR_DENIED;    /* It is a R/O object */
-    dsect = fs->winsect;
     dclust = ((DWORD)LD_WORD(&dir[DIR_FstClusHI]) << 16) | LD_WORD(&dir[DIR_FstClusLO]);
 
     if (dir[DIR_Attr] & AM_DIR) {                /* It is a sub-directory */
-        dirobj.clust = dclust;                    /* Check if the sub-dir is empty or not */
-        dirobj.sect = clust2sect(fs, dclust);
-        dirobj.index = 2;
+        sdirobj.fs = fs;                        /* Check if the sub-dir is empty or not */
+        sdirobj.clust = dclust;
+#if _FS_EXFAT
+        sdirobj.n_cont = 0;
+#endif
+        sdirobj.sect = clust2sect(fs, dclust);
+        sdirobj.index = 2;
         do {
-            if (!move_window(fs, dirobj.sect)) return FR_RW_ERROR;
-            sdir = &fs->win[(dirobj.index & ((S_SIZ - 1) >> 5)) * 32];
+            if (!move_window(fs, sdirobj.sect)) return FR_RW_ERROR;
+            sdir = &fs->win[(sdirobj.index & ((S_SIZ - 1) >> 5)) * 32];
             if (sdir[DIR_Name] == 0) break;
             if (sdir[DIR_Name] != 0xE5 && !(sdir[DIR_Attr] & AM_VOL))
                 return FR_DENIED;    /* The directory is not empty */
-        } while (next_dir_entry(&dirobj));
+        } while (next_dir_entry(&sdirobj));
     }
 
-    if (!move_window(fs, dsect)) return FR_RW_ERROR;    /* Mark the directory entry 'deleted' */
-    dir[DIR_Name] = 0xE5;
-    fs->winflag = 1;
+    res = remove_direntry(&dirobj);                /* Mark the directory entry 'deleted' */
+    if (res != FR_OK) return res;
     if (!remove_chain(fs, dclust)) return FR_RW_ERROR;    /* Remove the cluster chain */
 
     return sync(fs);
@@ -1432,8 +4024,9 @@ FRESULT f_mkdir (
     const char *path        /* Pointer to the directory path */
 )
 {
-    BYTE *dir, *fw, n;
-    char fn[8+3+1];
+    BYTE *dir, *fw;
+    WORD n;
+    char fn[8+3+2];
     DWORD sect, dsect, dclust, pclust, tim;
     FRESULT res;
     DIR dirobj;
@@ -1448,8 +4041,38 @@ FRESULT f_mkdir (
     if (res == FR_OK) return FR_EXIST;            /* Any file or directory is already existing */
     if (res != FR_NO_FILE) return res;
 
-    res = reserve_direntry(&dirobj, &dir);         /* Reserve a directory entry */
+    res = reserve_direntry(&dirobj, fn, &dir);         /* Reserve a directory entry */
     if (res != FR_OK) return res;
+#if _FS_EXFAT
+    if (FSTYPE(fs) == FS_EXFAT) {                /* The new entry set is in dirbuf[] */
+        dclust = create_chain(fs, 0);            /* Allocate a contiguous cluster for new directory table */
+        if (dclust == 1) return FR_RW_ERROR;
+        dsect = clust2sect(fs, dclust);
+        if (!dsect) return FR_DENIED;
+        if (!move_window(fs, dsect)) return FR_RW_ERROR;
+        fw = fs->win;
+#if _FS_BLOCK > 1
+        if (!drop_wblock(fs, dsect + 1, fs->sects_clust - 1)) return FR_RW_ERROR;
+#endif
+        memset(fw, 0, S_SIZ);                    /* Clear the new directory table, no dot entries */
+        for (n = 1; n < fs->sects_clust; n++) {
+            if (disk_write(fs->drive, fw, ++dsect, 1) != RES_OK)
+                return FR_RW_ERROR;
+        }
+        fs->winflag = 1;
+        ST_WORD(&dir[XDIR_Attr], AM_DIR);        /* Attribute */
+        tim = get_fattime();
+        ST_DWORD(&dir[XDIR_CrtTime], tim);        /* Created time */
+        ST_DWORD(&dir[XDIR_ModTime], tim);
+        dir[XDIR_GenFlags] = 0x03;                /* Contiguous */
+        ST_DWORD(&dir[XDIR_FstClus], dclust);    /* Table start cluster */
+        ST_QWORD(&dir[XDIR_ValidFileSize], (QWORD)fs->sects_clust * S_SIZ);
+        ST_QWORD(&dir[XDIR_FileSize], (QWORD)fs->sects_clust * S_SIZ);
+        res = store_xset(&dirobj);
+        if (res != FR_OK) return res;
+        return sync(fs);
+    }
+#endif
     sect = fs->winsect;
     dclust = create_chain(fs, 0);                /* Allocate a cluster for new directory table */
     if (dclust == 1) return FR_RW_ERROR;
@@ -1458,6 +4081,9 @@ FRESULT f_mkdir (
     if (!move_window(fs, dsect)) return FR_RW_ERROR;
 
     fw = fs->win;
+#if _FS_BLOCK > 1
+    if (!drop_wblock(fs, dsect + 1, fs->sects_clust - 1)) return FR_RW_ERROR;
+#endif
     memset(fw, 0, S_SIZ);                        /* Clear the new directory table */
     for (n = 1; n < fs->sects_clust; n++) {
         if (disk_write(fs->drive, fw, ++dsect, 1) != RES_OK)
@@ -1472,7 +4098,7 @@ FRESULT f_mkdir (
     pclust = dirobj.sclust;
 #if _FAT32
     ST_WORD(&fw[   DIR_FstClusHI], dclust >> 16);
-    if (fs->fs_type == FS_FAT32 && pclust == fs->dirbase) pclust = 0;
+    if (FSTYPE(fs) == FS_FAT32 && pclust == fs->dirbase) pclust = 0;
     ST_WORD(&fw[32+DIR_FstClusHI], pclust >> 16);
 #endif
     ST_WORD(&fw[   DIR_FstClusLO], dclust);
@@ -1507,7 +4133,7 @@ FRESULT f_chmod (
     FRESULT res;
     BYTE *dir;
     DIR dirobj;
-    char fn[8+3+1];
+    char fn[8+3+2];
     FATFS *fs;
 
 
@@ -1520,6 +4146,14 @@ FRESULT f_chmod (
                 res = FR_INVALID_NAME;
             } else {
                 mask &= AM_RDO|AM_HID|AM_SYS|AM_ARC;    /* Valid attribute mask */
+#if _FS_EXFAT
+                if (FSTYPE(fs) == FS_EXFAT) {
+                    dir[XDIR_Attr] = (value & mask) | (dir[XDIR_Attr] & (BYTE)~mask);
+                    res = store_xset(&dirobj);    /* Write back the entry set with new checksum */
+                    if (res == FR_OK) res = sync(fs);
+                    return res;
+                }
+#endif
                 dir[DIR_Attr] = (value & mask) | (dir[DIR_Attr] & (BYTE)~mask);    /* Apply attribute change */
                 res = sync(fs);
             }
@@ -1541,10 +4175,12 @@ FRESULT f_rename (
 )
 {
     FRESULT res;
-    DWORD sect_old;
     BYTE *dir_old, *dir_new, direntry[32-11];
-    DIR dirobj;
-    char fn[8+3+1];
+#if _FS_EXFAT
+    BYTE xset[64];
+#endif
+    DIR dirobj, dirobj_old;
+    char fn[8+3+2];
     FATFS *fs;
 
 
@@ -1555,13 +4191,31 @@ FRESULT f_rename (
     res = trace_path(&dirobj, fn, path_old, &dir_old);    /* Check old object */
     if (res != FR_OK) return res;            /* The old object is not found */
     if (!dir_old) return FR_NO_FILE;
-    sect_old = fs->winsect;                    /* Save the object information */
+    dirobj_old = dirobj;                    /* Save the object information */
+#if _FS_EXFAT
+    if (FSTYPE(fs) == FS_EXFAT) {
+        memcpy(xset, dir_old, 64);
+        res = trace_path(&dirobj, fn, path_new, &dir_new);    /* Check new object */
+        if (res == FR_OK) return FR_EXIST;
+        if (res != FR_NO_FILE) return res;
+        res = reserve_direntry(&dirobj, fn, &dir_new);    /* Reserve an entry set with the new name */
+        if (res != FR_OK) return res;
+        memcpy(&dir_new[XDIR_Attr], &xset[XDIR_Attr], 32 - XDIR_Attr);    /* Attribute and time stamps */
+        dir_new[XDIR_GenFlags] = xset[XDIR_GenFlags];
+        memcpy(&dir_new[XDIR_ValidFileSize], &xset[XDIR_ValidFileSize], 64 - XDIR_ValidFileSize);    /* Sizes and cluster */
+        res = store_xset(&dirobj);
+        if (res != FR_OK) return res;
+        res = remove_direntry(&dirobj_old);    /* Remove old entry set */
+        if (res != FR_OK) return res;
+        return sync(fs);
+    }
+#endif
     memcpy(direntry, &dir_old[DIR_Attr], 32-11);
 
     res = trace_path(&dirobj, fn, path_new, &dir_new);    /* Check new object */
     if (res == FR_OK) return FR_EXIST;            /* The new object name is already existing */
     if (res != FR_NO_FILE) return res;            /* Is there no old name? */
-    res = reserve_direntry(&dirobj, &dir_new);     /* Reserve a directory entry */
+    res = reserve_direntry(&dirobj, fn, &dir_new);     /* Reserve a directory entry */
     if (res != FR_OK) return res;
 
     memcpy(&dir_new[DIR_Attr], direntry, 32-11);    /* Create new entry */
@@ -1569,8 +4223,8 @@ FRESULT f_rename (
     dir_new[DIR_NTres] = fn[11];
     fs->winflag = 1;
 
-    if (!move_window(fs, sect_old)) return FR_RW_ERROR;    /* Remove old entry */
-    dir_old[DIR_Name] = 0xE5;
+    res = remove_direntry(&dirobj_old);        /* Remove old entry */
+    if (res != FR_OK) return res;
 
     return sync(fs);
 }
@@ -1583,10 +4237,35 @@ FRESULT f_rename (
 /*-----------------------------------------------------------------------*/
 
 #define N_ROOTDIR 512
-#define N_FATS 1
+#ifndef N_FATS
+#define N_FATS 1        /* FAT copies, tools/fftest builds with 2 to check the mirror */
+#endif
 #define MAX_SECTOR 64000000UL
 #define MIN_SECTOR 2000UL
 #define ERASE_BLK 32
+#define ZERO_BURST 16        /* Sectors per write to clear the FAT and directory area */
+
+
+static const BYTE Zeros[ZERO_BURST * S_MAX_SIZ];    /* Source of the zero fill (const data) */
+
+
+static
+BOOL zero_area (    /* TRUE: successful, FALSE: failed */
+    BYTE drv,        /* Physical drive number */
+    DWORD sect,        /* Start sector */
+    DWORD n_sect    /* Number of sectors to clear */
+)
+{
+    DWORD n;
+
+
+    while (n_sect) {
+        n = (n_sect < ZERO_BURST) ? n_sect : ZERO_BURST;
+        if (disk_write(drv, Zeros, sect, (BYTE)n) != RES_OK) return FALSE;
+        sect += n; n_sect -= n;
+    }
+    return TRUE;
+}
 
 
 FRESULT f_mkfs (
@@ -1595,10 +4274,10 @@ FRESULT f_mkfs (
     BYTE allocsize        /* Allocation unit size [sectors] */
 )
 {
-    BYTE fmt, m, *tbl;
+    BYTE fmt, m, opt, *tbl;
     DWORD b_part, b_fat, b_dir, b_data;        /* Area offset (LBA) */
     DWORD n_part, n_rsv, n_fat, n_dir;        /* Area size */
-    DWORD n_clust, n;
+    DWORD n_clust, n, n_au, rng[2];
     FATFS *fs;
     DSTATUS stat;
 
@@ -1608,10 +4287,15 @@ FRESULT f_mkfs (
     fs = FatFs[drv];
     if (!fs) return FR_NOT_ENABLED;
     memset(fs, 0, sizeof(FATFS));
+#if _USE_MNTCACHE
+    memset(MntCache, 0, sizeof(MntCache));    /* The geometry is about to change */
+#endif
     drv = LD2PD(drv);
 
     /* Check validity of the parameters */
     for (n = 1; n <= 64 && allocsize != n; n <<= 1);
+    opt = partition & FM_QUICK;
+    partition &= ~FM_QUICK;
     if (n > 64 || partition >= 2) return FR_MKFS_ABORTED;
 
     /* Get disk statics */
@@ -1621,7 +4305,19 @@ FRESULT f_mkfs (
     if (disk_ioctl(drv, GET_SECTOR_COUNT, &n_part) != RES_OK || n_part < MIN_SECTOR)
         return FR_MKFS_ABORTED;
     if (n_part > MAX_SECTOR) n_part = MAX_SECTOR;
+    n_au = ERASE_BLK;                        /* Alignment of the FATs and the data area */
+#if _USE_AU_ALIGN
+    if (disk_ioctl(drv, GET_AU_SIZE, &n) == RES_OK && n) {        /* Allocation unit of the card */
+        n_au = n;
+    } else if (disk_ioctl(drv, GET_BLOCK_SIZE, &n) == RES_OK && n) {    /* or its erase block */
+        n_au = n;
+    }
+#endif
+    while (n_au > 1 && (n_au > n_part / 128 || n_au > 0x8000)) n_au /= 2;    /* Limit the loss to 1/128 of the disk */
     b_part = (!partition) ? 63 : 0;
+#if _USE_AU_ALIGN
+    if (!partition && n_au > 63) b_part = n_au;    /* Start the partition at an AU boundary */
+#endif
     n_part -= b_part;
 #if S_MAX_SIZ > 512                        /* Check disk sector size */
     if (disk_ioctl(drv, GET_SECTOR_SIZE, &S_SIZ) != RES_OK
@@ -1635,6 +4331,7 @@ FRESULT f_mkfs (
     fmt = FS_FAT12;
     if (n_clust >= 0xFF7) fmt = FS_FAT16;
     if (n_clust >= 0xFFF7) fmt = FS_FAT32;
+    if (!(_FS_FATTYPES & (1 << (fmt - 1)))) return FR_MKFS_ABORTED;    /* Not supported by this build */
     switch (fmt) {
     case FS_FAT12:
         n_fat = ((n_clust * 3 + 1) / 2 + 3 + S_SIZ - 1) / S_SIZ;
@@ -1655,14 +4352,25 @@ FRESULT f_mkfs (
     b_dir = b_fat + n_fat * N_FATS;    /* Directory start sector */
     b_data = b_dir + n_dir;            /* Data start sector */
 
-#ifdef ERASE_BLK
-    /* Round up data start sector to erase block boundary */
-    n = (b_data + ERASE_BLK - 1) & ~(ERASE_BLK - 1);
+    /* Round up data start sector to the AU (the AU need not be a power of 2) */
+#if _USE_AU_ALIGN
+    if (fmt == FS_FAT32) {            /* Align each FAT and the data area, the reserved area takes the pad */
+        n_rsv += (n_au - b_fat % n_au) % n_au;
+        n_fat = (n_fat + n_au - 1) / n_au * n_au;
+    } else {                        /* Align the data area, the reserved area takes the pad (SD file system spec) */
+        n_rsv += (n_au - b_data % n_au) % n_au;
+    }
+    b_fat = b_part + n_rsv;
+    b_dir = b_fat + n_fat * N_FATS;
+    b_data = b_dir + n_dir;
+#else
+    n = (b_data + n_au - 1) / n_au * n_au;    /* The FAT takes the pad */
     b_dir += n - b_data;
     n_fat += (n - b_data) / N_FATS;
+    b_data = n;
 #endif
     /* Determine number of cluster and final check of validity of the FAT type */
-    n_clust = (n_part - n_rsv - n_fat * 2 - n_dir) / allocsize;
+    n_clust = (n_part - n_rsv - n_fat * N_FATS - n_dir) / allocsize;
     if (   (fmt == FS_FAT16 && n_clust < 0xFF7)
         || (fmt == FS_FAT32 && n_clust < 0xFFF7))
         return FR_MKFS_ABORTED;
@@ -1672,7 +4380,11 @@ FRESULT f_mkfs (
         DWORD n_disk = b_part + n_part;
 
         tbl = &fs->win[MBR_Table];
-        ST_DWORD(&tbl[0], 0x00010180);    /* Partition start in CHS */
+        n = b_part / 63 / 255;            /* Partition start in CHS */
+        tbl[0] = 0x80;
+        tbl[1] = (BYTE)(b_part / 63 % 255);
+        tbl[2] = (BYTE)((n >> 2 & 0xC0) | (b_part % 63 + 1));
+        tbl[3] = (BYTE)n;
         if (n_disk < 63UL * 255 * 1024) {    /* Partition end in CHS */
             n_disk = n_disk / 63 / 255;
             tbl[7] = (BYTE)n_disk;
@@ -1685,7 +4397,7 @@ FRESULT f_mkfs (
             tbl[4] = (n_part < 0x10000) ? 0x04 : 0x06;
         else
             tbl[4] = 0x0c;
-        ST_DWORD(&tbl[8], 63);            /* Partition start in LBA */
+        ST_DWORD(&tbl[8], b_part);        /* Partition start in LBA */
         ST_DWORD(&tbl[12], n_part);        /* Partition size in LBA */
         ST_WORD(&tbl[64], 0xAA55);        /* Signature */
         if (disk_write(drv, fs->win, 0, 1) != RES_OK)
@@ -1713,6 +4425,7 @@ FRESULT f_mkfs (
         ST_WORD(&tbl[BPB_FATSz16], n_fat);        /* Number of secters per FAT */
         tbl[BS_DrvNum] = 0x80;                    /* Drive number */
         tbl[BS_BootSig] = 0x29;                    /* Extended boot signature */
+        ST_DWORD(&tbl[BS_VolID], get_fattime());    /* Volume serial number */
         memcpy(&tbl[BS_VolLab], "NO NAME    FAT     ", 19);    /* Volume lavel, FAT signature */
     } else {
         ST_DWORD(&tbl[BPB_FATSz32], n_fat);        /* Number of secters per FAT */
@@ -1721,6 +4434,7 @@ FRESULT f_mkfs (
         ST_WORD(&tbl[BPB_BkBootSec], 6);        /* Backup boot record (bs+6) */
         tbl[BS_DrvNum32] = 0x80;                /* Drive number */
         tbl[BS_BootSig32] = 0x29;                /* Extended boot signature */
+        ST_DWORD(&tbl[BS_VolID32], get_fattime());    /* Volume serial number */
         memcpy(&tbl[BS_VolLab32], "NO NAME    FAT32   ", 19);    /* Volume lavel, FAT signature */
     }
     ST_WORD(&tbl[BS_55AA], 0xAA55);            /* Signature */
@@ -1729,9 +4443,25 @@ FRESULT f_mkfs (
     if (fmt == FS_FAT32)
         disk_write(drv, tbl, b_part+6, 1);
 
-    /* Initialize FAT area */
+    /* Clear the FATs and the root directory (cluster 2 on FAT32) */
+    rng[0] = b_fat;
+    rng[1] = b_data + ((fmt == FS_FAT32) ? allocsize : 0) - 1;
+    if (disk_ioctl(drv, GET_ERASE_VALUE, &m) != RES_OK || m != 0    /* Erase them if erased blocks read as zero */
+        || disk_ioctl(drv, CTRL_ERASE_SECTOR, rng) != RES_OK) {
+        n = n_fat;                                    /* Otherwise write zeros in bursts */
+        if (opt) {                                    /* Quick: only the FAT entries of the clusters */
+            n = (fmt == FS_FAT12) ? ((n_clust + 2) * 3 + 1) / 2 : (n_clust + 2) * ((fmt == FS_FAT16) ? 2 : 4);
+            n = (n + S_SIZ - 1) / S_SIZ;
+        }
+        for (m = 0; m < N_FATS; m++) {
+            if (!zero_area(drv, b_fat + n_fat * m, n)) return FR_RW_ERROR;
+        }
+        if (!zero_area(drv, b_dir, rng[1] + 1 - b_dir)) return FR_RW_ERROR;
+    }
+
+    /* Initialize the first sector of each FAT */
     for (m = 0; m < N_FATS; m++) {
-        memset(tbl, 0, S_SIZ);        /* 1st sector of the FAT  */
+        memset(tbl, 0, S_SIZ);
         if (fmt != FS_FAT32) {
             n = (fmt == FS_FAT12) ? 0x00FFFFF8 : 0xFFFFFFF8;
             ST_DWORD(&tbl[0], n);            /* Reserve cluster #0-1 (FAT12/16) */
@@ -1740,23 +4470,13 @@ FRESULT f_mkfs (
             ST_DWORD(&tbl[4], 0xFFFFFFFF);
             ST_DWORD(&tbl[8], 0x0FFFFFFF);    /* Reserve cluster #2 for root dir */
         }
-        if (disk_write(drv, tbl, b_fat++, 1) != RES_OK)
-            return FR_RW_ERROR;
-        memset(tbl, 0, S_SIZ);        /* Following FAT entries are filled by zero */
-        for (n = 1; n < n_fat; n++) {
-            if (disk_write(drv, tbl, b_fat++, 1) != RES_OK)
-                return FR_RW_ERROR;
-        }
-    }
-
-    /* Initialize Root directory */
-    for (m = 0; m < 64; m++) {
-        if (disk_write(drv, tbl, b_fat++, 1) != RES_OK)
+        if (disk_write(drv, tbl, b_fat + n_fat * m, 1) != RES_OK)
             return FR_RW_ERROR;
     }
 
     /* Create FSInfo record if needed */
     if (fmt == FS_FAT32) {
+        memset(tbl, 0, S_SIZ);
         ST_WORD(&tbl[BS_55AA], 0xAA55);
         ST_DWORD(&tbl[FSI_LeadSig], 0x41615252);
         ST_DWORD(&tbl[FSI_StrucSig], 0x61417272);
@@ -39,16 +39,20 @@
 #define _DRIVES        2
 /* Number of logical drives to be used. This affects the size of internal table. */
 
+#ifndef _USE_MKFS
 #define    _USE_MKFS    0
+#endif
 /* When _USE_MKFS is set to 1 and _FS_READONLY is set to 0, f_mkfs function is
-/  enabled. */
+/  enabled. Host tools (tools/mkimage) set it on the compiler command line. */
 
 #define    _MULTI_PARTITION    0
 /* When _MULTI_PARTITION is set to 0, each logical drive is bound to same
 /  physical drive number and can mount only 1st primaly partition. When it is
 /  set to 1, each logical drive can mount a partition listed in Drives[]. */
 
+#ifndef _USE_FSINFO
 #define _USE_FSINFO    0
+#endif
 /* To enable FSInfo support on FAT32 volume, set _USE_FSINFO to 1. */
 
 #define    _USE_SJIS    1
@@ -59,9 +63,102 @@
 /* When _USE_NTFLAG is set to 1, upper/lower case of the file name is preserved.
 /  Note that the files are always accessed in case insensitive. */
 
+#define    _USE_LFN    1
+#define    _MAX_LFN    255
+/* When _USE_LFN is set to 1, long file names are supported with a static
+/  working buffer of (_MAX_LFN + 1) * 2 bytes (not reentrant). Names are
+/  handled as single byte characters, so case folding applies to US-ASCII
+/  only. Short name aliases are made with a hashed numeric tail. */
+
+#ifndef _FS_EXFAT
+#define    _FS_EXFAT    1
+#endif
+/* When _FS_EXFAT is set to 1, exFAT volumes can be mounted, read and written,
+/  and the file size is extended to 64 bits. It requires _USE_LFN. New files
+/  are allocated contiguously (NoFatChain) and only touch the allocation bitmap
+/  until they get fragmented. Cluster size is limited to 1MB. */
+
+#ifndef _FS_FATTYPES
+#define    _FS_FATTYPES    7
+#endif
+/* Bit mask of the FAT sub types to be supported, 1:FAT12, 2:FAT16, 4:FAT32
+/  (exFAT is selected with _FS_EXFAT). Volumes of other types are not mounted
+/  and f_mkfs does not create them. When only one type is left, the FAT
+/  accessors are compiled for that type without any run-time type check.
+/  That needs _FS_EXFAT 0 (or _FS_FATTYPES 0 for an exFAT only build). With
+/  _FS_FATTYPES 4 and exFAT, FAT entries are always 4 bytes and the accessors
+/  are straight-line code that only masks FAT32 entries. A mix with FAT12 or
+/  FAT16 keeps the type switch. tools/fftest has a benchmark (make bench). */
+
+#define    _USE_FASTSEEK    1
+/* When _USE_FASTSEEK is set to 1, f_lseek can use a cluster link map table
+/  given in FIL.cltbl, so that a backward seek does not follow the FAT from
+/  the top of the file. The table is created with f_lseek(fp, CREATE_LINKMAP).
+/  f_truncate sets FIL.cltbl to NULL; set it and create the table again. */
+
+#define    _USE_FORWARD    1
+/* When _USE_FORWARD is set to 1, f_forward function is enabled. It passes file
+/  data to a streaming function straight from the file I/O buffer. */
+
+#define    _USE_WCACHE    1
+/* When _USE_WCACHE is set to 1, f_setwcache function is enabled. It gives a
+/  file a write-back cache of several sectors in a caller's buffer, which is
+/  written with one multiple sector write when full or on f_sync. */
+
+#define    _USE_ERASE    1
+/* When _USE_ERASE is set to 1 and _FS_READONLY is set to 0, f_erasefree function
+/  is enabled. It requires the CTRL_ERASE_SECTOR command in disk_ioctl(). A pass
+/  only visits the clusters freed since the previous pass (all of them after a
+/  mount), and each call examines a bounded number of FAT entries and erases
+/  one run of free clusters, which does not cross an allocation unit boundary
+/  when _USE_AU_ALIGN knows the AU. */
+
+#define    _USE_AU_ALIGN    1
+/* When _USE_AU_ALIGN is set to 1, files that are written or expanded by a
+/  cluster or more at a time start at the first free allocation unit boundary
+/  of the card (GET_AU_SIZE, or GET_BLOCK_SIZE in disk_ioctl()), and f_mkfs
+/  aligns the FATs and the data area to it. */
+
+#define    _FS_RESERVE    4
+/* Number of files that can hold a cluster reservation at a time (0:disabled).
+/  A file that allocates a cluster reserves the clusters that follow it up to
+/  the end of the allocation unit, and other allocations pass over them while
+/  other free clusters are left, so that files written at the same time grow
+/  in contiguous runs. The reservation is released on f_close, or when the
+/  same FIL is given to f_open again. A FIL that is dropped without either
+/  keeps its slot until the volume is mounted again. */
+
+#ifndef _FS_BLOCK
+#define    _FS_BLOCK    1
+#endif
+/* Number of sectors in a logical block (1, 2, 4 or 8). With more than one,
+/  the window and the file I/O buffers hold an aligned block of sectors that
+/  is read with one multiple sector read and written back with one multiple
+/  sector write. 8 gives 4KB blocks, the page size of most cards, at a cost of
+/  3.5KB more RAM per FATFS and FIL object. */
+
+#define    _USE_MNTCACHE    1
+/* When _USE_MNTCACHE is set to 1, the geometry of each mounted volume is kept
+/  in RAM with the CID and CSD of the card (MMC_GET_CID and MMC_GET_CSD in
+/  disk_ioctl()). When the same card is mounted again, such as after the socket
+/  power has been cycled, only the boot sector is read, to check that its
+/  signature, FAT type, cluster size and volume serial number still match;
+/  the MBR, FSInfo and AU size are not read. When they do not match, the
+/  volume is mounted from scratch. A card reformatted in another host with
+/  the same layout and serial number must be mounted after f_mount(drv, NULL). */
+
 
 #include "integer.h"
 
+#if _FS_EXFAT
+#if !_USE_LFN
+#error _FS_EXFAT requires _USE_LFN
+#endif
+typedef QWORD FSIZE_t;        /* File size and pointer */
+#else
+typedef DWORD FSIZE_t;
+#endif
+
 
 
 /* Definitions corresponds to multiple sector size (not tested) */
@@ -71,6 +168,9 @@
 #else
 #define    S_SIZ    512
 #endif
+#if _FS_BLOCK != 1 && _FS_BLOCK != 2 && _FS_BLOCK != 4 && _FS_BLOCK != 8
+#error _FS_BLOCK must be 1, 2, 4 or 8
+#endif
 
 
 /* File system object structure */
@@ -83,9 +183,31 @@ typedef struct _FATFS {
     DWORD    fatbase;        /* FAT start sector */
     DWORD    dirbase;        /* Root directory start sector (cluster# for FAT32) */
     DWORD    database;        /* Data start sector */
+#if _FS_EXFAT
+    DWORD    bitbase;        /* Allocation bitmap start sector (exFAT) */
+#endif
 #if !_FS_READONLY
     DWORD    last_clust;        /* Last allocated cluster */
     DWORD    free_clust;        /* Number of free clusters */
+#if _USE_AU_ALIGN
+    DWORD    au_clust;        /* Clusters per allocation unit (0:no alignment) */
+    DWORD    au_ofs;            /* First cluster# on an allocation unit boundary */
+    DWORD    au_next;        /* AU boundary the next free AU search starts at (0:none is free) */
+    DWORD    au_left;        /* AUs to look at before the search gives up */
+#endif
+#if _USE_ERASE
+    DWORD    ers_lo;            /* Clusters freed since the last erase pass started, */
+    DWORD    ers_hi;            /*   first and last (ers_lo > ers_hi: none) */
+    DWORD    ers_end;        /* End of the erase pass in progress (0:none) */
+#endif
+#if _FS_RESERVE
+    DWORD    rsv_clust[_FS_RESERVE];    /* First cluster of each reserved window */
+    DWORD    rsv_end[_FS_RESERVE];    /* End of each reserved window (0:slot not used) */
+    struct _FIL*    rsv_fil[_FS_RESERVE];    /* File object holding each slot */
+    BYTE    rsv_own;        /* Slot + 1 of the file being allocated to (its window is free to it) */
+    BYTE    rsv_full;        /* 1: no free cluster outside the windows since the last full scan */
+    BYTE    pad4[2];
+#endif
 #if _USE_FSINFO
     DWORD    fsi_sector;        /* fsinfo sector */
     BYTE    fsi_flag;        /* fsinfo dirty flag (1:must be written back) */
@@ -93,7 +215,8 @@ typedef struct _FATFS {
 #endif
 #endif
     BYTE    fs_type;        /* FAT sub type */
-    BYTE    sects_clust;    /* Sectors per cluster */
+    BYTE    pad0;
+    WORD    sects_clust;    /* Sectors per cluster */
 #if S_MAX_SIZ > 512
     WORD    s_size;            /* Sector size */
 #endif
@@ -101,9 +224,18 @@ typedef struct _FATFS {
     BYTE    drive;            /* Physical drive number */
     BYTE    winflag;        /* win[] dirty flag (1:must be written back) */
     BYTE    pad1;
-    BYTE    pad2;
-    BYTE    pad3;
     BYTE    win[S_MAX_SIZ];    /* Disk access window for Directory/FAT */
+#if _FS_BLOCK > 1
+    DWORD    wblk_sect;        /* First sector in wblk[] */
+    DWORD    wblk_end;        /* End of the area read by blocks (0:sector by sector) */
+    BYTE    wblk_n;            /* Number of sectors in wblk[] (0:empty) */
+    BYTE    wblk_dirty;        /* Sectors in wblk[] to be written back (bit0:wblk_sect) */
+    WORD    pad3;
+    BYTE    wblk[_FS_BLOCK * S_MAX_SIZ];    /* Block of sectors around the window */
+#endif
+#if _FS_EXFAT
+    BYTE    dirbuf[64];        /* File and stream extension entries of the found object (exFAT) */
+#endif
 } FATFS;
 
 
@@ -115,6 +247,15 @@ typedef struct _DIR {
     DWORD    sclust;        /* Start cluster */
     DWORD    clust;        /* Current cluster */
     DWORD    sect;        /* Current sector */
+#if _USE_LFN
+    WORD    lfn_idx;    /* Index of the LFN entries of the found object (0xFFFF:none) */
+#endif
+#if _FS_EXFAT
+    DWORD    n_cont;        /* Number of clusters of the contiguous table (0:FAT chain) */
+    DWORD    c_sclust;    /* Start cluster of the containing directory (exFAT) */
+    DWORD    c_ncont;    /* n_cont of the containing directory */
+    WORD    c_index;    /* Index of the entry set in the containing directory */
+#endif
 } DIR;
 
 
@@ -122,28 +263,62 @@ typedef struct _DIR {
 typedef struct _FIL {
     WORD    id;                /* Owner file system mount ID */
     BYTE    flag;            /* File status flags */
-    BYTE    sect_clust;        /* Left sectors in cluster */
+#if !_FS_READONLY && _FS_RESERVE
+    BYTE    rsv;            /* Cluster reservation slot + 1 (0:none) */
+#else
+    BYTE    pad1;
+#endif
+    WORD    sect_clust;        /* Left sectors in cluster */
     FATFS*    fs;                /* Pointer to the owner file system object */
-    DWORD    fptr;            /* File R/W pointer */
-    DWORD    fsize;            /* File size */
+    FSIZE_t    fptr;            /* File R/W pointer */
+    FSIZE_t    fsize;            /* File size */
     DWORD    org_clust;        /* File start cluster */
     DWORD    curr_clust;        /* Current cluster */
     DWORD    curr_sect;        /* Current sector */
+#if _FS_EXFAT
+    DWORD    n_cont;            /* Number of clusters of the contiguous chain (0:FAT chain) */
+#endif
+    DWORD    ext_clust;        /* First cluster of the cached contiguous run of the chain */
+    DWORD    ext_ncl;        /* Number of clusters in the run (0:no run cached) */
+#if _USE_FASTSEEK
+    DWORD*    cltbl;            /* Pointer to the cluster link map table (NULL:not used) */
+#endif
 #if _FS_READONLY == 0
     DWORD    dir_sect;        /* Sector containing the directory entry */
     BYTE*    dir_ptr;        /* Ponter to the directory entry in the window */
+#if _FS_EXFAT
+    DWORD    c_sclust;        /* Start cluster of the containing directory (exFAT) */
+    DWORD    c_ncont;        /* n_cont of the containing directory */
+    WORD    c_index;        /* Index of the entry set in the containing directory */
 #endif
-    BYTE    buffer[S_MAX_SIZ];    /* File R/W buffer */
+#if _USE_WCACHE
+    BYTE*    wc_buf;            /* Write cache buffer (wc_size sectors) */
+    DWORD    wc_sect;        /* Sector of wc_buf[0] */
+    BYTE    wc_size;        /* Sectors in the write cache (0:no cache) */
+    BYTE    wc_n;            /* Sectors held in the write cache */
+#endif
+#endif
+#if _FS_BLOCK > 1
+    DWORD    blk_sect;        /* First sector of the block in buffer[] */
+    BYTE    blk_valid;        /* Sectors of the block held in buffer[] (bit0:blk_sect) */
+    BYTE    blk_dirty;        /* Sectors of the block to be written back */
+    WORD    pad2;
+#endif
+    BYTE    buffer[_FS_BLOCK * S_MAX_SIZ];    /* File R/W buffer */
 } FIL;
 
 
 /* File status structure */
 typedef struct _FILINFO {
-    DWORD fsize;            /* Size */
+    FSIZE_t fsize;            /* Size */
     WORD fdate;                /* Date */
     WORD ftime;                /* Time */
     BYTE fattrib;            /* Attribute */
     char fname[8+1+3+1];    /* Name (8.3 format) */
+#if _USE_LFN
+    char *lfname;            /* Pointer to the LFN buffer (NULL:not needed) */
+    UINT lfsize;            /* Size of the LFN buffer in unit of chars */
+#endif
 } FILINFO;
 
 
@@ -197,7 +372,8 @@ FRESULT f_mount (BYTE, FATFS*);                        /* Mount/Unmount a logica
 FRESULT f_open (FIL*, const char*, BYTE);            /* Open or create a file */
 FRESULT f_read (FIL*, void*, WORD, WORD*);            /* Read data from a file */
 FRESULT f_write (FIL*, const void*, WORD, WORD*);    /* Write data to a file */
-FRESULT f_lseek (FIL*, DWORD);                        /* Move file pointer of a file object */
+FRESULT f_forward (FIL*, UINT(*)(const BYTE*,UINT), UINT, UINT*);    /* Forward data to the stream */
+FRESULT f_lseek (FIL*, FSIZE_t);                    /* Move file pointer of a file object */
 FRESULT f_close (FIL*);                                /* Close an open file object */
 FRESULT f_opendir (DIR*, const char*);                /* Open an existing directory */
 FRESULT f_readdir (DIR*, FILINFO*);                    /* Read a directory item */
@@ -209,6 +385,9 @@ FRESULT    f_mkdir (const char*);                        /* Create a new directo
 FRESULT f_chmod (const char*, BYTE, BYTE);            /* Change file/dir attriburte */
 FRESULT f_rename (const char*, const char*);        /* Rename/Move a file or directory */
 FRESULT f_mkfs (BYTE, BYTE, BYTE);                    /* Create a file system on the drive */
+FRESULT f_truncate (FIL*);                            /* Truncate a file at the R/W pointer */
+FRESULT f_setwcache (FIL*, BYTE*, UINT);            /* Give a file a multiple sector write cache */
+FRESULT f_erasefree (const char*, DWORD*, DWORD);    /* Pre-erase a run of free clusters on the drive */
 
 
 /* User defined function to give a current time to fatfs module */
@@ -238,6 +417,15 @@ DWORD get_fattime (void);    /* 31-25: Year(0-127 org.1980), 24-21: Month(1-12),
 #define FS_FAT12    1
 #define FS_FAT16    2
 #define FS_FAT32    3
+#define FS_EXFAT    4
+
+
+/* Offset to give f_lseek to create the cluster link map table */
+#define CREATE_LINKMAP    ((FSIZE_t)0 - 1)
+
+
+/* Option flag to add to the partitioning rule of f_mkfs */
+#define FM_QUICK    0x10    /* Clear only the FAT sectors that map clusters of the volume */
 
 
 /* File attribute bits for directory entry */
@@ -288,6 +476,16 @@ DWORD get_fattime (void);    /* 31-25: Year(0-127 org.1980), 24-21: Month(1-12),
 #define BS_VolLab32            71
 #define BS_FilSysType32        82
 
+#define BPB_FatOfsEx        80
+#define BPB_FatSzEx            84
+#define BPB_DataOfsEx        88
+#define BPB_NumClusEx        92
+#define BPB_RootClusEx        96
+#define BS_VolIDEx            100
+#define BPB_FSVerEx            104
+#define BPB_BytsPerSecEx    108
+#define BPB_SecPerClusEx    109
+
 #define    FSI_LeadSig            0
 #define    FSI_StrucSig        484
 #define    FSI_Free_Count        488
@@ -305,6 +503,24 @@ DWORD get_fattime (void);    /* 31-25: Year(0-127 org.1980), 24-21: Month(1-12),
 #define    DIR_WrtDate            24
 #define    DIR_FstClusLO        26
 #define    DIR_FileSize        28
+#define    LDIR_Ord            0
+#define    LDIR_Attr            11
+#define    LDIR_Type            12
+#define    LDIR_Chksum            13
+#define    LDIR_FstClusLO        26
+
+#define    XDIR_Type            0        /* exFAT entry set in FATFS.dirbuf[] */
+#define    XDIR_NumSec            1
+#define    XDIR_SetSum            2
+#define    XDIR_Attr            4
+#define    XDIR_CrtTime        8
+#define    XDIR_ModTime        12
+#define    XDIR_GenFlags        33
+#define    XDIR_NumName        35
+#define    XDIR_NameHash        36
+#define    XDIR_ValidFileSize    40
+#define    XDIR_FstClus        52
+#define    XDIR_FileSize        56
 
 
 
@@ -325,6 +541,8 @@ DWORD get_fattime (void);    /* 31-25: Year(0-127 org.1980), 24-21: Month(1-12),
 #error Do not forget to set _MCU_ENDIAN properly!
 #endif
 #endif
+#define    LD_QWORD(ptr)        (QWORD)(((QWORD)LD_DWORD((ptr)+4)<<32)|LD_DWORD(ptr))
+#define    ST_QWORD(ptr,val)    do { ST_DWORD(ptr,(DWORD)(val)); ST_DWORD((ptr)+4,(DWORD)((QWORD)(val)>>32)); } while (0)
 
 
 #define _FATFS
@@ -0,0 +1,45 @@
+/*-----------------------------------------------------------------------
+/  Storage stack event tracing
+/-----------------------------------------------------------------------*/
+
+#ifndef _FFTRACE
+
+#define _USE_TRACE	0	/* 1: Record trace events into a ring buffer */
+
+#include "integer.h"
+
+
+/* Trace event IDs (argument of the begin / end event) */
+
+#define TR_F_WRITE		1	/* f_write (B: bytes to write, E: result) */
+#define TR_WIN_HIT		2	/* move_window, sector already in the window (sector) */
+#define TR_WIN_MISS		3	/* move_window loads a sector (B: sector) */
+#define TR_CREATE_CHAIN	4	/* create_chain (B: cluster to stretch, E: new cluster) */
+#define TR_SEND_CMD		5	/* send_cmd (B: command, E: response) */
+#define TR_WAIT_READY	6	/* wait_ready (E: last byte received) */
+#define TR_DMA_TX		7	/* Sector transmit DMA (B: length) */
+#define TR_DMA_RX		8	/* Sector receive DMA (B: length) */
+#define TR_SSI_ISR		9	/* SSI interrupt entry (interrupt status) */
+#define TR_IO_WAIT		10	/* Request waits for the I/O task (B: sector, E: result) */
+
+#define TR_BEGIN		0x40	/* Event phase flags, none for an instant event */
+#define TR_END			0x80
+
+
+#if _USE_TRACE
+/* Provided by the platform: stamp and store one event, callable from ISRs */
+void ff_trace (BYTE ev, DWORD arg);
+void ff_trace_dump (void);
+
+#define TRACE_B(id, arg)	ff_trace((id) | TR_BEGIN, (DWORD)(arg))
+#define TRACE_E(id, arg)	ff_trace((id) | TR_END, (DWORD)(arg))
+#define TRACE_I(id, arg)	ff_trace((id), (DWORD)(arg))
+#else
+#define TRACE_B(id, arg)
+#define TRACE_E(id, arg)
+#define TRACE_I(id, arg)
+#endif
+
+
+#define _FFTRACE
+#endif
@@ -18,6 +18,9 @@ typedef signed long		LONG;
 typedef unsigned long	ULONG;
 typedef unsigned long	DWORD;
 
+/* This type is assumed as 64-bit integer */
+typedef unsigned long long	QWORD;
+
 /* Boolean type */
 typedef enum { FALSE = 0, TRUE } BOOL;
 
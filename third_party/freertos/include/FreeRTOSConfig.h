@@ -92,7 +92,7 @@
 to exclude the API function. */
 
 #define INCLUDE_vTaskPrioritySet            1
-#define INCLUDE_uxTaskPriorityGet           0//1
+#define INCLUDE_uxTaskPriorityGet           1
 #define INCLUDE_vTaskDelete                 0//1
 #define INCLUDE_vTaskCleanUpResources       0
 #define INCLUDE_vTaskSuspend                1
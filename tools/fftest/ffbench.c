@@ -0,0 +1,129 @@
+/*
+ * Host benchmark of the FAT accessors of ff.c.
+ *
+ *   ffbench IMAGE
+ *
+ * For each FAT type this build of ff.c supports, formats a scratch IMAGE,
+ * makes one file that takes every free cluster, and times f_lseek
+ * following its chain from the top to the end and f_getfree counting the
+ * free clusters.  Both go through get_cluster() once per cluster.  The
+ * best of BENCH_RUNS is printed in timer ticks per cluster: the time stamp
+ * counter on x86, nanoseconds elsewhere.  "make bench" builds it for a
+ * set of _FS_FATTYPES and _FS_EXFAT values and prints the size of ff.o.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ff.h"
+#include "diskio_file.h"
+
+#define BENCH_RUNS      200
+#define BENCH_AU        8192
+
+static FATFS fatfs;
+
+static unsigned long long
+ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Formats nsect sectors with clusters of csize sectors, which must give a
+ * volume of type fmt, and prints the ticks per cluster of f_lseek and
+ * f_getfree.  Returns 0 if the volume cannot be made.
+ */
+static int
+bench(const char *path, const char *name, BYTE fmt, DWORD nsect, BYTE csize)
+{
+  unsigned long long t, best_seek = ~0ULL, best_free = ~0ULL;
+  DWORD nfree, nclust;
+  FATFS *fs;
+  FIL fil;
+  int i, ok;
+
+  if (DiskFileOpen(path, nsect, BENCH_AU, 1))
+  {
+    return 0;
+  }
+  f_mount(0, &fatfs);
+  ok = f_mkfs(0, 0, csize) == FR_OK && f_getfree("", &nfree, &fs) == FR_OK
+       && fs->fs_type == fmt
+       && f_open(&fil, "CHAIN.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK;
+  if (ok)
+  {
+    /* Seeking past the end allocates the chain without writing data */
+    ok = f_lseek(&fil, (nfree - 1) * csize * 512) == FR_OK;
+    ok = f_close(&fil) == FR_OK && ok
+         && f_open(&fil, "CHAIN.BIN", FA_READ) == FR_OK;
+  }
+  nclust = ok ? (DWORD)(fil.fsize / (csize * 512)) : 0;
+
+  for (i = 0; ok && i < BENCH_RUNS; i++)
+  {
+    ok = f_lseek(&fil, 0) == FR_OK;
+    t = ticks();
+    ok = ok && f_lseek(&fil, fil.fsize) == FR_OK;
+    t = ticks() - t;
+    if (t < best_seek)
+    {
+      best_seek = t;
+    }
+
+    fatfs.free_clust = 0xFFFFFFFF;    /* Count again */
+    t = ticks();
+    ok = ok && f_getfree("", &nfree, &fs) == FR_OK;
+    t = ticks() - t;
+    if (t < best_free)
+    {
+      best_free = t;
+    }
+  }
+  if (ok)
+  {
+    printf("%-6s %7lu clusters  f_lseek %6.2f  f_getfree %6.2f  ticks/cluster\n",
+           name, (unsigned long)nclust, (double)best_seek / nclust,
+           (double)best_free / (fatfs.max_clust - 2));
+  }
+  f_close(&fil);
+  f_mount(0, NULL);
+  DiskFileClose();
+  unlink(path);
+  return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+  int failed = 0;
+
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: ffbench IMAGE\n");
+    return 2;
+  }
+#if _FS_FATTYPES & 1
+  failed += !bench(argv[1], "FAT12", FS_FAT12, 4096, 1);
+#endif
+#if _FS_FATTYPES & 2
+  failed += !bench(argv[1], "FAT16", FS_FAT16, 64UL * 2048, 4);
+#endif
+#if _FS_FATTYPES & 4
+  failed += !bench(argv[1], "FAT32", FS_FAT32, 64UL * 2048, 1);
+#endif
+  if (failed)
+  {
+    fprintf(stderr, "ffbench: cannot make %d of the volumes\n", failed);
+  }
+  return failed;
+}
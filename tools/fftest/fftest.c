@@ -0,0 +1,2085 @@
+/*
+ * Host regression checks for ff.c.
+ *
+ *   fftest IMAGE
+ *
+ * Formats a scratch IMAGE with the target's own ff.c over the file-backed
+ * disk of tools/mkimage, runs each check on it and removes it again.  The
+ * exFAT checks format the image again with format_exfat().  Every check
+ * prints one line; the exit status is the number of failed checks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_file.h"
+#include "sd_log.h"
+#include "sd_tslog.h"
+#include "sd_zlog.h"
+
+#define IMAGE_SECTORS   (64UL * 1024 * 2)   /* 64 MB */
+#define IMAGE_AU        8192
+#define CLUSTER_SECTORS 4
+#define SECTOR_SIZE     512
+#define CLUSTER_SIZE    (CLUSTER_SECTORS * SECTOR_SIZE)
+#define FILE_SIZE       (5 * CLUSTER_SIZE + 100)
+#define FORWARD_CHUNK   100     /* Most bytes the consumer takes per call */
+#define NAMES_SIMILAR   1500    /* Long names that share their SFN basis */
+#define NAMES_SAME_HASH 200     /* of which the first ones also share the tail hash */
+#define NAMES_MORE      100     /* Created again after renames and unlinks */
+#define EXFAT_FAT_OFS   32      /* First sector of the FAT on exFAT */
+#define EXFAT_CLUST_SHIFT 3     /* 4KB clusters on exFAT */
+#define EXFAT_CLUSTER   (SECTOR_SIZE << EXFAT_CLUST_SHIFT)
+#define EXFAT_SETS      150     /* Files in the entry set directory */
+#define LOG_CUTS        16      /* Power cuts in the middle of a log session */
+#define TSLOG_CUTS      6       /* Time series logs ended by a power cut */
+#define TSLOG_RECORDS   20000   /* Records in the time series log closed cleanly */
+#define TSLOG_SEEKS     300
+#define ZLOG_STREAM     (4UL * 1024 * 1024)     /* Bytes of samples in the compressed log */
+#define ZLOG_NOISE      (512UL * 1024)          /* Bytes of noise, which does not compress */
+#define ZLOG_SEEKS      500
+#define CHAIN_FILES     4       /* Files written and cut at the same time */
+#define CHAIN_ROUNDS    600
+#define MKFS_FILL       16384   /* Sectors filled with a pattern before f_mkfs */
+#define MKFS_PATTERN    0xA5
+#define WCACHE_SECTORS  16
+#define WCACHE_SIZE     (200UL * 1024)  /* Bytes appended 30 to 80 at a time */
+#define WCACHE_SEED     0x5A
+#define STRESS_FILES    3
+#define STRESS_SIZE     (768UL * 1024)  /* Most bytes in each file */
+#define STRESS_ROUNDS   4000
+#define STRESS_WRITE    4096            /* Most bytes in one write */
+
+static FATFS fatfs;
+static DWORD rnd_state = 1;
+
+/* Consumer state for the f_forward checks */
+static DWORD fwd_pos;           /* File offset of the next byte to take */
+static DWORD fwd_refuse;        /* Offset where the consumer takes nothing once */
+static int fwd_refused;
+static int fwd_bad;
+static UINT fwd_most;           /* Most bytes offered in one call */
+
+static BYTE
+pattern(DWORD ofs)
+{
+  return (BYTE)(ofs ^ (ofs >> 9) ^ (ofs >> 11));
+}
+
+/* Repeatable pseudo random numbers, 15 bits */
+static DWORD
+rnd(void)
+{
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return (rnd_state >> 16) & 0x7FFF;
+}
+
+static int
+report(const char *name, int ok)
+{
+  printf("%-44s %s\n", name, ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}
+
+/* Writes len bytes of the pattern at ofs of an open file */
+static FRESULT
+put_data(FIL *fil, DWORD ofs, DWORD len, BYTE seed)
+{
+  BYTE buf[SECTOR_SIZE];
+  FRESULT res;
+  DWORD end = ofs + len;
+  WORD n, bw;
+
+  res = f_lseek(fil, ofs);
+  while (res == FR_OK && ofs < end)
+  {
+    n = end - ofs < sizeof buf ? (WORD)(end - ofs) : sizeof buf;
+    for (bw = 0; bw < n; bw++)
+    {
+      buf[bw] = pattern(ofs + bw) + seed;
+    }
+    res = f_write(fil, buf, n, &bw);
+    if (res == FR_OK && bw != n)
+    {
+      res = FR_DENIED;
+    }
+    ofs += n;
+  }
+  return res;
+}
+
+/* Writes len bytes of the pattern at ofs, a new file if ofs is 0 */
+static FRESULT
+put_file(const char *path, DWORD ofs, DWORD len, BYTE seed)
+{
+  FIL fil;
+  FRESULT res;
+
+  res = f_open(&fil, path, ofs ? (FA_OPEN_ALWAYS | FA_WRITE) : (FA_CREATE_ALWAYS | FA_WRITE));
+  if (res == FR_OK)
+  {
+    res = put_data(&fil, ofs, len, seed);
+  }
+  if (res != FR_OK)
+  {
+    f_close(&fil);
+    return res;
+  }
+  return f_close(&fil);
+}
+
+/* Is the file len bytes of the pattern? */
+static int
+file_is(const char *path, DWORD len, BYTE seed)
+{
+  BYTE buf[SECTOR_SIZE];
+  FIL fil;
+  DWORD ofs;
+  WORD br, i;
+  int ok;
+
+  if (f_open(&fil, path, FA_READ) != FR_OK)
+  {
+    return 0;
+  }
+  ok = fil.fsize == len;
+  for (ofs = 0; ok && ofs < len; ofs += br)
+  {
+    ok = f_read(&fil, buf, sizeof buf, &br) == FR_OK && br;
+    for (i = 0; ok && i < br; i++)
+    {
+      ok = buf[i] == (BYTE)(pattern(ofs + i) + seed);
+    }
+  }
+  f_close(&fil);
+  return ok;
+}
+
+/*-----------------------------------------------------------------------*/
+/* f_forward                                                             */
+/*-----------------------------------------------------------------------*/
+
+/* Takes up to FORWARD_CHUNK bytes, stops at fwd_refuse and refuses once */
+static UINT
+forward_consumer(const BYTE *data, UINT n)
+{
+  UINT i;
+
+  if (!data)
+  {
+    return 1;   /* Always ready */
+  }
+  if (fwd_pos == fwd_refuse && !fwd_refused)
+  {
+    fwd_refused = 1;
+    return 0;
+  }
+  if (n > fwd_most)
+  {
+    fwd_most = n;
+  }
+  if (n > FORWARD_CHUNK)
+  {
+    n = FORWARD_CHUNK;
+  }
+  if (fwd_pos < fwd_refuse && n > fwd_refuse - fwd_pos)
+  {
+    n = fwd_refuse - fwd_pos;
+  }
+  for (i = 0; i < n; i++)
+  {
+    if (data[i] != pattern(fwd_pos + i))
+    {
+      fwd_bad++;
+    }
+  }
+  fwd_pos += n;
+  return n;
+}
+
+/*
+ * The consumer refuses with the file pointer at refuse.  The first call
+ * must stop there, and the rest of the file must then come out unchanged,
+ * from f_read for one sector and from a second f_forward for the rest.
+ * With _FS_BLOCK > 1 some call must be offered more than one sector, as a
+ * cluster of CLUSTER_SECTORS spans at least two sectors of one block.
+ */
+static int
+check_forward_refusal(const char *path, DWORD refuse)
+{
+  BYTE buf[SECTOR_SIZE];
+  FIL fil;
+  UINT bf;
+  WORD br, i;
+  int ok;
+
+  fwd_pos = 0;
+  fwd_refuse = refuse;
+  fwd_refused = 0;
+  fwd_bad = 0;
+  fwd_most = 0;
+
+  if (f_open(&fil, path, FA_READ) != FR_OK)
+  {
+    return 0;
+  }
+  ok = f_forward(&fil, forward_consumer, FILE_SIZE, &bf) == FR_OK
+       && fwd_refused && bf == refuse && fil.fptr == refuse;
+
+  /* f_read continues at the first byte not taken */
+  ok = ok && f_read(&fil, buf, sizeof buf, &br) == FR_OK && br == sizeof buf;
+  for (i = 0; ok && i < br; i++)
+  {
+    ok = buf[i] == pattern(refuse + i);
+  }
+  fwd_pos += br;
+
+  /* and so does f_forward */
+  ok = ok && f_forward(&fil, forward_consumer, FILE_SIZE, &bf) == FR_OK
+       && bf == FILE_SIZE - refuse - sizeof buf && fwd_pos == FILE_SIZE && !fwd_bad;
+  ok = ok && (_FS_BLOCK > 1 ? fwd_most > SECTOR_SIZE : fwd_most <= SECTOR_SIZE);
+
+  f_close(&fil);
+  return ok;
+}
+
+#if _USE_LFN
+/*-----------------------------------------------------------------------*/
+/* Long file names                                                       */
+/*-----------------------------------------------------------------------*/
+
+static char names_sfn[NAMES_SIMILAR + NAMES_MORE][8 + 1 + 3 + 1];
+static char names_sfx[NAMES_SAME_HASH][4];
+
+/* CRC-16 of a name, as hash_lfn() in ff.c makes it for the numeric tail */
+static WORD
+name_hash(WORD seed, const char *s)
+{
+  DWORD sr = seed;
+  WORD c;
+  int i;
+
+  for (; *s; s++)
+  {
+    c = (BYTE)*s;
+    for (i = 0; i < 16; i++)
+    {
+      sr = (sr << 1) + (c & 1);
+      c >>= 1;
+      if (sr & 0x10000)
+      {
+        sr ^= 0x11021;
+      }
+    }
+  }
+  return (WORD)sr;
+}
+
+/*
+ * Picks a three character suffix for each of the first NAMES_SAME_HASH
+ * names that gives them all the hash of the first one, so they share an
+ * SFN up to the tail number and use up all nine tails of a hash.
+ */
+static void
+make_same_hash(void)
+{
+  static const char chars[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz-_";
+  char name[48], *sfx;
+  WORD want = 0, sr;
+  long a;
+  int k;
+
+  for (k = 0; k < NAMES_SAME_HASH; k++)
+  {
+    sprintf(name, "Similar long file name %04d ", k);
+    sr = name_hash(0, name);
+    sfx = names_sfx[k];
+    for (a = 0; a < 64L * 64 * 64; a++)    /* Most likely found well before the end */
+    {
+      sfx[0] = chars[a >> 12];
+      sfx[1] = chars[(a >> 6) & 63];
+      sfx[2] = chars[a & 63];
+      sfx[3] = '\0';
+      if (!k)
+      {
+        want = name_hash(name_hash(sr, sfx), ".log");
+      }
+      if (name_hash(name_hash(sr, sfx), ".log") == want)
+      {
+        break;
+      }
+    }
+  }
+}
+
+static void
+similar_name(char *path, int k)
+{
+  if (k < NAMES_SAME_HASH)
+  {
+    sprintf(path, "Tails/Similar long file name %04d %.3s.log", k, names_sfx[k]);
+  }
+  else
+  {
+    sprintf(path, "Tails/Similar long file name %04d.log", k);
+  }
+}
+
+/* Flips the case of every letter */
+static void
+flip_case(char *s)
+{
+  for (; *s; s++)
+  {
+    if (*s >= 'a' && *s <= 'z')
+    {
+      *s -= 0x20;
+    }
+    else if (*s >= 'A' && *s <= 'Z')
+    {
+      *s += 0x20;
+    }
+  }
+}
+
+static int
+sfn_cmp(const void *a, const void *b)
+{
+  return strcmp(a, b);
+}
+
+/*
+ * Reads the Tails directory.  Every entry must have a unique SFN, and the
+ * long names seen must be exactly the similar names in want[] (1: there),
+ * plus renamed ones.  The SFN of each similar name goes to names_sfn[].
+ */
+static int
+scan_tails(const BYTE *want, int nwant, int nrenamed)
+{
+  static char sorted[NAMES_SIMILAR + NAMES_MORE][8 + 1 + 3 + 1];
+  char lfn[_MAX_LFN + 1];
+  int seen[NAMES_SIMILAR + NAMES_MORE];
+  FILINFO fi;
+  DIR dir;
+  int n = 0, renamed = 0, k, i;
+
+  memset(seen, 0, sizeof seen);
+  fi.lfname = lfn;
+  fi.lfsize = sizeof lfn;
+  if (f_opendir(&dir, "Tails") != FR_OK)
+  {
+    return 0;
+  }
+  for (;;)
+  {
+    if (f_readdir(&dir, &fi) != FR_OK)
+    {
+      return 0;
+    }
+    if (!fi.fname[0])
+    {
+      break;
+    }
+    if (n == NAMES_SIMILAR + NAMES_MORE)
+    {
+      return 0;
+    }
+    strcpy(sorted[n++], fi.fname);
+    if (sscanf(lfn, "Similar long file name %d", &k) == 1 && k >= 0 && k < nwant)
+    {
+      seen[k]++;
+      strcpy(names_sfn[k], fi.fname);
+    }
+    else if (sscanf(lfn, "Renamed %d", &k) == 1)
+    {
+      renamed++;
+    }
+    else
+    {
+      return 0;
+    }
+  }
+
+  for (k = 0; k < nwant; k++)
+  {
+    if (seen[k] != want[k])
+    {
+      return 0;
+    }
+  }
+  if (renamed != nrenamed)
+  {
+    return 0;
+  }
+  qsort(sorted, n, sizeof sorted[0], sfn_cmp);
+  for (i = 1; i < n; i++)
+  {
+    if (!strcmp(sorted[i - 1], sorted[i]))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Opens path and checks that it is the file created for index k */
+static int
+is_file(const char *path, int k)
+{
+  FIL fil;
+  WORD br;
+  int v = -1;
+
+  if (f_open(&fil, path, FA_READ) != FR_OK)
+  {
+    return 0;
+  }
+  if (f_read(&fil, &v, sizeof v, &br) != FR_OK || br != sizeof v)
+  {
+    v = -1;
+  }
+  f_close(&fil);
+  return v == k;
+}
+
+static int
+create_similar(int k)
+{
+  char path[64];
+  FIL fil;
+  WORD bw;
+
+  similar_name(path, k);
+  return f_open(&fil, path, FA_CREATE_NEW | FA_WRITE) == FR_OK
+         && f_write(&fil, &k, sizeof k, &bw) == FR_OK && bw == sizeof k
+         && f_close(&fil) == FR_OK;
+}
+
+/*
+ * NAMES_SIMILAR long names with the same SFN basis get numeric tails that
+ * must all differ, NAMES_SAME_HASH of them with the same hash too.  Each file must then be found by its long name in any
+ * case and by its SFN, and the tails must stay unique after renames,
+ * unlinks and new files that reuse the freed tails.
+ */
+static int
+check_name_tails(void)
+{
+  static BYTE want[NAMES_SIMILAR + NAMES_MORE];
+  char path[64], path2[64];
+  FILINFO fi;
+  int k, nrenamed = 0, ok;
+
+  fi.lfname = NULL;
+  make_same_hash();
+  ok = f_mkdir("Tails") == FR_OK;
+  for (k = 0; ok && k < NAMES_SIMILAR; k++)
+  {
+    ok = create_similar(k);
+    want[k] = 1;
+  }
+  ok = ok && scan_tails(want, NAMES_SIMILAR, 0);
+
+  /* Case insensitive and SFN lookups */
+  for (k = 0; ok && k < NAMES_SIMILAR; k += 7)
+  {
+    similar_name(path, k);
+    flip_case(path + 6);
+    sprintf(path2, "Tails/%.12s", names_sfn[k]);
+    ok = is_file(path, k) && is_file(path2, k);
+  }
+
+  /* Rename and unlink some of them */
+  for (k = 0; ok && k < NAMES_SIMILAR; k += 10)
+  {
+    similar_name(path, k);
+    sprintf(path2, "Tails/Renamed %04d with a long name.log", k);
+    ok = f_rename(path, path2) == FR_OK && is_file(path2, k)
+         && f_stat(path, &fi) == FR_NO_FILE;
+    want[k] = 0;
+    nrenamed++;
+    if (ok && k + 5 < NAMES_SIMILAR)
+    {
+      similar_name(path, k + 5);
+      ok = f_unlink(path) == FR_OK && f_stat(path, &fi) == FR_NO_FILE;
+      want[k + 5] = 0;
+    }
+  }
+
+  /* and create more that may take the freed tails */
+  for (k = NAMES_SIMILAR; ok && k < NAMES_SIMILAR + NAMES_MORE; k++)
+  {
+    ok = create_similar(k);
+    want[k] = 1;
+  }
+  ok = ok && scan_tails(want, NAMES_SIMILAR + NAMES_MORE, nrenamed);
+  for (k = 1; ok && k < NAMES_SIMILAR + NAMES_MORE; k += 11)
+  {
+    if (want[k])
+    {
+      sprintf(path2, "Tails/%.12s", names_sfn[k]);
+      ok = is_file(path2, k);
+    }
+  }
+  return ok;
+}
+
+/* A name of _MAX_LFN characters is created and read back, one more is refused */
+static int
+check_name_limit(void)
+{
+  char name[_MAX_LFN + 2], lfn[_MAX_LFN + 1];
+  FILINFO fi;
+  FIL fil;
+  DIR dir;
+  int ok, found = 0;
+
+  memset(name, 'n', _MAX_LFN);
+  memcpy(name + _MAX_LFN - 4, ".txt", 4);
+  name[_MAX_LFN] = '\0';
+  ok = f_open(&fil, name, FA_CREATE_NEW | FA_WRITE) == FR_OK && f_close(&fil) == FR_OK;
+
+  fi.lfname = lfn;
+  fi.lfsize = sizeof lfn;
+  ok = ok && f_opendir(&dir, "") == FR_OK;
+  while (ok && f_readdir(&dir, &fi) == FR_OK && fi.fname[0])
+  {
+    found += !strcmp(lfn, name);
+  }
+  ok = ok && found == 1 && f_stat(name, &fi) == FR_OK && f_unlink(name) == FR_OK;
+
+  memset(name, 'n', _MAX_LFN + 1);
+  memcpy(name + _MAX_LFN + 1 - 4, ".txt", 4);
+  name[_MAX_LFN + 1] = '\0';
+  return ok && f_open(&fil, name, FA_CREATE_NEW | FA_WRITE) == FR_INVALID_NAME
+         && f_stat(name, &fi) == FR_INVALID_NAME;
+}
+
+/* Names that differ only in case are the same file */
+static int
+check_name_case(void)
+{
+  FILINFO fi;
+  FIL fil;
+  int ok;
+
+  fi.lfname = NULL;
+  ok = f_open(&fil, "Case Only Name.txt", FA_CREATE_NEW | FA_WRITE) == FR_OK
+       && f_close(&fil) == FR_OK
+       && f_open(&fil, "Short.txt", FA_CREATE_NEW | FA_WRITE) == FR_OK
+       && f_close(&fil) == FR_OK;
+  ok = ok && f_open(&fil, "CASE ONLY NAME.TXT", FA_CREATE_NEW | FA_WRITE) == FR_EXIST
+       && f_open(&fil, "SHORT.TXT", FA_CREATE_NEW | FA_WRITE) == FR_EXIST
+       && f_open(&fil, "short.TXT", FA_CREATE_NEW | FA_WRITE) == FR_EXIST
+       && f_rename("Short.txt", "case only name.TXT") == FR_EXIST
+       && f_rename("Case Only Name.txt", "SHORT.txt") == FR_EXIST
+       && f_stat("cASE oNLY nAME.TXT", &fi) == FR_OK;
+  return ok && f_unlink("case only name.txt") == FR_OK && f_unlink("short.txt") == FR_OK
+         && f_stat("Case Only Name.txt", &fi) == FR_NO_FILE;
+}
+#endif
+
+#if _FS_RESERVE
+/*-----------------------------------------------------------------------*/
+/* Cluster reservation                                                   */
+/*-----------------------------------------------------------------------*/
+
+static int
+reserve_slots_used(void)
+{
+  int i, n = 0;
+
+  for (i = 0; i < _FS_RESERVE; i++)
+  {
+    if (fatfs.rsv_end[i])
+    {
+      n++;
+    }
+  }
+  return n;
+}
+
+/*
+ * One FIL is opened for writing over and over without f_close.  Each open
+ * must return the slot of the one before, so only one slot is ever in use.
+ */
+static int
+check_reserve_reopen(void)
+{
+  static BYTE buf[CLUSTER_SIZE];
+  char path[16];
+  FIL fil;
+  WORD bw;
+  int i, ok = 1;
+
+  for (i = 0; ok && i < 2 * _FS_RESERVE; i++)
+  {
+    sprintf(path, "RSV%d.BIN", i);
+    ok = f_open(&fil, path, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK
+         && f_write(&fil, buf, sizeof buf, &bw) == FR_OK && bw == sizeof buf
+         && f_sync(&fil) == FR_OK && reserve_slots_used() == 1;
+  }
+  ok = ok && f_close(&fil) == FR_OK && reserve_slots_used() == 0;
+  return ok;
+}
+
+#if _FS_FATTYPES & 2
+/* Appends one cluster */
+static int
+put_cluster_of(FIL *fil)
+{
+  static BYTE buf[CLUSTER_SIZE];
+  WORD bw;
+
+  return f_write(fil, buf, sizeof buf, &bw) == FR_OK && bw == sizeof buf;
+}
+
+/*
+ * On a fresh volume A takes one cluster and a window after it, and B is
+ * written until the only free clusters left are in the window of A.  Then
+ * B takes half of them from the far end of the window, each for far fewer
+ * sector reads than a scan of the FAT.  A cut of B frees clusters outside
+ * the windows, and B must grow into them again, not into the window.
+ * Once B takes from the window again, closing A must open the rest of it
+ * to a new file C, up to the last cluster of the volume.
+ */
+static int
+check_reserve_full(void)
+{
+  FIL a, b, c;
+  DWORD nfree, wfree, end, reads, i;
+  FATFS *fs;
+  BYTE slot;
+  int ok;
+
+  ok = f_mkfs(0, FM_QUICK, CLUSTER_SECTORS) == FR_OK && f_mount(0, &fatfs) == FR_OK
+       && f_open(&a, "A.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK && put_cluster_of(&a)
+       && f_open(&b, "B.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK
+       && f_getfree("", &nfree, &fs) == FR_OK && a.rsv;
+  if (!ok)
+  {
+    return 0;
+  }
+  slot = a.rsv - 1;
+  end = fatfs.rsv_end[slot];
+  wfree = end - fatfs.rsv_clust[slot];    /* All free on a fresh volume */
+  while (ok && fatfs.free_clust > wfree)
+  {
+    ok = put_cluster_of(&b);
+  }
+
+  reads = DiskFileReads();
+  for (i = 0; ok && i < wfree / 2; i++)
+  {
+    ok = put_cluster_of(&b);
+  }
+  reads = DiskFileReads() - reads;
+  ok = ok && reads < i / 4 && fatfs.rsv_end[slot] == end - i && fatfs.free_clust == wfree - i;
+
+  /* The cut clears the hint, so the window is left alone */
+  ok = ok && f_lseek(&b, b.fsize - 8 * CLUSTER_SIZE) == FR_OK && f_truncate(&b) == FR_OK;
+  for (i = 0; ok && i < 8; i++)
+  {
+    ok = put_cluster_of(&b);
+  }
+  ok = ok && fatfs.rsv_end[slot] == end - wfree / 2 && fatfs.free_clust == wfree - wfree / 2;
+
+  ok = ok && put_cluster_of(&b) && fatfs.free_clust == wfree - wfree / 2 - 1
+       && f_close(&a) == FR_OK && f_open(&c, "C.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK;
+  for (i = 0; ok && i < wfree - wfree / 2 - 1; i++)
+  {
+    ok = put_cluster_of(&c);
+  }
+  ok = ok && fatfs.free_clust == 0 && f_close(&c) == FR_OK;
+
+  ok = f_close(&b) == FR_OK && ok;
+  f_close(&a);
+  return ok && reserve_slots_used() == 0 && f_unlink("C.BIN") == FR_OK
+         && f_getfree("", &nfree, &fs) == FR_OK && nfree == wfree - wfree / 2 - 1;
+}
+#endif
+
+/*
+ * f_close must give the slot back even when its f_sync fails, here on a
+ * card that has lost its supply.
+ */
+static int
+check_reserve_close_error(void)
+{
+  static BYTE buf[100];
+  FIL fil;
+  WORD bw;
+  int ok;
+
+  ok = f_open(&fil, "CUT.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK
+       && f_write(&fil, buf, sizeof buf, &bw) == FR_OK && bw == sizeof buf
+       && reserve_slots_used() == 1;
+  DiskFileCutPower(0);
+  ok = ok && f_close(&fil) != FR_OK && reserve_slots_used() == 0;
+  DiskFileCutPower(-1);
+  return ok;
+}
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Chain removal and f_truncate                                          */
+/*-----------------------------------------------------------------------*/
+
+/* 1 if every FAT copy holds the same as the first one */
+static int
+fats_agree(void)
+{
+  BYTE a[SECTOR_SIZE], b[SECTOR_SIZE];
+  DWORD i;
+  UINT m;
+
+  for (i = 0; i < fatfs.sects_fat; i++)
+  {
+    if (disk_read(0, a, fatfs.fatbase + i, 1) != RES_OK)
+    {
+      return 0;
+    }
+    for (m = 1; m < fatfs.n_fats; m++)
+    {
+      if (disk_read(0, b, fatfs.fatbase + m * fatfs.sects_fat + i, 1) != RES_OK
+          || memcmp(a, b, sizeof a))
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static DWORD
+clusters_of(DWORD size)
+{
+  DWORD cs = (DWORD)fatfs.sects_clust * SECTOR_SIZE;
+
+  return (size + cs - 1) / cs;
+}
+
+/*
+ * CHAIN_FILES files, open at the same time and so each with a reservation,
+ * are appended to, cut by f_truncate at random offsets or cluster
+ * boundaries, synced, and now and then unlinked and created again.  Then
+ * the files must hold their data, the free cluster count kept by ff.c, a
+ * recount after a remount and the sizes of the files must agree, and so
+ * must the FAT copies.  Unlinking the files must give every cluster back.
+ */
+static int
+check_truncate(void)
+{
+  static FIL fil[CHAIN_FILES];
+  DWORD size[CHAIN_FILES], base, nfree, used, ofs, n;
+  DWORD cs = (DWORD)fatfs.sects_clust * SECTOR_SIZE;
+  char path[16];
+  FATFS *fs;
+  UINT i, k;
+  int ok;
+
+  ok = f_mount(0, &fatfs) == FR_OK && f_getfree("", &base, &fs) == FR_OK;
+  for (k = 0; ok && k < CHAIN_FILES; k++)
+  {
+    sprintf(path, "CHAIN%u.BIN", k);
+    size[k] = 0;
+    ok = f_open(&fil[k], path, FA_CREATE_ALWAYS | FA_WRITE | FA_READ) == FR_OK;
+  }
+
+  for (i = 0; ok && i < CHAIN_ROUNDS; i++)
+  {
+    k = rnd() % CHAIN_FILES;
+    switch (rnd() % 16)
+    {
+    case 0: case 1: case 2: case 3: case 4: case 5: case 6:
+      n = 1 + rnd() % (3 * cs);
+      ok = put_data(&fil[k], size[k], n, (BYTE)k) == FR_OK;
+      size[k] += n;
+      break;
+
+    case 7: case 8: case 9: case 10:
+      ofs = (rnd() << 15 | rnd()) % (size[k] + 1);
+      if (rnd() & 1)
+      {
+        ofs -= ofs % cs;
+      }
+      ok = f_lseek(&fil[k], ofs) == FR_OK && f_truncate(&fil[k]) == FR_OK
+           && fil[k].fsize == ofs;
+      size[k] = ofs;
+      break;
+
+    case 11: case 12: case 13: case 14:
+      ok = f_sync(&fil[k]) == FR_OK;
+      break;
+
+    default:
+      sprintf(path, "CHAIN%u.BIN", k);
+      ok = f_close(&fil[k]) == FR_OK && f_unlink(path) == FR_OK
+           && f_open(&fil[k], path, FA_CREATE_ALWAYS | FA_WRITE | FA_READ) == FR_OK;
+      size[k] = 0;
+      break;
+    }
+  }
+
+  used = 0;
+  for (k = 0; k < CHAIN_FILES; k++)
+  {
+    if (f_close(&fil[k]) != FR_OK)
+    {
+      ok = 0;
+    }
+    used += clusters_of(size[k]);
+  }
+  ok = ok && f_getfree("", &nfree, &fs) == FR_OK && nfree + used == base
+       && f_mount(0, &fatfs) == FR_OK && f_getfree("", &nfree, &fs) == FR_OK
+       && nfree + used == base && fats_agree();
+  for (k = 0; ok && k < CHAIN_FILES; k++)
+  {
+    sprintf(path, "CHAIN%u.BIN", k);
+    ok = file_is(path, size[k], (BYTE)k) && f_unlink(path) == FR_OK;
+  }
+  return ok && f_getfree("", &nfree, &fs) == FR_OK && nfree == base && fats_agree();
+}
+
+#if _USE_WCACHE
+/*-----------------------------------------------------------------------*/
+/* Write cache                                                           */
+/*-----------------------------------------------------------------------*/
+
+/*
+ * Appends len bytes of the pattern 30 to 80 at a time.  The cache must
+ * never be left full.  Counts in *flushes the writes that emptied it.
+ */
+static int
+wcache_append(FIL *fil, DWORD len, UINT *flushes)
+{
+  BYTE buf[80];
+  DWORD ofs = fil->fptr, end = fil->fptr + len;
+  WORD n, bw, i;
+  BYTE held;
+  int ok = 1;
+
+  while (ok && ofs < end)
+  {
+    n = 30 + rnd() % 51;
+    if (n > end - ofs)
+    {
+      n = (WORD)(end - ofs);
+    }
+    for (i = 0; i < n; i++)
+    {
+      buf[i] = pattern(ofs + i) + WCACHE_SEED;
+    }
+    held = fil->wc_n;
+    ok = f_write(fil, buf, n, &bw) == FR_OK && bw == n
+         && (!fil->wc_size || fil->wc_n < fil->wc_size);
+    if (fil->wc_n < held)
+    {
+      (*flushes)++;
+    }
+    ofs += n;
+  }
+  return ok;
+}
+
+/* 1 if the first cached sector has reached the disk */
+static int
+wcache_on_disk(FIL *fil, const BYTE *cache)
+{
+  BYTE raw[SECTOR_SIZE];
+
+  return disk_read(0, raw, fil->wc_sect, 1) == RES_OK && !memcmp(raw, cache, sizeof raw);
+}
+
+/*
+ * The same appends with and without a cache of WCACHE_SECTORS, on the
+ * fresh volume so that the files are contiguous.  Without the cache each
+ * block of data is one write command; with it the data must go out in
+ * full caches, and the other writes (FAT, directory) stay the same.  A
+ * partly filled cache must not be on the disk until f_sync or
+ * f_setwcache(NULL) writes it out.  Bad cache sizes are refused.  Both
+ * files must read back after a remount.
+ */
+static int
+check_wcache(void)
+{
+  static BYTE cache[WCACHE_SECTORS * SECTOR_SIZE];
+  FIL fil;
+  DWORD nsect = WCACHE_SIZE / SECTOR_SIZE, w_plain, w_cache;
+  UINT flushes = 0;
+  int ok;
+
+  w_plain = DiskFileWrites();
+  ok = f_open(&fil, "PLAIN.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK
+       && wcache_append(&fil, WCACHE_SIZE, &flushes) && f_close(&fil) == FR_OK;
+  w_plain = DiskFileWrites() - w_plain;
+
+  ok = ok && f_open(&fil, "WCACHE.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK
+       && f_setwcache(&fil, cache, 1) == FR_DENIED && f_setwcache(&fil, cache, 256) == FR_DENIED
+       && f_setwcache(&fil, cache, WCACHE_SECTORS) == FR_OK;
+  w_cache = DiskFileWrites();
+  ok = ok && wcache_append(&fil, WCACHE_SIZE, &flushes);
+  w_cache = DiskFileWrites() - w_cache;
+  ok = ok && flushes >= nsect / WCACHE_SECTORS - 1 && w_plain >= nsect / _FS_BLOCK
+       && w_cache <= nsect / WCACHE_SECTORS + w_plain - nsect / _FS_BLOCK;
+
+  /* Fill part of the cache, then f_sync writes it out.  Appending one
+     sector more than a block completes 1 to _FS_BLOCK + 1 sectors. */
+  ok = ok && f_sync(&fil) == FR_OK
+       && wcache_append(&fil, (_FS_BLOCK + 1) * SECTOR_SIZE, &flushes) && fil.wc_n
+       && !wcache_on_disk(&fil, cache)
+       && f_sync(&fil) == FR_OK && !fil.wc_n && wcache_on_disk(&fil, cache);
+
+  /* and so does removing the cache */
+  ok = ok && wcache_append(&fil, (_FS_BLOCK + 1) * SECTOR_SIZE, &flushes) && fil.wc_n
+       && !wcache_on_disk(&fil, cache)
+       && f_setwcache(&fil, NULL, 0) == FR_OK && !fil.wc_n && !fil.wc_size
+       && wcache_on_disk(&fil, cache);
+  ok = ok && wcache_append(&fil, 1000, &flushes);
+  if (f_close(&fil) != FR_OK)
+  {
+    ok = 0;
+  }
+
+  ok = ok && f_mount(0, &fatfs) == FR_OK
+       && file_is("PLAIN.BIN", WCACHE_SIZE, WCACHE_SEED)
+       && file_is("WCACHE.BIN", WCACHE_SIZE + 2 * (_FS_BLOCK + 1) * SECTOR_SIZE + 1000,
+                  WCACHE_SEED);
+  f_unlink("PLAIN.BIN");
+  f_unlink("WCACHE.BIN");
+  return ok;
+}
+#endif
+
+#if _FS_EXFAT
+/*-----------------------------------------------------------------------*/
+/* exFAT                                                                 */
+/*-----------------------------------------------------------------------*/
+
+static BYTE exfat_fat[128 * SECTOR_SIZE];    /* FAT as last saved */
+
+/*
+ * f_mkfs makes no exFAT volume, so the image is formatted here: the FAT
+ * at EXFAT_FAT_OFS, then clusters 2, 3 and 4 for the allocation bitmap,
+ * the up-case table (ASCII only) and the root directory.
+ */
+static int
+format_exfat(DWORD nsect)
+{
+  BYTE sect[SECTOR_SIZE];
+  DWORD spc = 1 << EXFAT_CLUST_SHIFT, nclust, fatlen, heap, sum = 0, rng[2];
+  UINT i;
+
+  nclust = (nsect - EXFAT_FAT_OFS) / spc;
+  for (;;)
+  {
+    fatlen = ((nclust + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    heap = (EXFAT_FAT_OFS + fatlen + spc - 1) / spc * spc;
+    if ((nsect - heap) / spc >= nclust)
+    {
+      break;
+    }
+    nclust = (nsect - heap) / spc;
+  }
+  if ((nclust + 7) / 8 > EXFAT_CLUSTER || fatlen * SECTOR_SIZE > sizeof exfat_fat)
+  {
+    return 0;    /* The bitmap takes one cluster */
+  }
+
+  rng[0] = 0;
+  rng[1] = nsect - 1;
+  if (disk_ioctl(0, CTRL_ERASE_SECTOR, rng) != RES_OK)    /* Reads back as zero */
+  {
+    return 0;
+  }
+
+  memset(sect, 0, sizeof sect);    /* Boot sector */
+  memcpy(sect, "\xEB\x76\x90" "EXFAT   ", 11);
+  ST_DWORD(&sect[72], nsect);      /* VolumeLength */
+  ST_DWORD(&sect[BPB_FatOfsEx], EXFAT_FAT_OFS);
+  ST_DWORD(&sect[BPB_FatSzEx], fatlen);
+  ST_DWORD(&sect[BPB_DataOfsEx], heap);
+  ST_DWORD(&sect[BPB_NumClusEx], nclust);
+  ST_DWORD(&sect[BPB_RootClusEx], 4);
+  ST_DWORD(&sect[BS_VolIDEx], 0x12345678);
+  ST_WORD(&sect[BPB_FSVerEx], 0x100);
+  sect[BPB_BytsPerSecEx] = 9;
+  sect[BPB_SecPerClusEx] = EXFAT_CLUST_SHIFT;
+  sect[110] = 1;                   /* NumberOfFats */
+  sect[111] = 0x80;                /* DriveSelect */
+  ST_WORD(&sect[BS_55AA], 0xAA55);
+  if (disk_write(0, sect, 0, 1) != RES_OK)
+  {
+    return 0;
+  }
+
+  memset(sect, 0, sizeof sect);    /* FAT, one cluster for each system object */
+  ST_DWORD(&sect[0], 0xFFFFFFF8);
+  for (i = 1; i <= 4; i++)
+  {
+    ST_DWORD(&sect[i * 4], 0xFFFFFFFF);
+  }
+  if (disk_write(0, sect, EXFAT_FAT_OFS, 1) != RES_OK)
+  {
+    return 0;
+  }
+
+  memset(sect, 0, sizeof sect);    /* Allocation bitmap */
+  sect[0] = 0x07;
+  if (disk_write(0, sect, heap, 1) != RES_OK)
+  {
+    return 0;
+  }
+
+  for (i = 0; i < 128; i++)        /* Up-case table */
+  {
+    ST_WORD(&sect[i * 2], (i >= 'a' && i <= 'z') ? i - 0x20 : i);
+  }
+  for (i = 0; i < 256; i++)
+  {
+    sum = ((sum >> 1) | (sum << 31)) + sect[i];
+  }
+  if (disk_write(0, sect, heap + spc, 1) != RES_OK)
+  {
+    return 0;
+  }
+
+  memset(sect, 0, sizeof sect);    /* Root directory */
+  sect[0] = 0x83;                  /* Volume label, empty */
+  sect[32] = 0x81;                 /* Allocation bitmap */
+  ST_DWORD(&sect[32 + 20], 2);
+  ST_DWORD(&sect[32 + 24], (nclust + 7) / 8);
+  sect[64] = 0x82;                 /* Up-case table */
+  ST_DWORD(&sect[64 + 4], sum);
+  ST_DWORD(&sect[64 + 20], 3);
+  ST_DWORD(&sect[64 + 24], 256);
+  return disk_write(0, sect, heap + 2 * spc, 1) == RES_OK;
+}
+
+/* Saves the FAT, returns 1 if it is the same as last saved */
+static int
+exfat_fat_same(void)
+{
+  static BYTE fat[sizeof exfat_fat];
+  DWORD n = fatfs.sects_fat, i;
+  int same;
+
+  for (i = 0; i < n; i++)
+  {
+    if (disk_read(0, fat + i * SECTOR_SIZE, fatfs.fatbase + i, 1) != RES_OK)
+    {
+      return 0;
+    }
+  }
+  same = !memcmp(fat, exfat_fat, n * SECTOR_SIZE);
+  memcpy(exfat_fat, fat, n * SECTOR_SIZE);
+  return same;
+}
+
+/*
+ * The clusters marked in the allocation bitmap, the free cluster count
+ * kept by ff.c and a recount by f_getfree must all agree.  Returns the
+ * free cluster count, or 0xFFFFFFFF if they do not.
+ */
+static DWORD
+exfat_bitmap_free(void)
+{
+  BYTE sect[SECTOR_SIZE];
+  DWORD nclust = fatfs.max_clust - 2, kept = fatfs.free_clust, nfree, used = 0, cl;
+  FATFS *fs;
+
+  for (cl = 0; cl < nclust; cl++)
+  {
+    if (!(cl % (SECTOR_SIZE * 8))
+        && disk_read(0, sect, fatfs.bitbase + cl / (SECTOR_SIZE * 8), 1) != RES_OK)
+    {
+      return 0xFFFFFFFF;
+    }
+    used += (sect[cl / 8 % SECTOR_SIZE] >> (cl % 8)) & 1;
+  }
+  fatfs.free_clust = 0xFFFFFFFF;
+  if (f_getfree("", &nfree, &fs) != FR_OK || nfree + used != nclust
+      || (kept != 0xFFFFFFFF && kept != nfree))
+  {
+    return 0xFFFFFFFF;
+  }
+  return nfree;
+}
+
+static int
+check_exfat_mount(void)
+{
+  DWORD nfree;
+  FATFS *fs;
+
+  return f_getfree("", &nfree, &fs) == FR_OK && fs->fs_type == FS_EXFAT
+         && nfree == fs->max_clust - 2 - 3 && exfat_bitmap_free() == nfree;
+}
+
+/* A contiguous file only marks the bitmap, and unlink clears it again */
+static int
+check_exfat_bitmap(void)
+{
+  DWORD nfree = exfat_bitmap_free(), len = 20 * EXFAT_CLUSTER + 7;
+  int ok;
+
+  exfat_fat_same();
+  ok = nfree != 0xFFFFFFFF && put_file("Contiguous file.bin", 0, len, 1) == FR_OK
+       && file_is("contiguous FILE.BIN", len, 1)
+       && exfat_bitmap_free() == nfree - 21 && exfat_fat_same();
+  ok = ok && put_file("Contiguous file.bin", len, EXFAT_CLUSTER, 1) == FR_OK
+       && file_is("Contiguous file.bin", len + EXFAT_CLUSTER, 1)
+       && exfat_bitmap_free() == nfree - 22 && exfat_fat_same();
+  return ok && f_unlink("Contiguous file.bin") == FR_OK
+         && exfat_bitmap_free() == nfree && exfat_fat_same();
+}
+
+/*
+ * A file that cannot grow in place because another file took the next
+ * cluster moves its chain into the FAT, and both keep their data across
+ * a remount and an unlink.
+ */
+static int
+check_exfat_fragment(void)
+{
+  DWORD nfree = exfat_bitmap_free(), len = 6 * EXFAT_CLUSTER;
+  int ok;
+
+  exfat_fat_same();
+  ok = nfree != 0xFFFFFFFF
+       && put_file("Grows.bin", 0, 100, 2) == FR_OK         /* Less than a cluster, */
+       && put_file("Blocks.bin", 0, 100, 3) == FR_OK        /* so not AU aligned */
+       && exfat_fat_same();
+  ok = ok && put_file("Grows.bin", 100, len - 100, 2) == FR_OK
+       && !exfat_fat_same() && exfat_bitmap_free() == nfree - 7
+       && put_file("Blocks.bin", 100, len - 100, 3) == FR_OK
+       && exfat_bitmap_free() == nfree - 12;
+  ok = ok && f_mount(0, &fatfs) == FR_OK
+       && file_is("Grows.bin", len, 2) && file_is("Blocks.bin", len, 3);
+  return ok && f_unlink("Grows.bin") == FR_OK && f_unlink("Blocks.bin") == FR_OK
+         && exfat_bitmap_free() == nfree;
+}
+
+/* Name of k, 1, 3 or 7 name entries of 15 characters long */
+static void
+set_name(char *path, int k)
+{
+  static const char *const tails[] = {
+    "",
+    " with a name of three entries",
+    " with a name long enough to take seven name entries of fifteen characters each in all"
+  };
+
+  sprintf(path, "Entry Sets/Set %03d%s.txt", k, tails[k % 3]);
+}
+
+/* Are the files of want[] (1: there) all there with their data, and nothing else? */
+static int
+sets_are(const BYTE *want, int nrenamed)
+{
+  char path[160], lfn[_MAX_LFN + 1];
+  FILINFO fi;
+  DIR dir;
+  int k, n = 0, renamed = 0;
+
+  fi.lfname = lfn;
+  fi.lfsize = sizeof lfn;
+  if (f_opendir(&dir, "Entry Sets") != FR_OK)
+  {
+    return 0;
+  }
+  while (f_readdir(&dir, &fi) == FR_OK && fi.fname[0])
+  {
+    if (sscanf(lfn, "Set %d", &k) == 1 && k >= 0 && k < EXFAT_SETS && want[k])
+    {
+      set_name(path, k);
+      if (strcmp(lfn, path + 11) || fi.fsize != 100U + k)
+      {
+        return 0;
+      }
+      n++;
+    }
+    else if (sscanf(lfn, "Renamed set %d", &k) == 1)
+    {
+      renamed++;
+    }
+    else
+    {
+      return 0;
+    }
+  }
+  for (k = 0; k < EXFAT_SETS; k++)
+  {
+    n -= want[k];
+    if (want[k])
+    {
+      set_name(path, k);
+      flip_case(path);
+      if (!file_is(path, 100 + k, (BYTE)k))
+      {
+        return 0;
+      }
+    }
+  }
+  return !n && renamed == nrenamed;
+}
+
+/*
+ * Entry sets of different lengths fill a directory over several clusters.
+ * Unlinks leave gaps, renames to longer names need more entries, and new
+ * sets fill the gaps; the directory must read back the same after a
+ * remount.
+ */
+static int
+check_exfat_sets(void)
+{
+  static BYTE want[EXFAT_SETS];
+  char path[160], path2[160];
+  int k, nrenamed = 0, ok;
+
+  ok = f_mkdir("Entry Sets") == FR_OK;
+  for (k = 0; ok && k < EXFAT_SETS; k++)
+  {
+    set_name(path, k);
+    ok = put_file(path, 0, 100 + k, (BYTE)k) == FR_OK;
+    want[k] = 1;
+  }
+  ok = ok && sets_are(want, 0);
+
+  for (k = 0; ok && k < EXFAT_SETS; k += 4)
+  {
+    set_name(path, k);
+    ok = f_unlink(path) == FR_OK;
+    want[k] = 0;
+  }
+  for (k = 1; ok && k < EXFAT_SETS; k += 8)
+  {
+    set_name(path, k);
+    sprintf(path2, "Entry Sets/Renamed set %03d to a name long enough to need a larger entry set"
+            " than it had before, whatever its length was.txt", k);
+    ok = f_rename(path, path2) == FR_OK && file_is(path2, 100 + k, (BYTE)k);
+    want[k] = 0;
+    nrenamed++;
+  }
+  for (k = 0; ok && k < EXFAT_SETS; k += 4)
+  {
+    set_name(path, k);
+    ok = put_file(path, 0, 100 + k, (BYTE)k) == FR_OK;
+    want[k] = 1;
+  }
+  ok = ok && sets_are(want, nrenamed)
+       && f_mount(0, &fatfs) == FR_OK && sets_are(want, nrenamed)
+       && f_unlink("Entry Sets") == FR_DENIED;
+  return ok && exfat_bitmap_free() != 0xFFFFFFFF;
+}
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* sd_log                                                                */
+/*-----------------------------------------------------------------------*/
+
+static SD_Log sdlog;
+
+/* Does the log file hold the first size bytes of the pattern? */
+static int
+log_holds(const char *path, DWORD size)
+{
+  BYTE blk[SD_LOG_BLOCK_SIZE];
+  FIL fil;
+  DWORD idx, ofs = 0;
+  WORD br, len, i;
+  int ok;
+
+  if (f_open(&fil, path, FA_READ) != FR_OK)
+  {
+    return 0;
+  }
+  ok = f_read(&fil, blk, sizeof blk, &br) == FR_OK && br == sizeof blk;    /* Header */
+  for (idx = 1; ok && ofs < size; idx++)
+  {
+    ok = f_read(&fil, blk, sizeof blk, &br) == FR_OK && br == sizeof blk
+         && !memcmp(blk, "LOGD", 4) && LD_DWORD(&blk[8]) == idx;
+    len = ok ? LD_WORD(&blk[12]) : 0;
+    if (len > size - ofs)
+    {
+      len = (WORD)(size - ofs);
+    }
+    for (i = 0; ok && i < len; i++)
+    {
+      ok = blk[SD_LOG_HEADER_SIZE + i] == pattern(ofs + i);
+    }
+    ofs += len;
+    ok = ok && (len == SD_LOG_PAYLOAD_SIZE || ofs == size);
+  }
+  f_close(&fil);
+  return ok;
+}
+
+/*
+ * Appends and checkpoints until the power is cut after a number of
+ * sectors, then mounts again as after a reset.  The log must open with
+ * at least what the last checkpoint made durable and no more than what
+ * was appended, and hold the right bytes.  The cuts land anywhere, also
+ * while a new chunk is allocated.
+ */
+static int
+check_log_power_cut(void)
+{
+  BYTE buf[160];
+  DWORD durable = 0, total = 0, size;
+  int cut, n, i, ok;
+
+  ok = SDLogCreate(&sdlog, "Power.log") == FR_OK && SDLogClose(&sdlog) == FR_OK;
+  for (cut = 0; ok && cut < LOG_CUTS; cut++)
+  {
+    DiskFileCutPower(cut < 4 ? cut : (long)(rnd() % 3000));
+    for (;;)
+    {
+      n = 1 + rnd() % sizeof buf;
+      for (i = 0; i < n; i++)
+      {
+        buf[i] = pattern(total + i);
+      }
+      total += n;    /* Some of it may be on the card even if this fails */
+      if (SDLogAppend(&sdlog, buf, n) != FR_OK)
+      {
+        break;
+      }
+      if (!(rnd() % 8))
+      {
+        if (SDLogCheckpoint(&sdlog) != FR_OK)
+        {
+          break;
+        }
+        durable = total;
+      }
+    }
+    DiskFileCutPower(-1);
+    f_mount(0, &fatfs);    /* Reset, nothing kept in RAM */
+
+    ok = SDLogOpen(&sdlog, "Power.log") == FR_OK;
+    size = ok ? (DWORD)SDLogSize(&sdlog) : 0;
+    ok = ok && size >= durable && size <= total && log_holds("Power.log", size);
+    durable = total = size;
+  }
+
+  /* A clean close keeps everything */
+  for (i = 0; ok && i < 1000; i++)
+  {
+    for (n = 0; n < (int)sizeof buf; n++)
+    {
+      buf[n] = pattern(total + n);
+    }
+    ok = SDLogAppend(&sdlog, buf, sizeof buf) == FR_OK;
+    total += sizeof buf;
+  }
+  ok = ok && SDLogClose(&sdlog) == FR_OK && f_mount(0, &fatfs) == FR_OK
+       && SDLogOpen(&sdlog, "Power.log") == FR_OK && SDLogSize(&sdlog) == total
+       && SDLogClose(&sdlog) == FR_OK && log_holds("Power.log", total);
+  return ok;
+}
+
+/*-----------------------------------------------------------------------*/
+/* sd_tslog                                                              */
+/*-----------------------------------------------------------------------*/
+
+static SD_TsLog tslog;
+
+/* Record k of a time series log, the timestamps repeat in pairs */
+static DWORD
+ts_of(DWORD k)
+{
+  return 1000 + k / 2 * 3;
+}
+
+static UINT
+ts_record(DWORD k, BYTE *buf)
+{
+  UINT len = 4 + k * 37 % 57, i;
+
+  for (i = 0; i < len; i++)
+  {
+    buf[i] = (BYTE)(k * 7 + i);
+  }
+  return len;
+}
+
+/*
+ * Reads the log from the top.  It must hold records 0 to n-1 in order,
+ * with at least nmin and at most nmax of them.  Then each seek must land
+ * on the first record at or after the timestamp.  Returns n, or -1.
+ */
+static long
+tslog_check(const char *path, DWORD nmin, DWORD nmax)
+{
+  BYTE want[SD_TSLOG_MAX_RECORD], got[SD_TSLOG_MAX_RECORD];
+  FRESULT res;
+  DWORD n, k, ts, tg;
+  UINT len;
+  int i, ok;
+
+  if (SDTsLogOpen(&tslog, path) != FR_OK)
+  {
+    return -1;
+  }
+  for (n = 0, ok = 1; ok && (res = SDTsLogRead(&tslog, &ts, got, sizeof got, &len)) == FR_OK; n++)
+  {
+    ok = n < nmax && ts == ts_of(n) && len == ts_record(n, want) && !memcmp(got, want, len);
+  }
+  ok = ok && res == FR_NO_FILE && n >= nmin;
+
+  for (i = 0; ok && i < TSLOG_SEEKS; i++)
+  {
+    tg = 900 + rnd() % (ts_of(n) - 900 + 10);
+    for (k = 0; k < n && ts_of(k) < tg; k++)
+      ;
+    ok = SDTsLogSeek(&tslog, tg) == FR_OK;
+    res = SDTsLogRead(&tslog, &ts, got, sizeof got, &len);
+    if (k == n)
+    {
+      ok = ok && res == FR_NO_FILE;
+    }
+    else
+    {
+      ok = ok && res == FR_OK && ts == ts_of(k) && len == ts_record(k, want)
+           && !memcmp(got, want, len);
+    }
+  }
+  SDTsLogClose(&tslog);
+  return ok ? (long)n : -1;
+}
+
+/*
+ * Logs written with flushes at random, each ended by a power cut and a
+ * mount as after a reset, must read back every record up to the last good
+ * flush, and seek in what is there.  A log closed cleanly must keep all of
+ * its records, also the ones of the group that has no index yet.
+ */
+static int
+check_tslog_power_cut(void)
+{
+  BYTE buf[SD_TSLOG_MAX_RECORD];
+  char path[16];
+  DWORD k, flushed;
+  UINT len;
+  int cut, ok = 1;
+
+  for (cut = 0; ok && cut < TSLOG_CUTS; cut++)
+  {
+    sprintf(path, "TS%d.LOG", cut);
+    ok = SDTsLogCreate(&tslog, path) == FR_OK;
+    DiskFileCutPower(rnd() % 600);
+    for (k = flushed = 0; ok; k++)
+    {
+      len = ts_record(k, buf);
+      if (SDTsLogWrite(&tslog, ts_of(k), buf, len) != FR_OK)
+      {
+        break;
+      }
+      if (!(rnd() % 400))
+      {
+        if (SDTsLogFlush(&tslog) != FR_OK)
+        {
+          break;
+        }
+        flushed = k + 1;
+      }
+    }
+    DiskFileCutPower(-1);
+    f_mount(0, &fatfs);    /* Reset, nothing kept in RAM */
+    ok = tslog_check(path, flushed, k + 1) >= 0;
+  }
+
+  ok = ok && SDTsLogCreate(&tslog, "TSALL.LOG") == FR_OK;
+  for (k = 0; ok && k < TSLOG_RECORDS; k++)
+  {
+    len = ts_record(k, buf);
+    ok = SDTsLogWrite(&tslog, ts_of(k), buf, len) == FR_OK;
+  }
+  return ok && SDTsLogWrite(&tslog, ts_of(k - 1) - 1, buf, 4) == FR_DENIED
+         && SDTsLogClose(&tslog) == FR_OK && f_mount(0, &fatfs) == FR_OK
+         && tslog_check("TSALL.LOG", TSLOG_RECORDS, TSLOG_RECORDS) == TSLOG_RECORDS;
+}
+
+/*-----------------------------------------------------------------------*/
+/* sd_zlog                                                               */
+/*-----------------------------------------------------------------------*/
+
+static SD_ZLog zlog;
+static BYTE zlog_src[ZLOG_STREAM], zlog_dst[ZLOG_STREAM];
+
+/* 12-byte samples: a timestamp, two slow signals, a spare word and flags */
+static void
+make_samples(BYTE *p, DWORD len)
+{
+  DWORD i;
+
+  for (i = 0; i + 12 <= len; i += 12, p += 12)
+  {
+    ST_DWORD(&p[0], 1000000 + i / 12 * 10);
+    ST_WORD(&p[4], 1000 + 200 * (i / 600 % 7) + rnd() % 5);
+    ST_WORD(&p[6], (WORD)(i / 12 % 100) - 300);
+    ST_WORD(&p[8], 0);
+    p[10] = 0x55;
+    p[11] = (BYTE)(i >> 8);
+  }
+}
+
+/*
+ * Writes len bytes of zlog_src[] in pieces of random size with flushes at
+ * random, then mounts again, reads the stream back whole and from random
+ * offsets found by SDZLogSeek.  Returns the file size, or 0 if it fails.
+ */
+static DWORD
+zlog_round_trip(const char *path, DWORD len, BYTE stride)
+{
+  DWORD pos, ofs = 0, size;
+  UINT n, br, want;
+  int i, ok;
+
+  ok = SDZLogCreate(&zlog, path, stride) == FR_OK;
+  for (pos = 0; ok && pos < len; pos += n)
+  {
+    n = 1 + rnd() % 3000;
+    if (n > len - pos)
+    {
+      n = len - pos;
+    }
+    ok = SDZLogWrite(&zlog, zlog_src + pos, n) == FR_OK
+         && (rnd() % 400 || SDZLogFlush(&zlog) == FR_OK);
+  }
+  ok = ok && SDZLogClose(&zlog) == FR_OK && f_mount(0, &fatfs) == FR_OK
+       && SDZLogOpen(&zlog, path) == FR_OK;
+  size = ok ? (DWORD)zlog.file.fsize : 0;
+
+  for (pos = 0; ok && pos < len; pos += br)
+  {
+    n = 1 + rnd() % 5000;
+    if (n > len - pos)
+    {
+      n = len - pos;
+    }
+    ok = SDZLogRead(&zlog, zlog_dst + pos, n, &br) == FR_OK && br == n;
+  }
+  ok = ok && SDZLogRead(&zlog, zlog_dst, 1, &br) == FR_OK && br == 0
+       && !memcmp(zlog_src, zlog_dst, len);
+
+  for (i = 0; ok && i < ZLOG_SEEKS; i++)
+  {
+    /* Every other seek stays near the last one, in the decoded frame */
+    ofs = (i & 1) ? (ofs + rnd() % 64) % (len + 1) : (rnd() << 15 | rnd()) % (len + 1);
+    n = rnd() % 3000;
+    want = len - ofs < n ? len - ofs : n;
+    ok = SDZLogSeek(&zlog, ofs) == FR_OK && SDZLogRead(&zlog, zlog_dst, n, &br) == FR_OK
+         && br == want && !memcmp(zlog_dst, zlog_src + ofs, want);
+  }
+  if (SDZLogClose(&zlog) != FR_OK)
+  {
+    ok = 0;
+  }
+  return ok ? size : 0;
+}
+
+/* Samples compress to less than half, noise at least round trips */
+static int
+check_zlog(void)
+{
+  DWORD size, i;
+
+  make_samples(zlog_src, ZLOG_STREAM);
+  size = zlog_round_trip("Samples.zlg", ZLOG_STREAM, 12);
+  if (!size || size > ZLOG_STREAM / 2)
+  {
+    return 0;
+  }
+  for (i = 0; i < ZLOG_NOISE; i++)
+  {
+    zlog_src[i] = (BYTE)rnd();
+  }
+  return zlog_round_trip("Noise.zlg", ZLOG_NOISE, 0) != 0;
+}
+
+/*-----------------------------------------------------------------------*/
+/* f_mkfs                                                                */
+/*-----------------------------------------------------------------------*/
+
+/* The AU f_mkfs aligns to: the card's, but no more than 1/128 of it */
+static DWORD
+mkfs_au(void)
+{
+  DWORD au = IMAGE_AU;
+
+  while (au > 1 && au > IMAGE_SECTORS / 128)
+  {
+    au /= 2;
+  }
+  return au;
+}
+
+/* 1 if n sectors from sect all hold val, but for the first skip bytes */
+static int
+sectors_are(DWORD sect, DWORD n, BYTE val, UINT skip)
+{
+  BYTE buf[SECTOR_SIZE];
+  UINT i;
+
+  for (; n; n--, sect++, skip = 0)
+  {
+    if (disk_read(0, buf, sect, 1) != RES_OK)
+    {
+      return 0;
+    }
+    for (i = skip; i < SECTOR_SIZE; i++)
+    {
+      if (buf[i] != val)
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/*
+ * Fills the start of the image with a pattern, formats it with clusters of
+ * csize sectors on a card whose erased sectors read as erased, and checks
+ * the volume: its FAT type, the partition, the FATs (FAT32) and the data
+ * area on AU boundaries, the FAT entries of the clusters and the root
+ * directory cleared.  The FAT sectors after the last cluster must keep the
+ * pattern with FM_QUICK when f_mkfs writes zeros, and be cleared otherwise.
+ */
+static int
+check_mkfs(BYTE opt, BYTE csize, BYTE type, BYTE erased)
+{
+  BYTE sect[SECTOR_SIZE];
+  DWORD au = mkfs_au(), part, fat, nfat, dir, data, used, n;
+  FATFS *fs;
+  UINT m, skip;
+  int ok = 1;
+
+  memset(sect, MKFS_PATTERN, sizeof sect);
+  for (n = 0; ok && n < MKFS_FILL; n++)
+  {
+    ok = disk_write(0, sect, n, 1) == RES_OK;
+  }
+  DiskFileSetErased(erased);
+  ok = ok && f_mkfs(0, opt, csize) == FR_OK;
+  DiskFileSetErased(0);
+  ok = ok && f_mount(0, &fatfs) == FR_OK && f_getfree("", &n, &fs) == FR_OK
+       && fs->fs_type == type && disk_read(0, sect, 0, 1) == RES_OK;
+  if (!ok)
+  {
+    return 0;
+  }
+
+  part = LD_DWORD(&sect[MBR_Table + 8]);
+  if (disk_read(0, sect, part, 1) != RES_OK)
+  {
+    return 0;
+  }
+  fat = part + LD_WORD(&sect[BPB_RsvdSecCnt]);
+  nfat = LD_WORD(&sect[BPB_FATSz16]);
+  if (!nfat)
+  {
+    nfat = LD_DWORD(&sect[BPB_FATSz32]);
+  }
+  dir = fat + nfat * sect[BPB_NumFATs];
+  data = dir + LD_WORD(&sect[BPB_RootEntCnt]) * 32 / SECTOR_SIZE;
+  if (part % au || data % au || data + csize > MKFS_FILL
+      || (type == FS_FAT32 && (fat % au || nfat % au)))
+  {
+    return 0;
+  }
+
+  /* FAT sectors that map the clusters, then the padding up to the AU */
+  used = (fs->max_clust * (type == FS_FAT16 ? 2 : 4) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  skip = (type == FS_FAT16) ? 4 : 12;
+  for (m = 0; ok && m < sect[BPB_NumFATs]; m++)
+  {
+    ok = sectors_are(fat + m * nfat, used, 0, skip)
+         && sectors_are(fat + m * nfat + used, nfat - used,
+                        (opt & FM_QUICK) && erased ? MKFS_PATTERN : 0, 0);
+  }
+  return ok && (type == FS_FAT32 ? sectors_are(data, csize, 0, 0)
+                                 : sectors_are(dir, data - dir, 0, 0));
+}
+
+#if _FS_FATTYPES & 4
+/*-----------------------------------------------------------------------*/
+/* FAT32 random writes                                                   */
+/*-----------------------------------------------------------------------*/
+
+/* 1 if the file reads back as the shadow copy from ofs for len bytes */
+static int
+stress_read(FIL *fil, const BYTE *shadow, DWORD ofs, DWORD len)
+{
+  BYTE buf[STRESS_WRITE];
+  WORD n, br;
+  int ok;
+
+  ok = f_lseek(fil, ofs) == FR_OK;
+  while (ok && len)
+  {
+    n = len < sizeof buf ? (WORD)len : sizeof buf;
+    ok = f_read(fil, buf, n, &br) == FR_OK && br == n && !memcmp(buf, shadow + ofs, n);
+    ofs += n;
+    len -= n;
+  }
+  return ok;
+}
+
+#if _USE_FSINFO
+/* 1 if the FSInfo sector on the disk holds the free cluster count nfree */
+static int
+fsinfo_is(DWORD nfree)
+{
+  BYTE sect[SECTOR_SIZE];
+
+  return disk_read(0, sect, fatfs.fsi_sector, 1) == RES_OK
+         && LD_DWORD(&sect[FSI_LeadSig]) == 0x41615252
+         && LD_DWORD(&sect[FSI_StrucSig]) == 0x61417272
+         && LD_DWORD(&sect[FSI_Free_Count]) == nfree;
+}
+#endif
+
+/*
+ * STRESS_FILES files on a FAT32 volume of 1-sector clusters, open at the
+ * same time, get random writes at random offsets up to their end, which
+ * overwrite or append, and now and then a read back, an f_truncate, an
+ * f_sync or a close and reopen.  A shadow copy holds what each file must
+ * read back.  The last change only frees clusters.  At the end the free
+ * cluster count kept by ff.c must match the file sizes, and so must the one in the FSInfo sector with
+ * _USE_FSINFO; the FAT copies must agree; and after a remount the count
+ * and a recount must still match and the files must read back.
+ */
+static int
+check_fat32_stress(void)
+{
+  static BYTE shadow[STRESS_FILES][STRESS_SIZE];
+  static FIL fil[STRESS_FILES];
+  DWORD size[STRESS_FILES], base, nfree, used, ofs, n, i;
+  char path[16];
+  FATFS *fs;
+  UINT k;
+  WORD bw;
+  int ok;
+
+  ok = f_mkfs(0, FM_QUICK, 1) == FR_OK && f_mount(0, &fatfs) == FR_OK
+       && f_getfree("", &base, &fs) == FR_OK && fs->fs_type == FS_FAT32;
+  for (k = 0; ok && k < STRESS_FILES; k++)
+  {
+    sprintf(path, "STRESS%u.BIN", k);
+    size[k] = 0;
+    ok = f_open(&fil[k], path, FA_CREATE_ALWAYS | FA_WRITE | FA_READ) == FR_OK;
+  }
+
+  for (i = 0; ok && i < STRESS_ROUNDS; i++)
+  {
+    k = rnd() % STRESS_FILES;
+    ofs = (rnd() << 15 | rnd()) % (size[k] + 1);
+    switch (rnd() % 16)
+    {
+    case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8:
+      if (rnd() & 1)
+      {
+        ofs = size[k];      /* Append */
+      }
+      n = 1 + rnd() % STRESS_WRITE;
+      if (n > STRESS_SIZE - ofs)
+      {
+        n = STRESS_SIZE - ofs;
+      }
+      for (bw = 0; bw < n; bw++)
+      {
+        shadow[k][ofs + bw] = (BYTE)rnd();
+      }
+      ok = f_lseek(&fil[k], ofs) == FR_OK
+           && f_write(&fil[k], &shadow[k][ofs], (WORD)n, &bw) == FR_OK && bw == n;
+      if (ofs + n > size[k])
+      {
+        size[k] = ofs + n;
+      }
+      break;
+
+    case 9: case 10:
+      n = rnd() % (2 * STRESS_WRITE);
+      if (n > size[k] - ofs)
+      {
+        n = size[k] - ofs;
+      }
+      ok = stress_read(&fil[k], shadow[k], ofs, n);
+      break;
+
+    case 11:
+      ok = f_lseek(&fil[k], ofs) == FR_OK && f_truncate(&fil[k]) == FR_OK
+           && fil[k].fsize == ofs;
+      size[k] = ofs;
+      break;
+
+    case 12: case 13:
+      ok = f_sync(&fil[k]) == FR_OK;
+      break;
+
+    default:
+      sprintf(path, "STRESS%u.BIN", k);
+      ok = f_close(&fil[k]) == FR_OK
+           && f_open(&fil[k], path, FA_OPEN_EXISTING | FA_WRITE | FA_READ) == FR_OK
+           && fil[k].fsize == size[k];
+      break;
+    }
+  }
+
+  /* Last a cut that only frees clusters, after everything else is synced */
+  for (k = 0; ok && k < STRESS_FILES; k++)
+  {
+    ok = f_sync(&fil[k]) == FR_OK;
+  }
+  ok = ok && f_lseek(&fil[0], size[0] / 2) == FR_OK && f_truncate(&fil[0]) == FR_OK;
+  size[0] /= 2;
+
+  used = 0;
+  for (k = 0; k < STRESS_FILES; k++)
+  {
+    if (f_close(&fil[k]) != FR_OK)
+    {
+      ok = 0;
+    }
+    used += clusters_of(size[k]);
+  }
+  ok = ok && f_getfree("", &nfree, &fs) == FR_OK && nfree + used == base && fats_agree();
+#if _USE_FSINFO
+  ok = ok && fsinfo_is(nfree);
+#endif
+
+  /* The count read at mount, then a real one */
+  ok = ok && f_mount(0, &fatfs) == FR_OK && f_getfree("", &nfree, &fs) == FR_OK
+       && nfree + used == base;
+  fatfs.free_clust = 0xFFFFFFFF;
+  ok = ok && f_getfree("", &nfree, &fs) == FR_OK && nfree + used == base;
+  for (k = 0; ok && k < STRESS_FILES; k++)
+  {
+    sprintf(path, "STRESS%u.BIN", k);
+    ok = f_open(&fil[k], path, FA_READ) == FR_OK && fil[k].fsize == size[k]
+         && stress_read(&fil[k], shadow[k], 0, size[k]);
+    f_close(&fil[k]);
+  }
+  return ok;
+}
+
+#if _USE_MNTCACHE
+/*-----------------------------------------------------------------------*/
+/* Mount cache                                                           */
+/*-----------------------------------------------------------------------*/
+
+/* Sector reads of the mount made by f_stat of path after f_mount, 0 if it fails */
+static DWORD
+mount_reads(const char *path)
+{
+  FILINFO fi;
+  DWORD reads;
+
+#if _USE_LFN
+  fi.lfname = NULL;
+#endif
+  f_mount(0, &fatfs);
+  reads = DiskFileReads();
+  return f_stat(path, &fi) == FR_OK ? DiskFileReads() - reads : 0;
+}
+
+/*
+ * On the FAT32 volume of the random writes, with a card identity set by
+ * DiskFileSetId(), a mount after f_mount(0, NULL) reads the MBR, the boot
+ * sector and with _USE_FSINFO the FSInfo sector, and the next one only the
+ * boot sector.  The count it restores must match a recount.  Another CID,
+ * a changed volume serial number or no identity at all mount from scratch.
+ * With _USE_FSINFO, each write of f_close is made to fail in turn by a
+ * power cut: after a failed FSInfo write the cache must still hold what
+ * the card holds, and the next sync, here of an f_rename, must write it.
+ */
+static int
+check_mount_cache(void)
+{
+  BYTE id[32], sect[SECTOR_SIZE];
+  DWORD cold, warm, nfree, n, part;
+  FATFS *fs;
+  int ok;
+#if _USE_FSINFO
+  FRESULT res;
+  FIL fil;
+  WORD bw;
+  int pass, cut;
+#endif
+
+  memset(id, 0x5C, sizeof id);
+  DiskFileSetId(id);
+  f_mount(0, NULL);
+  cold = mount_reads("STRESS0.BIN");
+  warm = mount_reads("STRESS0.BIN");
+  ok = cold && warm && warm + 1 + _USE_FSINFO == cold
+       && f_getfree("", &nfree, &fs) == FR_OK;
+  fatfs.free_clust = 0xFFFFFFFF;
+  ok = ok && f_getfree("", &n, &fs) == FR_OK && n == nfree;
+
+  /* Another card, then the same card with another volume serial number */
+  id[0] ^= 1;
+  DiskFileSetId(id);
+  ok = ok && mount_reads("STRESS0.BIN") == cold && mount_reads("STRESS0.BIN") == warm;
+  ok = ok && disk_read(0, sect, 0, 1) == RES_OK;
+  part = LD_DWORD(&sect[MBR_Table + 8]);
+  ok = ok && disk_read(0, sect, part, 1) == RES_OK;
+  sect[BS_VolID32] ^= 1;
+  ok = ok && disk_write(0, sect, part, 1) == RES_OK
+       && mount_reads("STRESS0.BIN") == cold + 1 && mount_reads("STRESS0.BIN") == warm;
+
+#if _USE_FSINFO
+  memset(sect, 0, sizeof sect);
+  for (pass = 0; ok && pass < 2; pass++)
+  {
+    for (n = 0, cut = 1; ok && cut; n++)
+    {
+      ok = f_open(&fil, "CACHE.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK
+           && f_write(&fil, sect, sizeof sect, &bw) == FR_OK && bw == sizeof sect;
+      DiskFileCutPower(n);
+      cut = f_close(&fil) != FR_OK;
+      DiskFileCutPower(-1);
+      if (ok && cut && f_close(&fil) == FR_OK && !pass)
+      {
+        ok = mount_reads("STRESS0.BIN") == warm && f_getfree("", &nfree, &fs) == FR_OK
+             && fsinfo_is(nfree);
+        fatfs.free_clust = 0xFFFFFFFF;    /* Clusters may be lost, count them */
+        ok = ok && f_getfree("", &nfree, &fs) == FR_OK;
+      }
+      else if (ok && cut)
+      {
+        ok = f_rename("STRESS0.BIN", "STRESS9.BIN") == FR_OK && fsinfo_is(fatfs.free_clust)
+             && f_rename("STRESS9.BIN", "STRESS0.BIN") == FR_OK;
+      }
+      res = f_unlink("CACHE.BIN");
+      ok = ok && (res == FR_OK || res == FR_NO_FILE);
+    }
+  }
+#endif
+
+  /* No identity, no cache */
+  DiskFileSetId(NULL);
+  ok = ok && mount_reads("STRESS0.BIN") == cold && mount_reads("STRESS0.BIN") == cold;
+  return ok;
+}
+#endif
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* main                                                                  */
+/*-----------------------------------------------------------------------*/
+
+int
+main(int argc, char **argv)
+{
+  DWORD nfree;
+  FATFS *fs;
+  int failed = 0;
+
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: fftest IMAGE\n");
+    return 2;
+  }
+  if (DiskFileOpen(argv[1], IMAGE_SECTORS, IMAGE_AU, 1))
+  {
+    perror(argv[1]);
+    return 2;
+  }
+  f_mount(0, &fatfs);
+  if (f_mkfs(0, FM_QUICK, CLUSTER_SECTORS) != FR_OK
+      || f_getfree("", &nfree, &fs) != FR_OK
+      || put_file("FWD.BIN", 0, FILE_SIZE, 0) != FR_OK)
+  {
+    fprintf(stderr, "fftest: cannot set up %s\n", argv[1]);
+    DiskFileClose();
+    unlink(argv[1]);
+    return 2;
+  }
+
+  failed += report("f_forward refusal at a sector boundary",
+                   check_forward_refusal("FWD.BIN", 3 * SECTOR_SIZE));
+  failed += report("f_forward refusal at a cluster boundary",
+                   check_forward_refusal("FWD.BIN", 2 * CLUSTER_SIZE));
+  failed += report("f_forward refusal at the start of the file",
+                   check_forward_refusal("FWD.BIN", 0));
+#if _USE_WCACHE
+  failed += report("f_setwcache write-back and flush",
+                   check_wcache());
+#endif
+#if _USE_LFN
+  failed += report("LFN numeric tails stay unique",
+                   check_name_tails());
+  failed += report("LFN of _MAX_LFN characters, not one more",
+                   check_name_limit());
+  failed += report("names that differ only in case",
+                   check_name_case());
+#endif
+#if _FS_RESERVE
+  failed += report("f_open returns the slot of an unclosed FIL",
+                   check_reserve_reopen());
+#endif
+  failed += report("f_truncate and unlink with reservations",
+                   check_truncate());
+  failed += report("sd_log recovers after power cuts",
+                   check_log_power_cut());
+  failed += report("sd_tslog reads back after power cuts",
+                   check_tslog_power_cut());
+  failed += report("sd_zlog round trip and seeks",
+                   check_zlog());
+#if _FS_FATTYPES & 2
+  failed += report("f_mkfs FAT16 layout, FM_QUICK",
+                   check_mkfs(FM_QUICK, CLUSTER_SECTORS, FS_FAT16, 0xFF));
+#endif
+#if _FS_RESERVE && (_FS_FATTYPES & 2)
+  failed += report("allocation from the window of another file",
+                   check_reserve_full());
+#endif
+#if _FS_RESERVE
+  failed += report("f_close frees the slot when f_sync fails",
+                   check_reserve_close_error());
+#endif
+#if _FS_FATTYPES & 4
+  failed += report("f_mkfs FAT32 layout, FM_QUICK",
+                   check_mkfs(FM_QUICK, 1, FS_FAT32, 0xFF));
+  failed += report("f_mkfs FAT32 layout, whole FATs cleared",
+                   check_mkfs(0, 1, FS_FAT32, 0xFF));
+  failed += report("f_mkfs FAT32 layout, cleared by erase",
+                   check_mkfs(FM_QUICK, 1, FS_FAT32, 0));
+  failed += report("FAT32 random writes, free count and FAT copies",
+                   check_fat32_stress());
+#if _USE_MNTCACHE
+  failed += report("mount cache reuse and invalidation",
+                   check_mount_cache());
+#endif
+#endif
+
+#if _FS_EXFAT
+  if (!format_exfat(IMAGE_SECTORS) || f_mount(0, &fatfs) != FR_OK)
+  {
+    failed += report("exFAT image", 0);
+  }
+  else
+  {
+    failed += report("exFAT mount", check_exfat_mount());
+    failed += report("exFAT contiguous file only uses the bitmap",
+                     check_exfat_bitmap());
+    failed += report("exFAT contiguous file grows fragmented",
+                     check_exfat_fragment());
+    failed += report("exFAT entry sets",
+                     check_exfat_sets());
+  }
+#endif
+
+  f_mount(0, NULL);
+  DiskFileClose();
+  unlink(argv[1]);
+  return failed;
+}
@@ -0,0 +1,305 @@
+/*
+ * File-backed disk for the host tools.
+ *
+ * Drive 0 is an image file opened by DiskFileOpen().  The image looks like
+ * a fresh SD card to ff.c: it reports the allocation unit given on the
+ * command line through GET_AU_SIZE and GET_BLOCK_SIZE, and erased sectors
+ * read back as zero, so f_mkfs clears the FAT area with CTRL_ERASE_SECTOR.
+ * That punches a hole in the file, which keeps images sparse.
+ * DiskFileSetErased() makes them read back as another value, as on cards
+ * that erase to ones, so that f_mkfs writes zeros instead.
+ *
+ * tools/fftest also cuts the power with DiskFileCutPower(): after a given
+ * number of sectors more, writes and erases fail and nothing more reaches
+ * the image, as on a card that lost its supply in the middle of a write.
+ * DiskFileSetId() gives the image a CID and CSD, so that ff.c keeps its
+ * geometry in the mount cache as it does for a card; without one the
+ * cache is not used.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskio.h"
+#include "diskio_file.h"
+
+#define SECTOR_SIZE     512
+
+static int disk_fd = -1;
+static DWORD disk_nsect;
+static DWORD disk_au;
+static long disk_power = -1;    /* Sectors left to write before the power cut (-1: none) */
+static BYTE disk_erased;        /* Value erased sectors read back as */
+static DWORD disk_reads;        /* disk_read() calls */
+static DWORD disk_writes;       /* disk_write() calls */
+static BYTE disk_id[32];        /* CID, then CSD */
+static BYTE disk_has_id;        /* MMC_GET_CID and MMC_GET_CSD succeed */
+
+int
+DiskFileOpen(const char *path, DWORD nsect, DWORD au, int create)
+{
+  struct stat st;
+
+  disk_fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+  if (disk_fd < 0)
+  {
+    return -1;
+  }
+
+  if (create)
+  {
+    if (ftruncate(disk_fd, (off_t)nsect * SECTOR_SIZE) != 0)
+    {
+      close(disk_fd);
+      disk_fd = -1;
+      return -1;
+    }
+  }
+  else
+  {
+    if (fstat(disk_fd, &st) != 0)
+    {
+      close(disk_fd);
+      disk_fd = -1;
+      return -1;
+    }
+    nsect = (DWORD)(st.st_size / SECTOR_SIZE);
+  }
+
+  disk_nsect = nsect;
+  disk_au = au;
+  return 0;
+}
+
+int
+DiskFileClose(void)
+{
+  int ret = 0;
+
+  if (disk_fd >= 0)
+  {
+    ret = fsync(disk_fd);
+    if (close(disk_fd) != 0)
+    {
+      ret = -1;
+    }
+  }
+  disk_fd = -1;
+  return ret;
+}
+
+DWORD
+DiskFileSectors(void)
+{
+  return disk_nsect;
+}
+
+void
+DiskFileCutPower(long nsect)
+{
+  disk_power = nsect;
+}
+
+void
+DiskFileSetErased(BYTE val)
+{
+  disk_erased = val;
+}
+
+void
+DiskFileSetId(const BYTE *id)
+{
+  disk_has_id = id != NULL;
+  if (id)
+  {
+    memcpy(disk_id, id, sizeof disk_id);
+  }
+}
+
+DWORD
+DiskFileReads(void)
+{
+  return disk_reads;
+}
+
+DWORD
+DiskFileWrites(void)
+{
+  return disk_writes;
+}
+
+DSTATUS
+disk_initialize(BYTE drv)
+{
+  return disk_status(drv);
+}
+
+DSTATUS
+disk_status(BYTE drv)
+{
+  if (drv != 0 || disk_fd < 0)
+  {
+    return STA_NOINIT;
+  }
+  return 0;
+}
+
+DRESULT
+disk_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
+{
+  size_t len = (size_t)count * SECTOR_SIZE;
+
+  disk_reads++;
+  if (drv != 0 || disk_fd < 0)
+  {
+    return RES_NOTRDY;
+  }
+  if (sector + count > disk_nsect)
+  {
+    return RES_PARERR;
+  }
+  if (pread(disk_fd, buff, len, (off_t)sector * SECTOR_SIZE) != (ssize_t)len)
+  {
+    return RES_ERROR;
+  }
+  return RES_OK;
+}
+
+DRESULT
+disk_write(BYTE drv, const BYTE *buff, DWORD sector, BYTE count)
+{
+  size_t len = (size_t)count * SECTOR_SIZE;
+
+  disk_writes++;
+  if (drv != 0 || disk_fd < 0)
+  {
+    return RES_NOTRDY;
+  }
+  if (sector + count > disk_nsect)
+  {
+    return RES_PARERR;
+  }
+  if (disk_power >= 0 && disk_power < count)
+  {
+    /* The sectors before the cut make it, the rest of the command does not */
+    len = (size_t)disk_power * SECTOR_SIZE;
+    disk_power = 0;
+    if (len && pwrite(disk_fd, buff, len, (off_t)sector * SECTOR_SIZE) != (ssize_t)len)
+    {
+      return RES_ERROR;
+    }
+    return RES_NOTRDY;
+  }
+  if (disk_power > 0)
+  {
+    disk_power -= count;
+  }
+  if (pwrite(disk_fd, buff, len, (off_t)sector * SECTOR_SIZE) != (ssize_t)len)
+  {
+    return RES_ERROR;
+  }
+  return RES_OK;
+}
+
+static DRESULT
+erase_sectors(DWORD start, DWORD end)
+{
+  static BYTE fill[64 * SECTOR_SIZE];
+  off_t ofs = (off_t)start * SECTOR_SIZE;
+  off_t len = (off_t)(end - start + 1) * SECTOR_SIZE;
+  size_t n;
+
+  if (end < start || end >= disk_nsect)
+  {
+    return RES_PARERR;
+  }
+
+  /* Holes read back as zero; write the fill where the file system cannot punch */
+  if (!disk_erased
+      && fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ofs, len) == 0)
+  {
+    return RES_OK;
+  }
+  memset(fill, disk_erased, sizeof fill);
+  while (len)
+  {
+    n = len > (off_t)sizeof fill ? sizeof fill : (size_t)len;
+    if (pwrite(disk_fd, fill, n, ofs) != (ssize_t)n)
+    {
+      return RES_ERROR;
+    }
+    ofs += n;
+    len -= n;
+  }
+  return RES_OK;
+}
+
+DRESULT
+disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
+{
+  DWORD *rng = buff;
+
+  if (drv != 0 || disk_fd < 0)
+  {
+    return RES_NOTRDY;
+  }
+
+  switch (ctrl)
+  {
+  case CTRL_SYNC:
+    return disk_power == 0 ? RES_NOTRDY : RES_OK;
+
+  case GET_SECTOR_COUNT:
+    *(DWORD*)buff = disk_nsect;
+    return RES_OK;
+
+  case GET_SECTOR_SIZE:
+    *(WORD*)buff = SECTOR_SIZE;
+    return RES_OK;
+
+  case GET_BLOCK_SIZE:
+  case GET_AU_SIZE:
+    *(DWORD*)buff = disk_au;
+    return RES_OK;
+
+  case GET_ERASE_VALUE:
+    *(BYTE*)buff = disk_erased;
+    return RES_OK;
+
+  case MMC_GET_CID:
+  case MMC_GET_CSD:
+    if (!disk_has_id)
+    {
+      return RES_PARERR;
+    }
+    memcpy(buff, &disk_id[ctrl == MMC_GET_CSD ? 16 : 0], 16);
+    return RES_OK;
+
+  case CTRL_ERASE_SECTOR:
+    if (disk_power == 0)
+    {
+      return RES_NOTRDY;
+    }
+    return erase_sectors(rng[0], rng[1]);
+
+  default:
+    return RES_PARERR;
+  }
+}
+
+DWORD
+get_fattime(void)
+{
+  time_t t = time(NULL);
+  struct tm *tm = localtime(&t);
+
+  return ((DWORD)(tm->tm_year - 80) << 25)
+         | ((DWORD)(tm->tm_mon + 1) << 21)
+         | ((DWORD)tm->tm_mday << 16)
+         | ((DWORD)tm->tm_hour << 11)
+         | ((DWORD)tm->tm_min << 5)
+         | ((DWORD)tm->tm_sec >> 1);
+}
@@ -0,0 +1,29 @@
+#ifndef DISKIO_FILE_H_
+#define DISKIO_FILE_H_
+
+#include <sys/stat.h>
+
+#include "integer.h"
+
+/* Open (create == 0) or create an image of nsect sectors as drive 0.
+   au is reported as the card's allocation unit, in sectors. */
+int DiskFileOpen(const char *path, DWORD nsect, DWORD au, int create);
+int DiskFileClose(void);
+DWORD DiskFileSectors(void);
+
+/* Cut the power after nsect more sectors are written (-1: restore it).
+   Writes and erases fail from then on, the image keeps what was written. */
+void DiskFileCutPower(long nsect);
+
+/* Erased sectors read back as val (0 at first), reported by GET_ERASE_VALUE. */
+void DiskFileSetErased(BYTE val);
+
+/* CID (16 bytes) then CSD returned by MMC_GET_CID and MMC_GET_CSD, NULL for
+   none (at first), in which case both fail. */
+void DiskFileSetId(const BYTE *id);
+
+/* Number of disk_read() and disk_write() calls so far, one command each. */
+DWORD DiskFileReads(void);
+DWORD DiskFileWrites(void);
+
+#endif /* DISKIO_FILE_H_ */
@@ -0,0 +1,32 @@
+/*
+ * Integer types for building ff.c on a 64-bit host.
+ *
+ * The target's integer.h uses long for DWORD, which is 64 bits wide on
+ * LP64 hosts.  This header is force-included ahead of it (-include), and
+ * defines _INTEGER so that integer.h is skipped.
+ */
+
+#ifndef _INTEGER
+#include <stdint.h>
+
+typedef int             INT;
+typedef unsigned int    UINT;
+
+typedef signed char     CHAR;
+typedef unsigned char   UCHAR;
+typedef unsigned char   BYTE;
+
+typedef int16_t         SHORT;
+typedef uint16_t        USHORT;
+typedef uint16_t        WORD;
+
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef uint32_t        DWORD;
+
+typedef uint64_t        QWORD;
+
+typedef enum { FALSE = 0, TRUE } BOOL;
+
+#define _INTEGER
+#endif
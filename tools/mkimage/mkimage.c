@@ -0,0 +1,657 @@
+/*
+ * Build and verify SD card images for provisioning.
+ *
+ *   mkimage build -s SIZE [-t TYPE] [-c CLUSTER] [-a AU] [-S]
+ *                 [-d DIR]... [-f PATH:SIZE]... IMAGE
+ *   mkimage verify [-j JOBS] [-t TYPE] [-a AU] [-f PATH:SIZE]... IMAGE...
+ *
+ * build formats IMAGE with the target's own ff.c, so the layout is exactly
+ * what f_mkfs makes on the device: partition, FATs and data area aligned to
+ * the allocation unit AU.  Every -f file is then pre-allocated to SIZE bytes
+ * by f_lseek, which starts it on a free AU and gives it one contiguous run,
+ * so the device overwrites it with multiple block writes from the start and
+ * never touches the FAT while logging.  Sizes take K, M and G suffixes.
+ *
+ * verify mounts each IMAGE, reads every file to the end, checks that cluster
+ * chains match the file sizes and do not cross, and that each -f file exists
+ * with its size in a single AU-aligned run.  Images are checked by JOBS
+ * processes at a time (default: one per online CPU).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "ff.h"
+#include "diskio_file.h"
+
+#define MAX_SPECS       256
+#define MAX_PATH        256
+#define LINKMAP_SIZE    (2 + 2 * 512)   /* Fragments reported per file */
+#define READ_CHUNK      32768
+
+typedef struct FileSpec
+{
+  char path[MAX_PATH];
+  QWORD size;
+} FileSpec;
+
+typedef struct VerifyState
+{
+  FATFS *fs;
+  BYTE *used;           /* Cluster bitmap of all files seen */
+  DWORD nused;          /* Clusters owned by files */
+  int errors;
+} VerifyState;
+
+static FileSpec specs[MAX_SPECS];
+static int nspecs;
+static const char *dirs[MAX_SPECS];
+static int ndirs;
+static BYTE fat_type;   /* FS_FAT12..FS_FAT32, 0: any */
+static DWORD au_sect = 8192;
+
+static BYTE readbuf[READ_CHUNK];
+static DWORD linkmap[LINKMAP_SIZE];
+
+static const char *
+fr_name(FRESULT res)
+{
+  static const char *names[] =
+  {
+    "OK", "NOT_READY", "NO_FILE", "NO_PATH", "INVALID_NAME", "INVALID_DRIVE",
+    "DENIED", "EXIST", "RW_ERROR", "WRITE_PROTECTED", "NOT_ENABLED",
+    "NO_FILESYSTEM", "INVALID_OBJECT", "MKFS_ABORTED"
+  };
+
+  return (unsigned)res < sizeof names / sizeof names[0] ? names[res] : "?";
+}
+
+static const char *
+type_name(BYTE type)
+{
+  static const char *names[] = { "none", "FAT12", "FAT16", "FAT32", "exFAT" };
+
+  return type < sizeof names / sizeof names[0] ? names[type] : "?";
+}
+
+static int
+parse_size(const char *s, QWORD *size)
+{
+  char *end;
+  unsigned long long v = strtoull(s, &end, 0);
+
+  switch (*end)
+  {
+  case 'k': case 'K': v <<= 10; end++; break;
+  case 'm': case 'M': v <<= 20; end++; break;
+  case 'g': case 'G': v <<= 30; end++; break;
+  }
+  if (end == s || *end)
+  {
+    return -1;
+  }
+  *size = v;
+  return 0;
+}
+
+static int
+parse_type(const char *s)
+{
+  if (!strcasecmp(s, "fat12")) fat_type = FS_FAT12;
+  else if (!strcasecmp(s, "fat16")) fat_type = FS_FAT16;
+  else if (!strcasecmp(s, "fat32")) fat_type = FS_FAT32;
+  else return -1;
+  return 0;
+}
+
+static int
+add_spec(const char *arg)
+{
+  const char *colon = strrchr(arg, ':');
+  FileSpec *spec;
+
+  if (nspecs == MAX_SPECS || !colon || colon == arg || colon - arg >= MAX_PATH)
+  {
+    return -1;
+  }
+  spec = &specs[nspecs];
+  memcpy(spec->path, arg, colon - arg);
+  spec->path[colon - arg] = 0;
+  if (parse_size(colon + 1, &spec->size) || spec->size > 0xFFFFFFFFULL)
+  {
+    return -1;
+  }
+  nspecs++;
+  return 0;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr,
+          "usage: mkimage build -s SIZE [-t fat12|fat16|fat32] [-c CLUSTER] [-a AU] [-S]\n"
+          "                     [-d DIR]... [-f PATH:SIZE]... IMAGE\n"
+          "       mkimage verify [-j JOBS] [-t TYPE] [-a AU] [-f PATH:SIZE]... IMAGE...\n");
+  exit(2);
+}
+
+/* Parses the options shared by both commands, returns the index of the first operand */
+static int
+parse_options(int argc, char **argv, int build, QWORD *size, DWORD *cluster, BYTE *rule, int *jobs)
+{
+  QWORD v;
+  int c;
+
+  while ((c = getopt(argc, argv, build ? "s:t:c:a:Sd:f:" : "j:t:a:f:")) != -1)
+  {
+    switch (c)
+    {
+    case 's':
+      if (parse_size(optarg, size) || *size / 512 > 0xFFFFFFFFULL) usage();
+      break;
+    case 't':
+      if (parse_type(optarg)) usage();
+      break;
+    case 'c':
+      if (parse_size(optarg, &v) || v < 512 || v > 32768 || (v & (v - 1))) usage();
+      *cluster = (DWORD)(v / 512);
+      break;
+    case 'a':
+      if (parse_size(optarg, &v) || v < 512 || (v & (v - 1)) || v / 512 > 0x8000) usage();
+      au_sect = (DWORD)(v / 512);
+      break;
+    case 'S':
+      *rule = 1;
+      break;
+    case 'd':
+      if (ndirs == MAX_SPECS) usage();
+      dirs[ndirs++] = optarg;
+      break;
+    case 'f':
+      if (add_spec(optarg)) usage();
+      break;
+    case 'j':
+      *jobs = atoi(optarg);
+      if (*jobs < 1) usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  return optind;
+}
+
+/* Creates the directories leading to path, and path itself if whole is set */
+static FRESULT
+make_dirs(const char *path, int whole)
+{
+  char buf[MAX_PATH];
+  FRESULT res;
+  size_t i, len = strlen(path);
+
+  if (len >= MAX_PATH)
+  {
+    return FR_INVALID_NAME;
+  }
+  memcpy(buf, path, len + 1);
+  for (i = 1; i <= len; i++)
+  {
+    if (buf[i] != '/' && (buf[i] || !whole))
+    {
+      continue;
+    }
+    buf[i] = 0;
+    res = f_mkdir(buf);
+    if (res != FR_OK && res != FR_EXIST)
+    {
+      return res;
+    }
+    buf[i] = '/';
+  }
+  return FR_OK;
+}
+
+/* Fills linkmap[] for the file at path and counts its fragments */
+static FRESULT
+file_layout(const char *path, DWORD *nfrag, DWORD *first, FSIZE_t *size)
+{
+  FIL fil;
+  FRESULT res;
+
+  res = f_open(&fil, path, FA_READ);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  *first = fil.org_clust;
+  *size = fil.fsize;
+  fil.cltbl = linkmap;
+  linkmap[0] = LINKMAP_SIZE;
+  res = f_lseek(&fil, CREATE_LINKMAP);
+  *nfrag = (linkmap[0] - 2) / 2;
+  f_close(&fil);
+  return res;
+}
+
+static int
+au_aligned(FATFS *fs, DWORD clust)
+{
+  return fs->au_clust && clust >= fs->au_ofs && (clust - fs->au_ofs) % fs->au_clust == 0;
+}
+
+/*-----------------------------------------------------------------------*/
+/* build                                                                 */
+/*-----------------------------------------------------------------------*/
+
+static int
+format_image(DWORD cluster, BYTE rule, FATFS **fs)
+{
+  DWORD spc, nfree;
+  FRESULT res;
+
+  /* Without -c, take the largest cluster that gives the requested type */
+  for (spc = cluster ? cluster : 64; spc; spc = cluster ? 0 : spc / 2)
+  {
+    res = f_mkfs(0, rule | FM_QUICK, (BYTE)spc);
+    if (res == FR_OK)
+    {
+      res = f_getfree("", &nfree, fs);
+    }
+    if (res != FR_OK)
+    {
+      fprintf(stderr, "mkimage: f_mkfs with %u byte clusters: %s\n", (unsigned)spc * 512, fr_name(res));
+      return -1;
+    }
+    if (!fat_type || (*fs)->fs_type == fat_type)
+    {
+      return 0;
+    }
+  }
+  fprintf(stderr, "mkimage: no cluster size gives %s on this image size\n", type_name(fat_type));
+  return -1;
+}
+
+static int
+cmd_build(int argc, char **argv)
+{
+  static FATFS fatfs;
+  FATFS *fs;
+  FIL fil;
+  FRESULT res;
+  QWORD size = 0;
+  DWORD cluster = 0, nfrag, first, nfree;
+  FSIZE_t fsize;
+  BYTE rule = 0;
+  int i, jobs = 0, ret = 0;
+
+  i = parse_options(argc, argv, 1, &size, &cluster, &rule, &jobs);
+  if (i != argc - 1 || !size)
+  {
+    usage();
+  }
+
+  if (DiskFileOpen(argv[i], (DWORD)(size / 512), au_sect, 1))
+  {
+    perror(argv[i]);
+    return 1;
+  }
+  f_mount(0, &fatfs);
+  if (format_image(cluster, rule, &fs))
+  {
+    DiskFileClose();
+    return 1;
+  }
+  printf("%s: %s, %u byte clusters, %u clusters, data at sector %u, AU %u sectors\n",
+         argv[i], type_name(fs->fs_type), (unsigned)fs->sects_clust * 512,
+         (unsigned)(fs->max_clust - 2), (unsigned)fs->database,
+         (unsigned)(fs->au_clust * fs->sects_clust));
+
+  for (i = 0; i < ndirs; i++)
+  {
+    res = make_dirs(dirs[i], 1);
+    if (res != FR_OK)
+    {
+      fprintf(stderr, "mkimage: %s: %s\n", dirs[i], fr_name(res));
+      ret = 1;
+    }
+  }
+
+  for (i = 0; i < nspecs && !ret; i++)
+  {
+    res = make_dirs(specs[i].path, 0);
+    if (res == FR_OK)
+    {
+      res = f_open(&fil, specs[i].path, FA_CREATE_ALWAYS | FA_WRITE);
+    }
+    if (res == FR_OK)
+    {
+      res = f_lseek(&fil, specs[i].size);    /* Allocates the clusters, AU aligned */
+      if (f_close(&fil) != FR_OK && res == FR_OK)
+      {
+        res = FR_RW_ERROR;
+      }
+      if (res == FR_OK && fil.fptr != specs[i].size)
+      {
+        fprintf(stderr, "mkimage: %s: volume full\n", specs[i].path);
+        ret = 1;
+        break;
+      }
+    }
+    if (res == FR_OK)
+    {
+      res = file_layout(specs[i].path, &nfrag, &first, &fsize);
+    }
+    if (res != FR_OK)
+    {
+      fprintf(stderr, "mkimage: %s: %s\n", specs[i].path, fr_name(res));
+      ret = 1;
+      break;
+    }
+    printf("  %-32s %10llu bytes  cluster %u  %u fragment%s%s\n", specs[i].path,
+           (unsigned long long)fsize, (unsigned)first, (unsigned)nfrag, nfrag == 1 ? "" : "s",
+           !first || au_aligned(fs, first) ? "" : "  (not AU aligned)");
+  }
+
+  if (!ret && f_getfree("", &nfree, &fs) == FR_OK)
+  {
+    printf("  %u clusters free\n", (unsigned)nfree);
+  }
+  f_mount(0, NULL);
+  if (DiskFileClose())
+  {
+    perror("mkimage");
+    ret = 1;
+  }
+  return ret;
+}
+
+/*-----------------------------------------------------------------------*/
+/* verify                                                                */
+/*-----------------------------------------------------------------------*/
+
+static void
+verify_file(VerifyState *vs, const char *img, const char *path)
+{
+  FATFS *fs = vs->fs;
+  FIL fil;
+  FRESULT res;
+  DWORD nfrag, first, ncl = 0, ncross = 0, cl, n, *tbl;
+  FSIZE_t size;
+  WORD br;
+  QWORD csize = (QWORD)fs->sects_clust * 512;
+
+  res = file_layout(path, &nfrag, &first, &size);
+  if (res == FR_DENIED)
+  {
+    printf("%s: %s: more than %u fragments, chain not checked\n", img, path, (LINKMAP_SIZE - 2) / 2);
+  }
+  else if (res != FR_OK)
+  {
+    printf("%s: %s: broken cluster chain (%s)\n", img, path, fr_name(res));
+    vs->errors++;
+    return;
+  }
+  else
+  {
+    for (tbl = linkmap + 1; *tbl; tbl += 2)
+    {
+      for (n = 0, cl = tbl[1]; n < tbl[0]; n++, cl++)
+      {
+        if (vs->used[cl / 8] & (1 << (cl % 8)))
+        {
+          ncross++;
+        }
+        vs->used[cl / 8] |= 1 << (cl % 8);
+      }
+      ncl += tbl[0];
+    }
+    vs->nused += ncl;
+    if (ncross)
+    {
+      printf("%s: %s: %u clusters cross-linked with other files\n", img, path, (unsigned)ncross);
+      vs->errors++;
+    }
+    if (ncl != (size + csize - 1) / csize)
+    {
+      printf("%s: %s: %u clusters for %llu bytes\n", img, path, (unsigned)ncl, (unsigned long long)size);
+      vs->errors++;
+    }
+  }
+
+  /* Read every sector of the file */
+  res = f_open(&fil, path, FA_READ);
+  while (res == FR_OK)
+  {
+    res = f_read(&fil, readbuf, READ_CHUNK, &br);
+    if (br < READ_CHUNK)
+    {
+      break;
+    }
+  }
+  if (res == FR_OK && fil.fptr != size)
+  {
+    res = FR_RW_ERROR;
+  }
+  if (res != FR_OK)
+  {
+    printf("%s: %s: read failed at %llu (%s)\n", img, path, (unsigned long long)fil.fptr, fr_name(res));
+    vs->errors++;
+  }
+  f_close(&fil);
+}
+
+static void
+verify_dir(VerifyState *vs, const char *img, char *path)
+{
+  static char lfn[_MAX_LFN + 1];
+  FILINFO fno;
+  DIR dir;
+  FRESULT res;
+  size_t len = strlen(path);
+  const char *name;
+
+  res = f_opendir(&dir, path);
+  if (res != FR_OK)
+  {
+    printf("%s: %s: cannot open directory (%s)\n", img, path, fr_name(res));
+    vs->errors++;
+    return;
+  }
+  for (;;)
+  {
+    fno.lfname = lfn;
+    fno.lfsize = sizeof lfn;
+    res = f_readdir(&dir, &fno);
+    if (res != FR_OK)
+    {
+      printf("%s: %s: directory read failed (%s)\n", img, path, fr_name(res));
+      vs->errors++;
+      return;
+    }
+    if (!fno.fname[0])
+    {
+      break;
+    }
+    name = lfn[0] ? lfn : fno.fname;
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+    {
+      continue;
+    }
+    if (len + 1 + strlen(name) >= MAX_PATH)
+    {
+      printf("%s: %s/%s: path too long, skipped\n", img, path, name);
+      continue;
+    }
+    sprintf(path + len, "/%s", name);
+    if (fno.fattrib & AM_DIR)
+    {
+      verify_dir(vs, img, path);
+      /* f_readdir keeps its position in dir, the window may have moved */
+    }
+    else
+    {
+      verify_file(vs, img, path);
+    }
+    path[len] = 0;
+  }
+}
+
+static int
+verify_image(const char *img)
+{
+  static FATFS fatfs;
+  static char path[MAX_PATH];
+  VerifyState vs;
+  FATFS *fs;
+  FRESULT res;
+  DWORD nfree, nfrag, first;
+  FSIZE_t size;
+  int i;
+
+  if (DiskFileOpen(img, 0, au_sect, 0))
+  {
+    printf("%s: cannot open\n", img);
+    return 1;
+  }
+  f_mount(0, &fatfs);
+  res = f_getfree("", &nfree, &fs);
+  if (res != FR_OK)
+  {
+    printf("%s: no file system (%s)\n", img, fr_name(res));
+    DiskFileClose();
+    return 1;
+  }
+
+  memset(&vs, 0, sizeof vs);
+  vs.fs = fs;
+  vs.used = calloc(fs->max_clust / 8 + 1, 1);
+  if (!vs.used)
+  {
+    printf("%s: out of memory\n", img);
+    DiskFileClose();
+    return 1;
+  }
+  if (fat_type && fs->fs_type != fat_type)
+  {
+    printf("%s: %s, expected %s\n", img, type_name(fs->fs_type), type_name(fat_type));
+    vs.errors++;
+  }
+
+  path[0] = 0;
+  verify_dir(&vs, img, path);
+
+  for (i = 0; i < nspecs; i++)
+  {
+    res = file_layout(specs[i].path, &nfrag, &first, &size);
+    if (res != FR_OK)
+    {
+      printf("%s: %s: %s\n", img, specs[i].path, fr_name(res));
+      vs.errors++;
+    }
+    else if (size != specs[i].size || nfrag != (size ? 1 : 0) || (first && !au_aligned(fs, first)))
+    {
+      printf("%s: %s: %llu bytes in %u fragments at cluster %u, expected %llu bytes in one AU-aligned run\n",
+             img, specs[i].path, (unsigned long long)size, (unsigned)nfrag, (unsigned)first,
+             (unsigned long long)specs[i].size);
+      vs.errors++;
+    }
+  }
+
+  if (nfree + vs.nused > fs->max_clust - 2)
+  {
+    printf("%s: %u free + %u in files exceeds %u clusters\n", img, (unsigned)nfree,
+           (unsigned)vs.nused, (unsigned)(fs->max_clust - 2));
+    vs.errors++;
+  }
+
+  printf("%s: %s, %u clusters, %u in files, %u free: %s\n", img, type_name(fs->fs_type),
+         (unsigned)(fs->max_clust - 2), (unsigned)vs.nused, (unsigned)nfree,
+         vs.errors ? "FAILED" : "ok");
+  free(vs.used);
+  f_mount(0, NULL);
+  DiskFileClose();
+  return vs.errors ? 1 : 0;
+}
+
+static int
+cmd_verify(int argc, char **argv)
+{
+  QWORD size;
+  DWORD cluster;
+  BYTE rule;
+  pid_t pid;
+  int i, status, jobs, running = 0, failed = 0;
+
+  jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1)
+  {
+    jobs = 1;
+  }
+  i = parse_options(argc, argv, 0, &size, &cluster, &rule, &jobs);
+  if (i == argc)
+  {
+    usage();
+  }
+
+  /* One process per image: ff.c keeps its state in globals */
+  for (; i < argc || running; )
+  {
+    if (i < argc && running < jobs)
+    {
+      fflush(stdout);
+      pid = fork();
+      if (pid == 0)
+      {
+        static char out[1 << 16];
+
+        setvbuf(stdout, out, _IOFBF, sizeof out);    /* Keep each report in one piece */
+        status = verify_image(argv[i]);
+        fflush(stdout);
+        _exit(status);
+      }
+      if (pid < 0)
+      {
+        perror("fork");
+        failed++;
+      }
+      else
+      {
+        running++;
+      }
+      i++;
+      continue;
+    }
+    if (wait(&status) < 0)
+    {
+      break;
+    }
+    running--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    {
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    usage();
+  }
+  if (!strcmp(argv[1], "build"))
+  {
+    return cmd_build(argc - 1, argv + 1);
+  }
+  if (!strcmp(argv[1], "verify"))
+  {
+    return cmd_verify(argc - 1, argv + 1);
+  }
+  usage();
+  return 2;
+}
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Convert a storage stack trace dump to Chrome / Perfetto trace JSON.
+
+The dump is what ff_trace_dump() prints on the UART (see
+third_party/fatfs/port/trace-tiva-cm4f.c).  Capture the serial output to a
+file, then:
+
+    python3 tools/trace2json.py capture.txt > trace.json
+
+and open trace.json in chrome://tracing or https://ui.perfetto.dev.  Every
+task gets its own track, interrupts get one track per exception number.
+Text around the dump in the capture is ignored; with several dumps in one
+capture, the last one is converted.
+"""
+
+import json
+import sys
+
+# Keep in sync with fftrace.h
+EVENTS = {
+    1: "f_write",
+    2: "move_window hit",
+    3: "move_window miss",
+    4: "create_chain",
+    5: "send_cmd",
+    6: "wait_ready",
+    7: "DMA tx",
+    8: "DMA rx",
+    9: "SSI ISR",
+    10: "I/O wait",
+}
+TR_BEGIN = 0x40
+TR_END = 0x80
+
+# Fields named after the event argument, for the begin and end events
+ARGS = {
+    "f_write": ("bytes", "result"),
+    "move_window hit": ("sector", None),
+    "move_window miss": ("sector", None),
+    "create_chain": ("cluster", "new cluster"),
+    "send_cmd": ("cmd", "response"),
+    "wait_ready": (None, "last byte"),
+    "DMA tx": ("length", None),
+    "DMA rx": ("length", None),
+    "SSI ISR": ("status", None),
+    "I/O wait": ("sector", "result"),
+}
+
+
+def parse(lines):
+    """Return (clock_hz, {task: name}, [(ts, task, ev, arg)]) of the last dump."""
+    dump = None
+    for line in lines:
+        f = line.split()
+        if not f:
+            continue
+        if f[0] == "TRACE" and len(f) == 3:
+            dump = (int(f[1]), {}, [])
+        elif dump is None:
+            continue
+        elif f[0] == "T" and len(f) >= 2:
+            dump[1][int(f[1], 16)] = " ".join(f[2:]) or f[1]
+        elif f[0] == "E" and len(f) == 5:
+            dump[2].append(tuple(int(x, 16) for x in f[1:]))
+    if dump is None:
+        raise SystemExit("no TRACE dump found in the input")
+    return dump
+
+
+def thread_name(task, names):
+    if task == 0:
+        return "main (no task)"
+    if task < 0x200:
+        return "ISR %d" % task
+    return names.get(task, "task %08x" % task)
+
+
+def convert(clock_hz, names, events):
+    out = []
+    us_per_cycle = 1e6 / clock_hz
+    ts = 0
+    last = events[0][0] if events else 0
+    stacks = {}
+    tids = {}
+
+    def tid(task):
+        if task not in tids:
+            tids[task] = len(tids) + 1
+            out.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": tids[task],
+                        "args": {"name": thread_name(task, names)}})
+        return tids[task]
+
+    for cyc, task, ev, arg in events:
+        ts += (cyc - last) & 0xFFFFFFFF     # The cycle counter wraps
+        last = cyc
+        name = EVENTS.get(ev & 0x3F, "event %d" % (ev & 0x3F))
+        t = tid(task)
+        stack = stacks.setdefault(t, [])
+        rec = {"name": name, "cat": "storage", "pid": 1, "tid": t, "ts": ts * us_per_cycle}
+        labels = ARGS.get(name, ("arg", "arg"))
+
+        if ev & TR_BEGIN:
+            rec["ph"] = "B"
+            if labels[0]:
+                rec["args"] = {labels[0]: arg}
+            stack.append(name)
+        elif ev & TR_END:
+            if name not in stack:
+                continue    # Began before the oldest event kept in the ring
+            # Close what was left open inside it (error returns)
+            while stack[-1] != name:
+                out.append({"name": stack.pop(), "ph": "E", "pid": 1, "tid": t, "ts": rec["ts"]})
+            stack.pop()
+            rec["ph"] = "E"
+            if labels[1]:
+                rec["args"] = {labels[1]: arg}
+        else:
+            rec["ph"] = "i"
+            rec["s"] = "t"
+            if labels[0]:
+                rec["args"] = {labels[0]: arg}
+        out.append(rec)
+
+    return {"traceEvents": out, "displayTimeUnit": "ns"}
+
+
+def main():
+    src = open(sys.argv[1], errors="replace") if len(sys.argv) > 1 else sys.stdin
+    clock_hz, names, events = parse(src)
+    json.dump(convert(clock_hz, names, events), sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()